@@ -1,328 +1,1003 @@
 #include "AsciiModbusSlave.h"
+#if defined(__AVR__)
 #include <avr/pgmspace.h> // needed when using Progmem
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#else
+#define PROGMEM           // the host keeps everything in ram
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define pgm_read_ptr(addr) (*(void* const*)(addr))
+#endif
+#include "ModbusRegisterMap.h"
+#include "ModbusStateMachine.h"
+#include "ModbusCodec.h"
+#include <string.h>
 
 // AsciiModbusSlave
 //----file globals------------------------- 
  
-// These global variables are pointed to by both the transmit and recieve structures.
-// MODBUS is a masterslave system so only the transmit OR receive statemachines will be 
-// changing things at any one point in time.  
-uint8_t slaveID = 0x01;                     // the modbus ID of this slave device. 
-uint8_t functionCode = 0x06;                // the function code sent by the master 
-uint16_t holding_registers[hr_ARRAY_SIZE] = {0x0000, 0x3456, 0x0001, 0x0002, 0x0003};  // the modbus registers 
-uint8_t modbus_timer = 0;                   // updated by an interrupt (outside this file) it decrements to zero every 38uS. 
-                                            // set it to a value, when it gets to zero then that value x 38uS have elapsed.
-                                            // used by the tx statemachine start state.  
-                          
-//----helper functions------------------------- 
+// All the state of a slave is in its ModbusSlave context (AsciiModbusSlave.h), this is the default one used by 
+// modbus_init(), modbus_update() and the UART interrupt routines below. 
+ModbusSlave modbus_slave;
 
-uint8_t ascii_to_uint8(uint8_t ch);
-uint8_t send_bin_as_ascii_char(uint16_t data, uint8_t bits);
-uint8_t calculateLRC(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4, uint8_t array_start_index, uint8_t number_of_array_elements, uint16_t the_array[]);
-#define UINT8_TO_ASCII(in) (((in) < 10) ? ((in) + '0') : ((in) < 16) ? ((in) + ('A' - 10)) : 255)
-void exceptionResponse(uint8_t exception);
+//----UART ring buffers------------------------- 
 
-//----General State machine infrustructure------
+#define RX_BUFFER_MASK (MODBUS_RX_BUFFER_SIZE - 1)
+#define TX_BUFFER_MASK (MODBUS_TX_BUFFER_SIZE - 1)
+static_assert(((MODBUS_RX_BUFFER_SIZE & RX_BUFFER_MASK) == 0) && (MODBUS_RX_BUFFER_SIZE <= 128), "MODBUS_RX_BUFFER_SIZE must be a power of two <= 128");
+static_assert(((MODBUS_TX_BUFFER_SIZE & TX_BUFFER_MASK) == 0) && (MODBUS_TX_BUFFER_SIZE <= 128), "MODBUS_TX_BUFFER_SIZE must be a power of two <= 128");
 
-// a row of the statemachine table array, to make the array a bit nicer.  
-#define ST(current_state, forward_state, branch_state, repeat_state) {\
-            {current_state, forward_state}, \
-            {current_state, branch_state},  \
-            {current_state, repeat_state},  \
-        }
+// RTU frames are separated by silence rather than characters. The rx interrupt sets the bit matching a byte's slot in
+// rx when the byte arrived after at least MODBUS_RTU_SILENCE of quiet, i.e. it is the first byte of a frame. 
+#define FRAME_START_BIT(ms, index) ((ms)->rxFrameStart[((index) & RX_BUFFER_MASK) >> 3] & _BV((index) & 0x07))
 
-// The ONLY valid return values from a state machine function
-// noting that rMAX... is not a valid return value, its used to define the array size.          
-enum return_values {rFORWARD, rBRANCH, rREPEAT, rMAX_RETURN_VALUES};
-
-// To create something a bit like a poor mans dictionary, current state is paired with each possible future state.
-// in the state table .
-enum transition_index {tCURRENT_STATE, tFUTURE_STATE, tMAX_TRANSITION_INDEX};
-
-// The macro works out the next state using the current state and the value returned from the function. 
-#define NEXT_STATE(current_state, return_val) (\
-              return_val == rFORWARD ? txs_state_table[current_state][rFORWARD][tFUTURE_STATE] \
-            : return_val == rBRANCH ? txs_state_table[current_state][rBRANCH][tFUTURE_STATE] \
-            : txs_state_table[current_state][rREPEAT][tFUTURE_STATE]\
-        )    
-
-// The following macros are used to return one of the valid return values from a state function. 
-// note that the in parameter isn't used, it can be used to document whats happening and can be extracted 
-// to draw the state machine diagram. 
-#define REPEAT_UNTIL(in) do{return rREPEAT;}while(0)
-#define FORWARD_WHEN(in) do{return rFORWARD;}while(0)
-#define BRANCH_IF(in) do{return rBRANCH;}while(0)
-
-//----State function prototypes and data structures for receive and transmit statemachines------
-
-// Structure of data for the slave transmit state machine. Some of the entries are pointers to the 
-// global variables which are shared with the slave receive state machine. 
-typedef struct TXRX {
-   uint8_t   messageReadyToSend = 1;         // Setting to 1 makes this slave send a response (moves out of mFINISH state)
-   uint8_t   data_in;                        // Data from the UART   
-   uint8_t*  slave_ID = &slaveID;            // MODBUS slave ID for this device. Wraps the global ID into this struct for neatness
-   uint8_t*  fnCode = &functionCode;         // Master function command. Wraps the global into this struct for neatness.  
-   uint8_t   exception = 0x01;               // Exception code if an exception happened when msg rx from master. 
-   uint8_t   numBytes = 0x02;                // Number of bytes to be sent back to master (should be 2x numRegisters)  
-   uint8_t   dataAddress = 0x01;             // Data adress to start reading data back to the master. 
-   uint8_t   numRegisters = 0x01;            // The number of registers to send back to the master (should be half of the numBytes). 
-   uint16_t* registers = holding_registers;  // this just wraps the global array into the struct for neatness. 
-}TXRXdata;
-
-TXRXdata txrx;
-
-// Structure of data for the slave receive state machine. Some of the entries are pointers to the 
-// global variables which are shared with the slave transmit state machine. 
-typedef struct RXS {
-   uint8_t   data_in;                        // Data from the UART
-   uint8_t*  slave_ID = &slaveID;            // MODBUS slave ID for this device. Wraps the global ID into this struct for neatness
-   uint8_t*  fnCode = &functionCode;         // Master function command. Wraps the global into this struct for neatness.  
-   uint8_t   exception = 0x01;               // Exception code if an exception happened when msg rx from master. 
-   uint8_t   numBytes = 0x02;                // Number of bytes to be sent back to master (should be 2x numRegisters)  
-   uint8_t   dataAddress = 0x01;             // Data adress to start reading data back to the master. 
-   uint8_t   numRegisters = 0x01;            // The number of registers to send back to the master (should be half of the numBytes). 
-   uint16_t* registers = holding_registers;  // this just wraps the global array into the struct for neatness. 
-}Rxstdata;
-
-Rxstdata rxst;
-
-
-uint8_t ftx_mTXSTART_beginDelayTimer (uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mCOLON_sendColon(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mSLAVEID_sendAddress(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mFNCODE_sendFnCode(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mCHOICE_fn3OrFn6(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mEXCEPT_sendException(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mLRC_sendLrc(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mFINISH_waitUntilNewMsg(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mNUMDATA_txNumBytes(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mTXREG_sendRegisters(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mDATAADD_txDataAddress(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mVALUE_txDataValue(uint8_t previous_state, TXRXdata* txd);
-uint8_t ftx_mCRLF_sendCrLf(uint8_t previous_state, TXRXdata* txd); 
-
-uint8_t frx_rSTART_waitForColon(uint8_t previous_state, Rxstdata* rxd); 
-uint8_t frx_rSLAVEID_rxSlaveId(uint8_t previous_state, Rxstdata* rxd); 
-uint8_t frx_rFNCODE_rxFnCode(uint8_t previous_state, Rxstdata* rxd); 
-
-//----Array of ALL state functions and a set of indexes to retrieve the function from the array------
-
-// Must keep the enum (array indexes) consistent with the array of function pointers. 
-enum STATESENUM{
-    mTXSTART, mCOLON, mSLAVEID, mFNCODE, mCHOICE, mEXCEPT, mLRC, mFINISH, mNUMDATA, mTXREG, mDATAADD, mVALUE, mCRLF,
-    rSTART, rSLAVEID, rFNCODE, 
-    mMAX_STATES, mNULL // leave these two in place at the end of the enum
-};
+#define BUFFER_COUNT(buf) ((uint8_t)((buf).head - (buf).tail))
+#define TX_BUFFER_PUT(ms, byte) ({(ms)->tx.data[(ms)->tx.head & TX_BUFFER_MASK] = (byte); (ms)->tx.head++;})
 
-uint8_t (*state_fns_array[mMAX_STATES])(uint8_t, TXRXdata*) = { 
-          ftx_mTXSTART_beginDelayTimer, ftx_mCOLON_sendColon, ftx_mSLAVEID_sendAddress, ftx_mFNCODE_sendFnCode, 
-          ftx_mCHOICE_fn3OrFn6, ftx_mEXCEPT_sendException, ftx_mLRC_sendLrc, ftx_mFINISH_waitUntilNewMsg, ftx_mNUMDATA_txNumBytes,
-          ftx_mTXREG_sendRegisters, ftx_mDATAADD_txDataAddress, ftx_mVALUE_txDataValue, ftx_mCRLF_sendCrLf,
-          frx_rSTART_waitForColon, frx_rSLAVEID_rxSlaveId, frx_rFNCODE_rxFnCode
-};
+//----Registers shared with an ISR------------------------- 
 
-//----Transmit statemachine table------
+#define ISR_SLOT(name) name,
+const uint8_t isr_setpoint_slots[isr_SETPOINT_COUNT] PROGMEM = { MODBUS_ISR_SETPOINTS(ISR_SLOT) };
+const uint8_t isr_measurement_slots[isr_MEASUREMENT_COUNT] PROGMEM = { MODBUS_ISR_MEASUREMENTS(ISR_SLOT) };
 
-// This is one specific statemachine a sequence of the functions above. 
- 
-// the pattern for each row is:
-// ST( currentState, forwardState, branchState, repeatState)
-uint8_t txs_state_table[mMAX_STATES][rMAX_RETURN_VALUES][tMAX_TRANSITION_INDEX] = {
-    ST(mTXSTART, mCOLON, mNULL, mNULL),
-    ST(mCOLON, mSLAVEID, mNULL, mCOLON),
-    ST(mSLAVEID, mFNCODE, mNULL, mSLAVEID),
-    ST(mFNCODE, mCHOICE, mEXCEPT, mFNCODE),    
-    ST(mCHOICE, mNUMDATA, mDATAADD, mNULL),        
-    ST(mEXCEPT, mLRC, mNULL, mEXCEPT),            
-    ST(mLRC, mCRLF, mNULL, mLRC),                
-    ST(mFINISH, mTXSTART, mNULL, mFINISH),
-    ST(mNUMDATA, mTXREG, mNULL, mNUMDATA),   
-    ST(mTXREG, mLRC, mNULL, mTXREG),   
-    ST(mDATAADD, mVALUE, mNULL, mDATAADD),       
-    ST(mVALUE, mLRC, mNULL, mVALUE),           
-    ST(mCRLF, mFINISH, mNULL, mCRLF)
-};
+#if MODBUS_ASCII_CACHE
+//----ASCII register cache------------------------- 
 
+#define ASCII_CACHE_VALID(ms, slot) ((ms)->ascii_cache_valid[(slot) >> 3] & _BV((slot) & 0x07))
+#define ASCII_CACHE_INVALIDATE(ms, slot) ((ms)->ascii_cache_valid[(slot) >> 3] &= ~(_BV((slot) & 0x07)))
+#else
+#define ASCII_CACHE_INVALIDATE(ms, slot) ((void)0)
+#endif
 
-//----Receive statemachine table------
+//----helper functions------------------------- 
 
-// This is one specific statemachine. a sequence of the functions above. 
- 
-// the pattern for each row is:      
-// ST( currentState, forwardState, branchState, repeatState)
-uint8_t rxs_state_table[mMAX_STATES][rMAX_RETURN_VALUES][tMAX_TRANSITION_INDEX] = {
-    ST(rSTART, rSLAVEID, mNULL, rSTART),
-    ST(rSLAVEID, rFNCODE, mNULL, mNULL),
-    ST(rFNCODE, rSTART, mNULL, mNULL)
-};
+uint8_t send_bin_as_ascii_char(ModbusSlave* ms, uint16_t data, uint8_t bits, uint8_t* lrc);
+uint8_t send_bin_as_rtu_bytes(ModbusSlave* ms, uint16_t data, uint8_t bits, uint16_t* crc);
+void send_ascii_cached(ModbusSlave* ms, uint8_t slot, uint8_t* lrc);
+void isr_publish_setpoints(ModbusSlave* ms);
+void isr_collect_measurements(ModbusSlave* ms);
+// ASCII sends every byte as two hex characters, RTU sends the bytes as they are. 
+#define SEND_DATA(data, bits, ms) (((ms)->mode == MODBUS_RTU) ? send_bin_as_rtu_bytes((ms), (data), (bits), &(ms)->txrx.crc) \
+                                                              : send_bin_as_ascii_char((ms), (data), (bits), &(ms)->txrx.lrc))
+#define MAX_READ_REGISTERS 125  // the most registers fn3 or fn23 can ask for, limited by the 252 byte modbus PDU
+#define MAX_WRITE_REGISTERS 123 // the most registers fn16 can write
+#define MAX_RW_WRITE_REGISTERS 121 // the most registers fn23 can write
+void exceptionResponse(ModbusSlave* ms, uint8_t exception);
+uint8_t modbus_diagnostics(ModbusSlave* ms);
+uint16_t slave_clock(ModbusSlave* ms);
+uint16_t error_total(ModbusSlave* ms);
+void stream_schedule(ModbusSlave* ms);
+void save_changed(ModbusSlave* ms, uint8_t slot);
+void save_write_back(ModbusSlave* ms);
+#define COUNTER_INC(counter) do { if ((counter) != 0xFFFF) (counter)++; } while (0)
+// Record a byte or a marker when capturing (see MODBUS_CAPTURE), costs a test of the mode when not.
+#if MODBUS_CAPTURE
+void capture_put(ModbusSlave* ms, uint8_t kind, uint8_t data);
+#define CAPTURE(ms, kind, data) do { if ((ms)->capture_mode) capture_put((ms), (kind), (data)); } while (0)
+#else
+#define CAPTURE(ms, kind, data) ((void)0)
+#endif
+#define CAPTURE_MARK(ms, mark) CAPTURE((ms), MODBUS_CAPTURE_MARK, (mark))
+// What the transmit statemachine sends: a push's own block, or what the request asked for. A push doesn't use txrx 
+// for them, so it can go out while a request is still arriving. 
+#define TX_FN(ms) ((ms)->tx_push_count ? MODBUS_FN_STREAM : (ms)->txrx.functionCode)
+#define TX_SLOT(ms) ((ms)->tx_push_count ? (ms)->tx_push_slot : (ms)->txrx.dataSlot)
+#define TX_REGISTERS(ms) ((ms)->tx_push_count ? (ms)->tx_push_count : (ms)->txrx.numRegisters)
+
+//----Profiling------------------------- 
+
+// see MODBUS_PROFILE in AsciiModbusSlave.h 
+#if MODBUS_PROFILE
+typedef struct PROFILESTAT {
+   uint16_t  min;                            // cycles
+   uint16_t  max;
+   uint16_t  average;                        // running average, each new time counts for 1/8 
+   uint16_t  calls;                          // stops at 0xFFFF
+}ProfileStat;
+
+typedef struct MODBUSPROFILE {
+   ProfileStat tx[mMAX_STATES];
+   ProfileStat rx[sMAX_STATES];
+   ProfileStat update;
+   ProfileStat isr;                          // written by the interrupt
+   volatile uint16_t isr_overruns;           // written by the interrupt
+   volatile uint16_t ticks;                  // Timer1 periods, counted by the interrupt
+   volatile uint8_t isr_clear;               // set to have the interrupt clear isr and isr_overruns
+   uint16_t  overhead;                       // cycles taken by timing nothing, taken off every time
+}ModbusProfile;
+
+static ModbusProfile modbus_profile;
+
+static_assert((mMAX_STATES <= (MODBUS_PROFILE_RX - MODBUS_PROFILE_TX)) && (sMAX_STATES <= (MODBUS_PROFILE_UPDATE - MODBUS_PROFILE_RX)),
+              "too many states for the MODBUS_PROFILE_... numbers");
+
+uint16_t modbus_profile_now();
+void modbus_profile_clear();
+static uint16_t profile_since(uint16_t start);
+static void profile_record(volatile ProfileStat* stat, uint16_t cycles);
+
+#define PROFILE_START(start) uint16_t start = modbus_profile_now()
+#define PROFILE_STOP(stat, start) profile_record((stat), profile_since(start))
+#define PROFILED(stat, call) ({PROFILE_START(profile_start); uint8_t profile_rc = (call); PROFILE_STOP((stat), profile_start); profile_rc;})
+#else
+#define PROFILE_START(start) ((void)0)
+#define PROFILE_STOP(stat, start) ((void)0)
+#define PROFILED(stat, call) (call)
+#endif
+
+//----State functions and dispatch for the receive and transmit statemachines------
+
+// The tables are in ModbusStateMachine.h. 
+
+static uint8_t ftx_mTXSTART_beginDelayTimer (uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mCOLON_sendColon(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mSLAVEID_sendAddress(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mFNCODE_sendFnCode(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mCHOICE_fn3OrFn6(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mEXCEPT_sendException(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mLRC_sendLrc(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mFINISH_waitUntilNewMsg(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mNUMDATA_txNumBytes(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mTXREG_sendRegisters(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mDATAADD_txDataAddress(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mVALUE_txDataValue(uint8_t previous_state, ModbusSlave* ms);
+static uint8_t ftx_mCRLF_sendCrLf(uint8_t previous_state, ModbusSlave* ms); 
+
+static uint8_t frx_sSLAVE_ADDRESS_checkId(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sCOMMAND_checkFnCode(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sREG_ADDRESS1_rxAddressHi(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sREG_NUM_OR_ADDRESS2_rxAddressLo(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sVALUE1_rxValueHi(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sVALUE2_rxValueLo(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sWRITE_ADDRESS1_rxWriteAddressHi(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sWRITE_ADDRESS2_rxWriteAddressLo(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sWRITE_NUM1_rxWriteNumHi(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sWRITE_NUM2_rxWriteNumLo(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sBYTE_COUNT_rxByteCount(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sDATA_rxValues(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sLRC_checkLrc(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sCRC_HI_checkCrc(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_sSKIP_TO_END_waitForEnd(ModbusSlave* ms, uint8_t data);
+static uint8_t frx_framing(ModbusSlave* ms, uint8_t data);
+
+// every state has an exit and they all lead to states of the same machine. 
+#define TX_ROW_CHECK(state, function, ...) SM_CHECK(mMAX_STATES, mNULL, state, __VA_ARGS__)
+#define RX_ROW_CHECK(state, function, ...) SM_CHECK(sMAX_STATES, sNULL, state, __VA_ARGS__)
+MODBUS_TX_STATES(TX_ROW_CHECK)
+MODBUS_RX_STATES(RX_ROW_CHECK)
+
+// Run the state function for the current state and return the next state. 
+#define TX_CASE(state, function, ...) \
+        case state: return SmExits<__VA_ARGS__>::next(PROFILED(&modbus_profile.tx[state], function(previous_state, ms)), mFINISH);
+static inline uint8_t tx_dispatch(uint8_t state, uint8_t previous_state, ModbusSlave* ms) {
+    switch (state) {
+        MODBUS_TX_STATES(TX_CASE)
+        default: return mFINISH;
+    }
+}
+
+#define RX_CASE(state, function, ...) \
+        case state: return SmExits<__VA_ARGS__>::next(PROFILED(&modbus_profile.rx[state], function(ms, data)), sCOLON);
+static inline uint8_t rx_dispatch(uint8_t state, ModbusSlave* ms, uint8_t data) {
+    switch (state) {
+        MODBUS_RX_STATES(RX_CASE)
+        default: return sCOLON;
+    }
+}
 
 //------------------------------------------------------------------------------
 
+// Start the transmit side of the default slave, it has something in its tx buffer. 
+void modbus_uart_tx_start(ModbusSlave*) {
+  SET_TX_ENABLE_HIGH();
+  UART_TX_INTERRUPT_ENABLE();
+}
 
-void modbus_init(uint8_t slaveID_init) {
+static_assert(MODBUS_SAVE_EEPROM_BASE + MODBUS_SAVE_EEPROM_SIZE <= EEPROM_SIZE, "The saved register copies don't fit in the EEPROM");
+
+void modbus_init(uint8_t slaveID_init, uint8_t mode) {
+  modbus_slave_init(&modbus_slave, slaveID_init, mode, modbus_uart_tx_start);
+  modbus_slave_restore(&modbus_slave, MODBUS_SAVE_EEPROM_BASE);
   UART_SETUP();
   TX_PIN_SETUP();
-  slaveID = slaveID_init;
 }
 
+// Everything not set here starts as zero. 
+void modbus_slave_init(ModbusSlave* ms, uint8_t slaveID_init, uint8_t mode, ModbusTxStart tx_start) {
+  memset((void*)ms, 0, sizeof(ModbusSlave));
+  ms->slaveID = slaveID_init;
+  ms->holding_registers[hr_SLAVE_ID] = slaveID_init;
+  ms->mode = mode;
+  ms->tx_start = tx_start;
+  ms->rx_state = sCOLON;
+  ms->rx_get_hi = 1;
+  ms->tx_state = mFINISH;
+  ms->tx_previous_state = mFINISH;
+  isr_publish_setpoints(ms);
+#if MODBUS_PROFILE
+  modbus_profile_clear();
+#endif
+}
+
+
+
+// The request is decoded a byte at a time as it arrives by modbus_receive_byte(), which is the same for ASCII and RTU 
+// and runs the receive statemachine (ModbusStateMachine.h). 
+// The ASCII framing (':', hex character pairs, CR LF) is handled by modbus_receive_statemachine() and the RTU framing 
+// (silence between frames) by modbus_rtu_receive(), both of which hand the data bytes on to modbus_receive_byte(). 
+// Each byte goes straight into the transmit structure (txrx), so once the frame ends the response can start without
+// copying anything. 
+// The check is kept as a running value over every byte including the received LRC/CRC itself. For both the 
+// LRC and the CRC a good frame then comes out as zero, so checking it costs nothing extra at the end of the frame. 
+// Errors in the request (bad function code, address etc.) are remembered and only answered with an exception 
+// once the whole frame has arrived and its check is good. A frame with a bad LRC/CRC or a framing error is ignored, 
+// as the master will time out and ask again. Both are counted in ms->counters. 
+
+// fn16 and fn23 carry a variable number of register values. They are held in ms->rxValues until the end of the 
+// frame, as nothing may be written unless the check is good. A request can't write more registers than there are. 
+
+// Hand the setpoints to the ISR. The whole set is written into the bank the ISR isn't reading, then one byte 
+// switches it over. The ISR can't run part way through itself, so it never sees a bank being written. 
+void isr_publish_setpoints(ModbusSlave* ms) {
+    uint8_t back = ms->isr_setpoints.front ^ 1;
+    uint8_t i;
+    
+    for (i = 0; i < isr_SETPOINT_COUNT; i++) {
+        ms->isr_setpoints.bank[back][i] = ms->holding_registers[pgm_read_byte(&isr_setpoint_slots[i])];
+    }
+    ms->isr_setpoints.front = back;
+    ms->isr_setpoints_dirty = 0;
+}
+
+// Copy the measurements from the ISR into holding_registers. If the ISR wrote one while they were being copied 
+// (the sequence count changed) the copy might be torn, so do it again. 
+void isr_collect_measurements(ModbusSlave* ms) {
+    uint16_t values[isr_MEASUREMENT_COUNT];
+    uint8_t seq;
+    uint8_t slot;
+    uint8_t i;
+    
+    if (ms->isr_measurements.seq == ms->isr_measurements_seq) return;
+    do {
+        seq = ms->isr_measurements.seq;
+        for (i = 0; i < isr_MEASUREMENT_COUNT; i++) values[i] = ms->isr_measurements.value[i];
+    } while (seq != ms->isr_measurements.seq);
+    ms->isr_measurements_seq = seq;
+    
+    for (i = 0; i < isr_MEASUREMENT_COUNT; i++) {
+        slot = pgm_read_byte(&isr_measurement_slots[i]);
+        if (ms->holding_registers[slot] != values[i]) {
+            ms->holding_registers[slot] = values[i];
+            ASCII_CACHE_INVALIDATE(ms, slot);
+        }
+    }
+}
+
+// The master reading a register, through its read hook if it has one. 
+uint16_t master_read_register(ModbusSlave* ms, uint8_t slot) {
+    RegisterReadHook hook;
+    
+    if (pgm_read_byte(&hr_flag_table[slot]) & HR_FLAG_READ_HOOK) {
+        hook = (RegisterReadHook)pgm_read_ptr(&hr_read_hooks[slot]);
+        return hook(ms, slot);
+    }
+    return ms->holding_registers[slot];
+}
+
+// The master writing a register, the write hook (if any) is called once the new value is in place. 
+void master_write_register(ModbusSlave* ms, uint8_t slot, uint16_t value) {
+    RegisterWriteHook hook;
+    
+    if (ms->holding_registers[slot] != value) save_changed(ms, slot);
+    ms->holding_registers[slot] = value;
+    ASCII_CACHE_INVALIDATE(ms, slot);
+    ms->isr_setpoints_dirty = 1;
+    if (pgm_read_byte(&hr_flag_table[slot]) & HR_FLAG_WRITE_HOOK) {
+        hook = (RegisterWriteHook)pgm_read_ptr(&hr_write_hooks[slot]);
+        hook(ms, slot, value);
+    }
+}
+
+// A complete request with a good check has arrived, answer it. 
+void modbus_process_request(ModbusSlave* ms) {
+    uint8_t i;
+    uint8_t exception = ms->rx_exception;
+    
+    ms->rx_end_clock = slave_clock(ms);
+    CAPTURE_MARK(ms, MODBUS_CAPTURE_REQUEST);
+    if (ms->txrx.broadcast && (ms->txrx.functionCode != 0x06) && (ms->txrx.functionCode != 0x10)) {
+        exception = EXCEPTION_ILLEGAL_FN;
+    }
+    if (exception == 0) {
+        if (ms->txrx.functionCode == 0x06) master_write_register(ms, ms->txrx.dataSlot, ms->txrx.value);
+        else if ((ms->txrx.functionCode == 0x10) || (ms->txrx.functionCode == 0x17)) {
+            // fn23 writes before it reads, the transmit statemachine reads the registers as it sends them. 
+            for (i = 0; i < ms->txrx.writeRegisters; i++) master_write_register(ms, ms->txrx.writeSlot + i, ms->rxValues[i]);
+        }
+        else if (ms->txrx.functionCode == 0x08) exception = modbus_diagnostics(ms);
+        else if (ms->txrx.functionCode == 0x0B) {
+            // sent like fn6's address and value: the status (never busy, as nothing is done in the background) 
+            // and the event count. 
+            ms->txrx.address = 0;
+            ms->txrx.value = ms->counters.events;
+        }
+    }
+    if (ms->txrx.broadcast) {
+        // never answered, see MODBUS_BROADCAST_ID. 
+        if (exception == 0) COUNTER_INC(ms->counters.events);
+        COUNTER_INC(ms->counters.no_responses);
+    }
+    else if (exception) exceptionResponse(ms, exception);
+    else {
+        // fn11 itself isn't counted as an event. 
+        if (ms->txrx.functionCode != 0x0B) COUNTER_INC(ms->counters.events);
+        ms->txrx.messageReadyToSend = 1;
+    }
+}
 
-enum MODBUSST {sSLAVE_ADDRESS, sCOMMAND, sREG_ADDRESS1, sREG_NUM_OR_ADDRESS2, sVALUE1, sVALUE2, sLRC, sCR, sLF, sEXCEPTION, sCOLON};
+// Function 8. ms->txrx.address is the sub-function and is echoed back, ms->txrx.value is the data sent and is 
+// replaced by what to send back. Returns the exception to answer with, 0 if none. 
+uint8_t modbus_diagnostics(ModbusSlave* ms) {
+    switch (ms->txrx.address) {
+        case MODBUS_DIAG_RETURN_QUERY_DATA: break;
+        case MODBUS_DIAG_RESTART_COMMS :
+            // the response is an echo of the request, the same as clearing the counters. 
+            if ((ms->txrx.value != 0x0000) && (ms->txrx.value != 0xFF00)) return EXCEPTION_ILLEGAL_DATA_VALUE;
+            // fall through
+        case MODBUS_DIAG_CLEAR_COUNTERS :
+            memset((void*)&ms->counters, 0, sizeof(ms->counters));
+            break;
+        case MODBUS_DIAG_DIAGNOSTIC_REGISTER : ms->txrx.value = 0; break;
+        case MODBUS_DIAG_BUS_MESSAGES : ms->txrx.value = ms->counters.bus_messages; break;
+        case MODBUS_DIAG_BUS_ERRORS : ms->txrx.value = ms->counters.check_errors; break;
+        case MODBUS_DIAG_EXCEPTIONS : ms->txrx.value = ms->counters.exceptions; break;
+        case MODBUS_DIAG_SLAVE_MESSAGES : ms->txrx.value = ms->counters.slave_messages; break;
+        case MODBUS_DIAG_NO_RESPONSES : ms->txrx.value = ms->counters.no_responses; break;
+        case MODBUS_DIAG_OVERRUNS : ms->txrx.value = ms->counters.overruns; break;
+        case MODBUS_DIAG_CLEAR_OVERRUNS : ms->counters.overruns = 0; break;
+        default : return EXCEPTION_ILLEGAL_FN;
+    }
+    return 0;
+}
 
+// The time in UPDATE_MODBUS_TIMER() ticks. The timer interrupt can change it while it is being read, so it is 
+// read until the same value comes back twice. 
+uint16_t slave_clock(ModbusSlave* ms) {
+    uint16_t clock;
+    
+    do {
+        clock = ms->clock;
+    } while (clock != ms->clock);
+    return clock;
+}
 
+// The total returned by modbus_update() and read from hr_ERRORCOUNT. 
+uint16_t error_total(ModbusSlave* ms) {
+    return ms->counters.check_errors + ms->counters.framing_errors + ms->counters.exceptions;
+}
 
-// ignore the start and end (colon and cr, lf), but store all the other bytes in the dataframe.
-// The rxFrame is layed out: [slaveAddress, command, registeraddresshighbyte, registeraddresslowbyte, valuehighbyte, valuelowbyte, lrc] 
-// The layout of the array is the same as the enumerated state variable so the state variable can be used as the index. 
-#define NUMBER_OF_BYTES_IN_RX_FRAME 7
-uint8_t rxFrame[NUMBER_OF_BYTES_IN_RX_FRAME];
+// Check the number of registers to read or write and that they all exist at consecutive addresses (and can be 
+// written if write is set), setting ms->rx_exception if not. The run tables hold how many registers in a row start 
+// at each slot, so this is one lookup whatever the count. 
+void check_register_range(ModbusSlave* ms, uint8_t slot, uint16_t count, uint8_t max_count, uint8_t write) {
+    uint8_t run;
+    
+    if ((count == 0) || (count > max_count)) ms->rx_exception = EXCEPTION_ILLEGAL_DATA_VALUE;
+    else if (slot == HR_NO_SLOT) ms->rx_exception = EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    else {
+        run = write ? pgm_read_byte(&hr_write_run_table.v[slot]) : pgm_read_byte(&hr_run_table.v[slot]);
+        if (count > run) ms->rx_exception = EXCEPTION_ILLEGAL_DATA_ADDRESS;
+    }
+}
 
-uint8_t modbus_rx_state = sCOLON;
+void modbus_receive_byte(ModbusSlave* ms, uint8_t data) {
 
-void modbus_receive_statemachine (uint8_t data_in) {
+  if (ms->mode == MODBUS_RTU) ms->rx_check = crc16_update(ms->rx_check, data);
+  else ms->rx_check += data;
+
+  ms->rx_state = rx_dispatch(ms->rx_state, ms, data);
+}
 
-  static uint8_t get_hi = 1;
-  static uint8_t hi_nibble = 0;
-  static uint8_t lo_nibble = 0;
+// ASCII framing
+void modbus_receive_statemachine(ModbusSlave* ms, uint8_t data_in) {
+
+  uint8_t nibble;
 
   // if a colon is recieved at any stage, it resets things back to the start. 
-  if (data_in == ':') modbus_rx_state = sCOLON;
+  if (data_in == ':') {
+      if (ms->rx_state != sCOLON) CAPTURE_MARK(ms, MODBUS_CAPTURE_RESYNC);
+      ms->rx_state = sCOLON;
+  }
 
   // ignore tab and space bytes (whitespace)
-  if ((data_in == 9) || (data_in == 32)) return 0;
+  if ((data_in == 9) || (data_in == 32)) return;
 
-  switch(modbus_rx_state) {
+  // states which deal with single characters rather than hex pairs. 
+  switch(ms->rx_state) {
       case sCOLON :
           if (data_in == ':') {
-              modbus_rx_state = sSLAVE_ADDRESS;
-              get_hi = 1;
-          }
-          break;
-      case sSLAVE_ADDRESS:   
-          if (get_hi) {
-              get_hi = 0;
-              hi_nibble = ascii_to_uint8(data_in);
+              ms->rx_state = sSLAVE_ADDRESS;
+              ms->rx_get_hi = 1;
+              ms->rx_check = 0;
+              ms->rx_exception = 0;
           }
-          else { 
-              get_hi = 1;            
-              lo_nibble = ascii_to_uint8(data_in);
-              rxFrame[sSLAVE_ADDRESS] = ((hi_nibble << 8) | lo_nibble);
-              // wait for the next frame to start if this isn't our address. 
-              if (rxFrame[sSLAVE_ADDRESS] != slaveID) modbus_rx_state = sCOLON;  
-              else modbus_rx_state = sCOMMAND;
+          return;
+      case sCR :
+          if (data_in == '\r') ms->rx_state = sLF;  
+          else {
+              ms->rx_state = sCOLON;  
+              COUNTER_INC(ms->counters.framing_errors);
+              CAPTURE_MARK(ms, MODBUS_CAPTURE_FRAMING);
           }
-          break;
-      case sCOMMAND :
-         if (get_hi) {
-              get_hi = 0;
-              hi_nibble = ascii_to_uint8(data_in);
+          return;
+      case sLF :
+          ms->rx_state = sCOLON;
+          if (data_in == '\n') modbus_process_request(ms);
+          else {
+              COUNTER_INC(ms->counters.framing_errors);
+              CAPTURE_MARK(ms, MODBUS_CAPTURE_FRAMING);
           }
-          else { 
-              get_hi = 1;
-              lo_nibble = ascii_to_uint8(data_in);
-              rxFrame[sCOMMAND] = ((hi_nibble << 8) | lo_nibble);
-              // Only commands 3 and 6 are availble, everything else is an error. 
-              if ((rxFrame[sCOMMAND] == 3) || (rxFrame[sCOMMAND] == 6)) modbus_rx_state = sREG_ADDRESS1;  
+          return;
+      case sSKIP_TO_END :
+          // the LRC of a request we can't handle (or with nothing to decode) still has to be good before answering it. 
+          if (data_in == '\r') {
+              if (((uint8_t)ms->rx_check == 0) && ms->rx_get_hi) ms->rx_state = sLF;
               else {
-                exceptionResponse(EXCEPTION_ILLEGAL_FN);
-                modbus_rx_state = sCOLON;
-              }
-          }      
-          break;
-      case sREG_ADDRESS1 : case sREG_NUM_OR_ADDRESS2 :
-          if (get_hi) {
-              get_hi = 0;
-              hi_nibble = ascii_to_uint8(data_in);
-          }
-          else {
-              get_hi = 1;  
-              lo_nibble = ascii_to_uint8(data_in);
-              rxFrame[modbus_rx_state] = ((hi_nibble << 8) | lo_nibble);  
-              if (modbus_rx_state == sREG_ADDRESS1) {
-                  if (rxFrame[sREG_ADDRESS1] != 0) {
-                      exceptionResponse(EXCEPTION_ILLEGAL_DATA_ADDRESS);  // not supporting more than 255 so this has to be zero. 
-                      modbus_rx_state = sCOLON;                                             
+                  ms->rx_state = sCOLON;
+                  if (!ms->rx_get_hi) {
+                      COUNTER_INC(ms->counters.framing_errors);
+                      CAPTURE_MARK(ms, MODBUS_CAPTURE_FRAMING);
                   }
-                  else modbus_rx_state = sREG_NUM_OR_ADDRESS2;           
-              }
-              else {
-                  if (rxFrame[sREG_NUM_OR_ADDRESS2] >= hr_ARRAY_SIZE) {
-                      exceptionResponse(EXCEPTION_ILLEGAL_DATA_ADDRESS);  // can't have an address greater than defined registers. 
-                      modbus_rx_state = sCOLON;                                             
+                  else {
+                      COUNTER_INC(ms->counters.check_errors);
+                      CAPTURE_MARK(ms, MODBUS_CAPTURE_CHECK);
                   }
-                  else modbus_rx_state = sVALUE1;
               }
+              return;
           }
-          break;  
-      case sVALUE1 : case sVALUE2 :
-          if (get_hi) {
-              get_hi = 0;
-              hi_nibble = ascii_to_uint8(data_in);
-          }
-          else {
-              get_hi = 1;  
-              lo_nibble = ascii_to_uint8(data_in);
-              rxFrame[modbus_rx_state] = ((hi_nibble << 8) | lo_nibble);  
-              modbus_rx_state++;   
-          }      
-          break;  
-      case sLRC :
-          if (get_hi) {
-              get_hi = 0;
-              hi_nibble = ascii_to_uint8(data_in);
-          }
-          else {
-              get_hi = 1;  
-              lo_nibble = ascii_to_uint8(data_in);
-              rxFrame[sLRC] = ((hi_nibble << 8) | lo_nibble);  
-              // calculate LRC on the received bytes and check. Don't inlude the LRC itself so subtract 1 from index. 
-//              if (calculateLRC(rxFrame, NUMBER_OF_BYTES_IN_RX_FRAME - 1) == rxFrame[sLRC]) modbus_rx_state = sCR;
-//              else {
-//                  exceptionResponse(EXCEPTION_ILLEGAL_DATA_VALUE);  // LRC didn't match. 
-                  modbus_rx_state = sCOLON;                
-//              }
-          }      
-          break;                                                        
-      case sCR :
-          if (data_in == '\r') modbus_rx_state = sLF;  
-          else {
-              modbus_rx_state = sCOLON;  
-              exceptionResponse(EXCEPTION_ILLEGAL_DATA_VALUE);
-          }
-          break;  
-      case sLF :
-          if (data_in == '\n') {
-              modbus_rx_state = sCOLON;
-              // DO SOMETHING WITH THE RECEIVED FRAME!!!!!!-----------------------------------  
-          }
-          else {
-              modbus_rx_state = sCOLON;  
-              exceptionResponse(EXCEPTION_ILLEGAL_DATA_VALUE);
-          }
-          break;         
+          break;
       default :
           break;      
-  }  
+  }
+
+  // everything else is two hex characters per byte. 
+  nibble = ascii_to_uint8(data_in);
+  if (nibble > 15) {
+      ms->rx_state = sCOLON;   // not a hex character so the frame is corrupt. 
+      COUNTER_INC(ms->counters.framing_errors);
+      CAPTURE_MARK(ms, MODBUS_CAPTURE_FRAMING);
+      return;
+  }
+  if (ms->rx_get_hi) {
+      ms->rx_get_hi = 0;
+      ms->rx_hi_nibble = nibble;
+      return;
+  }
+  ms->rx_get_hi = 1;
+  modbus_receive_byte(ms, (ms->rx_hi_nibble << 4) | nibble);
+}
+
+// RTU framing. frame_start is set for the first byte after a silence. 
+void modbus_rtu_receive(ModbusSlave* ms, uint8_t data_in, uint8_t frame_start) {
+  if (frame_start) {
+      ms->rx_state = sSLAVE_ADDRESS;
+      ms->rx_check = 0xFFFF;
+      ms->rx_exception = 0;
+  }
+  if (ms->rx_state != sCOLON) modbus_receive_byte(ms, data_in);
 }
 
 
 uint16_t modbus_update() {
+    return modbus_slave_update(&modbus_slave);
+}
+
+uint16_t modbus_slave_update(ModbusSlave* ms) {
+    uint8_t head;
+    uint8_t next_state;
+    uint8_t cur_state = ms->tx_state;
+    uint8_t previous_state = ms->tx_previous_state;
+    uint8_t overruns;
+    uint8_t lost;
+    uint8_t data;
+    PROFILE_START(update_start);
+
+    // bring the measurements and the overrun count up to date before any request that reads them is answered. 
+    isr_collect_measurements(ms);
+    overruns = ms->rx_overruns;
+    if (overruns != ms->rx_overruns_seen) {
+        lost = (uint8_t)(overruns - ms->rx_overruns_seen);
+        ms->rx_overruns_seen = overruns;
+        ms->counters.overruns = (ms->counters.overruns > (0xFFFF - lost)) ? 0xFFFF : (ms->counters.overruns + lost);
+    }
+
+    // process everything that has been received since the last call. 
+    if (ms->mode == MODBUS_RTU) {
+        while (BUFFER_COUNT(ms->rx)) {
+            modbus_rtu_receive(ms, ms->rx.data[ms->rx.tail & RX_BUFFER_MASK], FRAME_START_BIT(ms, ms->rx.tail));
+            ms->rx.tail++;
+        }
+        // a request with a bad function code (or fn11) is only over when the line goes quiet. 
+        if ((ms->rx_state == sSKIP_TO_END) && MODBUS_TIMER_EXPIRED(ms)) {
+            ms->rx_state = sCOLON;
+            if (ms->rx_check == 0) modbus_process_request(ms);
+            else {
+                COUNTER_INC(ms->counters.check_errors);
+                CAPTURE_MARK(ms, MODBUS_CAPTURE_CHECK);
+            }
+        }
+    }
+    else {
+        while (BUFFER_COUNT(ms->rx)) {
+            data = ms->rx.data[ms->rx.tail & RX_BUFFER_MASK];
+            // between frames only a ':' means anything, the rest needn't go through the statemachine
+            if ((ms->rx_state != sCOLON) || (data == ':')) modbus_receive_statemachine(ms, data);
+            ms->rx.tail++;
+        }
+    }
+    // waiting for the next frame (after a frame for another slave, a bad one, or one which is done) and nothing 
+    // left in rx: the rx interrupt can drop everything until the next frame starts. Interrupts are held off so a
+    // byte can't arrive between looking at rx and setting rx_skip. 
+    if (ms->rx_state == sCOLON) {
+#if defined(__AVR__)
+        uint8_t sreg = SREG;
+        cli();
+#endif
+        if (ms->rx.head == ms->rx.tail) ms->rx_skip = 1;
+#if defined(__AVR__)
+        SREG = sreg;
+#endif
+    }
+
+    // pass on anything the master (or the application) has written. 
+    if (ms->isr_setpoints_dirty) isr_publish_setpoints(ms);
 
-    static uint8_t cur_state = mFINISH;
-    static uint8_t previous_state = mFINISH;
-    uint8_t rc;
-    uint8_t (* state_fun)(uint8_t, TXRXdata*);
+    if (ms->stream_period && ms->stream_count) stream_schedule(ms);
+    if (ms->save_on) save_write_back(ms);
 
-    if (UART_READY_TO_SEND()) {
-        state_fun = state_fns_array[cur_state];
-        rc = state_fun(previous_state, &txrx);
+    // run the transmit statemachine until the tx buffer is full or it is waiting for something (the delay timer 
+    // or a message to send). Each state function puts at most one byte into the buffer, except mTXREG sending 
+    // from the ASCII cache which waits until there is room for all four characters. 
+    while (BUFFER_COUNT(ms->tx) < MODBUS_TX_BUFFER_SIZE) {
+        head = ms->tx.head;
+        next_state = tx_dispatch(cur_state, previous_state, ms);
         previous_state = cur_state;
-        cur_state = NEXT_STATE(cur_state, rc);      
+        cur_state = next_state;      
+        if ((head == ms->tx.head) && (cur_state == previous_state)) break;
     }
+    ms->tx_state = cur_state;
+    ms->tx_previous_state = previous_state;
 
+    // the data register empty interrupt sends whatever is in the buffer and turns itself off when it is empty. 
+    if (BUFFER_COUNT(ms->tx) && ms->tx_start) ms->tx_start(ms);
   
+    PROFILE_STOP(&modbus_profile.update, update_start);
+    return error_total(ms);
+}
+
+// Mark a push of the stream block (see MODBUS_FN_STREAM) as due, the transmit statemachine sends it when it is next 
+// free. A push still waiting when the next is due is the same one, so it is skipped rather than sent twice. 
+void stream_schedule(ModbusSlave* ms) {
+    uint16_t now = slave_clock(ms);
+    
+    if ((int16_t)(now - ms->stream_due) < 0) return;
+    ms->stream_due += ms->stream_period;
+    if ((int16_t)(now - ms->stream_due) >= 0) ms->stream_due = now + ms->stream_period;   // a whole period late
+    ms->stream_pending = 1;
+}
+
+//--Saved registers-----------------------------------------------------------------------------------------------
+
+// See Saved registers in AsciiModbusSlave.h. A copy in the EEPROM is
+//   sequence  the saved registers, high byte first, in address order  CRC low byte  CRC high byte
+// The CRC starts with the number of saved registers, so copies made for a different set don't match. The sequence
+// number goes up by one each copy, so among the good copies (which are never more than MODBUS_SAVE_COPIES apart) 
+// the newest is the one the others are all behind. 
+#define SAVE_ADDRESS(ms, copy) ((ms)->save_base + (uint16_t)(copy) * MODBUS_SAVE_COPY_SIZE)
+
+static uint16_t save_crc(const uint8_t* data) {
+    uint16_t crc = crc16_update(0xFFFF, MODBUS_SAVED_REGISTERS);
+    uint8_t i;
+    
+    for (i = 0; i < MODBUS_SAVE_COPY_SIZE - 2; i++) crc = crc16_update(crc, data[i]);
+    return crc;
+}
+
+// A saved register is about to change. The copy is made MODBUS_SAVE_SETTLE after the first change, so the ones 
+// after it are all in the same copy. 
+void save_changed(ModbusSlave* ms, uint8_t slot) {
+    if (!ms->save_on || ms->save_dirty || !(pgm_read_byte(&hr_flag_table[slot]) & HR_FLAG_SAVED)) return;
+    ms->save_dirty = 1;
+    ms->save_dirty_at = slave_clock(ms);
+}
+
+// Called by modbus_slave_update(). Makes a copy of the saved registers once they have settled and writes it into the
+// next place round, one byte per call when the EEPROM has finished the last one. Bytes which already hold the right
+// value are passed over. A register changed while the copy is being written goes in the next one. 
+void save_write_back(ModbusSlave* ms) {
+    uint8_t copy = (ms->save_copy + 1 == MODBUS_SAVE_COPIES) ? 0 : (ms->save_copy + 1);
+    uint16_t address;
+    uint16_t value;
+    uint16_t crc;
+    uint8_t data;
+    uint8_t i;
+    
+    if (ms->save_index == 0) {
+        if (!ms->save_dirty || ((int16_t)(slave_clock(ms) - ms->save_dirty_at) < (int16_t)MODBUS_SAVE_SETTLE)) return;
+        // through the read hooks, so hr_GROUPS is the groups in use even if the application set them. 
+        ms->save_data[0] = (uint8_t)(ms->save_seq + 1);
+        for (i = 0; i < MODBUS_SAVED_REGISTERS; i++) {
+            value = master_read_register(ms, pgm_read_byte(&hr_saved_table.v[i]));
+            ms->save_data[1 + 2 * i] = (uint8_t)(value >> 8);
+            ms->save_data[2 + 2 * i] = (uint8_t)value;
+        }
+        crc = save_crc(ms->save_data);
+        ms->save_data[MODBUS_SAVE_COPY_SIZE - 2] = (uint8_t)crc;
+        ms->save_data[MODBUS_SAVE_COPY_SIZE - 1] = (uint8_t)(crc >> 8);
+        ms->save_dirty = 0;
+        ms->save_index = 1;
+    }
+    if (EEPROM_BUSY()) return;
+    while (ms->save_index <= MODBUS_SAVE_COPY_SIZE) {
+        address = SAVE_ADDRESS(ms, copy) + ms->save_index - 1;
+        data = ms->save_data[ms->save_index - 1];
+        ms->save_index++;
+        if (EEPROM_READ_BYTE(address) != data) {
+            EEPROM_WRITE_BYTE(address, data);
+            return;
+        }
+    }
+    // the CRC has gone, this copy is now the newest. 
+    ms->save_copy = copy;
+    ms->save_seq = ms->save_data[0];
+    ms->save_index = 0;
+}
+
+// Only called at start up, so it waits for a write left going by a reset and reads the copies straight through. 
+// The registers are put back through their write hooks, as if the master had written them. 
+uint8_t modbus_slave_restore(ModbusSlave* ms, uint16_t eeprom_base) {
+    uint8_t data[MODBUS_SAVE_COPY_SIZE];
+    uint8_t newest[MODBUS_SAVE_COPY_SIZE];
+    uint8_t found = 0;
+    uint8_t copy;
+    uint8_t i;
+    uint16_t crc;
+    uint16_t id;
+    
+    ms->save_on = 0;
+    ms->save_dirty = 0;
+    ms->save_index = 0;
+    ms->save_base = eeprom_base;
+    ms->save_copy = MODBUS_SAVE_COPIES - 1;             // so the first copy goes in place 0
+    ms->save_seq = 0;
+    if ((uint32_t)eeprom_base + MODBUS_SAVE_EEPROM_SIZE > EEPROM_SIZE) return 0;
+    
+    while (EEPROM_BUSY());
+    for (copy = 0; copy < MODBUS_SAVE_COPIES; copy++) {
+        for (i = 0; i < MODBUS_SAVE_COPY_SIZE; i++) data[i] = EEPROM_READ_BYTE(SAVE_ADDRESS(ms, copy) + i);
+        crc = save_crc(data);
+        if ((data[MODBUS_SAVE_COPY_SIZE - 2] != (uint8_t)crc) || (data[MODBUS_SAVE_COPY_SIZE - 1] != (uint8_t)(crc >> 8))) continue;
+        if (found && ((int8_t)(data[0] - ms->save_seq) <= 0)) continue;
+        memcpy(newest, data, sizeof(newest));
+        ms->save_copy = copy;
+        ms->save_seq = data[0];
+        found = 1;
+    }
+    if (found) {
+        for (i = 0; i < MODBUS_SAVED_REGISTERS; i++) {
+            master_write_register(ms, pgm_read_byte(&hr_saved_table.v[i]), (uint16_t)((newest[1 + 2 * i] << 8) | newest[2 + 2 * i]));
+        }
+        id = ms->holding_registers[hr_SLAVE_ID];
+        if ((id >= 1) && (id <= 247)) ms->slaveID = (uint8_t)id;
+        else {
+            ms->holding_registers[hr_SLAVE_ID] = ms->slaveID;
+            ASCII_CACHE_INVALIDATE(ms, hr_SLAVE_ID);
+        }
+        isr_publish_setpoints(ms);
+    }
+    ms->save_on = 1;
+    return found;
+}
+
+uint8_t modbus_slave_saving(ModbusSlave* ms) {
+    return (ms->save_dirty || ms->save_index) ? 1 : 0;
+}
+
+//--UART interrupt routines---------------------------------------------------------------------------------------
+
+// These do the work for a slave's UART interrupts, whichever UART it is on. 
+
+void modbus_slave_rx_byte(ModbusSlave* ms, uint8_t data) {
+    uint8_t index = ms->rx.head;
+    uint8_t frame_start;
+    
+    // RTU: a frame starts with the first byte after a silence, and every byte restarts the silence timer. 
+    if (ms->mode == MODBUS_RTU) {
+        frame_start = MODBUS_TIMER_EXPIRED(ms);
+        SET_MODBUS_TIMER(ms, MODBUS_RTU_SILENCE);
+        if (frame_start) CAPTURE_MARK(ms, MODBUS_CAPTURE_SILENCE);
+    }
+    else frame_start = (data == ':');
+    CAPTURE(ms, MODBUS_CAPTURE_RX, data);
+    // skipping to the next frame (see modbus_slave_update()), nothing before it goes into rx
+    if (ms->rx_skip) {
+        if (!frame_start) return;
+        ms->rx_skip = 0;
+    }
+    if (BUFFER_COUNT(ms->rx) < MODBUS_RX_BUFFER_SIZE) {
+        ms->rx.data[index & RX_BUFFER_MASK] = data;
+        if (ms->mode == MODBUS_RTU) {
+            if (frame_start) ms->rxFrameStart[(index & RX_BUFFER_MASK) >> 3] |= _BV(index & 0x07);
+            else ms->rxFrameStart[(index & RX_BUFFER_MASK) >> 3] &= ~(_BV(index & 0x07));
+        }
+        ms->rx.head = index + 1;
+    }
+    else {
+        ms->rx_overruns++;
+        CAPTURE_MARK(ms, MODBUS_CAPTURE_OVERRUN);
+    }
+}
+
+int16_t modbus_slave_tx_byte(ModbusSlave* ms) {
+    uint8_t data;
+    
+    if (BUFFER_COUNT(ms->tx) == 0) return -1;
+    data = ms->tx.data[ms->tx.tail & TX_BUFFER_MASK];
+    ms->tx.tail++;
+    CAPTURE(ms, MODBUS_CAPTURE_TX, data);
+    return data;
+}
+
+uint8_t modbus_slave_tx_idle(ModbusSlave* ms) {
+    return (BUFFER_COUNT(ms->tx) == 0) ? 1 : 0;
+}
+
+// Nothing for modbus_slave_update() to do until the next interrupt: rx and tx empty, no response or push waiting 
+// to go, no timer running (a response delay or an RTU silence) and no EEPROM write in hand. Interrupts must be off.
+uint8_t modbus_slave_idle(ModbusSlave* ms) {
+    return (BUFFER_COUNT(ms->rx) == 0) && (BUFFER_COUNT(ms->tx) == 0) && (ms->tx_state == mFINISH) && 
+           !ms->txrx.messageReadyToSend && !ms->stream_pending && !(ms->stream_period && ms->stream_count) &&
+           MODBUS_TIMER_EXPIRED(ms) && !ms->isr_setpoints_dirty && !modbus_slave_saving(ms);
+}
+
+// see MODBUS_IDLE_SLEEP in AsciiModbusSlave.h
+uint8_t modbus_idle() {
+#if defined(__AVR__) && MODBUS_IDLE_SLEEP
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    cli();
+    if (modbus_slave_idle(&modbus_slave)) {
+        // the instruction after sei() always runs before any interrupt, so one which came after the check still 
+        // wakes sleep_cpu() rather than being taken before it
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+        return 1;
+    }
+    sei();
+#endif
     return 0;
 }
 
+// The default slave on the UART in the HARDWARE CONFIGURATION. 
+
+void modbus_uart_rx_isr() {
+    // always read the byte, it clears the interrupt.
+    modbus_slave_rx_byte(&modbus_slave, UART_GET_BYTE());
+}
+
+void modbus_uart_udre_isr() {
+    int16_t data = modbus_slave_tx_byte(&modbus_slave);
+    
+    if (data < 0) UART_TX_INTERRUPT_DISABLE();
+    else UART_SEND_BYTE((uint8_t)data);
+}
+
+void modbus_uart_txc_isr() {
+    // the last bit has gone out on the wire, let go of the RS485 bus if nothing else is waiting to be sent. 
+    if (modbus_slave_tx_idle(&modbus_slave)) SET_TX_ENABLE_LOW();
+}
+
+#if defined(__AVR__)
+ISR(USART_RX_vect) { modbus_uart_rx_isr(); }
+ISR(USART_UDRE_vect) { modbus_uart_udre_isr(); }
+ISR(USART_TX_vect) { modbus_uart_txc_isr(); }
+#endif
+
+#if MODBUS_CAPTURE
+//--Capture--------------------------------------------------------------------------------------------------------
+
+#define CAPTURE_MASK (MODBUS_CAPTURE_SIZE - 1)
+#define CAPTURE_ENTRY(kind, clock, data) ((uint16_t)(kind) << 14 | ((uint16_t)(clock) & 0x3F) << 8 | (uint8_t)(data))
+#define CAPTURE_EMPTY CAPTURE_ENTRY(MODBUS_CAPTURE_MARK, 0, MODBUS_CAPTURE_NONE)
+static_assert((MODBUS_CAPTURE_SIZE & CAPTURE_MASK) == 0, "MODBUS_CAPTURE_SIZE must be a power of two");
+
+// Entries come from the rx and tx interrupts and from modbus_slave_update(), so the ring is only touched with 
+// interrupts held off. (an interrupt routine already has them off, it just puts them back as they were)
+#if defined(__AVR__)
+#define CAPTURE_ATOMIC_BEGIN() uint8_t capture_sreg = SREG; cli()
+#define CAPTURE_ATOMIC_END() SREG = capture_sreg
+#else
+#define CAPTURE_ATOMIC_BEGIN()
+#define CAPTURE_ATOMIC_END()
+#endif
+
+// Record an entry, with a _TIME entry in front of it if the last was 64 ticks or more ago. In 
+// MODBUS_CAPTURE_TRIGGER mode an error marker starts the count down to stopping. 
+void capture_put(ModbusSlave* ms, uint8_t kind, uint8_t data) {
+    uint16_t now;
+    uint16_t head;
+    CAPTURE_ATOMIC_BEGIN();
+    
+    // the mode is looked at again with interrupts off, one might have stopped it since
+    if (ms->capture_mode != MODBUS_CAPTURE_OFF) {
+        now = ms->clock;
+        head = ms->capture_head;
+        if ((uint16_t)(now - ms->capture_last) >= 64) {
+            ms->capture[head & CAPTURE_MASK] = CAPTURE_ENTRY(MODBUS_CAPTURE_TIME, now, now >> 6);
+            head++;
+        }
+        ms->capture[head & CAPTURE_MASK] = CAPTURE_ENTRY(kind, now, data);
+        head++;
+        ms->capture_last = now;
+        ms->capture_head = head;
+        if (ms->capture_mode == MODBUS_CAPTURE_TRIGGERED) {
+            if ((int16_t)(head - ms->capture_stop_at) >= 0) ms->capture_mode = MODBUS_CAPTURE_OFF;
+        }
+        else if ((ms->capture_mode == MODBUS_CAPTURE_TRIGGER) && (kind == MODBUS_CAPTURE_MARK) && 
+                 (data >= MODBUS_CAPTURE_FRAMING)) {
+            ms->capture_mode = MODBUS_CAPTURE_TRIGGERED;
+            ms->capture_stop_at = head + (MODBUS_CAPTURE_SIZE / 2);
+        }
+    }
+    CAPTURE_ATOMIC_END();
+}
+
+// Write hook for hr_CAPTURE_MODE. Starting clears the ring, the first entry is always a _TIME. 
+void modbus_capture_mode(ModbusSlave* ms, uint8_t, uint16_t value) {
+    CAPTURE_ATOMIC_BEGIN();
+    
+    if ((value == MODBUS_CAPTURE_RUN) || (value == MODBUS_CAPTURE_TRIGGER)) {
+        ms->capture_head = 0;
+        ms->capture_last = ms->clock - 64;
+        ms->capture_mode = (uint8_t)value;
+    }
+    else ms->capture_mode = MODBUS_CAPTURE_OFF;
+    CAPTURE_ATOMIC_END();
+    CAPTURE_MARK(ms, MODBUS_CAPTURE_STARTED);
+}
+
+// Read hook for the CAPTURE registers. hr_CAPTURE_0 ... _7 read the entries from hr_CAPTURE_INDEX on, an entry 
+// that has been written over (or not recorded yet) reads as CAPTURE_EMPTY. 
+uint16_t modbus_capture_read(ModbusSlave* ms, uint8_t reg) {
+    uint16_t index;
+    uint16_t value = CAPTURE_EMPTY;
+    CAPTURE_ATOMIC_BEGIN();
+    
+    if (reg == hr_CAPTURE_MODE) value = ms->capture_mode;
+    else if (reg == hr_CAPTURE_HEAD) value = ms->capture_head;
+    else {
+        index = ms->holding_registers[hr_CAPTURE_INDEX] + (reg - hr_CAPTURE_0);
+        // one of the last MODBUS_CAPTURE_SIZE recorded, an index at or past the head wraps round to a big number
+        if ((uint16_t)(ms->capture_head - index - 1) < MODBUS_CAPTURE_SIZE) value = ms->capture[index & CAPTURE_MASK];
+    }
+    CAPTURE_ATOMIC_END();
+    return value;
+}
+#endif
+
+#if MODBUS_PROFILE
+//--Profiling-----------------------------------------------------------------------------------------------------
+
+// Timer1 as a 16 bit count of CPU cycles. ticks * (top + 1) wraps at 65536 in step with ticks, so the difference of
+// two readings is right as long as they are less than 65536 cycles apart (8mS at 8MHz). 
+// If Timer1 has gone back to 0 but the interrupt hasn't counted it yet (the compare flag is still set) it is counted
+// here. Interrupts are held off while reading as the 16 bit TCNT1 read isn't safe if the interrupt reads it as well. 
+uint16_t modbus_profile_now() {
+    uint16_t ticks;
+    uint16_t count;
+#if defined(__AVR__)
+    uint8_t sreg = SREG;
+    cli();
+#endif
+    ticks = modbus_profile.ticks;
+    count = PROFILE_CLOCK_COUNT();
+    if (PROFILE_CLOCK_WRAPPED() && (count < (PROFILE_CLOCK_TOP() >> 1))) ticks++;
+#if defined(__AVR__)
+    SREG = sreg;
+#endif
+    return (uint16_t)(ticks * (uint16_t)(PROFILE_CLOCK_TOP() + 1) + count);
+}
+
+// cycles since start, less the cost of timing. 
+static uint16_t profile_since(uint16_t start) {
+    uint16_t cycles = modbus_profile_now() - start;
+    
+    return (cycles > modbus_profile.overhead) ? (cycles - modbus_profile.overhead) : 0;
+}
+
+static void profile_record(volatile ProfileStat* stat, uint16_t cycles) {
+    if ((stat->calls == 0) || (cycles < stat->min)) stat->min = cycles;
+    if (cycles > stat->max) stat->max = cycles;
+    if (stat->calls == 0) stat->average = cycles;
+    else stat->average = (uint16_t)(((uint32_t)stat->average * 7 + cycles + 4) >> 3);
+    if (stat->calls != 0xFFFF) stat->calls++;
+}
+
+void modbus_profile_clear() {
+    uint16_t start;
+    
+    memset((void*)modbus_profile.tx, 0, sizeof(modbus_profile.tx));
+    memset((void*)modbus_profile.rx, 0, sizeof(modbus_profile.rx));
+    memset((void*)&modbus_profile.update, 0, sizeof(modbus_profile.update));
+    modbus_profile.isr_clear = 1;
+    // what it costs to time nothing
+    modbus_profile.overhead = 0;
+    start = modbus_profile_now();
+    modbus_profile.overhead = modbus_profile_now() - start;
+}
+
+// The time of an interrupt is the count at the end less the count at the start. With a CTC timer the interrupt is 
+// entered when it goes back to 0 (which clears the compare flag), and if the flag is set again by the end it took 
+// longer than a whole period. 
+// A clear is done at the start, so a late edge in the same interrupt is still counted. 
+uint16_t modbus_profile_isr_begin() {
+    modbus_profile.ticks++;
+    if (modbus_profile.isr_clear) {
+        memset((void*)&modbus_profile.isr, 0, sizeof(modbus_profile.isr));
+        modbus_profile.isr_overruns = 0;
+        modbus_profile.isr_clear = 0;
+    }
+    return PROFILE_CLOCK_COUNT();
+}
+
+void modbus_profile_isr_end(uint16_t start) {
+    uint16_t end = PROFILE_CLOCK_COUNT();
+    
+    if (PROFILE_CLOCK_WRAPPED()) {
+        modbus_profile.isr_overruns++;
+        end += PROFILE_CLOCK_TOP() + 1;
+    }
+    profile_record(&modbus_profile.isr, end - start);
+}
+
+void modbus_profile_isr_late() {
+    modbus_profile.isr_overruns++;
+}
+
+// Write hook for hr_PROFILE_SELECT. 
+void modbus_profile_select(ModbusSlave*, uint8_t, uint16_t value) {
+    if (value == MODBUS_PROFILE_CLEAR) modbus_profile_clear();
+}
+
+// Read hook for the PROFILE registers. The interrupt's numbers can change while being read, so they are read 
+// until the same value comes back twice. 
+uint16_t modbus_profile_read(ModbusSlave* ms, uint8_t reg) {
+    uint16_t select = ms->holding_registers[hr_PROFILE_SELECT];
+    volatile ProfileStat* stat;
+    volatile uint16_t* field;
+    uint16_t value;
+    
+    if (reg == hr_PROFILE_ISR_OVERRUNS) field = &modbus_profile.isr_overruns;
+    else {
+        if (select < (MODBUS_PROFILE_TX + mMAX_STATES)) stat = &modbus_profile.tx[select - MODBUS_PROFILE_TX];
+        else if ((select >= MODBUS_PROFILE_RX) && (select < (MODBUS_PROFILE_RX + sMAX_STATES))) stat = &modbus_profile.rx[select - MODBUS_PROFILE_RX];
+        else if (select == MODBUS_PROFILE_UPDATE) stat = &modbus_profile.update;
+        else if (select == MODBUS_PROFILE_ISR) stat = &modbus_profile.isr;
+        else return 0;
+        if (reg == hr_PROFILE_MIN) field = &stat->min;
+        else if (reg == hr_PROFILE_MAX) field = &stat->max;
+        else if (reg == hr_PROFILE_AVERAGE) field = &stat->average;
+        else field = &stat->calls;
+    }
+    do {
+        value = *field;
+    } while (value != *field);
+    return value;
+}
+#endif
+
 // return the ascii character representation for integers 0,1,2,3...15
 // return 255 if its an error (a number bigger than 15)
 uint8_t uint8_to_ascii(uint8_t in) {
@@ -341,175 +1016,484 @@ uint8_t ascii_to_uint8(uint8_t ch) {
 
 
 
+// The application's access to the registers, no hooks are called. 
+uint16_t modbus_read_register(uint8_t reg) {
+  return modbus_slave.holding_registers[reg];
+}
+
+void modbus_write_register(uint8_t reg, uint16_t value) {
+  modbus_slave_write_register(&modbus_slave, reg, value);
+}
+
+uint16_t modbus_slave_read_register(ModbusSlave* ms, uint8_t reg) {
+  return ms->holding_registers[reg];
+}
+
+void modbus_slave_write_register(ModbusSlave* ms, uint8_t reg, uint16_t value) {
+  if (ms->holding_registers[reg] != value) save_changed(ms, reg);
+  ms->holding_registers[reg] = value;
+  ASCII_CACHE_INVALIDATE(ms, reg);
+  ms->isr_setpoints_dirty = 1;
+}
+
+void modbus_set_groups(uint8_t groups) {
+  modbus_slave_set_groups(&modbus_slave, groups);
+}
+
+void modbus_slave_set_groups(ModbusSlave* ms, uint8_t groups) {
+  ms->groups = groups;
+}
+
+// Read hook for hr_ERRORCOUNT. 
+uint16_t modbus_error_count_read(ModbusSlave* ms, uint8_t) {
+  return error_total(ms);
+}
+
+// Read and write hooks for hr_GROUPS, the groups are kept in the context so the receiver doesn't depend on the map. 
+uint16_t modbus_groups_read(ModbusSlave* ms, uint8_t) {
+  return ms->groups;
+}
+
+void modbus_groups_write(ModbusSlave* ms, uint8_t, uint16_t value) {
+  ms->groups = (uint8_t)value;
+}
+
+// Write hook for hr_STREAM_..., the block is checked and looked up here rather than at every push. Setting the 
+// period starts the pushes, the first a period later so it isn't held up behind the answer to the write. 
+void modbus_stream_write(ModbusSlave* ms, uint8_t reg, uint16_t) {
+  uint16_t address = ms->holding_registers[hr_STREAM_ADDRESS];
+  uint16_t count = ms->holding_registers[hr_STREAM_COUNT];
+  uint8_t slot = hr_lookup((uint8_t)(address >> 8), (uint8_t)address);
+  
+  ms->stream_count = 0;
+  if ((slot != HR_NO_SLOT) && (count > 0) && (count <= MODBUS_STREAM_MAX_REGISTERS) 
+      && (count <= pgm_read_byte(&hr_run_table.v[slot]))) {
+    ms->stream_slot = slot;
+    ms->stream_count = (uint8_t)count;
+  }
+  ms->stream_period = ms->holding_registers[hr_STREAM_PERIOD] & 0x7FFF;
+  if (reg == hr_STREAM_PERIOD) ms->stream_due = slave_clock(ms) + ms->stream_period;
+}
+
+// Read hook for hr_FRAMING_ERRORS and hr_LATENCY_... 
+uint16_t modbus_diagnostic_read(ModbusSlave* ms, uint8_t reg) {
+  if (reg == hr_FRAMING_ERRORS) return ms->counters.framing_errors;
+  return ms->counters.latency[(reg - hr_LATENCY_0) & (MODBUS_LATENCY_BUCKETS - 1)];
+}
+
+// Set up the transmit statemachine to send an exception response for the function code just received. 
+void exceptionResponse(ModbusSlave* ms, uint8_t exception) {
+  COUNTER_INC(ms->counters.exceptions);
+  CAPTURE_MARK(ms, MODBUS_CAPTURE_EXCEPTION);
+  ms->txrx.functionCode |= 0x80;
+  ms->txrx.exception = exception;
+  ms->txrx.messageReadyToSend = 1;
+}
+
 //--Slave transmit state machine functions-------------------------------------------------------------------------------
 
-uint8_t ftx_mTXSTART_beginDelayTimer (uint8_t previous_state, TXRXdata* txd) {
-     // there is supposed to be a delay between a message being recieved and a message being sent. 
-     SET_MODBUS_TIMER(MODBUS_DELAY);
+static uint8_t ftx_mTXSTART_beginDelayTimer (uint8_t, ModbusSlave* ms) {
+     // there is supposed to be a delay between a message being recieved and a message being sent. A push isn't an 
+     // answer, in ASCII it can go straight away, RTU still needs the silence in front of it. 
+     if (ms->tx_push_count && (ms->mode == MODBUS_ASCII)) SET_MODBUS_TIMER(ms, 0);
+     else SET_MODBUS_TIMER(ms, MODBUS_DELAY);
      FORWARD_WHEN("Delay timer started");  
 }
 
-uint8_t ftx_mCOLON_sendColon(uint8_t previous_state, TXRXdata* txd){
-  if (!MODBUS_TIMER_EXPIRED()) REPEAT_UNTIL("Delay timer has expired"); 
-  UART_SEND_BYTE(':');
+static uint8_t ftx_mCOLON_sendColon(uint8_t, ModbusSlave* ms){
+  uint16_t late;
+  uint8_t bucket = 0;
+  
+  if (!MODBUS_TIMER_EXPIRED(ms)) REPEAT_UNTIL("Delay timer has expired"); 
+  // RTU frames don't have a start character. 
+  if (ms->mode != MODBUS_RTU) TX_BUFFER_PUT(ms, ':');
+  // the response has started, count how late it was (see MODBUS_LATENCY_BUCKETS). A push doesn't answer anything. 
+  if (!ms->tx_push_count) {
+    late = slave_clock(ms) - ms->rx_end_clock;
+    late = (late > MODBUS_DELAY) ? (late - MODBUS_DELAY) : 0;
+    while (late && (bucket < (MODBUS_LATENCY_BUCKETS - 1))) {
+      late >>= 1;
+      bucket++;
+    }
+    COUNTER_INC(ms->counters.latency[bucket]);
+  }
+  ms->txrx.lrc = 0;
+  ms->txrx.crc = 0xFFFF;
   FORWARD_WHEN("Delay timer expired and ':' sent");  
 }
 
-uint8_t ftx_mSLAVEID_sendAddress(uint8_t previous_state, TXRXdata* txd){
-    if (send_bin_as_ascii_char((uint16_t) *(txd->slave_ID), 8)) FORWARD_WHEN("All SalveID nibbles sent");
+static uint8_t ftx_mSLAVEID_sendAddress(uint8_t, ModbusSlave* ms){
+    if (SEND_DATA((uint16_t) ms->slaveID, 8, ms)) FORWARD_WHEN("All SalveID nibbles sent");
     REPEAT_UNTIL("All SlaveID nibbles sent");           
 }
 
-uint8_t ftx_mFNCODE_sendFnCode(uint8_t previous_state, TXRXdata* txd){
-    if (send_bin_as_ascii_char((uint16_t) *(txd->fnCode), 8)) 
+static uint8_t ftx_mFNCODE_sendFnCode(uint8_t, ModbusSlave* ms){
+    if (SEND_DATA((uint16_t) TX_FN(ms), 8, ms)) 
     {
-      if (*(txd->fnCode) & 0b10000000) BRANCH_IF("Fn is an exception");
+      if (TX_FN(ms) & 0b10000000) BRANCH_IF("Fn is an exception");
       else FORWARD_WHEN("All FnCode nibbles sent"); 
     }    
     REPEAT_UNTIL("All FnCode nibbles sent");           
 }
 
-uint8_t ftx_mCHOICE_fn3OrFn6(uint8_t previous_state, TXRXdata* txd){
-      if (*(txd->fnCode) == 0x03) FORWARD_WHEN("Fn Code 03");
-      BRANCH_IF("Fn Code 06");        
+static uint8_t ftx_mCHOICE_fn3OrFn6(uint8_t, ModbusSlave* ms){
+      // fn23 and a push send registers just like fn3, fn16 answers with the address and count like fn6. 
+      // fn8 and fn11 answer with two values like fn6 as well. 
+      if (ms->tx_push_count || (ms->txrx.functionCode == 0x03) || (ms->txrx.functionCode == 0x17)) {
+        FORWARD_WHEN("Fn Code 03, 23 or a push");
+      }
+      BRANCH_IF("Fn Code 06, 08, 11 or 16");        
 }
 
-uint8_t ftx_mEXCEPT_sendException(uint8_t previous_state, TXRXdata* txd) {
-    if (send_bin_as_ascii_char((uint16_t) txd->exception, 8)) FORWARD_WHEN("Exception nibbles sent");
+static uint8_t ftx_mEXCEPT_sendException(uint8_t, ModbusSlave* ms) {
+    if (SEND_DATA((uint16_t) ms->txrx.exception, 8, ms)) FORWARD_WHEN("Exception nibbles sent");
     REPEAT_UNTIL("Exception nibbles sent");     
 }
 
-uint8_t ftx_mFINISH_waitUntilNewMsg(uint8_t previous_state, TXRXdata* txd){
-    if (txd->messageReadyToSend == 1) FORWARD_WHEN("Msg to send");
-    else REPEAT_UNTIL("Msg available");   
+static uint8_t ftx_mFINISH_waitUntilNewMsg(uint8_t, ModbusSlave* ms){
+    // an answer goes before a push, the master is timing it. RTU only starts a push once the last frame has gone, 
+    // so the silence in front of it is timed from the end of that frame. 
+    ms->tx_push_count = 0;
+    if (ms->txrx.messageReadyToSend == 1) FORWARD_WHEN("Msg to send");
+    if (ms->stream_pending && ((ms->mode == MODBUS_ASCII) || (BUFFER_COUNT(ms->tx) == 0))) {
+      ms->stream_pending = 0;
+      ms->tx_push_slot = ms->stream_slot;
+      ms->tx_push_count = ms->stream_count;
+      FORWARD_WHEN("Push due");
+    }
+    REPEAT_UNTIL("Msg available");   
 }
-uint8_t ftx_mNUMDATA_txNumBytes(uint8_t previous_state, TXRXdata* txd){
-    if (send_bin_as_ascii_char((uint16_t)txd->numBytes, 8)) FORWARD_WHEN("Nibbles for num bytes sent");
+static uint8_t ftx_mNUMDATA_txNumBytes(uint8_t, ModbusSlave* ms){
+    if (SEND_DATA((uint16_t)(TX_REGISTERS(ms) << 1), 8, ms)) FORWARD_WHEN("Nibbles for num bytes sent");
     REPEAT_UNTIL("Nibbles for num bytes sent");     
 }
 
-uint8_t ftx_mDATAADD_txDataAddress(uint8_t previous_state, TXRXdata* txd){
-    if (send_bin_as_ascii_char((uint16_t)txd->dataAddress, 16)) FORWARD_WHEN("Data address nibbles sent");
+static uint8_t ftx_mDATAADD_txDataAddress(uint8_t, ModbusSlave* ms){
+    if (SEND_DATA(ms->txrx.address, 16, ms)) FORWARD_WHEN("Data address nibbles sent");
     REPEAT_UNTIL("Data address nibbles sent");     
 }
 
-uint8_t ftx_mVALUE_txDataValue(uint8_t previous_state, TXRXdata* txd){
-    if (send_bin_as_ascii_char((uint16_t) txd->registers[txd->dataAddress], 16)) FORWARD_WHEN("Value nibbles sent");
+static uint8_t ftx_mVALUE_txDataValue(uint8_t, ModbusSlave* ms){
+    // fn6: the value written.  fn16: the number of registers written.  fn8: the result.  fn11: the event count. 
+    if (SEND_DATA(ms->txrx.value, 16, ms)) FORWARD_WHEN("Value nibbles sent");
     REPEAT_UNTIL("Value nibbles sent");     
 }
 
-uint8_t ftx_mLRC_sendLrc(uint8_t previous_state, TXRXdata* txd){
-    static uint8_t lrc;
+static uint8_t ftx_mLRC_sendLrc(uint8_t, ModbusSlave* ms){
+    uint16_t crc;
     
-    if (previous_state == mEXCEPT) {
-      //                 b1,                b2,            b3,             b4,   array_start_index, number_of_array_elements, the_array[]      
-      lrc = calculateLRC(*(txd->slave_ID), *(txd->fnCode), txd->exception, 0x00, 0x00,              0x00,                     txd->registers);    
-    }    
-    else if (previous_state == mTXREG) {
-      //                 b1,                b2,            b3,            b4,   array_start_index, number_of_array_elements, the_array[]     
-      lrc = calculateLRC(*(txd->slave_ID), *(txd->fnCode), txd->numBytes, 0x00, txd->dataAddress,  txd->numRegisters,        txd->registers);          
+    // every byte of the response was added into ms->txrx.lrc/crc as it was sent, so the check is ready to go. 
+    // ASCII: the 2's compliment of the sum. (sending the LRC adds it into ms->txrx.lrc as well but nothing uses it after this) 
+    // RTU: the CRC, low byte first. It is sent through a copy as ms->txrx.crc must not change between the two bytes. 
+    if (ms->mode == MODBUS_RTU) {
+      crc = ms->txrx.crc;
+      if (send_bin_as_rtu_bytes(ms, (uint16_t)((ms->txrx.crc << 8) | (ms->txrx.crc >> 8)), 16, &crc)) FORWARD_WHEN("CRC bytes sent");
     }
-    else if (previous_state == mVALUE) {
-      //                 b1,                b2,            b3,                b4,   array_start_index, number_of_array_elements, the_array[]     
-      lrc = calculateLRC(*(txd->slave_ID), *(txd->fnCode), txd->dataAddress,  0x00, txd->dataAddress,  0x01,                     txd->registers);          
-    }    
-    
-    if (send_bin_as_ascii_char((uint16_t)lrc, 8)) FORWARD_WHEN("LRC nibbles sent");
+    else if (send_bin_as_ascii_char(ms, (uint16_t)(uint8_t)(0 - ms->txrx.lrc), 8, &ms->txrx.lrc)) FORWARD_WHEN("LRC nibbles sent");
     REPEAT_UNTIL("LRC nibbles sent");
 }
 
-uint8_t ftx_mTXREG_sendRegisters(uint8_t previous_state, TXRXdata* txd) {
-    static uint8_t i = 0;
-    uint8_t address = 0;
+static uint8_t ftx_mTXREG_sendRegisters(uint8_t previous_state, ModbusSlave* ms) {
+    // consecutive addresses are consecutive slots, check_register_range() made sure they are all there. 
+    if (previous_state != mTXREG) ms->tx_reg_index = 0; 
     
-    if (previous_state != mTXREG) i = 0; 
-    address = txd->dataAddress + i;
-    
-    if (send_bin_as_ascii_char((uint16_t)txd->registers[address], 16)) {
-      i++;
-      if (i >= txd->numRegisters) FORWARD_WHEN("Registers sent");
+#if MODBUS_ASCII_CACHE
+    // ASCII registers without a read hook are copied from the cache, four characters in one go. 
+    if ((ms->mode == MODBUS_ASCII) && !(pgm_read_byte(&hr_flag_table[TX_SLOT(ms) + ms->tx_reg_index]) & HR_FLAG_READ_HOOK)) {
+      if (BUFFER_COUNT(ms->tx) > (MODBUS_TX_BUFFER_SIZE - 4)) REPEAT_UNTIL("Room in the tx buffer");
+      send_ascii_cached(ms, TX_SLOT(ms) + ms->tx_reg_index, &ms->txrx.lrc);
+      ms->tx_reg_index++;
+      if (ms->tx_reg_index >= TX_REGISTERS(ms)) FORWARD_WHEN("Registers sent");
+      REPEAT_UNTIL("Registers sent");
+    }
+#endif
+    if (SEND_DATA(master_read_register(ms, TX_SLOT(ms) + ms->tx_reg_index), 16, ms)) {
+      ms->tx_reg_index++;
+      if (ms->tx_reg_index >= TX_REGISTERS(ms)) FORWARD_WHEN("Registers sent");
     }
     REPEAT_UNTIL("Registers sent");     
 }
 
-uint8_t ftx_mCRLF_sendCrLf(uint8_t previous_state, TXRXdata* txd) {
+static uint8_t ftx_mCRLF_sendCrLf(uint8_t previous_state, ModbusSlave* ms) {
+    // a response waiting behind a push is still waiting. 
+    if (ms->mode == MODBUS_RTU) {
+      // the end of an RTU frame is the silence after it. 
+      if (!ms->tx_push_count) ms->txrx.messageReadyToSend = 0;
+      FORWARD_WHEN("CR and LF sent");  
+    }
     if (previous_state != mCRLF) {
-      UART_SEND_BYTE(0x0D);
+      TX_BUFFER_PUT(ms, 0x0D);
       REPEAT_UNTIL("CR and LF sent");
     } 
     else {
-      UART_SEND_BYTE(0x0A);
+      TX_BUFFER_PUT(ms, 0x0A);
+      if (!ms->tx_push_count) ms->txrx.messageReadyToSend = 0;
       FORWARD_WHEN("CR and LF sent");  
     } 
 }
 
 //--Slave receive state machine functions-------------------------------------------------------------------------------
 
-uint8_t frx_rSTART_waitForColon(uint8_t previous_state, Rxstdata* rxd) {
-  if (rxd->data_in == ":") FORWARD_WHEN("Rx Colon");
-  else REPEAT_UNTIL("Rx Colon");  
-} 
+// Each is given the next byte of the request, ms->rx_check already includes it. 
 
-uint8_t frx_rSLAVEID_rxSlaveId(uint8_t previous_state, Rxstdata* rxd) {
-  FORWARD_WHEN("null");    
-  
+static uint8_t frx_sSLAVE_ADDRESS_checkId(ModbusSlave* ms, uint8_t data) {
+    // wait for the next frame to start if this isn't our address, a broadcast or one of our groups, or the last 
+    // response hasn't gone yet. 
+    COUNTER_INC(ms->counters.bus_messages);
+    if (data == ms->slaveID) ms->txrx.broadcast = 0;
+    else if ((data == MODBUS_BROADCAST_ID) || 
+             ((data >= MODBUS_GROUP_BASE) && (ms->groups & (1 << (data - MODBUS_GROUP_BASE))))) {
+        ms->txrx.broadcast = 1;
+    }
+    else {
+        CAPTURE_MARK(ms, MODBUS_CAPTURE_FOREIGN);
+        DROP_IF("Not our ID");
+    }
+    COUNTER_INC(ms->counters.slave_messages);
+    if (ms->txrx.messageReadyToSend) {
+        COUNTER_INC(ms->counters.no_responses);
+        CAPTURE_MARK(ms, MODBUS_CAPTURE_BUSY);
+        DROP_IF("Still answering the last request");
+    }
+    FORWARD_WHEN("Our ID");
+}
+
+static uint8_t frx_sCOMMAND_checkFnCode(ModbusSlave* ms, uint8_t data) {
+    ms->txrx.functionCode = data;
+    // Only commands 3, 6, 8, 11, 16 and 23 are availble, everything else is an error. 
+    // fn8 has the same layout as fn6, a sub-function where the address would be. fn11 has no data at all. 
+    if ((data == 0x03) || (data == 0x06) || (data == 0x08) || (data == 0x10) || (data == 0x17)) FORWARD_WHEN("Fn Code 3, 6, 8, 16 or 23");
+    if (data != 0x0B) ms->rx_exception = EXCEPTION_ILLEGAL_FN;
+    BRANCH_IF("Fn Code 11 or not supported");
+}
+
+static uint8_t frx_sREG_ADDRESS1_rxAddressHi(ModbusSlave* ms, uint8_t data) {
+    ms->txrx.address = (uint16_t)data << 8;
+    FORWARD_WHEN("Address high byte");
+}
+
+static uint8_t frx_sREG_NUM_OR_ADDRESS2_rxAddressLo(ModbusSlave* ms, uint8_t data) {
+    // the address has to be one in the register map (fn8: it is the sub-function). 
+    ms->txrx.address |= data;
+    if (ms->txrx.functionCode == 0x08) FORWARD_WHEN("Address low byte");
+    ms->txrx.dataSlot = hr_lookup((uint8_t)(ms->txrx.address >> 8), data);
+    if (ms->txrx.dataSlot == HR_NO_SLOT) ms->rx_exception = EXCEPTION_ILLEGAL_DATA_ADDRESS;  
+    // fn16 carries the same write address, count, byte count and values as the end of a fn23 request.  
+    if (ms->txrx.functionCode == 0x10) {
+      ms->txrx.writeSlot = ms->txrx.dataSlot;
+      BRANCH_IF("Fn Code 16, the write count is next");
+    }
+    FORWARD_WHEN("Address low byte");
+}
+
+static uint8_t frx_sVALUE1_rxValueHi(ModbusSlave* ms, uint8_t data) {
+    ms->txrx.value = (uint16_t)data << 8;
+    FORWARD_WHEN("Value high byte");
+}
+
+static uint8_t frx_sVALUE2_rxValueLo(ModbusSlave* ms, uint8_t data) {
+    // fn6: the value to write.  fn3/23: the number of registers to read. 
+    ms->txrx.value |= data;
+    if (ms->txrx.functionCode == 0x08) FORWARD_WHEN("Fn Code 8, data received");
+    if (ms->txrx.functionCode == 0x06) {
+        check_register_range(ms, ms->txrx.dataSlot, 1, 1, 1);
+        FORWARD_WHEN("Fn Code 6, value to write received");
+    }
+    check_register_range(ms, ms->txrx.dataSlot, ms->txrx.value, MAX_READ_REGISTERS, 0);
+    ms->txrx.numRegisters = (uint8_t)ms->txrx.value;
+    ms->txrx.numBytes = ms->txrx.numRegisters << 1;
+    if (ms->txrx.functionCode == 0x17) BRANCH_IF("Fn Code 23, the write address is next");
+    FORWARD_WHEN("Fn Code 3, number of registers received");
+}
+
+static uint8_t frx_sWRITE_ADDRESS1_rxWriteAddressHi(ModbusSlave* ms, uint8_t data) {
+    ms->rx_count = data;  // just holding the high byte until the low byte arrives
+    FORWARD_WHEN("Write address high byte");
+}
+
+static uint8_t frx_sWRITE_ADDRESS2_rxWriteAddressLo(ModbusSlave* ms, uint8_t data) {
+    // fn23 doesn't echo the write address so only the slot is kept. 
+    ms->txrx.writeSlot = hr_lookup(ms->rx_count, data);
+    FORWARD_WHEN("Write address low byte");
+}
+
+static uint8_t frx_sWRITE_NUM1_rxWriteNumHi(ModbusSlave* ms, uint8_t data) {
+    ms->rx_count = data;  // just holding the high byte until the low byte arrives
+    FORWARD_WHEN("Write count high byte");
 }
 
-uint8_t frx_rFNCODE_rxFnCode(uint8_t previous_state, Rxstdata* rxd) {
-  FORWARD_WHEN("null");    
+static uint8_t frx_sWRITE_NUM2_rxWriteNumLo(ModbusSlave* ms, uint8_t data) {
+    uint16_t count = ((uint16_t)ms->rx_count << 8) | data;
+    
+    // fn16 answers with the number of registers written. 
+    if (ms->txrx.functionCode == 0x10) {
+        check_register_range(ms, ms->txrx.writeSlot, count, MAX_WRITE_REGISTERS, 1);
+        ms->txrx.value = count;
+    }
+    else check_register_range(ms, ms->txrx.writeSlot, count, MAX_RW_WRITE_REGISTERS, 1);
+    ms->txrx.writeRegisters = data;
+    FORWARD_WHEN("Write count low byte");
+}
+
+static uint8_t frx_sBYTE_COUNT_rxByteCount(ModbusSlave* ms, uint8_t data) {
+    // the byte count is what says how long the rest of the frame is, even if the request is no good. 
+    if (data != (uint8_t)(ms->txrx.writeRegisters << 1)) ms->rx_exception = EXCEPTION_ILLEGAL_DATA_VALUE;
+    ms->rx_count = data;
+    ms->rx_index = 0;
+    if (ms->rx_count == 0) BRANCH_IF("No values to write");
+    FORWARD_WHEN("Byte count received");
+}
+
+static uint8_t frx_sDATA_rxValues(ModbusSlave* ms, uint8_t data) {
+    // only keep the values if the request is good, otherwise they might not fit in ms->rxValues. 
+    if (!ms->rx_exception) {
+        if (ms->rx_index & 0x01) ms->rxValues[ms->rx_index >> 1] |= data;
+        else ms->rxValues[ms->rx_index >> 1] = (uint16_t)data << 8;
+    }
+    ms->rx_index++;
+    if (ms->rx_index >= ms->rx_count) FORWARD_WHEN("All values received");
+    REPEAT_UNTIL("All values received");
+}
+
+static uint8_t frx_sLRC_checkLrc(ModbusSlave* ms, uint8_t) {
+    // ASCII: the LRC byte, CR LF still to come.  RTU: the low byte of the CRC. 
+    if (ms->mode == MODBUS_RTU) BRANCH_IF("RTU, CRC low byte");
+    if ((uint8_t)ms->rx_check == 0) FORWARD_WHEN("LRC good");
+    COUNTER_INC(ms->counters.check_errors);
+    CAPTURE_MARK(ms, MODBUS_CAPTURE_CHECK);
+    DROP_IF("LRC bad");
+}
+
+static uint8_t frx_sCRC_HI_checkCrc(ModbusSlave* ms, uint8_t) {
+    // RTU: don't wait for the silence at the end of the frame, the CRC says whether it is complete and good. 
+    if (ms->rx_check == 0) modbus_process_request(ms);
+    else {
+        COUNTER_INC(ms->counters.check_errors);
+        CAPTURE_MARK(ms, MODBUS_CAPTURE_CHECK);
+    }
+    FORWARD_WHEN("CRC checked, answered if good");
+}
+
+static uint8_t frx_sSKIP_TO_END_waitForEnd(ModbusSlave*, uint8_t) {
+    // the end of the frame is found by the framing (CR in ASCII, silence in RTU). 
+    REPEAT_UNTIL("End of fn11 or a request we can't handle");
+}
+
+static uint8_t frx_framing(ModbusSlave*, uint8_t) {
+    // bytes are never decoded in sCR, sLF and sCOLON, modbus_receive_statemachine() and modbus_rtu_receive() deal with them. 
+    REPEAT_UNTIL("The framing starts a new frame");
 }
 
 //----Helper functions---------------------------------------------------------------------------------------------
 
-// Convert binary data into an ASCII hexidecimal representation & send out the uart. 
+// Convert binary data into an ASCII hexidecimal representation & put it in the tx buffer for the uart to send. 
 // uint8_t (8 bits) will be represented as two ASCII charactes. Type cast the data as follows:
-// send_bin_as_ascii_char((uint16_t)0xA7, 8)  The eight signifies eight bits so two characters sent. 
+// send_bin_as_ascii_char((uint16_t)0xA7, 8, &lrc)  The eight signifies eight bits so two characters sent. 
 // uint16_t will be sent as four ascii characters. It is called as per:
-// send_bin_as_ascii_char((uint16_t)0xCDA7, 16)  The 16 signifies sixteen bits so four characters sent. 
-// The function assumes it is called sequentially until all is done otherwise it will get out of synch.   
+// send_bin_as_ascii_char((uint16_t)0xCDA7, 16, &lrc)  The 16 signifies sixteen bits so four characters sent. 
+// Once the last character is sent the data is added to *lrc, so the LRC of a message builds up as it goes out. 
+// The function assumes it is called sequentially until all is done otherwise it will get out of synch 
+// (ms->tx_part counts the characters sent so far).   
 // returns 1 meaning the data has been sent. 
 // return 0 means the function has to be called again with the same data to complete. 
 //
-uint8_t send_bin_as_ascii_char(uint16_t data, uint8_t numBits){
-    static uint8_t nibble_counter = 0;
+uint8_t send_bin_as_ascii_char(ModbusSlave* ms, uint16_t data, uint8_t numBits, uint8_t* lrc){
     uint8_t total_nibbles = 0;
     uint8_t data_nibble;
     uint8_t shift;
     
     total_nibbles = numBits >> 2;  // each four bits is represented by one ascii character so divide by four.
-    shift = ((total_nibbles - 1) - nibble_counter) << 2;
+    shift = ((total_nibbles - 1) - ms->tx_part) << 2;
     data_nibble = (uint8_t)((data >> shift) & 0x000F); 
-    UART_SEND_BYTE(UINT8_TO_ASCII(data_nibble)); 
-    nibble_counter++;
-    if (nibble_counter >= total_nibbles) {
-      nibble_counter = 0;
+    TX_BUFFER_PUT(ms, UINT8_TO_ASCII(data_nibble)); 
+    ms->tx_part++;
+    if (ms->tx_part >= total_nibbles) {
+      ms->tx_part = 0;
+      *lrc += (uint8_t)(data >> 8) + (uint8_t)data;   // for 8 bits the high byte is zero.
       return 1;
     }
     return 0;  
 }
 
 
-// You can calculate the LCR using none, some or all of b1 through to b4 and include none, some or all of the_array by 
-// setting setting number_of_array_elements to zero (so none of the array will be included into the calculation) 
-// or to some positive value which will include part of the array starting from array_start_index. 
-// Basically set the things you don't want to impact the LRC calculation to zero. 
+#if MODBUS_ASCII_CACHE
+// Put a register's four hex characters into the tx buffer from the cache (encoding them first if the register has
+// been written since they were last sent) and add it to *lrc. The caller makes sure there is room for all four. 
 //
-// NB: array_start_index and number_of_array_elements are NOT included in the LRC calculation.   
+void send_ascii_cached(ModbusSlave* ms, uint8_t slot, uint8_t* lrc){
+    AsciiCacheEntry* entry = &ms->ascii_cache[slot];
+    uint16_t value;
+    uint8_t n;
+    
+    if (!ASCII_CACHE_VALID(ms, slot)) {
+      value = ms->holding_registers[slot];
+      for (n = 0; n < 4; n++) entry->hex[n] = UINT8_TO_ASCII((uint8_t)(value >> (12 - (n << 2))) & 0x0F);
+      entry->lrc = (uint8_t)(value >> 8) + (uint8_t)value;
+      ms->ascii_cache_valid[slot >> 3] |= _BV(slot & 0x07);
+    }
+    for (n = 0; n < 4; n++) TX_BUFFER_PUT(ms, entry->hex[n]);
+    *lrc += entry->lrc;
+}
+#endif
+
+// The RTU version of send_bin_as_ascii_char(). The data is sent as bytes, high byte first, one byte per call. 
+// returns 1 when all the bytes are sent and 0 if it needs to be called again with the same data. 
+// Each byte is added into *crc as it is sent. 
 //
-uint8_t calculateLRC(uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4, uint8_t array_start_index, uint8_t number_of_array_elements, uint16_t the_array[]) {
-  uint8_t i = 0;
-  uint8_t lrc = 0;
-  
-  lrc = b1 + b2 + b3 + b4;
-  for (i=array_start_index; i < array_start_index + number_of_array_elements; i++){
-    lrc = lrc + (uint8_t)((the_array[i] >> 8) & 0x00FF);    
-    lrc = lrc + (uint8_t)(the_array[i] & 0x00FF);          
-  }
-  
-  // 2's compliment
-  lrc = 0xFF - lrc;
-  lrc = lrc + 1;
+uint8_t send_bin_as_rtu_bytes(ModbusSlave* ms, uint16_t data, uint8_t numBits, uint16_t* crc){
+    uint8_t total_bytes = numBits >> 3;
+    uint8_t data_byte;
+    
+    data_byte = (uint8_t)(data >> (((total_bytes - 1) - ms->tx_part) << 3)); 
+    TX_BUFFER_PUT(ms, data_byte); 
+    *crc = crc16_update(*crc, data_byte);
+    ms->tx_part++;
+    if (ms->tx_part >= total_bytes) {
+      ms->tx_part = 0;
+      return 1;
+    }
+    return 0;  
+}
+
+
+// CRC-16 (polynomial 0xA001 reflected, start 0xFFFF) as used by Modbus RTU, one table lookup per byte.
+// Running it over a frame including its own CRC (low byte first) gives zero when the frame is good. 
+const uint16_t crc16_table[256] PROGMEM = {
+    0x0000, 0xC0C1, 0xC181, 0x0140, 0xC301, 0x03C0, 0x0280, 0xC241,
+    0xC601, 0x06C0, 0x0780, 0xC741, 0x0500, 0xC5C1, 0xC481, 0x0440,
+    0xCC01, 0x0CC0, 0x0D80, 0xCD41, 0x0F00, 0xCFC1, 0xCE81, 0x0E40,
+    0x0A00, 0xCAC1, 0xCB81, 0x0B40, 0xC901, 0x09C0, 0x0880, 0xC841,
+    0xD801, 0x18C0, 0x1980, 0xD941, 0x1B00, 0xDBC1, 0xDA81, 0x1A40,
+    0x1E00, 0xDEC1, 0xDF81, 0x1F40, 0xDD01, 0x1DC0, 0x1C80, 0xDC41,
+    0x1400, 0xD4C1, 0xD581, 0x1540, 0xD701, 0x17C0, 0x1680, 0xD641,
+    0xD201, 0x12C0, 0x1380, 0xD341, 0x1100, 0xD1C1, 0xD081, 0x1040,
+    0xF001, 0x30C0, 0x3180, 0xF141, 0x3300, 0xF3C1, 0xF281, 0x3240,
+    0x3600, 0xF6C1, 0xF781, 0x3740, 0xF501, 0x35C0, 0x3480, 0xF441,
+    0x3C00, 0xFCC1, 0xFD81, 0x3D40, 0xFF01, 0x3FC0, 0x3E80, 0xFE41,
+    0xFA01, 0x3AC0, 0x3B80, 0xFB41, 0x3900, 0xF9C1, 0xF881, 0x3840,
+    0x2800, 0xE8C1, 0xE981, 0x2940, 0xEB01, 0x2BC0, 0x2A80, 0xEA41,
+    0xEE01, 0x2EC0, 0x2F80, 0xEF41, 0x2D00, 0xEDC1, 0xEC81, 0x2C40,
+    0xE401, 0x24C0, 0x2580, 0xE541, 0x2700, 0xE7C1, 0xE681, 0x2640,
+    0x2200, 0xE2C1, 0xE381, 0x2340, 0xE101, 0x21C0, 0x2080, 0xE041,
+    0xA001, 0x60C0, 0x6180, 0xA141, 0x6300, 0xA3C1, 0xA281, 0x6240,
+    0x6600, 0xA6C1, 0xA781, 0x6740, 0xA501, 0x65C0, 0x6480, 0xA441,
+    0x6C00, 0xACC1, 0xAD81, 0x6D40, 0xAF01, 0x6FC0, 0x6E80, 0xAE41,
+    0xAA01, 0x6AC0, 0x6B80, 0xAB41, 0x6900, 0xA9C1, 0xA881, 0x6840,
+    0x7800, 0xB8C1, 0xB981, 0x7940, 0xBB01, 0x7BC0, 0x7A80, 0xBA41,
+    0xBE01, 0x7EC0, 0x7F80, 0xBF41, 0x7D00, 0xBDC1, 0xBC81, 0x7C40,
+    0xB401, 0x74C0, 0x7580, 0xB541, 0x7700, 0xB7C1, 0xB681, 0x7640,
+    0x7200, 0xB2C1, 0xB381, 0x7340, 0xB101, 0x71C0, 0x7080, 0xB041,
+    0x5000, 0x90C1, 0x9181, 0x5140, 0x9301, 0x53C0, 0x5280, 0x9241,
+    0x9601, 0x56C0, 0x5780, 0x9741, 0x5500, 0x95C1, 0x9481, 0x5440,
+    0x9C01, 0x5CC0, 0x5D80, 0x9D41, 0x5F00, 0x9FC1, 0x9E81, 0x5E40,
+    0x5A00, 0x9AC1, 0x9B81, 0x5B40, 0x9901, 0x59C0, 0x5880, 0x9841,
+    0x8801, 0x48C0, 0x4980, 0x8941, 0x4B00, 0x8BC1, 0x8A81, 0x4A40,
+    0x4E00, 0x8EC1, 0x8F81, 0x4F40, 0x8D01, 0x4DC0, 0x4C80, 0x8C41,
+    0x4400, 0x84C1, 0x8581, 0x4540, 0x8701, 0x47C0, 0x4680, 0x8641,
+    0x8201, 0x42C0, 0x4380, 0x8341, 0x4100, 0x81C1, 0x8081, 0x4040
+};
 
-  return lrc;
+uint16_t crc16_update(uint16_t crc, uint8_t data) {
+  return (crc >> 8) ^ pgm_read_word(&crc16_table[(uint8_t)(crc ^ data)]);
 }
 
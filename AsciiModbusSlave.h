@@ -2,17 +2,24 @@
 #define ASCII_MODBUS_SLAVE_H
 
 #include <stdint.h>
-#include <avr/io.h>
+#include <stddef.h>
 /*
  
  This implementation DOES NOT fully comply with the Modbus specifications.
  
  SimpleModbusSlave implements an unsigned int return value on a call to modbus_update().
  This value is the total error count since the slave started. It's useful for fault finding.
+ Frames with a bad LRC/CRC, framing errors (not hex, missing CR LF) and exception responses are counted. 
  
- This code is for a Modbus slave implementing functions 3, 6 
+ This code is for a Modbus slave implementing functions 3, 6, 8, 11, 16, 23 using either ASCII or RTU framing.
  function 3: Reads the binary contents of holding registers (4X references)
  function 6: Presets a value into a single holding register (4X reference)
+ function 8: Diagnostics, sub-functions 0, 1, 2, 10-15, 18 and 20 (see MODBUS_DIAG_... below)
+ function 11: Get Comm Event Counter
+ function 16: Presets values into a sequence of holding registers (4X references)
+ function 23: Presets values into a sequence of holding registers then reads a sequence back, in one transaction
+ 
+ Functions 6 and 16 can also be broadcast, to address 0 (every slave) or a group address (see MODBUS_GROUP_BASE). 
  
 */
 
@@ -31,19 +38,274 @@
 //         FUNCTIONS TO CALL
 // -------------------------------
 
-// modbus_init() must be called once before using. 
-// modbus_update() must be called in the main loop at least at the rate that bytes are expected to arrive. 
-// at 57600bps that is approx 173uS.
-// Call the UPATE MODBUS_TIMER() in an interrupt routine and define the MODBUS_DELAY value. Example:
-// modbus spec is a 3.5 character delay between send and transmist. At 57600 that is approx 1/57600 * 10 * 3.5 = 600uS.
-// Say your using an interrupt routine which is set to 38uS (so if UPDATE_MODBUS_TIMER() is called every 38us) then 
-// you would set the the MODBUS_DELAY to be 600/38 which is approximatly 16. 
-// Note to be atomic on an eight bit processor the value must be a uint8_t and so it has to be less than 255. 
+// modbus_init() must be called once before using. It enables the UART interrupts, so interrupts must be enabled (sei()).
+// modbus_update() must be called in the main loop. Bytes are received and sent by the UART interrupts into ring buffers, 
+// so modbus_update() only has to be called before the receive buffer fills up. 
+// At 57600bps that is MODBUS_RX_BUFFER_SIZE x 173uS (approx 11mS for 64 bytes), at 1Mbps only 640uS. 
+// Call UPDATE_MODBUS_TIMER() every MODBUS_TICK_CYCLES CPU cycles, from an interrupt routine or by counting off a 
+// free running timer. The delays below are worked out from it, see TIMING. 
 
-void modbus_init(uint8_t slaveID_init);
+// The framing mode passed to modbus_init(). Both use the same registers and function codes. 
+// ASCII sends each byte as two hex characters between ':' and CR LF with an LRC. 
+// RTU sends the bytes as they are with a CRC, and frames are separated by at least 3.5 characters of silence.  
+// That silence is measured with the same timer as MODBUS_DELAY, MODBUS_RTU_SILENCE below. 
+#define MODBUS_ASCII 0
+#define MODBUS_RTU 1
+
+void modbus_init(uint8_t slaveID_init, uint8_t mode = MODBUS_ASCII);
 uint16_t modbus_update();
-#define UPDATE_MODBUS_TIMER() ({if (modbus_timer > 0) modbus_timer--;})
-#define MODBUS_DELAY 20
+
+// Frames for other slaves cost next to nothing. Once the address of a frame doesn't match (or a frame is bad, or 
+// done with) modbus_update() tells the rx interrupt to skip to the next frame, and until a ':' (RTU: the first byte
+// after a silence) it only records the byte for MODBUS_CAPTURE and returns, so the rest of the frame never goes
+// into rx or through the receive statemachine, and can't fill rx up. 
+// Idle sleep, set MODBUS_IDLE_SLEEP to 1 and call modbus_idle() at the end of the main loop. When the slave has 
+// nothing to do until the next interrupt it puts the CPU into idle sleep (the UARTs and timers keep running) and 
+// returns 1 once an interrupt has woken it, so between frames, and while frames for other slaves go by, the CPU
+// sleeps in between the interrupts. It doesn't sleep while anything is waiting on the timer (a response delay, an
+// RTU silence, a push, an EEPROM write), as UPDATE_MODBUS_TIMER() may be counted off a timer by the main loop rather
+// than by an interrupt. Anything else the main loop does must be woken by an interrupt too. Always 0 on the host. 
+#ifndef MODBUS_IDLE_SLEEP
+#define MODBUS_IDLE_SLEEP 0
+#endif
+
+uint8_t modbus_idle();
+
+// The application gets at the registers with these, using the names from the register map below. 
+// They don't call the read/write hooks, those are only for when the master reads or writes. 
+uint16_t modbus_read_register(uint8_t reg);
+void modbus_write_register(uint8_t reg, uint16_t value);
+
+// Broadcasts. A fn6 or fn16 sent to MODBUS_BROADCAST_ID is done by every slave on the bus, and one sent to a group 
+// address by every slave in that group, so one frame can stop or change the speed of all of them together. 
+// There is never an answer (the slaves would all talk at once), not even an exception, so the master has to leave
+// the slaves MODBUS_DELAY after the frame before sending the next one. Anything else sent to a broadcast address
+// is ignored. Each is counted as a frame for this slave and in no_responses (function 8). 
+// The group addresses are the 8 which Modbus reserves, MODBUS_GROUP_BASE to 255. Bit n of groups is membership of 
+// MODBUS_GROUP_BASE + n, set with modbus_set_groups() or by the master through hr_GROUPS. 0 (the default) is none. 
+#define MODBUS_BROADCAST_ID 0
+#define MODBUS_GROUP_BASE 248
+
+void modbus_set_groups(uint8_t groups);
+
+// Streaming. On a point to point link the slave can push a block of registers at a fixed rate without being asked,
+// so the master gets its samples without spending half the link on requests and the MODBUS_DELAY before each 
+// answer. The master sets hr_STREAM_ADDRESS and hr_STREAM_COUNT to the block (no more than 
+// MODBUS_STREAM_MAX_REGISTERS, all there) and then hr_STREAM_PERIOD to the time between pushes in 
+// UPDATE_MODBUS_TIMER() ticks, up to 32767 (1.2S). 0, the default, stops it. A push is framed like a fn3 response
+// but with function code MODBUS_FN_STREAM:
+//   ':' slaveID 41 byte-count values LRC CR LF        (RTU the same with a CRC, after the usual silence)
+// A push goes out when it is due unless a response is being sent, which it then follows. Requests still arrive and
+// are answered as usual, a response waiting for its MODBUS_DELAY goes out after the push if one has started. The 
+// next push is due a period after the last was, so the rate doesn't drift, and one held up for more than a whole 
+// period is skipped rather than sent late. 
+// Only stream where nothing else talks to the master, and on half duplex RS485 only with a master which waits for
+// a push to end before sending its own request. 
+#define MODBUS_FN_STREAM 0x41                                           // the first user defined function code
+#define MODBUS_STREAM_MAX_REGISTERS ((MODBUS_TX_BUFFER_SIZE - 11) / 4)   // a whole ASCII push fits in tx 
+
+// Saved registers. Registers marked HR_RW_SAVED in the map are kept in the EEPROM and put back at start up, so the
+// configuration (the slave ID in hr_SLAVE_ID, the ramp, the groups) survives a reset. A write lands in the register 
+// straight away as usual, the EEPROM is written behind it by modbus_update(), a byte at a time when the EEPROM is 
+// ready, so nothing waits the 3.3mS each byte takes. Writes are gathered up for MODBUS_SAVE_SETTLE_MS after the
+// first, however many there are, then all the saved registers go out together as one copy. The copies take turns
+// round MODBUS_SAVE_COPIES places in the EEPROM to spread the wear, and each has a sequence number and a CRC 
+// written last, so at start up the newest whole copy is used and one cut short by a reset is ignored. 
+// modbus_init() restores the default slave from MODBUS_SAVE_EEPROM_BASE, other slaves only save their registers
+// after modbus_slave_restore() with their own part of the EEPROM. The ID passed to modbus_init() is only used 
+// until the master has written hr_SLAVE_ID (1 to 247, anything else is ignored), and a new ID is used from the next
+// start up, so the answer to the write still comes from the old one. 
+
+// All of a slave's state is kept in a ModbusSlave context (see SLAVE CONTEXT below), so several slaves can run 
+// side by side, one per USART or lots of simulated ones on a PC. The functions above and UPDATE_MODBUS_TIMER() 
+// work on the default one, modbus_slave, which uses the UART in the HARDWARE CONFIGURATION. Any other slave 
+// uses the modbus_slave_...() versions of them and gets its bytes from its own UART interrupt routines. 
+
+#define UPDATE_MODBUS_TIMER() MODBUS_SLAVE_UPDATE_TIMER(&modbus_slave)
+#define MODBUS_SLAVE_UPDATE_TIMER(slave) ({if ((slave)->timer > 0) (slave)->timer--; (slave)->clock++;})
+
+
+// --------------------------
+//          TIMING
+// --------------------------
+
+// Set the CPU clock, the baud rate and how often UPDATE_MODBUS_TIMER() is called, and everything else is worked out
+// from them when compiling: the UART's divider (UBRR) and whether it runs at double speed (U2X), and the delays in
+// timer ticks. Anything the UART can't get within MODBUS_BAUD_MAX_ERROR of, or a delay which doesn't fit the 8 bit
+// timer (it has to be a uint8_t to be atomic), won't compile. MODBUS_BAUD, MODBUS_TICK_CYCLES and 
+// MODBUS_DELAY_EXTRA_US can be set when compiling (e.g. -DMODBUS_BAUD=1000000UL) rather than here. 
+// At 8MHz 250000, 500000 and 1000000 bps are exact. The bus is then 4 to 17 times faster than at 57600, but the rx 
+// interrupt comes every 10uS at 1Mbps and modbus_update() has to keep up with it, so check with MODBUS_PROFILE. 
+// The delays are 3.5 characters at this baud rate, as the spec asks for between frames. Above 19200bps the spec 
+// allows a fixed 1.75mS instead, which would throw away most of the gain from a faster bus, so it isn't used. 
+//   MODBUS_DELAY        from the end of a request to the start of the response, with MODBUS_DELAY_EXTRA_US more for
+//                       a master which is slow to turn its RS485 driver round
+//   MODBUS_RTU_SILENCE  the gap which ends an RTU frame
+// The first tick can come straight after the timer is set, so each delay is one tick more than the time rounded up
+// to whole ticks, or at 1Mbps a silence of one tick could end an RTU frame between two of its bytes. 
+
+#if defined(F_CPU)
+#define MODBUS_F_CPU F_CPU
+#else
+#define MODBUS_F_CPU 8000000UL              // the host builds stand in for the 8MHz board
+#endif
+#ifndef MODBUS_BAUD
+#define MODBUS_BAUD 57600UL
+#endif
+#ifndef MODBUS_TICK_CYCLES
+#define MODBUS_TICK_CYCLES 304UL            // CPU cycles between UPDATE_MODBUS_TIMER() calls, 38uS at 8MHz
+#endif
+#ifndef MODBUS_DELAY_EXTRA_US
+#define MODBUS_DELAY_EXTRA_US 100
+#endif
+#define MODBUS_BAUD_MAX_ERROR 25            // in 1/1000ths, the UART's own rate against MODBUS_BAUD. 57600 at 8MHz 
+                                            // is 2.1%, which the datasheet table lists and works
+
+// the divider for a UART clock of MODBUS_F_CPU / div (16, or 8 at double speed), rounded to the nearest
+#define MODBUS_UBRR_FOR(div) ((long)((MODBUS_F_CPU + (div) * MODBUS_BAUD / 2) / ((div) * MODBUS_BAUD)) - 1)
+#define MODBUS_BAUD_FOR(div) ((long long)MODBUS_F_CPU / ((div) * (MODBUS_UBRR_FOR(div) + 1)))
+#define MODBUS_ERROR_FOR(div) ((MODBUS_UBRR_FOR(div) < 0) ? 1000LL :                                          \
+        ((MODBUS_BAUD_FOR(div) > (long long)MODBUS_BAUD) ? (MODBUS_BAUD_FOR(div) - MODBUS_BAUD) : (MODBUS_BAUD - MODBUS_BAUD_FOR(div))) \
+        * 1000LL / MODBUS_BAUD)
+
+// double speed only if it is closer
+#define MODBUS_U2X (MODBUS_ERROR_FOR(8) < MODBUS_ERROR_FOR(16))
+#define MODBUS_UBRR (MODBUS_U2X ? MODBUS_UBRR_FOR(8) : MODBUS_UBRR_FOR(16))
+#define MODBUS_BAUD_ERROR (MODBUS_U2X ? MODBUS_ERROR_FOR(8) : MODBUS_ERROR_FOR(16))
+
+#define MODBUS_CHAR_CYCLES(n) ((n) * 10 * MODBUS_F_CPU / MODBUS_BAUD)   // n characters, start 8 data and stop
+#define MODBUS_TICKS(cycles) (((cycles) + MODBUS_TICK_CYCLES - 1) / MODBUS_TICK_CYCLES + 1)
+#define MODBUS_DELAY MODBUS_TICKS(MODBUS_CHAR_CYCLES(7) / 2 + MODBUS_DELAY_EXTRA_US * (MODBUS_F_CPU / 1000000UL))
+#define MODBUS_RTU_SILENCE MODBUS_TICKS(MODBUS_CHAR_CYCLES(7) / 2)
+
+static_assert((MODBUS_UBRR >= 0) && (MODBUS_UBRR <= 4095), "MODBUS_BAUD is out of the UART's range at this F_CPU");
+static_assert(MODBUS_BAUD_ERROR <= MODBUS_BAUD_MAX_ERROR, "The UART can't get close enough to MODBUS_BAUD at this F_CPU");
+static_assert((MODBUS_DELAY > 0) && (MODBUS_DELAY <= 255), "MODBUS_DELAY doesn't fit the 8 bit timer, change MODBUS_TICK_CYCLES");
+static_assert((MODBUS_RTU_SILENCE > 0) && (MODBUS_RTU_SILENCE <= 255), "MODBUS_RTU_SILENCE doesn't fit the 8 bit timer, change MODBUS_TICK_CYCLES");
+
+
+// Sizes of the ring buffers between the UART interrupts and modbus_update(). 
+// Must be a power of two and no more than 128. 
+#define MODBUS_RX_BUFFER_SIZE 64
+#define MODBUS_TX_BUFFER_SIZE 64
+
+// ASCII responses to fn3/fn23 can be sent from a cache of each register already turned into its four hex characters
+// (and its part of the LRC), so sending a register is a copy rather than encoding it every time it is read. 
+// An entry is only encoded again after the register is written (by the master or modbus_write_register()). 
+// Registers with a read hook are never cached. Costs 5 bytes of ram per register plus one bit, set to 0 to turn off. 
+#ifndef MODBUS_ASCII_CACHE
+#define MODBUS_ASCII_CACHE 1
+#endif
+
+// Saved registers (see above). A copy is a sequence byte, the saved registers and a 2 byte CRC, so with the 3 in 
+// the map below it is 9 bytes and the 16 copies use 144 bytes of EEPROM. Each EEPROM byte is then written once 
+// every 16 saves at most, and bytes which are already right aren't written at all. 
+#define MODBUS_SAVE_COPIES 16
+#define MODBUS_SAVE_SETTLE_MS 500           // after the first write, no more than 2 saves a second
+#define MODBUS_SAVE_EEPROM_BASE 0           // where the default slave's copies start
+
+#define MODBUS_SAVE_SETTLE MODBUS_TICKS(MODBUS_SAVE_SETTLE_MS * (MODBUS_F_CPU / 1000UL))
+static_assert(MODBUS_SAVE_SETTLE < 32768, "MODBUS_SAVE_SETTLE_MS is too long for the 16 bit clock");
+
+// Profiling, set to 1 to find out where the CPU time goes. Every call of a receive or transmit state function, 
+// every modbus_update() and the motor timer interrupts (if they use MODBUS_PROFILE_ISR_BEGIN() / _END()) is timed in 
+// CPU clock cycles with Timer1, keeping the shortest, longest and a running average for each. The master reads them
+// from the PROFILE registers added to the end of the map: write the number of what to look at into hr_PROFILE_SELECT
+// (MODBUS_PROFILE_... below, a fn23 can write it and read the results back in one go), 0xFFFF clears them all. 
+// hr_PROFILE_ISR_OVERRUNS counts the times a motor interrupt set up its next edge too late (MODBUS_PROFILE_ISR_LATE()),
+// each of which puts a glitch in the motor data. 
+// Times include any interrupts which happened during them, and are shared by all slaves. Costs about 330 bytes of 
+// ram and a few uS per state function, so leave it at 0 in normal use. host/ProfileRead.cpp builds it on the host 
+// (which turns it on from the command line) and reads the registers back. 
+#ifndef MODBUS_PROFILE
+#define MODBUS_PROFILE 0
+#endif
+
+#define MODBUS_PROFILE_TX 0x00         // + transmit state, in MODBUS_TX_STATES order (ModbusStateMachine.h)
+#define MODBUS_PROFILE_RX 0x20         // + receive state, in MODBUS_RX_STATES order
+#define MODBUS_PROFILE_UPDATE 0x40     // a whole modbus_update()
+#define MODBUS_PROFILE_ISR 0x41        // the motor timer interrupts
+#define MODBUS_PROFILE_CLEAR 0xFFFF
+
+// Capture, set to 1 to record what a slave actually receives and sends on a live bus. Every byte received (when the 
+// rx interrupt gets it) and sent (when it is handed to the UART) goes into a ring of MODBUS_CAPTURE_SIZE entries in 
+// the context with the time in UPDATE_MODBUS_TIMER() ticks, along with a marker wherever the receiver decided 
+// something about a frame (MODBUS_CAPTURE_... below), so framing problems and slow turnarounds can be seen without a 
+// protocol analyser. Recording an entry takes the same few cycles whatever is going on, with interrupts held off for
+// them. The master controls it through the CAPTURE registers added to the end of the map: 
+//   hr_CAPTURE_MODE     write MODBUS_CAPTURE_RUN to clear the ring and record until it is written with 
+//                       MODBUS_CAPTURE_OFF, or MODBUS_CAPTURE_TRIGGER to clear it and record until half the ring 
+//                       after the next error, so the error ends up in the middle. Reads as the mode it is in, 
+//                       MODBUS_CAPTURE_TRIGGERED once the error has been seen. 
+//   hr_CAPTURE_HEAD     the number of entries recorded since it was cleared (wraps at 65536). The last 
+//                       MODBUS_CAPTURE_SIZE of them are in the ring. 
+//   hr_CAPTURE_INDEX    the number of the entry hr_CAPTURE_0 reads, hr_CAPTURE_1 reads the next and so on. A fn23 
+//                       can write it and read it back with the 8 entries after it in one go. 
+// Stop it before reading it, or the reading is recorded over what is being read. An entry not in the ring reads as 
+// 0x8000. host/CaptureDecode.cpp turns the entries into a timeline. Each entry is 16 bits: 
+//   bits 15-14  MODBUS_CAPTURE_RX, _TX, _MARK or _TIME 
+//   bits 13-8   the clock (in ticks) when it was recorded, the low 6 bits 
+//   bits 7-0    the byte, the marker, or for _TIME bits 13-6 of the clock 
+// A _TIME entry comes first and before any entry 64 ticks or more after the last, so the whole time can be worked
+// out (up to 16384 ticks, 0.6S, between entries). Once the ring has gone round, the entries before the first _TIME 
+// left in it are only timed from one to the next. Costs 2 bytes of ram an entry plus 11 registers, about 360 
+// bytes, so leave it at 0 in normal use. (the host tools turn it on from the command line)
+#ifndef MODBUS_CAPTURE
+#define MODBUS_CAPTURE 0
+#endif
+#define MODBUS_CAPTURE_SIZE 128                   // a power of two
+
+#define MODBUS_CAPTURE_OFF 0                      // hr_CAPTURE_MODE
+#define MODBUS_CAPTURE_RUN 1
+#define MODBUS_CAPTURE_TRIGGER 2
+#define MODBUS_CAPTURE_TRIGGERED 3
+
+#define MODBUS_CAPTURE_RX 0                       // the kind of entry
+#define MODBUS_CAPTURE_TX 1
+#define MODBUS_CAPTURE_MARK 2
+#define MODBUS_CAPTURE_TIME 3
+
+#define MODBUS_CAPTURE_NONE 0x00                  // markers. Not an entry, only read back
+#define MODBUS_CAPTURE_STARTED 0x01               // the mode was written
+#define MODBUS_CAPTURE_REQUEST 0x02               // a good frame for this slave, done and answered if not broadcast
+#define MODBUS_CAPTURE_FOREIGN 0x03               // the frame is for another slave, skipped
+#define MODBUS_CAPTURE_BUSY 0x04                  // for this slave, but the last response hasn't gone
+#define MODBUS_CAPTURE_SILENCE 0x05               // RTU: the byte after came after a silence, it starts a frame
+#define MODBUS_CAPTURE_FRAMING 0x10               // errors from here on, which set off MODBUS_CAPTURE_TRIGGER
+#define MODBUS_CAPTURE_CHECK 0x11                 // bad LRC/CRC
+#define MODBUS_CAPTURE_RESYNC 0x12                // a ':' part way through a frame, which is thrown away
+#define MODBUS_CAPTURE_OVERRUN 0x13               // the byte before was lost, rx was full
+#define MODBUS_CAPTURE_EXCEPTION 0x14             // the request is answered with an exception
+
+// Diagnostics (function 8) sub-functions. The counters are kept by each slave. 
+#define MODBUS_DIAG_RETURN_QUERY_DATA 0x00        // echoes the data
+#define MODBUS_DIAG_RESTART_COMMS 0x01            // clears the counters, there is no listen only mode to leave
+#define MODBUS_DIAG_DIAGNOSTIC_REGISTER 0x02      // always 0
+#define MODBUS_DIAG_CLEAR_COUNTERS 0x0A
+#define MODBUS_DIAG_BUS_MESSAGES 0x0B             // frames seen on the bus, for any slave
+#define MODBUS_DIAG_BUS_ERRORS 0x0C               // frames with a bad LRC/CRC 
+#define MODBUS_DIAG_EXCEPTIONS 0x0D               // exception responses sent
+#define MODBUS_DIAG_SLAVE_MESSAGES 0x0E           // frames addressed to this slave
+#define MODBUS_DIAG_NO_RESPONSES 0x0F             // frames addressed to this slave which weren't answered
+#define MODBUS_DIAG_OVERRUNS 0x12                 // bytes lost because the rx buffer was full
+#define MODBUS_DIAG_CLEAR_OVERRUNS 0x14
+
+// Response latency, from the end of a request to the first byte of the response being handed to the UART, in 
+// UPDATE_MODBUS_TIMER() ticks. Counted in MODBUS_LATENCY_BUCKETS by how far past MODBUS_DELAY (the least it can 
+// be) it was: 0, 1, 2-3, 4-7, 8-15, 16-31, 32-63, 64 or more. Anything past the first couple of buckets is 
+// modbus_update() not being called often enough. 
+#define MODBUS_LATENCY_BUCKETS 8
+
+// The first and last lines of a motor timer interrupt, and what it calls when it has missed its next edge. 
+#if MODBUS_PROFILE
+#define MODBUS_PROFILE_ISR_BEGIN() uint16_t modbus_profile_isr_start = modbus_profile_isr_begin()
+#define MODBUS_PROFILE_ISR_END() modbus_profile_isr_end(modbus_profile_isr_start)
+#define MODBUS_PROFILE_ISR_LATE() modbus_profile_isr_late()
+#else
+#define MODBUS_PROFILE_ISR_BEGIN() ((void)0)
+#define MODBUS_PROFILE_ISR_END() ((void)0)
+#define MODBUS_PROFILE_ISR_LATE() ((void)0)
+#endif
 
 
 
@@ -51,19 +313,332 @@ uint16_t modbus_update();
 //          HOLDING REGISTER MAP 
 // -------------------------------------
 
-// Leave hr_ARRAY_SIZE at the end of the enum, its used to create the array to hold the registers. 
-// adjust all the other entries according to the application. 
-// NOTE: No more than 255 register entries are supported by the current code. 
+// One REG() line per register, adjust them according to the application: 
+//   name       - used by the application with modbus_read_register() / modbus_write_register(). 
+//   address    - the 16 bit address the master uses. Addresses can have gaps but must be in increasing order. 
+//   access     - HR_RO if the master can only read the register, HR_RW if it can write it as well, HR_RW_SAVED if
+//                it is kept in the EEPROM too (see Saved registers at the top). 
+//   read hook  - NULL, or a function called when the master reads the register which returns the value to send: 
+//                uint16_t hook(ModbusSlave* slave, uint8_t reg)
+//   write hook - NULL, or a function called after the master has written the register: 
+//                void hook(ModbusSlave* slave, uint8_t reg, uint16_t value)
+// Hooks must be declared before the map. 
+// The motor registers are the sketch's: hr_..._SETTING are the speeds sent to the motors, hr_SPEED_RAMP the most the
+// speeds sent change by each motor frame (3.2mS, 0 for straight away) and hr_..._MEASURED the speeds from the 
+// feedback lines, in feedback edges per second (MotorOutput.h, MotorFeedback.h). 
+// hr_ERRORCOUNT, hr_GROUPS, hr_STREAM_..., the diagnostic registers and the PROFILE registers use hooks from 
+// AsciiModbusSlave.cpp, keep them in the map if wanted. hr_ERRORCOUNT is the same total modbus_update() returns, 
+// hr_GROUPS the broadcast groups the slave is in, hr_STREAM_... set up streaming, hr_FRAMING_ERRORS and 
+// hr_LATENCY_... are the counters which function 8 has no sub-function for. hr_SLAVE_ID is the ID to start up with,
+// it needs no hook but AsciiModbusSlave.cpp uses it too. 
+// The map is turned into lookup tables at compile time (ModbusRegisterMap.h). Each block of 256 addresses 
+// with registers in it costs 256 bytes of flash, so keep the addresses close together. 
+// NOTE: No more than 254 registers are supported by the current code. 
+
+#define HR_RO 0
+#define HR_RW 1
+#define HR_SAVED 0x08
+#define HR_RW_SAVED (HR_RW | HR_SAVED)
+
+typedef struct MODBUSSLAVE ModbusSlave;
+typedef uint16_t (*RegisterReadHook)(ModbusSlave* slave, uint8_t reg);
+typedef void (*RegisterWriteHook)(ModbusSlave* slave, uint8_t reg, uint16_t value);
+
+uint16_t modbus_error_count_read(ModbusSlave* slave, uint8_t reg);
+uint16_t modbus_diagnostic_read(ModbusSlave* slave, uint8_t reg);
+uint16_t modbus_profile_read(ModbusSlave* slave, uint8_t reg);
+void modbus_profile_select(ModbusSlave* slave, uint8_t reg, uint16_t value);
+uint16_t modbus_groups_read(ModbusSlave* slave, uint8_t reg);
+void modbus_groups_write(ModbusSlave* slave, uint8_t reg, uint16_t value);
+void modbus_stream_write(ModbusSlave* slave, uint8_t reg, uint16_t value);
+uint16_t modbus_capture_read(ModbusSlave* slave, uint8_t reg);
+void modbus_capture_mode(ModbusSlave* slave, uint8_t reg, uint16_t value);
+
+#if MODBUS_PROFILE
+#define MODBUS_PROFILE_REGISTERS(REG)                                                 \
+  REG(hr_PROFILE_SELECT,         0x0080,  HR_RW,  NULL,   modbus_profile_select)      \
+  REG(hr_PROFILE_MIN,            0x0081,  HR_RO,  modbus_profile_read,  NULL)        \
+  REG(hr_PROFILE_MAX,            0x0082,  HR_RO,  modbus_profile_read,  NULL)        \
+  REG(hr_PROFILE_AVERAGE,        0x0083,  HR_RO,  modbus_profile_read,  NULL)        \
+  REG(hr_PROFILE_CALLS,          0x0084,  HR_RO,  modbus_profile_read,  NULL)        \
+  REG(hr_PROFILE_ISR_OVERRUNS,   0x0085,  HR_RO,  modbus_profile_read,  NULL)
+#else
+#define MODBUS_PROFILE_REGISTERS(REG)
+#endif
 
+#if MODBUS_CAPTURE
+#define MODBUS_CAPTURE_REGISTERS(REG)                                                 \
+  REG(hr_CAPTURE_MODE,           0x0090,  HR_RW,  modbus_capture_read,  modbus_capture_mode) \
+  REG(hr_CAPTURE_HEAD,           0x0091,  HR_RO,  modbus_capture_read,  NULL)        \
+  REG(hr_CAPTURE_INDEX,          0x0092,  HR_RW,  NULL,   NULL)                      \
+  REG(hr_CAPTURE_0,              0x0093,  HR_RO,  modbus_capture_read,  NULL)        \
+  REG(hr_CAPTURE_1,              0x0094,  HR_RO,  modbus_capture_read,  NULL)        \
+  REG(hr_CAPTURE_2,              0x0095,  HR_RO,  modbus_capture_read,  NULL)        \
+  REG(hr_CAPTURE_3,              0x0096,  HR_RO,  modbus_capture_read,  NULL)        \
+  REG(hr_CAPTURE_4,              0x0097,  HR_RO,  modbus_capture_read,  NULL)        \
+  REG(hr_CAPTURE_5,              0x0098,  HR_RO,  modbus_capture_read,  NULL)        \
+  REG(hr_CAPTURE_6,              0x0099,  HR_RO,  modbus_capture_read,  NULL)        \
+  REG(hr_CAPTURE_7,              0x009A,  HR_RO,  modbus_capture_read,  NULL)
+#else
+#define MODBUS_CAPTURE_REGISTERS(REG)
+#endif
+
+#define MODBUS_REGISTER_MAP(REG)                                            \
+  /*  name                       address  access  read hook  write hook */  \
+  REG(hr_L_MOTOR_SPEED_SETTING,  0x0000,  HR_RW,  NULL,      NULL)          \
+  REG(hr_R_MOTOR_SPEED_SETTING,  0x0001,  HR_RW,  NULL,      NULL)          \
+  REG(hr_L_MOTOR_SPEED_MEASURED, 0x0002,  HR_RO,  NULL,      NULL)          \
+  REG(hr_R_MOTOR_SPEED_MEASURED, 0x0003,  HR_RO,  NULL,      NULL)          \
+  REG(hr_ERRORCOUNT,             0x0004,  HR_RO,  modbus_error_count_read, NULL) \
+  REG(hr_SPEED_RAMP,             0x0005,  HR_RW_SAVED,  NULL,      NULL)    \
+  REG(hr_GROUPS,                 0x0006,  HR_RW_SAVED,  modbus_groups_read, modbus_groups_write) \
+  REG(hr_STREAM_PERIOD,          0x0007,  HR_RW,  NULL,      modbus_stream_write) \
+  REG(hr_STREAM_ADDRESS,         0x0008,  HR_RW,  NULL,      modbus_stream_write) \
+  REG(hr_STREAM_COUNT,           0x0009,  HR_RW,  NULL,      modbus_stream_write) \
+  REG(hr_SLAVE_ID,               0x000A,  HR_RW_SAVED,  NULL,      NULL)    \
+  REG(hr_FRAMING_ERRORS,         0x0010,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  REG(hr_LATENCY_0,              0x0011,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  REG(hr_LATENCY_1,              0x0012,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  REG(hr_LATENCY_2_3,            0x0013,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  REG(hr_LATENCY_4_7,            0x0014,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  REG(hr_LATENCY_8_15,           0x0015,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  REG(hr_LATENCY_16_31,          0x0016,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  REG(hr_LATENCY_32_63,          0x0017,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  REG(hr_LATENCY_64_UP,          0x0018,  HR_RO,  modbus_diagnostic_read,  NULL) \
+  MODBUS_PROFILE_REGISTERS(REG)                                             \
+  MODBUS_CAPTURE_REGISTERS(REG)
+
+// Leave hr_ARRAY_SIZE at the end of the enum, its used to create the array to hold the registers. 
+#define HR_ENUM(name, address, access, read_hook, write_hook) name,
 enum HREG {
-  hr_L_MOTOR_SPEED_SETTING,
-  hr_R_MOTOR_SPEED_SETTING,
-  hr_L_MOTOR_SPEED_MEASURED,
-  hr_R_MOTOR_SPEED_MEASURED,
-  hr_ERRORCOUNT,
+  MODBUS_REGISTER_MAP(HR_ENUM)
   hr_ARRAY_SIZE
 };
 
+// The saved registers counted at compile time, a copy of them in the EEPROM is a sequence byte, 2 bytes for each 
+// and a CRC. 
+#define HR_SAVED_COUNT(name, address, access, read_hook, write_hook) + (((access) & HR_SAVED) ? 1 : 0)
+#define MODBUS_SAVED_REGISTERS (0 MODBUS_REGISTER_MAP(HR_SAVED_COUNT))
+#define MODBUS_SAVE_COPY_SIZE (1 + 2 * MODBUS_SAVED_REGISTERS + 2)
+
+
+// -------------------------------------
+//     REGISTERS SHARED WITH AN ISR
+// -------------------------------------
+
+// Registers used by an interrupt routine (e.g. the motor timer) go through an exchange rather than being read or 
+// written in holding_registers directly, as a 16 bit value can be half written when the other side looks at it. 
+// Neither direction turns interrupts off, so the interrupt routine's timing isn't disturbed. 
+//
+// Setpoints - written by the master, read by the ISR. modbus_update() copies them into whichever of two banks the 
+//   ISR isn't using and then switches the ISR over with a single byte write. The ISR always sees a complete set. 
+// Measurements - written by the ISR, read by the master. The ISR bumps a sequence count after each write and 
+//   modbus_update() copies them into holding_registers, starting again if the count changed while it was copying. 
+//
+// List the registers (names from the map above) in these two, either can be empty. 
+// In the ISR use MODBUS_ISR_SETPOINT(isr_<name>) and MODBUS_ISR_MEASURED(isr_<name>, value). These are only safe 
+// from an interrupt routine, as they rely on modbus_update() not being able to run in the middle of them. 
+
+#define MODBUS_ISR_SETPOINTS(X)      \
+  X(hr_L_MOTOR_SPEED_SETTING)        \
+  X(hr_R_MOTOR_SPEED_SETTING)        \
+  X(hr_SPEED_RAMP)
+
+#define MODBUS_ISR_MEASUREMENTS(X)   \
+  X(hr_L_MOTOR_SPEED_MEASURED)       \
+  X(hr_R_MOTOR_SPEED_MEASURED)
+
+#define ISR_ENUM(name) isr_##name,
+enum ISR_SETPOINT { MODBUS_ISR_SETPOINTS(ISR_ENUM) isr_SETPOINT_COUNT };
+enum ISR_MEASUREMENT { MODBUS_ISR_MEASUREMENTS(ISR_ENUM) isr_MEASUREMENT_COUNT };
+
+typedef struct ISRSETPOINTS {
+   volatile uint8_t front;                                 // the bank the ISR reads, only changed by modbus_update()
+   volatile uint16_t bank[2][isr_SETPOINT_COUNT];
+}IsrSetpoints;
+
+typedef struct ISRMEASUREMENTS {
+   volatile uint8_t seq;                                   // incremented by the ISR after every write 
+   volatile uint16_t value[isr_MEASUREMENT_COUNT];
+}IsrMeasurements;
+
+#define MODBUS_ISR_SETPOINT(index) MODBUS_SLAVE_ISR_SETPOINT(&modbus_slave, index)
+#define MODBUS_ISR_MEASURED(index, val) MODBUS_SLAVE_ISR_MEASURED(&modbus_slave, index, val)
+#define MODBUS_SLAVE_ISR_SETPOINT(slave, index) ((slave)->isr_setpoints.bank[(slave)->isr_setpoints.front][index])
+#define MODBUS_SLAVE_ISR_MEASURED(slave, index, val) \
+        ({(slave)->isr_measurements.value[index] = (val); (slave)->isr_measurements.seq++;})
+
+// -------------------------------
+//        SLAVE CONTEXT 
+// -------------------------------
+
+// Everything one slave needs. It is all plain data, so a context can be a global, in an array, or allocated, 
+// and modbus_slave_init() sets every part of it. 
+// On the ATMEGA328 with the settings above a context is 440 bytes, 132 of which are the two ring buffers and 
+// 9 for each register, so MODBUS_RX_BUFFER_SIZE and MODBUS_TX_BUFFER_SIZE (and the diagnostic registers in the 
+// map) are the things to shrink if several slaves are needed. 
+// (the host benchmark prints the size on the PC, which is bigger because of the 8 byte pointer and padding)
+
+// Bytes are moved between the UART interrupts and modbus_update() through ring buffers. Each buffer has exactly one 
+// writer and one reader (rx: the RX complete interrupt writes and modbus_update() reads, tx: the other way round) and 
+// head and tail are single bytes, so neither side ever needs to turn interrupts off.
+// head and tail just count up and wrap at 256, masking them gives the index into the data array. 
+typedef struct RXBUF {
+   volatile uint8_t head;                             // only changed by the RX complete interrupt
+   volatile uint8_t tail;                             // only changed by modbus_update()
+   volatile uint8_t data[MODBUS_RX_BUFFER_SIZE];
+}RxBuffer;
+
+typedef struct TXBUF {
+   volatile uint8_t head;                             // only changed by modbus_update()
+   volatile uint8_t tail;                             // only changed by the data register empty interrupt
+   volatile uint8_t data[MODBUS_TX_BUFFER_SIZE];
+}TxBuffer;
+
+// Each register's value as the four hex characters an ASCII response sends, and the two bytes added together for 
+// the LRC. 
+typedef struct ASCIICACHE {
+   uint8_t hex[4];
+   uint8_t lrc;
+}AsciiCacheEntry;
+
+// The request being answered. The receive statemachine fills it in as the request arrives and the transmit 
+// statemachine sends the response from it. MODBUS is a masterslave system so only one of them is using it at a time. 
+typedef struct TXRX {
+   uint8_t   messageReadyToSend;             // Setting to 1 makes this slave send a response (moves out of mFINISH state)
+   uint8_t   functionCode;                   // the function code sent by the master 
+   uint8_t   exception;                      // Exception code if an exception happened when msg rx from master. 
+   uint8_t   numBytes;                       // Number of bytes to be sent back to master (should be 2x numRegisters)  
+   uint16_t  address;                        // The register address as sent by the master, fn6/16 echo it back. 
+   uint8_t   dataSlot;                       // Slot (index into holding_registers) of the register at address. 
+   uint8_t   numRegisters;                   // The number of registers to send back to the master (should be half of the numBytes). 
+   uint16_t  value;                          // fn6: the value written. fn3/23: the number of registers to read. fn16: the number written. 
+   uint8_t   writeSlot;                      // fn16/23: the slot of the first register to write. 
+   uint8_t   writeRegisters;                 // fn16/23: the number of registers to write. 
+   uint8_t   broadcast;                      // sent to every slave or a group of them, done without an answer
+   uint16_t  crc;                            // Running CRC of the bytes sent so far in this response (RTU).
+   uint8_t   lrc;                            // Running sum of the bytes sent so far in this response (ASCII).
+}TXRXdata;
+
+// Bus health, see function 8 and MODBUS_DIAG_... at the top. All stop at 0xFFFF rather than wrapping. 
+typedef struct MODBUSCOUNTERS {
+   uint16_t  bus_messages;                   // frames seen, for any slave
+   uint16_t  slave_messages;                 // frames addressed to this slave, including broadcasts
+   uint16_t  check_errors;                   // bad LRC/CRC
+   uint16_t  framing_errors;                 // not hex, no CR LF after the LRC, odd number of hex characters
+   uint16_t  exceptions;                     // exception responses sent
+   uint16_t  no_responses;                   // frames for this slave which weren't answered
+   uint16_t  overruns;                       // bytes lost because rx was full
+   uint16_t  events;                         // function 11, requests completed without an exception
+   uint16_t  latency[MODBUS_LATENCY_BUCKETS];
+}ModbusCounters;
+
+typedef void (*ModbusTxStart)(ModbusSlave* slave);
+
+struct MODBUSSLAVE {
+   // used by the interrupt routines, kept at the start
+   uint8_t   slaveID;                        // the modbus ID of this slave device. 
+   uint8_t   groups;                         // bit n set for membership of broadcast group MODBUS_GROUP_BASE + n
+   uint8_t   mode;                           // MODBUS_ASCII or MODBUS_RTU
+   volatile uint8_t timer;                   // see MODBUS_SLAVE_UPDATE_TIMER(), used for the response delay and the RTU silence.
+   volatile uint16_t clock;                  // counts every MODBUS_SLAVE_UPDATE_TIMER(), for the response latency 
+   uint8_t   rx_overruns;                    // bytes thrown away because rx was full
+   volatile uint8_t rx_skip;                 // the rx interrupt drops bytes until a frame starts
+   volatile uint8_t rxFrameStart[(MODBUS_RX_BUFFER_SIZE + 7) >> 3];  // RTU: a bit per rx slot, set on the first byte of a frame
+   RxBuffer  rx;
+   TxBuffer  tx;
+   ModbusTxStart tx_start;                   // called by modbus_slave_update() when there is something to send, can be NULL
+
+   uint16_t  holding_registers[hr_ARRAY_SIZE];  // the modbus registers, in MODBUS_REGISTER_MAP order 
+
+   // receive statemachine
+   uint16_t  rx_check;                       // running LRC (ASCII, low byte only) or CRC (RTU) of the frame so far.
+   uint8_t   rx_state;
+   uint8_t   rx_exception;                   // exception to answer with at the end of the frame, 0 if none. 
+   uint8_t   rx_count;                       // sDATA: the number of data bytes still to come. 
+   uint8_t   rx_index;                       // sDATA: the number of data bytes received so far. 
+   uint8_t   rx_hi_nibble;                   // ASCII: the first character of a hex pair
+   uint8_t   rx_get_hi;                      // ASCII: the next character is the first of a hex pair
+   uint16_t  rxValues[hr_ARRAY_SIZE];        // fn16/23: the values to write, held until the check is good
+   uint16_t  rx_end_clock;                   // clock when the request being answered ended
+
+   // transmit statemachine
+   TXRXdata  txrx;
+   uint8_t   tx_state;
+   uint8_t   tx_previous_state;
+   uint8_t   tx_part;                        // the nibble (ASCII) or byte (RTU) of the value being sent
+   uint8_t   tx_reg_index;                   // mTXREG: the register being sent
+   uint8_t   tx_push_slot;                   // a push: the block being sent
+   uint8_t   tx_push_count;                  // and how many, 0 when it is a response
+
+   // streaming, from the hr_STREAM_... registers
+   uint16_t  stream_period;                  // ticks between pushes, 0 for none
+   uint16_t  stream_due;                     // clock when the next push is due
+   uint8_t   stream_slot;                    // the first register pushed
+   uint8_t   stream_count;                   // and how many, 0 if the block isn't valid
+   uint8_t   stream_pending;                 // a push is due, waiting for the transmit statemachine
+
+   // saved registers, see MODBUS_SAVE_... 
+   uint8_t   save_on;                        // modbus_slave_restore() has been called
+   uint8_t   save_dirty;                     // a saved register has changed since the copy being written was made
+   uint16_t  save_dirty_at;                  // clock when it first changed
+   uint16_t  save_base;                      // EEPROM address of the first copy
+   uint8_t   save_copy;                      // the newest whole copy in the EEPROM
+   uint8_t   save_seq;                       // and its sequence number
+   uint8_t   save_index;                     // the byte of save_data being written next, 0 when not writing
+   uint8_t   save_data[MODBUS_SAVE_COPY_SIZE];  // the copy being written
+
+   // registers shared with an ISR
+   IsrSetpoints isr_setpoints;
+   IsrMeasurements isr_measurements;
+   uint8_t   isr_setpoints_dirty;            // a register has been written since the setpoints were last handed to the ISR
+   uint8_t   isr_measurements_seq;           // isr_measurements.seq when they were last copied
+
+   ModbusCounters counters;
+   uint8_t   rx_overruns_seen;               // rx_overruns when they were last added to counters.overruns 
+
+#if MODBUS_ASCII_CACHE
+   uint8_t   ascii_cache_valid[(hr_ARRAY_SIZE + 7) >> 3];  // a bit per register, set when its entry matches the register
+   AsciiCacheEntry ascii_cache[hr_ARRAY_SIZE];
+#endif
+
+#if MODBUS_CAPTURE
+   // written by the interrupt routines and modbus_slave_update(), with interrupts held off
+   volatile uint8_t capture_mode;            // MODBUS_CAPTURE_OFF ... _TRIGGERED
+   volatile uint16_t capture_head;           // entries recorded since the ring was cleared
+   uint16_t  capture_last;                   // clock at the last entry
+   uint16_t  capture_stop_at;                // _TRIGGERED: capture_head when it stops
+   uint16_t  capture[MODBUS_CAPTURE_SIZE];
+#endif
+};
+
+extern ModbusSlave modbus_slave;
+
+// The same as the functions at the top but for any slave. tx_start is called when there is something in the tx 
+// buffer to send, it should turn on the RS485 driver and the UART's data register empty interrupt. 
+void modbus_slave_init(ModbusSlave* slave, uint8_t slaveID_init, uint8_t mode, ModbusTxStart tx_start);
+uint16_t modbus_slave_update(ModbusSlave* slave);
+uint16_t modbus_slave_read_register(ModbusSlave* slave, uint8_t reg);
+void modbus_slave_write_register(ModbusSlave* slave, uint8_t reg, uint16_t value);
+void modbus_slave_set_groups(ModbusSlave* slave, uint8_t groups);
+// Put back the saved registers from the newest whole copy at eeprom_base, and save them there from now on. Call it
+// once after modbus_slave_init(), each slave needs MODBUS_SAVE_EEPROM_SIZE bytes of its own. Returns 1 if a copy
+// was found, 0 if not (a new board, or a different set of saved registers) which leaves the registers as they were.
+// modbus_slave_saving() is 1 while there are changes not yet in the EEPROM. 
+uint8_t modbus_slave_restore(ModbusSlave* slave, uint16_t eeprom_base);
+uint8_t modbus_slave_saving(ModbusSlave* slave);
+#define MODBUS_SAVE_EEPROM_SIZE (MODBUS_SAVE_COPIES * MODBUS_SAVE_COPY_SIZE)
+
+// For a slave's UART interrupt routines.
+// rx complete: pass on the received byte.  
+// data register empty: send the byte returned, or turn the interrupt off if it is negative (nothing left). 
+// tx complete: let go of the RS485 bus if this returns 1. 
+void modbus_slave_rx_byte(ModbusSlave* slave, uint8_t data);
+int16_t modbus_slave_tx_byte(ModbusSlave* slave);
+uint8_t modbus_slave_tx_idle(ModbusSlave* slave);
+// 1 if modbus_slave_update() has nothing to do until the next interrupt, call with interrupts off (see modbus_idle()).
+uint8_t modbus_slave_idle(ModbusSlave* slave);
+
 // -------------------------------
 //  HARDWARE CONFIGURATION 
 // -------------------------------
@@ -72,7 +647,14 @@ enum HREG {
 // the hardware UART and output pin availble on 
 // the microcontroller. Only needs to be 
 // adjusted if the hardware is being changed.   
-// The following is for the ATMEGA328.
+// Two transport backends are provided. When compiled for an AVR the ATMEGA328 USART is used.
+// Everything else (a PC) gets the host backend in host/HostUart.h, an in-memory loopback that 
+// lets the protocol engine be run and benchmarked without a board. 
+// To port to different hardware add another #elif block which defines the same set of macros. 
+
+#if defined(__AVR__)
+
+#include <avr/io.h>
 
 // --------------------------
 //    TRANSMIT PIN ENABLE
@@ -85,38 +667,111 @@ enum HREG {
 // and used on a multidrop bus. Replace the following three definitions with NOP if you don't want to use the pin this way. 
 // EG:  #define SET_TX_ENABLE_LOW() NOP
 // the TX_PIN_SETUP macro will be called once as part of modbus_init to configure the hardware. 
+// It is PD7 (Arduino pin 7). PD6 is the sketch's SYNCH, which the motor interrupt toggles every frame. 
 
-#define SET_TX_ENABLE_LOW() (PORTD &= ~(_BV(6))) 
-#define SET_TX_ENABLE_HIGH() (PORTD |= _BV(6))
-#define TX_PIN_SETUP() NOP  
+#define TX_ENABLE_BIT 7
+#define SET_TX_ENABLE_LOW() (PORTD &= ~(_BV(TX_ENABLE_BIT))) 
+#define SET_TX_ENABLE_HIGH() (PORTD |= _BV(TX_ENABLE_BIT))
+#define TX_PIN_SETUP() ({SET_TX_ENABLE_LOW(); DDRD |= _BV(TX_ENABLE_BIT);})   // receiving until there is a response
 
 
 // --------------------------
 //    HARDWARE UART MACROS
 // --------------------------
 
-// Macros to setup the hardware UART, check the status of the UART (is it ready to send, does it have data)
-// and macros to actually get a byte from the hardware and send a byte. 
+// Macros to setup the hardware UART, get a byte from the hardware and send a byte, and to turn the 
+// data register empty interrupt on and off. They are used by the UART interrupt routines in AsciiModbusSlave.cpp 
 // the UART_SETUP macro will be called once as part of modbus_init to configure the hardware. 
  
-#define UART_BYTE_AVAILABLE() (UCSR0A & (_BV(RXC0)))
-#define UART_READY_TO_SEND() (UCSR0A & (_BV(UDRE0)))
 #define UART_GET_BYTE() (UDR0)
 #define UART_SEND_BYTE(data) (UDR0 = data)
+#define UART_TX_INTERRUPT_ENABLE() (UCSR0B |= _BV(UDRIE0))
+#define UART_TX_INTERRUPT_DISABLE() (UCSR0B &= ~(_BV(UDRIE0)))
 
-// set baud rate to 57600bps as per datasheet table for 8MHZ xtal.
-// UBRR = (8MHz / (8*57600bps)) - 1 = 16.4 => round to 16
-// Timing error = 2.1%   
-// 8,N,1 No interrupts. 
-
-#define UART_SETUP() ({              \
-                UBRR0H = 0;          \
-                UBRR0L = 16;         \
-                UCSR0A = 0b01100010; \
-                UCSR0B = 0b00011000; \
-                UCSR0C = 0b00000110; \
+// MODBUS_BAUD with the divider and double speed worked out in TIMING (57600bps at 8MHz is UBRR 16 at double speed, 
+// 2.1% fast). 
+// 8,N,1 RX complete and TX complete interrupts on. The data register empty interrupt is turned on when there is data to send. 
+
+#define UART_SETUP() ({                                         \
+                UBRR0H = (uint8_t)(MODBUS_UBRR >> 8);           \
+                UBRR0L = (uint8_t)MODBUS_UBRR;                  \
+                UCSR0A = 0b01100000 | (MODBUS_U2X << U2X0);     \
+                UCSR0B = 0b11011000;                            \
+                UCSR0C = 0b00000110;                            \
         })
 
+// --------------------------
+//    PROFILING CLOCK 
+// --------------------------
+
+// Only used when MODBUS_PROFILE is 1. Timer1 counts CPU clock cycles from 0 to 0xFFFF and round again (normal mode,
+// set up by the application for the motor output), which is already the 16 bit count the profiling wants. 
+// For a timer which counts to TOP and is reset (CTC mode), set TOP here and make PROFILE_CLOCK_WRAPPED() its compare 
+// flag, which is set when the count has gone back to 0 but the interrupt, which counts the periods with 
+// MODBUS_PROFILE_ISR_BEGIN(), hasn't run yet. 
+
+#define PROFILE_CLOCK_COUNT() (TCNT1)
+#define PROFILE_CLOCK_TOP() (0xFFFF)
+#define PROFILE_CLOCK_WRAPPED() (0)
+
+// --------------------------
+//    EEPROM 
+// --------------------------
+
+// For the saved registers. A write (erase and write, 3.3mS) is only started when EEPROM_BUSY() is 0, and a read is
+// only done then as well, so neither ever waits. Interrupts are held off for the 2 instructions which have to follow
+// each other to start the write. 
+// Set the brown out detector fuse, the EEPROM can be corrupted by writing it while the supply is too low. 
+
+#define EEPROM_SIZE (E2END + 1)
+#define EEPROM_BUSY() (EECR & _BV(EEPE))
+#define EEPROM_READ_BYTE(address) ({EEAR = (address); EECR |= _BV(EERE); EEDR;})
+#define EEPROM_WRITE_BYTE(address, data) ({                    \
+                uint8_t eeprom_sreg = SREG;                     \
+                EEAR = (address);                               \
+                EEDR = (data);                                  \
+                cli();                                          \
+                EECR = _BV(EEMPE);                              \
+                EECR |= _BV(EEPE);                              \
+                SREG = eeprom_sreg;                             \
+        })
+
+#else 
+
+// --------------------------
+//    HOST LOOPBACK BACKEND
+// --------------------------
+
+// The "wire" is a pair of byte queues. A test or benchmark puts bytes in with host_uart_inject() 
+// as if a master sent them and collects the slaves response with host_uart_take(). 
+// There are no real interrupts, host_uart_interrupts() stands in for the USART and calls the interrupt routines. 
+// The EEPROM is an array which takes as long to write as the real one, in simulated time (host_eeprom_elapse()). 
+
+#include "host/HostUart.h"
+
+#define NOP ((void)0)
+#define _BV(bit) (1 << (bit))
+#define SET_TX_ENABLE_LOW() (host_uart_tx_enable = 0)
+#define SET_TX_ENABLE_HIGH() (host_uart_tx_enable = 1)
+#define TX_PIN_SETUP() NOP
+
+#define UART_GET_BYTE() (host_uart_get_byte())
+#define UART_SEND_BYTE(data) (host_uart_send_byte(data))
+#define UART_TX_INTERRUPT_ENABLE() (host_uart_tx_interrupt = 1)
+#define UART_TX_INTERRUPT_DISABLE() (host_uart_tx_interrupt = 0)
+#define UART_SETUP() (host_uart_reset())
+
+#define PROFILE_CLOCK_COUNT() (host_profile_clock())
+#define PROFILE_CLOCK_TOP() (0xFFFF)
+#define PROFILE_CLOCK_WRAPPED() (0)
+
+#define EEPROM_SIZE HOST_EEPROM_SIZE
+#define EEPROM_BUSY() (host_eeprom_busy())
+#define EEPROM_READ_BYTE(address) (host_eeprom_read(address))
+#define EEPROM_WRITE_BYTE(address, data) (host_eeprom_write((address), (data)))
+
+#endif
+
 
 
 //----------------------------------------------
@@ -124,9 +779,19 @@ enum HREG {
 // The following go with the UPDATE_MODBUS_TIMER() 
 // but are used by AsciiModbusSlave.cpp
 
-#define SET_MODBUS_TIMER(val) (modbus_timer = val)
-#define MODBUS_TIMER_EXPIRED() ((modbus_timer == 0) ? 1 : 0) 
-extern uint8_t modbus_timer;
+#define SET_MODBUS_TIMER(slave, val) ((slave)->timer = val)
+#define MODBUS_TIMER_EXPIRED(slave) (((slave)->timer == 0) ? 1 : 0) 
+
+// The UART interrupt routines. On the AVR these are called from the ISR()s in AsciiModbusSlave.cpp,
+// on the host they are called by host_uart_interrupts(). 
+void modbus_uart_rx_isr();
+void modbus_uart_udre_isr();
+void modbus_uart_txc_isr();
+
+// Used by MODBUS_PROFILE_ISR_BEGIN() / _END() / _LATE() 
+uint16_t modbus_profile_isr_begin();
+void modbus_profile_isr_end(uint16_t start);
+void modbus_profile_isr_late();
 
 // -------------------------------------
 
@@ -0,0 +1,21 @@
+#ifndef MODBUS_CODEC_H
+#define MODBUS_CODEC_H
+
+// The byte level encoding shared by the slave (AsciiModbusSlave.cpp, which has the definitions) and the host 
+// master (host/ModbusMaster.cpp). 
+// ASCII sends each byte as two hex characters and its LRC is the 2's compliment of the bytes added up. 
+// RTU sends the bytes as they are followed by a CRC-16, low byte first. For both, running the check over a 
+// whole frame including the received LRC/CRC gives zero when the frame is good. 
+
+#include <stdint.h>
+
+#define UINT8_TO_ASCII(in) (((in) < 10) ? ((in) + '0') : ((in) < 16) ? ((in) + ('A' - 10)) : 255)
+
+// 0..15 to '0'..'9', 'A'..'F', 255 for anything bigger. 
+uint8_t uint8_to_ascii(uint8_t in);
+// '0'..'9', 'A'..'F' to 0..15, 255 for any other character. 
+uint8_t ascii_to_uint8(uint8_t ch);
+// add one byte to a Modbus RTU CRC, start with 0xFFFF. 
+uint16_t crc16_update(uint16_t crc, uint8_t data);
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef MODBUS_REGISTER_MAP_H
+#define MODBUS_REGISTER_MAP_H
+
+// Lookup tables for the holding register map declared with MODBUS_REGISTER_MAP in AsciiModbusSlave.h
+// Only AsciiModbusSlave.cpp includes this, after PROGMEM and pgm_read_byte() are defined.
+//
+// Everything here is worked out by the compiler, so at run time turning an address into a register (slot)
+// and checking a request costs a couple of table reads and no searching:
+//
+//   hr_page_table      256 entries, indexed by the high byte of an address. Gives the row in hr_slot_rows
+//                      or HR_NO_SLOT if there are no registers with that high byte.
+//   hr_slot_rows       one row of 256 entries for each high byte that is used, indexed by the low byte.
+//                      Gives the slot (index into holding_registers) or HR_NO_SLOT.
+//   hr_run_table       for each slot, how many registers at consecutive addresses start there. A request
+//                      for count registers from a slot is good if this is >= count.
+//   hr_write_run_table the same but only counting registers the master is allowed to write.
+//   hr_flag_table      HR_FLAG_... bits for each slot.
+//   hr_saved_table     the slots of the saved registers (HR_RW_SAVED), in address order.
+//
+// Slots are given out in address order, which is why the addresses in the map must be increasing.
+// Each row of hr_slot_rows is 256 bytes of flash, so keep the registers in as few 256 address pages as possible.
+
+#include "AsciiModbusSlave.h"
+
+#define HR_NO_SLOT 0xFF
+
+#define HR_FLAG_WRITABLE   HR_RW
+#define HR_FLAG_READ_HOOK  0x02
+#define HR_FLAG_WRITE_HOOK 0x04
+#define HR_FLAG_SAVED      HR_SAVED
+
+//----The map as constant arrays, only used by the compiler------
+
+#define HR_ADDRESS(name, address, access, read_hook, write_hook) (uint16_t)(address),
+#define HR_FLAGS(name, address, access, read_hook, write_hook) \
+        (uint8_t)((access) | (((read_hook) != NULL) ? HR_FLAG_READ_HOOK : 0) | (((write_hook) != NULL) ? HR_FLAG_WRITE_HOOK : 0)),
+#define HR_READ_HOOK(name, address, access, read_hook, write_hook) read_hook,
+#define HR_WRITE_HOOK(name, address, access, read_hook, write_hook) write_hook,
+
+constexpr uint16_t hr_addresses[hr_ARRAY_SIZE] = { MODBUS_REGISTER_MAP(HR_ADDRESS) };
+constexpr uint8_t hr_flags[hr_ARRAY_SIZE] = { MODBUS_REGISTER_MAP(HR_FLAGS) };
+
+//----Compile time helpers (C++11 constexpr, so one return statement each)------
+
+constexpr uint8_t hr_hi(uint8_t i) { return (uint8_t)(hr_addresses[i] >> 8); }
+
+// the addresses are strictly increasing from register i onwards
+constexpr bool hr_ascending(uint8_t i) {
+    return ((i + 1) >= hr_ARRAY_SIZE) ? true : ((hr_addresses[i] < hr_addresses[i + 1]) && hr_ascending(i + 1));
+}
+
+// register i is the first (lowest address) one with its high byte
+constexpr bool hr_first_in_page(uint8_t i) { return (i == 0) || (hr_hi(i) != hr_hi(i - 1)); }
+
+// the number of pages (high bytes) used by registers before register i
+constexpr uint8_t hr_pages_before(uint8_t i) {
+    return (i == 0) ? 0 : (hr_pages_before(i - 1) + (hr_first_in_page(i - 1) ? 1 : 0));
+}
+
+#define HR_NUM_PAGES hr_pages_before(hr_ARRAY_SIZE)
+
+static_assert(hr_ARRAY_SIZE > 0, "MODBUS_REGISTER_MAP is empty");
+static_assert(hr_ARRAY_SIZE < HR_NO_SLOT, "No more than 254 registers are supported");
+static_assert(hr_ascending(0), "The addresses in MODBUS_REGISTER_MAP must be in increasing order without repeats");
+
+// row in hr_slot_rows for a high byte, searching from register i
+constexpr uint8_t hr_page_of(uint8_t hi, uint8_t i) {
+    return (i >= hr_ARRAY_SIZE) ? HR_NO_SLOT : (hr_hi(i) == hi) ? hr_pages_before(i) : hr_page_of(hi, i + 1);
+}
+
+// high byte of the addresses in row p of hr_slot_rows, counting pages from register i
+constexpr uint8_t hr_page_hi(uint8_t p, uint8_t i, uint8_t count) {
+    return (i >= hr_ARRAY_SIZE) ? 0
+         : !hr_first_in_page(i) ? hr_page_hi(p, i + 1, count)
+         : (count == p) ? hr_hi(i) : hr_page_hi(p, i + 1, count + 1);
+}
+
+// slot of an address, searching from register i
+constexpr uint8_t hr_slot_of(uint16_t address, uint8_t i) {
+    return (i >= hr_ARRAY_SIZE) ? HR_NO_SLOT : (hr_addresses[i] == address) ? i : hr_slot_of(address, i + 1);
+}
+
+// the next slot holds the next address
+constexpr bool hr_next_is_consecutive(uint8_t i) {
+    return ((i + 1) < hr_ARRAY_SIZE) && (hr_addresses[i + 1] == (uint16_t)(hr_addresses[i] + 1));
+}
+
+// add one without going past 255, the tables are bytes
+constexpr uint8_t hr_inc(uint8_t n) { return (n == 255) ? 255 : (n + 1); }
+
+constexpr uint8_t hr_run(uint8_t i) {
+    return hr_next_is_consecutive(i) ? hr_inc(hr_run(i + 1)) : 1;
+}
+
+constexpr uint8_t hr_write_run(uint8_t i) {
+    return !(hr_flags[i] & HR_FLAG_WRITABLE) ? 0 : hr_next_is_consecutive(i) ? hr_inc(hr_write_run(i + 1)) : 1;
+}
+
+// slot of the nth saved register, searching from register i
+constexpr uint8_t hr_saved_slot(uint8_t n, uint8_t i) {
+    return (i >= hr_ARRAY_SIZE) ? HR_NO_SLOT
+         : !(hr_flags[i] & HR_FLAG_SAVED) ? hr_saved_slot(n, i + 1)
+         : (n == 0) ? i : hr_saved_slot(n - 1, i + 1);
+}
+
+static_assert(MODBUS_SAVED_REGISTERS <= 32, "No more than 32 saved registers, the whole copy is kept in the context");
+
+//----Building the tables------
+
+// a list of 0, 1, 2 ... N-1 to expand the helpers above over (std::make_index_sequence isn't available on the AVR)
+template<uint16_t... I> struct HrIndexList {};
+template<uint16_t N, uint16_t... I> struct HrMakeIndexList : HrMakeIndexList<N - 1, N - 1, I...> {};
+template<uint16_t... I> struct HrMakeIndexList<0, I...> { typedef HrIndexList<I...> type; };
+
+template<uint16_t SIZE> struct HrTable { uint8_t v[SIZE]; };
+struct HrSlotRows { HrTable<256> page[HR_NUM_PAGES]; };
+
+template<uint16_t... I> constexpr HrTable<sizeof...(I)> hr_make_page_table(HrIndexList<I...>) {
+    return HrTable<sizeof...(I)>{{ hr_page_of((uint8_t)I, 0)... }};
+}
+
+template<uint16_t... I> constexpr HrTable<sizeof...(I)> hr_make_slot_row(uint8_t hi, HrIndexList<I...>) {
+    return HrTable<sizeof...(I)>{{ hr_slot_of((uint16_t)((hi << 8) | I), 0)... }};
+}
+
+template<uint16_t... P> constexpr HrSlotRows hr_make_slot_rows(HrIndexList<P...>) {
+    return HrSlotRows{{ hr_make_slot_row(hr_page_hi((uint8_t)P, 0, 0), HrMakeIndexList<256>::type())... }};
+}
+
+template<uint16_t... I> constexpr HrTable<sizeof...(I)> hr_make_run_table(HrIndexList<I...>) {
+    return HrTable<sizeof...(I)>{{ hr_run((uint8_t)I)... }};
+}
+
+template<uint16_t... I> constexpr HrTable<sizeof...(I)> hr_make_write_run_table(HrIndexList<I...>) {
+    return HrTable<sizeof...(I)>{{ hr_write_run((uint8_t)I)... }};
+}
+
+// one entry even with no saved registers, so the table is never empty
+template<uint16_t... I> constexpr HrTable<sizeof...(I)> hr_make_saved_table(HrIndexList<I...>) {
+    return HrTable<sizeof...(I)>{{ hr_saved_slot((uint8_t)I, 0)... }};
+}
+#define HR_SAVED_TABLE_SIZE ((MODBUS_SAVED_REGISTERS > 0) ? MODBUS_SAVED_REGISTERS : 1)
+
+//----The tables, in flash------
+
+const HrTable<256> hr_page_table PROGMEM = hr_make_page_table(HrMakeIndexList<256>::type());
+const HrSlotRows hr_slot_rows PROGMEM = hr_make_slot_rows(HrMakeIndexList<HR_NUM_PAGES>::type());
+const HrTable<hr_ARRAY_SIZE> hr_run_table PROGMEM = hr_make_run_table(HrMakeIndexList<hr_ARRAY_SIZE>::type());
+const HrTable<hr_ARRAY_SIZE> hr_write_run_table PROGMEM = hr_make_write_run_table(HrMakeIndexList<hr_ARRAY_SIZE>::type());
+const HrTable<HR_SAVED_TABLE_SIZE> hr_saved_table PROGMEM = hr_make_saved_table(HrMakeIndexList<HR_SAVED_TABLE_SIZE>::type());
+const uint8_t hr_flag_table[hr_ARRAY_SIZE] PROGMEM = { MODBUS_REGISTER_MAP(HR_FLAGS) };
+const RegisterReadHook hr_read_hooks[hr_ARRAY_SIZE] PROGMEM = { MODBUS_REGISTER_MAP(HR_READ_HOOK) };
+const RegisterWriteHook hr_write_hooks[hr_ARRAY_SIZE] PROGMEM = { MODBUS_REGISTER_MAP(HR_WRITE_HOOK) };
+
+//----Run time lookups------
+
+// the slot for an address or HR_NO_SLOT if there isn't a register there.
+static inline uint8_t hr_lookup(uint8_t address_hi, uint8_t address_lo) {
+    uint8_t page = pgm_read_byte(&hr_page_table.v[address_hi]);
+    if (page == HR_NO_SLOT) return HR_NO_SLOT;
+    return pgm_read_byte(&hr_slot_rows.page[page].v[address_lo]);
+}
+
+#endif
@@ -0,0 +1,131 @@
+#ifndef MODBUS_STATE_MACHINE_H
+#define MODBUS_STATE_MACHINE_H
+
+// The receive and transmit statemachines used by AsciiModbusSlave.cpp, and the bits needed to run them.
+//
+// Each machine is a table of rows, one per state:
+//   ST(currentState, stateFunction, forwardState, branchState, repeatState [, dropState])
+// The state function does the work for the state and says which way to go by returning with one of the macros below.
+// The table is expanded at compile time into:
+//   - the enum of states, in table order.
+//   - a switch (see TX_CASE / RX_CASE in AsciiModbusSlave.cpp) which calls the state function directly and turns
+//     its return value into the next state. The state functions are static and only called from there so the
+//     compiler inlines them, and as each return is a constant the choice of next state folds away as well.
+//     No function pointers and no transition table in ram or flash.
+//   - static_asserts that every state has somewhere to go and that every exit is a state in the same machine.
+// mNULL / sNULL mark an exit that isn't used. If a state function does return through one the machine goes back to
+// its idle state (mFINISH / sCOLON).
+//
+// The text in FORWARD_WHEN("...") etc. isn't compiled, it's there to document what is happening. host/StateDiagram.cpp
+// reads the tables below and those strings out of AsciiModbusSlave.cpp to draw the machines with graphviz.
+
+#include <stdint.h>
+
+//----General State machine infrustructure------
+
+// The ONLY valid return values from a state machine function, each picks the matching column of the row.
+// noting that rMAX... is not a valid return value.
+enum return_values {rFORWARD, rBRANCH, rREPEAT, rDROP, rMAX_RETURN_VALUES};
+
+// The following macros are used to return one of the valid return values from a state function.
+// note that the in parameter isn't used, it can be used to document whats happening and can be extracted
+// to draw the state machine diagram.
+#define REPEAT_UNTIL(in) do{return rREPEAT;}while(0)
+#define FORWARD_WHEN(in) do{return rFORWARD;}while(0)
+#define BRANCH_IF(in) do{return rBRANCH;}while(0)
+#define DROP_IF(in) do{return rDROP;}while(0)
+
+// The next state for a return value, from the exits of a row:
+//   SmExits<forward, branch, repeat, drop>::next(rc, null_state)
+// which is null_state for a return value the row has no exit for.
+template<uint8_t... EXITS> struct SmExits;
+template<> struct SmExits<> {
+    static inline uint8_t next(uint8_t, uint8_t null_state) { return null_state; }
+};
+template<uint8_t FIRST, uint8_t... REST> struct SmExits<FIRST, REST...> {
+    static inline uint8_t next(uint8_t rc, uint8_t null_state) {
+        return (rc == 0) ? FIRST : SmExits<REST...>::next(rc - 1, null_state);
+    }
+};
+
+// Compile time checks of a row's exits
+constexpr bool sm_exits_valid(uint8_t, uint8_t) { return true; }
+template<typename... REST> constexpr bool sm_exits_valid(uint8_t max_states, uint8_t null_state, uint8_t exit, REST... rest) {
+    return ((exit < max_states) || (exit == null_state)) && sm_exits_valid(max_states, null_state, rest...);
+}
+constexpr bool sm_has_exit(uint8_t) { return false; }
+template<typename... REST> constexpr bool sm_has_exit(uint8_t null_state, uint8_t exit, REST... rest) {
+    return (exit != null_state) || sm_has_exit(null_state, rest...);
+}
+
+#define SM_ENUM(state, function, ...) state,
+#define SM_CHECK(max_states, null_state, state, ...) \
+        static_assert(sm_has_exit(null_state, __VA_ARGS__), "state " #state " has no exits"); \
+        static_assert(sm_exits_valid(max_states, null_state, __VA_ARGS__), "state " #state " has an exit which isn't a state");
+
+//----Transmit statemachine table------
+
+// Sends the response once the receive statemachine sets txrx.messageReadyToSend. The state functions are ftx_...
+//   uint8_t function(uint8_t previous_state, ModbusSlave* ms)
+
+// the pattern for each row is:
+// ST( currentState, stateFunction, forwardState, branchState, repeatState)
+#define MODBUS_TX_STATES(ST) \
+    ST(mTXSTART, ftx_mTXSTART_beginDelayTimer, mCOLON, mNULL, mNULL) \
+    ST(mCOLON, ftx_mCOLON_sendColon, mSLAVEID, mNULL, mCOLON) \
+    ST(mSLAVEID, ftx_mSLAVEID_sendAddress, mFNCODE, mNULL, mSLAVEID) \
+    ST(mFNCODE, ftx_mFNCODE_sendFnCode, mCHOICE, mEXCEPT, mFNCODE) \
+    ST(mCHOICE, ftx_mCHOICE_fn3OrFn6, mNUMDATA, mDATAADD, mNULL) \
+    ST(mEXCEPT, ftx_mEXCEPT_sendException, mLRC, mNULL, mEXCEPT) \
+    ST(mLRC, ftx_mLRC_sendLrc, mCRLF, mNULL, mLRC) \
+    ST(mFINISH, ftx_mFINISH_waitUntilNewMsg, mTXSTART, mNULL, mFINISH) \
+    ST(mNUMDATA, ftx_mNUMDATA_txNumBytes, mTXREG, mNULL, mNUMDATA) \
+    ST(mTXREG, ftx_mTXREG_sendRegisters, mLRC, mNULL, mTXREG) \
+    ST(mDATAADD, ftx_mDATAADD_txDataAddress, mVALUE, mNULL, mDATAADD) \
+    ST(mVALUE, ftx_mVALUE_txDataValue, mLRC, mNULL, mVALUE) \
+    ST(mCRLF, ftx_mCRLF_sendCrLf, mFINISH, mNULL, mCRLF)
+
+enum STATESENUM {
+    MODBUS_TX_STATES(SM_ENUM)
+    mMAX_STATES, mNULL // leave these two in place at the end of the enum
+};
+
+//----Receive statemachine table------
+
+// Decodes the request one byte at a time (after the ASCII hex pairs have been turned into bytes). The state
+// functions are frx_...
+//   uint8_t function(ModbusSlave* ms, uint8_t data)
+// DROP_IF() gives up on the frame, the rest of it is ignored until the next one starts.
+// sCR, sLF and sCOLON are the ASCII framing around the bytes and are handled by modbus_receive_statemachine()
+// (sCOLON is also the RTU "waiting for the next frame" state), no bytes are decoded in them.
+// sSKIP_TO_END waits for the end of a frame which has nothing more to decode (function 11, or one we can't handle) 
+// and it is answered if its check is good. 
+
+// the pattern for each row is:
+// ST( currentState, stateFunction, forwardState, branchState, repeatState, dropState)
+#define MODBUS_RX_STATES(ST) \
+    ST(sSLAVE_ADDRESS, frx_sSLAVE_ADDRESS_checkId, sCOMMAND, sNULL, sNULL, sCOLON) \
+    ST(sCOMMAND, frx_sCOMMAND_checkFnCode, sREG_ADDRESS1, sSKIP_TO_END, sNULL, sNULL) \
+    ST(sREG_ADDRESS1, frx_sREG_ADDRESS1_rxAddressHi, sREG_NUM_OR_ADDRESS2, sNULL, sNULL, sNULL) \
+    ST(sREG_NUM_OR_ADDRESS2, frx_sREG_NUM_OR_ADDRESS2_rxAddressLo, sVALUE1, sWRITE_NUM1, sNULL, sNULL) \
+    ST(sVALUE1, frx_sVALUE1_rxValueHi, sVALUE2, sNULL, sNULL, sNULL) \
+    ST(sVALUE2, frx_sVALUE2_rxValueLo, sLRC, sWRITE_ADDRESS1, sNULL, sNULL) \
+    ST(sWRITE_ADDRESS1, frx_sWRITE_ADDRESS1_rxWriteAddressHi, sWRITE_ADDRESS2, sNULL, sNULL, sNULL) \
+    ST(sWRITE_ADDRESS2, frx_sWRITE_ADDRESS2_rxWriteAddressLo, sWRITE_NUM1, sNULL, sNULL, sNULL) \
+    ST(sWRITE_NUM1, frx_sWRITE_NUM1_rxWriteNumHi, sWRITE_NUM2, sNULL, sNULL, sNULL) \
+    ST(sWRITE_NUM2, frx_sWRITE_NUM2_rxWriteNumLo, sBYTE_COUNT, sNULL, sNULL, sNULL) \
+    ST(sBYTE_COUNT, frx_sBYTE_COUNT_rxByteCount, sDATA, sLRC, sNULL, sNULL) \
+    ST(sDATA, frx_sDATA_rxValues, sLRC, sNULL, sDATA, sNULL) \
+    ST(sLRC, frx_sLRC_checkLrc, sCR, sCRC_HI, sNULL, sCOLON) \
+    ST(sCRC_HI, frx_sCRC_HI_checkCrc, sCOLON, sNULL, sNULL, sNULL) \
+    ST(sCR, frx_framing, sNULL, sNULL, sCR, sNULL) \
+    ST(sLF, frx_framing, sNULL, sNULL, sLF, sNULL) \
+    ST(sSKIP_TO_END, frx_sSKIP_TO_END_waitForEnd, sNULL, sNULL, sSKIP_TO_END, sNULL) \
+    ST(sCOLON, frx_framing, sNULL, sNULL, sCOLON, sNULL)
+
+enum MODBUSST {
+    MODBUS_RX_STATES(SM_ENUM)
+    sMAX_STATES, sNULL // leave these two in place at the end of the enum
+};
+
+#endif
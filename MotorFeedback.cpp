@@ -0,0 +1,57 @@
+#include "MotorFeedback.h"
+
+// Measured speed from the feedback line, see MotorFeedback.h
+
+void motor_feedback_init(MotorFeedback* fb, uint16_t at) {
+    fb->frame_time = 0;
+    fb->frame_at = at;
+    fb->first = 0;
+    fb->last = 0;
+    fb->edges = 0;
+    fb->idle_frames = FEEDBACK_TIMEOUT_FRAMES;
+    fb->started = 0;
+}
+
+// An edge before the frame it is counted from would look nearly 8mS after it. That can't happen in the sketch, the
+// capture interrupts have a higher priority than the compare ones, so an edge before a frame is always handled first.
+void motor_feedback_edge(MotorFeedback* fb, uint16_t at) {
+    uint32_t time = fb->frame_time + (uint16_t)(at - fb->frame_at);
+
+    fb->idle_frames = 0;
+    if (!fb->started) {
+        fb->first = time;
+        fb->edges = 0;
+        fb->started = 1;
+    }
+    else if (fb->edges < FEEDBACK_MAX_EDGES) {
+        fb->edges++;
+        fb->last = time;
+    }
+}
+
+uint8_t motor_feedback_frame(MotorFeedback* fb, uint16_t at, int16_t sent, int16_t* speed) {
+    uint32_t span;
+    uint32_t rate;
+
+    fb->frame_time += (uint16_t)(at - fb->frame_at);
+    fb->frame_at = at;
+    if (fb->idle_frames < 0xFF) fb->idle_frames++;
+    if (fb->idle_frames == FEEDBACK_TIMEOUT_FRAMES) {
+        fb->started = 0;
+        *speed = 0;
+        return 1;
+    }
+    if (fb->edges == 0) return 0;
+    span = fb->last - fb->first;
+    if (span == 0) return 0;
+    if ((span < (uint32_t)FEEDBACK_WINDOW_FRAMES * MOTOR_FRAME_CYCLES) && (fb->edges < FEEDBACK_MAX_EDGES / 2)) {
+        return 0;
+    }
+
+    rate = ((uint32_t)fb->edges * FEEDBACK_CPU_HZ + (span >> 1)) / span;
+    if (rate > 0x7FFF) rate = 0x7FFF;
+    *speed = (sent < 0) ? -(int16_t)rate : (int16_t)rate;
+    fb->first = fb->last;
+    fb->edges = 0;
+    return 1;
+}
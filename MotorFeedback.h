@@ -0,0 +1,46 @@
+#ifndef MOTOR_FEEDBACK_H
+#define MOTOR_FEEDBACK_H
+
+#include <stdint.h>
+#include "MotorOutput.h"
+
+// The measured speed of a motor, from the pulses on its feedback line timed with Timer1.
+//
+// Each rising edge of the feedback line is timed by a capture (the input capture unit for one channel, an
+// external interrupt reading Timer1 for the other) and given to motor_feedback_edge(). Timer1 wraps every 8mS,
+// which is shorter than many feedback periods, so the times are made 32 bits long from the motor frames: 
+// motor_feedback_frame() is called at an edge of every frame (3.2mS apart) and keeps a 32 bit count of the cycles
+// up to it, so an edge is never more than two frames (52000 cycles) after the last frame's time.
+// Once a frame, the edges counted since the start of the window over the time between the first and the latest
+// is the speed, in feedback edges per second. It is worked out when the window is at least FEEDBACK_WINDOW_FRAMES
+// long, so the count is never less than a few edges, and the next window starts at the edge this one ended on.
+// The feedback line doesn't say which way the motor is going, so the speed has the sign of the speed being sent.
+// With no edge for FEEDBACK_TIMEOUT_FRAMES the speed is 0.
+//
+// Nothing in here touches the hardware. host/MotorSim.cpp checks it against simulated feedback.
+
+#define FEEDBACK_CPU_HZ 8000000UL           // Timer1's clock
+#define FEEDBACK_WINDOW_FRAMES 8            // 26mS, at least this many frames of edges for a speed
+#define FEEDBACK_TIMEOUT_FRAMES 64          // 206mS without an edge is stopped, anything under 5 edges/S
+#define FEEDBACK_MAX_EDGES 512              // the most counted, so edges * FEEDBACK_CPU_HZ fits. A window ends early
+                                            // at half this, so nothing is lost below 80000 edges/S
+
+typedef struct MOTORFEEDBACK {
+   uint32_t  frame_time;                     // when the last frame was, in cycles since motor_feedback_init()
+   uint16_t  frame_at;                       // and the same on Timer1
+   uint32_t  first;                          // the first edge of the window
+   uint32_t  last;                           // and the latest
+   uint16_t  edges;                          // from first to last
+   uint8_t   idle_frames;                    // frames since the last edge
+   uint8_t   started;                        // first is set
+}MotorFeedback;
+
+// Stopped, counting time from Timer1 count at.
+void motor_feedback_init(MotorFeedback* fb, uint16_t at);
+// A rising edge of the feedback line, at is Timer1 at the edge.
+void motor_feedback_edge(MotorFeedback* fb, uint16_t at);
+// Once a frame, at is Timer1 at an edge of the frame which has already gone and sent the speed being sent. 
+// Returns 1 and sets speed when there is a new one, 0 if not.
+uint8_t motor_feedback_frame(MotorFeedback* fb, uint16_t at, int16_t sent, int16_t* speed);
+
+#endif
@@ -0,0 +1,75 @@
+#include "MotorOutput.h"
+
+// Edge schedule for the motor serial data, see MotorOutput.h
+
+// One word's bit times, bit 0 is the start bit.
+static uint16_t motor_word(uint16_t data) {
+    return (uint16_t)(((data & 0x1FF) << 1) | (3 << 10));     // start 0, 9 data bits, stop and idle 1
+}
+
+void motor_channel_init(MotorChannel* ch) {
+    ch->sent = 0;
+    motor_channel_load(ch, 0, 0);
+    // the first compare match is the start bit of the first frame
+    ch->word = 0;
+    ch->bit = 0;
+    ch->level = 0;
+}
+
+// The differences are worked out unsigned, as target - sent can be more than an int16_t holds. 
+void motor_channel_load(MotorChannel* ch, int16_t target, uint16_t ramp) {
+    if (ramp == 0) ch->sent = target;
+    else if (target > ch->sent) {
+        if ((uint16_t)(target - ch->sent) > ramp) ch->sent = (int16_t)(ch->sent + ramp);
+        else ch->sent = target;
+    }
+    else {
+        if ((uint16_t)(ch->sent - target) > ramp) ch->sent = (int16_t)(ch->sent - ramp);
+        else ch->sent = target;
+    }
+    ch->bits = motor_word(MOTOR_FRAME_MARKER);
+}
+
+// Word 1 to 5 of the frame, built when the last one is done with. 
+static uint16_t motor_frame_word(const MotorChannel* ch, uint8_t word) {
+    if (word == MOTOR_FRAME_WORDS - 1) return motor_word(MOTOR_END_OF_FRAME);
+    if (word & 1) return motor_word((uint8_t)ch->sent);             // low byte then high, twice
+    return motor_word((uint8_t)((uint16_t)ch->sent >> 8));
+}
+
+// Step through the bit times from the edge which has just happened until the level changes. After the last word the
+// line is idle for the whole pause and then drops for the next frame's start bit, so that is one step.
+// Shifts and counts rather than indexing, the AVR has no barrel shifter or divide. The longest run inside a frame is
+// a start bit and 9 zeros, 10 steps.
+uint16_t motor_channel_next_edge(MotorChannel* ch) {
+    uint8_t word = ch->word;
+    uint8_t bit = ch->bit;
+    uint16_t bits = ch->bits;
+    uint8_t level = ch->level;
+    uint8_t next;
+    uint16_t cycles = 0;
+
+    do {
+        cycles += MOTOR_BIT_CYCLES;
+        bits >>= 1;
+        bit++;
+        if (bit == MOTOR_WORD_BITS) {
+            bit = 0;
+            word++;
+            if (word < MOTOR_FRAME_WORDS) bits = motor_frame_word(ch, word);
+            else {
+                // the pause, then the next frame's start bit. Its speed isn't loaded yet, but it isn't needed to 
+                // get here. 
+                cycles += MOTOR_PAUSE_BITS * MOTOR_BIT_CYCLES;
+                word = 0;
+                bits = 0;
+            }
+        }
+        next = (uint8_t)(bits & 1);
+    } while (next == level);
+    ch->word = word;
+    ch->bit = bit;
+    ch->bits = bits;
+    ch->level = next;
+    return cycles;
+}
@@ -0,0 +1,58 @@
+#ifndef MOTOR_OUTPUT_H
+#define MOTOR_OUTPUT_H
+
+#include <stdint.h>
+
+// The serial data to the hoverboard motor controllers, as a schedule of edges for a timer's output compare.
+//
+// Each motor channel is a 9 bit serial line at one bit per 38uS. A frame is MOTOR_FRAME_WORDS words:
+//   0x00 with the 9th bit set (the start of frame marker), speed low, speed high, speed low, speed high, 0x55
+// each sent as a start bit, 9 data bits (lsb first), a stop bit and one more bit time of idle, then the line is
+// held high for MOTOR_PAUSE_BITS so a receiver can find the start of the next frame (the 500uS sync pause).
+// This is the same bit for bit as the old per-bit interrupt sent.
+//
+// Rather than an interrupt every bit, the timer's compare output toggles the pin in hardware and the compare
+// interrupt only has to work out when the next change of level is and load it. Runs of the same bit cost nothing,
+// so a word takes 2 interrupts (0x00) to 10 (0x55), and the interrupt's timing doesn't matter as long as it is done
+// before the next edge, at least one bit time later. When there are two channels on one timer, start one half a bit
+// time after the other so their interrupts don't have to share a bit time.
+// The speed is read once per frame, when the last edge of a frame has gone (MOTOR_FRAME_DUE() after 
+// motor_channel_next_edge()), and is in the very next frame, so a new speed starts going out within a frame period
+// (MOTOR_FRAME_CYCLES, 3.2mS) of being written. It can be slew rate limited, each frame's speed is then the last 
+// one moved towards the one asked for by no more than the ramp. Each word is built as it is reached, so no 
+// interrupt does much more work than another and holds up the other channel's.
+//
+// Nothing in here touches the hardware, the sketch owns the timer. host/MotorSim.cpp runs the same code against a
+// simulated timer and checks its output against the old interrupt's.
+
+#define MOTOR_BIT_CYCLES 304                // 38uS at 8MHz, one bit
+#define MOTOR_WORD_BITS 12                  // start, 9 data, stop, idle
+#define MOTOR_FRAME_WORDS 6
+#define MOTOR_PAUSE_BITS 13                 // more idle after the last word, with its stop and idle bits 570uS
+#define MOTOR_FRAME_BITS (MOTOR_FRAME_WORDS * MOTOR_WORD_BITS + MOTOR_PAUSE_BITS)
+#define MOTOR_FRAME_CYCLES ((uint16_t)(MOTOR_FRAME_BITS * MOTOR_BIT_CYCLES))   // 25840, 3.2mS
+#define MOTOR_FRAME_MARKER 0x100            // the 9th bit, only set in the first word
+#define MOTOR_END_OF_FRAME 0x55
+
+typedef struct MOTORCHANNEL {
+   int16_t   sent;                           // the speed in the frame being sent
+   uint8_t   word;                           // where the next edge is: the word
+   uint8_t   bit;                            // and the bit time in it
+   uint16_t  bits;                           // the rest of the word, the bit time at bit in bit 0 (bit n of a 
+                                             // whole word is its nth bit time)
+   uint8_t   level;                          // the line from the next edge on, 1 is idle
+}MotorChannel;
+
+// The edge motor_channel_next_edge() has just set up starts a new frame, so the one before is finished with and
+// motor_channel_load() can give the new one its speed.
+#define MOTOR_FRAME_DUE(ch) (((ch)->word == 0) && ((ch)->bit == 0))
+
+// Ready to start a frame of speed 0 at the first compare match.
+void motor_channel_init(MotorChannel* ch);
+// Set the next frame's speed, when MOTOR_FRAME_DUE(). It is moved from the last frame's towards target by at most
+// ramp, 0 goes straight to it.
+void motor_channel_load(MotorChannel* ch, int16_t target, uint16_t ramp);
+// Called at an edge (the compare match which toggled the line), returns the timer cycles to the next one.
+uint16_t motor_channel_next_edge(MotorChannel* ch);
+
+#endif
@@ -0,0 +1,316 @@
+// Decodes the bus capture (Capture in AsciiModbusSlave.h) into a timeline, and checks it against a simulation.
+//
+// With no arguments, one slave (built with MODBUS_CAPTURE) is sent ASCII requests a character time at a time, with
+// its timer ticked and modbus_slave_update() called once a character, and every byte that goes either way is
+// logged here with the slave's clock. The master:
+//   - writes MODBUS_CAPTURE_TRIGGER to hr_CAPTURE_MODE
+//   - sends reads with different gaps between them (two much longer than the 64 ticks an entry's clock covers), a
+//     request for another slave and one with a bad LRC, reading hr_CAPTURE_MODE after each until the capture has
+//     stopped by itself
+//   - reads hr_CAPTURE_HEAD and downloads the ring with a fn23 per 8 entries (writing hr_CAPTURE_INDEX and reading
+//     it back with hr_CAPTURE_0 ... _7)
+// The download is printed as a timeline, and checked: the bytes and their times must be the ones logged (the
+// ring holds the last MODBUS_CAPTURE_SIZE entries, so a run of the log), the bad LRC must be there as a
+// MODBUS_CAPTURE_CHECK marker with half the ring after it. Exits with 1 if any check fails.
+//
+// With a file, decodes the entries in it (hex words, as read from hr_CAPTURE_0 on, in order) and prints the timeline.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -DMODBUS_CAPTURE=1 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/HexCodec.cpp host/SimSlave.cpp
+//       host/CaptureDecode.cpp -o capture_decode
+//   ./capture_decode [entries.txt]
+
+#include "AsciiModbusSlave.h"
+#include "host/SimSlave.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !MODBUS_CAPTURE
+#error "build with -DMODBUS_CAPTURE=1"
+#endif
+
+#define SIM_SLAVE_ID 1
+#define SIM_OTHER_ID 9
+#define SIM_MAX_REQUESTS 200
+#define SIM_LOG_SIZE 65536
+#define DECODE_MAX 4096
+#define SIM_CAPTURE_MODE 0x0090                   // the addresses of the CAPTURE registers in MODBUS_CAPTURE_REGISTERS
+#define SIM_CAPTURE_HEAD 0x0091
+#define SIM_CAPTURE_INDEX 0x0092
+
+typedef struct LOGGED {
+    uint8_t   kind;                               // MODBUS_CAPTURE_RX or _TX
+    uint8_t   data;
+    uint16_t  clock;                              // the slave's clock when it went
+} Logged;
+
+typedef struct DECODED {
+    uint8_t   kind;
+    uint8_t   data;
+    int32_t   time;                               // in ticks, from the first entry
+    uint8_t   gap_unknown;                        // the gap from the entry before is at least what time says
+} Decoded;
+
+static SimSlave sim;
+static Logged sim_log[SIM_LOG_SIZE];
+static size_t log_len = 0;
+
+static void log_byte(uint8_t kind, uint8_t data) {
+    if (log_len < SIM_LOG_SIZE) {
+        sim_log[log_len].kind = kind;
+        sim_log[log_len].data = data;
+        sim_log[log_len].clock = sim.slave.clock;
+        log_len++;
+    }
+}
+
+// Every byte that goes either way, with the slave's clock as it goes.
+static void log_char(SimSlave*, int16_t rx, int16_t tx) {
+    if (rx >= 0) log_byte(MODBUS_CAPTURE_RX, (uint8_t)rx);
+    if (tx >= 0) log_byte(MODBUS_CAPTURE_TX, (uint8_t)tx);
+}
+
+// The 8 entries from index on, with a fn23 that writes hr_CAPTURE_INDEX and reads from it.
+static void read_entries(uint16_t index, uint16_t* entries) {
+    uint8_t pdu[13] = {sim.slave.slaveID, 0x17, 0x00, SIM_CAPTURE_INDEX, 0x00, 9, 0x00, SIM_CAPTURE_INDEX, 0x00, 1, 2,
+                       (uint8_t)(index >> 8), (uint8_t)index};
+    int i;
+
+    sim_slave_request(&sim, pdu, sizeof(pdu), 0);
+    for (i = 0; i < 8; i++) {
+        entries[i] = (uint16_t)(sim_slave_answer_byte(&sim, 5 + i * 2) << 8 | sim_slave_answer_byte(&sim, 6 + i * 2));
+    }
+}
+
+//--Decoding--------------------------------------------------------------------------------------------------------
+
+static const char* marker_name(uint8_t marker) {
+    switch (marker) {
+        case MODBUS_CAPTURE_STARTED : return "started";
+        case MODBUS_CAPTURE_REQUEST : return "request";
+        case MODBUS_CAPTURE_FOREIGN : return "for another slave";
+        case MODBUS_CAPTURE_BUSY : return "busy, still answering";
+        case MODBUS_CAPTURE_SILENCE : return "silence, frame start";
+        case MODBUS_CAPTURE_FRAMING : return "FRAMING ERROR";
+        case MODBUS_CAPTURE_CHECK : return "CHECK ERROR";
+        case MODBUS_CAPTURE_RESYNC : return "RESYNC";
+        case MODBUS_CAPTURE_OVERRUN : return "OVERRUN";
+        case MODBUS_CAPTURE_EXCEPTION : return "exception";
+    }
+    return "unknown marker";
+}
+
+// Turn entries into bytes and markers with their times. An entry's clock has the low 6 bits of the time, the
+// gap to the one before is less than 64 ticks unless there is a _TIME entry (14 bits of it) between them. Once the
+// ring has gone round the first entries may have lost the _TIME in front of them, and the gap from them to the
+// first _TIME is only known to be 64 ticks or more: that entry is marked gap_unknown and given the shortest gap
+// that fits. Entries which weren't in the ring are left out. Returns the number decoded.
+static size_t decode(const uint16_t* entries, size_t n, Decoded* out) {
+    size_t count = 0;
+    size_t i;
+    uint8_t kind;
+    uint16_t clock;
+    int32_t time = 0;
+    int32_t gap;
+    int32_t offset = 0;
+    int started = 0;
+    int synced = 0;
+    int unknown = 0;
+
+    for (i = 0; (i < n) && (count < DECODE_MAX); i++) {
+        kind = (uint8_t)(entries[i] >> 14);
+        clock = (uint16_t)(entries[i] >> 8 & 0x3F);
+        if ((kind == MODBUS_CAPTURE_MARK) && ((uint8_t)entries[i] == MODBUS_CAPTURE_NONE)) continue;
+        if (kind == MODBUS_CAPTURE_TIME) {
+            // the entry after has the same clock, the _TIME itself isn't kept
+            clock |= (uint16_t)((entries[i] & 0xFF) << 6);
+            if (!started) time = clock;
+            else if (synced) time += (clock - (time + offset)) & 0x3FFF;
+            else {
+                gap = (clock - time) & 0x3F;
+                time += gap + 64;
+                unknown = 1;
+            }
+            // from here time + offset is the slave's clock (to 14 bits), before only the low 6 bits were
+            offset = (clock - time) & 0x3FFF;
+            started = 1;
+            synced = 1;
+            continue;
+        }
+        if (!started) time = clock;
+        else time += (clock - time) & 0x3F;
+        started = 1;
+        out[count].kind = kind;
+        out[count].data = (uint8_t)entries[i];
+        out[count].time = time;
+        out[count].gap_unknown = (uint8_t)unknown;
+        unknown = 0;
+        count++;
+    }
+    for (i = count; i > 0; i--) out[i - 1].time -= out[0].time;
+    return count;
+}
+
+static double ticks_ms(int32_t ticks) {
+    return ticks * (double)SIM_SLAVE_TICK_NS / 1000000.0;
+}
+
+static void print_bytes(const Decoded* d, size_t n) {
+    size_t i;
+    int text = 1;
+
+    for (i = 0; i < n; i++) {
+        if ((d[i].data < ' ' || d[i].data > '~') && (d[i].data != '\r') && (d[i].data != '\n')) text = 0;
+    }
+    for (i = 0; i < n; i++) {
+        if (!text) printf("%02X ", d[i].data);
+        else if (d[i].data == '\r') printf("\\r");
+        else if (d[i].data == '\n') printf("\\n");
+        else putchar(d[i].data);
+    }
+}
+
+// A line for each run of bytes the same way and each marker, with the gap between the end of what was received
+// and the start of the answer. Returns the longest turnaround, in ticks.
+static int32_t print_timeline(const Decoded* d, size_t n) {
+    int32_t longest = 0;
+    int32_t rx_end = -1;
+    size_t i = 0;
+    size_t run;
+
+    while (i < n) {
+        if (d[i].gap_unknown) {
+            printf("            --  a gap of at least %.3f ms, the times before are only right from one to the next\n",
+                   ticks_ms(d[i].time - d[i - 1].time));
+            rx_end = -1;
+        }
+        if (d[i].kind == MODBUS_CAPTURE_MARK) {
+            printf("%10.3f ms  --  %s\n", ticks_ms(d[i].time), marker_name(d[i].data));
+            i++;
+            continue;
+        }
+        for (run = i + 1; (run < n) && (d[run].kind == d[i].kind) && !d[run].gap_unknown; run++);
+        printf("%10.3f ms  %s  ", ticks_ms(d[i].time), (d[i].kind == MODBUS_CAPTURE_RX) ? "rx" : "tx");
+        print_bytes(d + i, run - i);
+        if ((d[i].kind == MODBUS_CAPTURE_TX) && (rx_end >= 0)) {
+            printf("   (turnaround %.3f ms)", ticks_ms(d[i].time - rx_end));
+            if ((d[i].time - rx_end) > longest) longest = d[i].time - rx_end;
+            rx_end = -1;
+        }
+        if (d[i].kind == MODBUS_CAPTURE_RX) rx_end = d[run - 1].time;
+        printf("\n");
+        i = run;
+    }
+    return longest;
+}
+
+//--The simulation--------------------------------------------------------------------------------------------------
+
+static int run_sim() {
+    static uint16_t entries[MODBUS_CAPTURE_SIZE + 8];
+    static Decoded decoded[MODBUS_CAPTURE_SIZE + 8];
+    uint8_t read_pdu[6] = {SIM_SLAVE_ID, 0x03, 0x00, 0x00, 0x00, 0x02};     // hr_L_ and hr_R_MOTOR_SPEED_SETTING
+    uint8_t other_pdu[6] = {SIM_OTHER_ID, 0x03, 0x00, 0x00, 0x00, 0x02};
+    uint16_t head;
+    uint16_t start;
+    uint16_t index;
+    uint16_t mode = MODBUS_CAPTURE_TRIGGER;
+    size_t n = 0;
+    size_t count;
+    size_t at;
+    size_t i;
+    size_t after = 0;
+    int found_check = 0;
+    int matched = 0;
+    int requests;
+    int32_t longest;
+    int ok;
+
+    sim_slave_init(&sim, SIM_SLAVE_ID, log_char);
+    sim_slave_idle(&sim, 1000);
+    sim_slave_write_register(&sim, SIM_CAPTURE_MODE, MODBUS_CAPTURE_TRIGGER);
+    for (requests = 0; (requests < SIM_MAX_REQUESTS) && (mode != MODBUS_CAPTURE_OFF); requests++) {
+        sim_slave_idle(&sim, (requests % 4) * 700);
+        if (requests == 5) {
+            sim_slave_request(&sim, other_pdu, sizeof(other_pdu), 0);
+            sim_slave_idle(&sim, 400000);
+        }
+        if (requests == 6) sim_slave_idle(&sim, 300000);
+        sim_slave_request(&sim, read_pdu, sizeof(read_pdu), requests == 5);
+        sim_slave_idle(&sim, 200);
+        mode = sim_slave_read_register(&sim, SIM_CAPTURE_MODE);
+    }
+    // download the ring
+    head = sim_slave_read_register(&sim, SIM_CAPTURE_HEAD);
+    start = (head > MODBUS_CAPTURE_SIZE) ? (uint16_t)(head - MODBUS_CAPTURE_SIZE) : 0;
+    for (index = start; (uint16_t)(index - start) < (uint16_t)(head - start); index += 8) {
+        read_entries(index, entries + n);
+        n += 8;
+    }
+    count = decode(entries, n, decoded);
+    printf("capture of %u entries, the last %u of %u downloaded with %u fn23s, %u requests sent\n",
+           MODBUS_CAPTURE_SIZE, (unsigned)(head - start), head, (unsigned)(n / 8), requests);
+    longest = print_timeline(decoded, count);
+
+    // the check error half a ring from the end (the entry that goes past it can be a _TIME and the byte after), 
+    // and the bytes a run of the log at the same times
+    for (i = 0; i < n; i++) {
+        if (entries[i] == ((MODBUS_CAPTURE_MARK << 14) | (entries[i] & 0x3F00) | MODBUS_CAPTURE_CHECK)) {
+            found_check = 1;
+            after = (head - start) - i - 1;
+        }
+    }
+    for (i = 0; (i < count) && (decoded[i].kind == MODBUS_CAPTURE_MARK); i++);
+    for (at = 0; (i < count) && (at < log_len) && !matched; at++) {
+        size_t d;
+        size_t l = at;
+        size_t log_base = at;
+        size_t base = i;
+
+        if ((sim_log[at].kind != decoded[i].kind) || (sim_log[at].data != decoded[i].data)) continue;
+        matched = 1;
+        for (d = i; (d < count) && matched; d++) {
+            if (decoded[d].gap_unknown) {
+                // the decoder can only say the gap was at least this long
+                matched = (l < log_len) &&
+                          ((uint16_t)(sim_log[l].clock - sim_log[l - 1].clock) >= (decoded[d].time - decoded[d - 1].time));
+                log_base = l;
+                base = d;
+            }
+            if (decoded[d].kind == MODBUS_CAPTURE_MARK) continue;
+            matched = matched && (l < log_len) && (sim_log[l].kind == decoded[d].kind) &&
+                      (sim_log[l].data == decoded[d].data) &&
+                      ((uint16_t)(sim_log[l].clock - sim_log[log_base].clock) == (decoded[d].time - decoded[base].time));
+            l++;
+        }
+    }
+    ok = (mode == MODBUS_CAPTURE_OFF) && matched && found_check && (after >= MODBUS_CAPTURE_SIZE / 2) &&
+         (after <= MODBUS_CAPTURE_SIZE / 2 + 1) && (head - start == MODBUS_CAPTURE_SIZE) && (sim.unanswered == 0);
+    printf("stopped by itself %s, bytes and times match the log %s, check error found %s with %u after it, "
+           "longest turnaround %.3f ms  %s\n", (mode == MODBUS_CAPTURE_OFF) ? "yes" : "no", matched ? "yes" : "no",
+           found_check ? "yes" : "no", (unsigned)after, ticks_ms(longest), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static int run_file(const char* name) {
+    static uint16_t entries[DECODE_MAX];
+    static Decoded decoded[DECODE_MAX];
+    FILE* f = fopen(name, "r");
+    unsigned int word;
+    size_t n = 0;
+
+    if (!f) {
+        perror(name);
+        return 0;
+    }
+    while ((n < DECODE_MAX) && (fscanf(f, "%x", &word) == 1)) entries[n++] = (uint16_t)word;
+    fclose(f);
+    print_timeline(decoded, decode(entries, n, decoded));
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1) return run_file(argv[1]) ? 0 : 1;
+    return run_sim() ? 0 : 1;
+}
@@ -0,0 +1,248 @@
+// Checks the bulk hex codec (HexCodec.h) against the slave's nibble at a time helpers (ModbusCodec.h) and measures
+// how fast it is against them.
+//
+// The reference is what the master did before: ascii_to_uint8() on each character, UINT8_TO_ASCII on each nibble
+// and the LRC added up a byte at a time. hex_decode() and hex_encode(), and the _scalar ones, must give the same
+// bytes, characters, LRC and valid / not valid for:
+//   - every pair of characters, at every position in a run long enough for the widest vector step
+//   - every character at every position of such a run, the rest good hex
+//   - every byte value at every position, encoded
+//   - CODEC_RANDOM_RUNS random runs of good hex and random bytes, from 0 to CODEC_MAX_PAIRS long, starting at any
+//     alignment, with and without one bad character somewhere
+// and never write past the end of what they were given. Exits with 1 if anything is different.
+//
+// Then it times decoding and encoding, as characters of hex a second, for a frame with the biggest PDU (as the
+// master and gateway do it) and for a 1MB capture being replayed, the vector path against the scalar one.
+//
+// Build and run from the top of the repository (add -mavx2 or -march=native for the AVX2 path):
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/HexCodec.cpp host/CodecBench.cpp -o codec_bench
+//   ./codec_bench [seconds_per_test]
+
+#include "ModbusCodec.h"
+#include "HexCodec.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#define CODEC_RUN_PAIRS 88                // two AVX2 steps (32 pairs), an SSE2 one (16) and 8 a nibble at a time
+#define CODEC_MAX_PAIRS 600
+#define CODEC_RANDOM_RUNS 200000
+#define CODEC_ALIGN 32                    // start anywhere in a 32 byte line
+#define CODEC_GUARD 64                    // bytes after the output which mustn't be touched
+#define CODEC_FRAME_PAIRS 254             // address, a 252 byte PDU and the LRC
+#define CODEC_CAPTURE_PAIRS (512 * 1024)  // 1MB of hex
+#define DEFAULT_SECONDS 0.3
+
+typedef std::chrono::steady_clock Clock;
+
+typedef uint8_t (*DecodeFn)(const uint8_t* hex, size_t n, uint8_t* bytes, uint8_t* lrc);
+typedef void (*EncodeFn)(const uint8_t* bytes, size_t n, uint8_t* hex, uint8_t* lrc);
+
+static const DecodeFn decoders[] = {hex_decode, hex_decode_scalar};
+static const EncodeFn encoders[] = {hex_encode, hex_encode_scalar};
+static const char* const names[] = {"hex_*", "hex_*_scalar"};
+static unsigned long failures = 0;
+static uint32_t random_state = 12345;
+
+static uint32_t next_random() {
+    random_state = random_state * 1103515245UL + 12345UL;
+    return random_state >> 8;
+}
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+//--The reference, the slave's helpers------------------------------------------------------------------------------
+
+static uint8_t reference_decode(const uint8_t* hex, size_t n, uint8_t* bytes, uint8_t* lrc) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        uint8_t hi = ascii_to_uint8(hex[i * 2]);
+        uint8_t lo = ascii_to_uint8(hex[i * 2 + 1]);
+        if ((hi > 15) || (lo > 15)) return 0;
+        bytes[i] = (uint8_t)((hi << 4) | lo);
+        *lrc += bytes[i];
+    }
+    return 1;
+}
+
+static void reference_encode(const uint8_t* bytes, size_t n, uint8_t* hex, uint8_t* lrc) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        hex[i * 2] = UINT8_TO_ASCII(bytes[i] >> 4);
+        hex[i * 2 + 1] = UINT8_TO_ASCII(bytes[i] & 0x0F);
+        *lrc += bytes[i];
+    }
+}
+
+//--Differential checks---------------------------------------------------------------------------------------------
+
+// Decode n pairs from hex (which can be anywhere) with each decoder and compare with the reference. The bytes and
+// LRC only have to match when the characters were all hex.
+static void check_decode(const uint8_t* hex, size_t n, uint8_t start_lrc, const char* what) {
+    static uint8_t expected[CODEC_MAX_PAIRS + CODEC_GUARD];
+    static uint8_t got[CODEC_MAX_PAIRS + CODEC_GUARD];
+    uint8_t expected_lrc = start_lrc;
+    uint8_t lrc;
+    uint8_t expected_valid = reference_decode(hex, n, expected, &expected_lrc);
+    uint8_t valid;
+    size_t i;
+    size_t d;
+
+    for (d = 0; d < 2; d++) {
+        memset(got, 0xA5, sizeof(got));
+        lrc = start_lrc;
+        valid = decoders[d](hex, n, got, &lrc);
+        for (i = n; (i < n + CODEC_GUARD) && (got[i] == 0xA5); i++);
+        if ((valid != expected_valid) || (i != n + CODEC_GUARD) ||
+            (valid && ((lrc != expected_lrc) || (memcmp(got, expected, n) != 0)))) {
+            if (failures++ < 10) {
+                printf("decode %s, %s of %u pairs: valid %u (expected %u), LRC %02X (expected %02X)%s\n", what,
+                       names[d], (unsigned)n, valid, expected_valid, lrc, expected_lrc,
+                       (i != n + CODEC_GUARD) ? ", wrote past the end" : "");
+            }
+        }
+    }
+}
+
+static void check_encode(const uint8_t* bytes, size_t n, uint8_t start_lrc, const char* what) {
+    static uint8_t expected[CODEC_MAX_PAIRS * 2 + CODEC_GUARD];
+    static uint8_t got[CODEC_MAX_PAIRS * 2 + CODEC_GUARD];
+    uint8_t expected_lrc = start_lrc;
+    uint8_t lrc;
+    size_t i;
+    size_t e;
+
+    reference_encode(bytes, n, expected, &expected_lrc);
+    for (e = 0; e < 2; e++) {
+        memset(got, 0xA5, sizeof(got));
+        lrc = start_lrc;
+        encoders[e](bytes, n, got, &lrc);
+        for (i = n * 2; (i < n * 2 + CODEC_GUARD) && (got[i] == 0xA5); i++);
+        if ((lrc != expected_lrc) || (i != n * 2 + CODEC_GUARD) || (memcmp(got, expected, n * 2) != 0)) {
+            if (failures++ < 10) {
+                printf("encode %s, %s of %u bytes: LRC %02X (expected %02X)%s\n", what, names[e], (unsigned)n, lrc,
+                       expected_lrc, (i != n * 2 + CODEC_GUARD) ? ", wrote past the end" : "");
+            }
+        }
+    }
+}
+
+static void random_hex(uint8_t* hex, size_t n) {
+    static const char digits[] = "0123456789ABCDEF";
+    size_t i;
+
+    for (i = 0; i < n * 2; i++) hex[i] = (uint8_t)digits[next_random() & 0x0F];
+}
+
+static void run_checks() {
+    static uint8_t buffer[CODEC_ALIGN + CODEC_MAX_PAIRS * 2];
+    uint8_t run[CODEC_RUN_PAIRS * 2];
+    unsigned long checks = 0;
+    unsigned pair;
+    unsigned at;
+    unsigned ch;
+    unsigned long r;
+    size_t n;
+    uint8_t* start;
+
+    // every pair of characters, each at a different place in the run
+    for (pair = 0; pair < 65536; pair++) {
+        random_hex(run, CODEC_RUN_PAIRS);
+        at = pair % CODEC_RUN_PAIRS;
+        run[at * 2] = (uint8_t)(pair >> 8);
+        run[at * 2 + 1] = (uint8_t)pair;
+        check_decode(run, CODEC_RUN_PAIRS, (uint8_t)pair, "every pair");
+        checks++;
+    }
+    // every character at every position
+    for (ch = 0; ch < 256; ch++) {
+        for (at = 0; at < CODEC_RUN_PAIRS * 2; at++) {
+            random_hex(run, CODEC_RUN_PAIRS);
+            run[at] = (uint8_t)ch;
+            check_decode(run, CODEC_RUN_PAIRS, 0, "every character");
+            checks++;
+        }
+    }
+    // every byte at every position
+    for (ch = 0; ch < 256; ch++) {
+        for (at = 0; at < CODEC_RUN_PAIRS; at++) {
+            for (n = 0; n < CODEC_RUN_PAIRS; n++) run[n] = (uint8_t)next_random();
+            run[at] = (uint8_t)ch;
+            check_encode(run, CODEC_RUN_PAIRS, (uint8_t)at, "every byte");
+            checks++;
+        }
+    }
+    // random lengths and alignments
+    for (r = 0; r < CODEC_RANDOM_RUNS; r++) {
+        n = next_random() % (CODEC_MAX_PAIRS + 1);
+        start = buffer + next_random() % CODEC_ALIGN;
+        random_hex(start, n);
+        if ((r & 1) && (n > 0)) start[next_random() % (n * 2)] = (uint8_t)next_random();
+        check_decode(start, n, (uint8_t)r, "random");
+        for (size_t i = 0; i < n; i++) start[i] = (uint8_t)next_random();
+        check_encode(start, n, (uint8_t)r, "random");
+        checks += 2;
+    }
+    printf("%lu checks of hex_decode/hex_encode (%s) and the _scalar ones against ascii_to_uint8()/UINT8_TO_ASCII: "
+           "%lu different  %s\n", checks * 2, hex_codec_path(), failures, failures ? "FAILED" : "ok");
+}
+
+//--Speed-----------------------------------------------------------------------------------------------------------
+
+// Hex characters a second (in GB/s) through a decoder and an encoder, n pairs at a time, for about seconds each.
+static void measure(size_t n, double seconds, DecodeFn decode, EncodeFn encode, double* decode_gbs, double* encode_gbs) {
+    uint8_t* hex = (uint8_t*)malloc(n * 2);
+    uint8_t* bytes = (uint8_t*)malloc(n);
+    volatile uint8_t sink = 0;
+    uint8_t lrc = 0;
+    unsigned long rounds = 0;
+    unsigned long i;
+    Clock::time_point start;
+
+    random_hex(hex, n);
+    // a batch is about 4MB of hex, so the clock isn't read often
+    unsigned long batch = 1 + (4UL << 20) / (n * 2);
+    start = Clock::now();
+    do {
+        for (i = 0; i < batch; i++) sink = (uint8_t)(sink + decode(hex, n, bytes, &lrc));
+        rounds += batch;
+    } while (seconds_since(start) < seconds);
+    *decode_gbs = (double)rounds * n * 2 / seconds_since(start) / 1e9;
+    rounds = 0;
+    start = Clock::now();
+    do {
+        for (i = 0; i < batch; i++) encode(bytes, n, hex, &lrc);
+        rounds += batch;
+    } while (seconds_since(start) < seconds);
+    *encode_gbs = (double)rounds * n * 2 / seconds_since(start) / 1e9;
+    sink = (uint8_t)(sink + lrc);
+    free(hex);
+    free(bytes);
+}
+
+static void run_speed(const char* what, size_t n, double seconds) {
+    double scalar_decode;
+    double scalar_encode;
+    double decode;
+    double encode;
+
+    measure(n, seconds, hex_decode_scalar, hex_encode_scalar, &scalar_decode, &scalar_encode);
+    measure(n, seconds, hex_decode, hex_encode, &decode, &encode);
+    printf("%-24s decode %6.2f GB/s (scalar %5.2f, x%4.1f)   encode %6.2f GB/s (scalar %5.2f, x%4.1f)\n", what,
+           decode, scalar_decode, decode / scalar_decode, encode, scalar_encode, encode / scalar_encode);
+}
+
+int main(int argc, char** argv) {
+    double seconds = (argc > 1) ? atof(argv[1]) : DEFAULT_SECONDS;
+
+    run_checks();
+    printf("%s path, GB/s of hex characters:\n", hex_codec_path());
+    run_speed("frame, 254 bytes", CODEC_FRAME_PAIRS, seconds);
+    run_speed("capture, 1MB of hex", CODEC_CAPTURE_PAIRS, seconds);
+    return failures ? 1 : 0;
+}
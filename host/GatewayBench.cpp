@@ -0,0 +1,274 @@
+// Loopback load test for the Modbus TCP gateway (host/GatewayDaemon.cpp) running its simulated slaves.
+//
+// Opens BENCH_CLIENTS TCP connections to the gateway, spread over the slaves, and has each of them keep one
+// request outstanding for the given time, like a SCADA client polling as fast as it is answered.
+// Most clients read registers 0x0000-0x0003 and check the values the simulated slaves hold. The first client of
+// each slave writes hr_L_MOTOR_SPEED_SETTING with fn6 and reads it straight back, which checks that the gateway
+// neither reorders a write nor answers the read from a cache older than the write.
+// Then a read which the gateway joins onto another client's is refused by the slave (it runs past the end of the
+// map), BENCH_JOIN_ROUNDS times: the client whose registers are all there must still get them, and only the other
+// one the exception.
+// Prints the requests answered per second, the response times and anything wrong. The gateway prints how many
+// serial transactions it took.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. host/GatewayBench.cpp -o gateway_bench
+//   ./modbus_gateway -n 8 &
+//   ./gateway_bench [seconds] [clients] [port]
+
+#include "AsciiModbusSlave.h"
+#include "host/ModbusGateway.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define BENCH_PORT 5020
+#define BENCH_SLAVES 8                      // must match the gateway's -n
+#define BENCH_CLIENTS 64
+#define BENCH_MAX_CLIENTS 1024
+#define BENCH_SECONDS 5
+#define BENCH_READ_COUNT 4
+#define BENCH_JOIN_ROUNDS 20
+#define BENCH_LAST_REGISTER 0x0018           // the address of the last register in the map, hr_LATENCY_64_UP
+#define BENCH_REPLY_MS 2000
+
+typedef struct BENCHCLIENT {
+   int       fd;
+   uint8_t   slave_id;
+   uint8_t   writer;                         // writes then reads back, the others only read
+   uint8_t   wrote;                          // the write has been answered, the read back is next
+   uint16_t  transaction;
+   uint16_t  value;                          // last value written
+   uint8_t   in[300];
+   size_t    in_len;
+   uint64_t  sent_us;
+}BenchClient;
+
+static BenchClient clients[BENCH_MAX_CLIENTS];
+static unsigned long answered = 0;
+static unsigned long wrong = 0;
+static unsigned long exceptions = 0;
+static uint64_t total_latency_us = 0;
+static uint64_t max_latency_us = 0;
+
+static uint64_t now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint16_t expected_value(int slave_id, int reg) {
+    return (uint16_t)((slave_id - 1) * 0x100 + reg);
+}
+
+static void send_request(BenchClient* c) {
+    uint8_t adu[12];
+
+    c->transaction++;
+    adu[0] = (uint8_t)(c->transaction >> 8);
+    adu[1] = (uint8_t)c->transaction;
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[4] = 0;
+    adu[5] = 6;
+    adu[6] = c->slave_id;
+    if (c->writer && !c->wrote) {
+        c->value++;
+        adu[7] = 0x06;
+        adu[8] = 0;
+        adu[9] = hr_L_MOTOR_SPEED_SETTING;
+        adu[10] = (uint8_t)(c->value >> 8);
+        adu[11] = (uint8_t)c->value;
+    }
+    else {
+        adu[7] = 0x03;
+        adu[8] = 0;
+        adu[9] = c->writer ? hr_L_MOTOR_SPEED_SETTING : 0;
+        adu[10] = 0;
+        adu[11] = c->writer ? 1 : BENCH_READ_COUNT;
+    }
+    c->sent_us = now_us();
+    if (send(c->fd, adu, sizeof(adu), MSG_NOSIGNAL) != (ssize_t)sizeof(adu)) {
+        perror("send");
+        exit(1);
+    }
+}
+
+// A whole response is in c->in, check it.
+static void check_response(BenchClient* c) {
+    const uint8_t* pdu = &c->in[7];
+    uint64_t latency = now_us() - c->sent_us;
+    int i;
+
+    answered++;
+    total_latency_us += latency;
+    if (latency > max_latency_us) max_latency_us = latency;
+    if ((((c->in[0] << 8) | c->in[1]) != c->transaction) || (c->in[6] != c->slave_id)) {
+        wrong++;
+        return;
+    }
+    if (pdu[0] & 0x80) {
+        exceptions++;
+        c->wrote = 0;
+        return;
+    }
+    if (c->writer && !c->wrote) {
+        if ((pdu[0] != 0x06) || (((pdu[3] << 8) | pdu[4]) != c->value)) wrong++;
+        c->wrote = 1;
+        return;
+    }
+    c->wrote = 0;
+    if ((pdu[0] != 0x03) || (pdu[1] != 2 * (c->writer ? 1 : BENCH_READ_COUNT))) {
+        wrong++;
+        return;
+    }
+    if (c->writer) {
+        if (((pdu[2] << 8) | pdu[3]) != c->value) wrong++;
+        return;
+    }
+    // register 0 belongs to the writer
+    for (i = 1; i < BENCH_READ_COUNT; i++) {
+        if (((pdu[2 + 2 * i] << 8) | pdu[3 + 2 * i]) != expected_value(c->slave_id, i)) wrong++;
+    }
+}
+
+static int connect_gateway(const struct sockaddr_in* addr) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+
+    if ((fd < 0) || (connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) < 0)) {
+        perror("can't connect to the gateway");
+        exit(1);
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+static void send_read(int fd, uint16_t transaction, uint8_t slave_id, uint16_t address, uint8_t count) {
+    uint8_t adu[12] = {(uint8_t)(transaction >> 8), (uint8_t)transaction, 0, 0, 0, 6, slave_id, 0x03,
+                       (uint8_t)(address >> 8), (uint8_t)address, 0, count};
+
+    if (send(fd, adu, sizeof(adu), MSG_NOSIGNAL) != (ssize_t)sizeof(adu)) {
+        perror("send");
+        exit(1);
+    }
+}
+
+// Waits for one whole response, exits if there isn't one in BENCH_REPLY_MS.
+static void receive_response(int fd, uint8_t* adu, size_t size) {
+    struct pollfd p = {fd, POLLIN, 0};
+    size_t len = 0;
+    ssize_t n;
+
+    while ((len < 7) || (len < 6 + (size_t)((adu[4] << 8) | adu[5]))) {
+        if ((poll(&p, 1, BENCH_REPLY_MS) <= 0) || ((n = recv(fd, adu + len, size - len, 0)) <= 0)) {
+            fprintf(stderr, "no response from the gateway\n");
+            exit(1);
+        }
+        len += n;
+    }
+}
+
+// A read of another slave goes on the bus first, so A's and B's reads of slave 1 queue behind it and B's is
+// joined onto A's. A reads the last two registers, B the last one and the one after it, which isn't there. The
+// rounds are a cache lifetime apart so A is never answered from the cache.
+static void check_refused_join(const struct sockaddr_in* addr) {
+    uint8_t adu[300];
+    unsigned long a_answered = 0;
+    unsigned long b_refused = 0;
+    uint16_t round;
+    int fd[3];
+    int i;
+
+    for (i = 0; i < 3; i++) fd[i] = connect_gateway(addr);
+    for (round = 0; round < BENCH_JOIN_ROUNDS; round++) {
+        usleep(2 * GATEWAY_CACHE_TTL_US);
+        send_read(fd[0], round, 2, 0, BENCH_READ_COUNT);
+        send_read(fd[1], round, 1, BENCH_LAST_REGISTER - 1, 2);
+        send_read(fd[2], round, 1, BENCH_LAST_REGISTER, 2);
+        receive_response(fd[0], adu, sizeof(adu));
+        receive_response(fd[1], adu, sizeof(adu));
+        if ((adu[7] == 0x03) && (adu[8] == 4)) a_answered++;
+        receive_response(fd[2], adu, sizeof(adu));
+        if ((adu[7] == 0x83) && (adu[8] == EXCEPTION_ILLEGAL_DATA_ADDRESS)) b_refused++;
+    }
+    if ((a_answered != BENCH_JOIN_ROUNDS) || (b_refused != BENCH_JOIN_ROUNDS)) wrong++;
+    printf("joined read refused: %d rounds, the good part answered %lu, the bad part refused %lu  %s\n",
+           BENCH_JOIN_ROUNDS, a_answered, b_refused,
+           ((a_answered == BENCH_JOIN_ROUNDS) && (b_refused == BENCH_JOIN_ROUNDS)) ? "ok" : "WRONG");
+    for (i = 0; i < 3; i++) close(fd[i]);
+}
+
+int main(int argc, char** argv) {
+    struct pollfd fds[BENCH_MAX_CLIENTS];
+    struct sockaddr_in addr;
+    unsigned long seconds = BENCH_SECONDS;
+    int num_clients = BENCH_CLIENTS;
+    uint16_t port = BENCH_PORT;
+    uint64_t start;
+    uint64_t end;
+    int i;
+
+    if (argc > 1) seconds = strtoul(argv[1], NULL, 0);
+    if (argc > 2) num_clients = (int)strtol(argv[2], NULL, 0);
+    if (argc > 3) port = (uint16_t)strtoul(argv[3], NULL, 0);
+    if ((num_clients <= 0) || (num_clients > BENCH_MAX_CLIENTS)) num_clients = BENCH_CLIENTS;
+    if (seconds == 0) seconds = BENCH_SECONDS;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (i = 0; i < num_clients; i++) {
+        BenchClient* c = &clients[i];
+        c->fd = connect_gateway(&addr);
+        c->slave_id = (uint8_t)(i % BENCH_SLAVES + 1);
+        c->writer = (i < BENCH_SLAVES);
+        fds[i].fd = c->fd;
+        fds[i].events = POLLIN;
+    }
+
+    start = now_us();
+    end = start + seconds * 1000000ULL;
+    for (i = 0; i < num_clients; i++) send_request(&clients[i]);
+    while (now_us() < end) {
+        if (poll(fds, num_clients, 10) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+        for (i = 0; i < num_clients; i++) {
+            BenchClient* c = &clients[i];
+            ssize_t n;
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+            if (n <= 0) {
+                fprintf(stderr, "client %d: the gateway closed the connection\n", i);
+                return 1;
+            }
+            c->in_len += n;
+            while ((c->in_len >= 7) && (c->in_len >= 6 + (size_t)((c->in[4] << 8) | c->in[5]))) {
+                size_t len = 6 + ((c->in[4] << 8) | c->in[5]);
+                check_response(c);
+                memmove(c->in, c->in + len, c->in_len - len);
+                c->in_len -= len;
+                send_request(c);
+            }
+        }
+    }
+
+    printf("%d clients, %lu seconds: %8.0f requests/s  response %6.2f mS average %6.2f mS max  %lu exceptions  "
+           "%lu wrong\n", num_clients, seconds, answered / ((now_us() - start) / 1e6),
+           answered ? total_latency_us / 1000.0 / answered : 0.0, max_latency_us / 1000.0, exceptions, wrong);
+    for (i = 0; i < num_clients; i++) close(clients[i].fd);
+    check_refused_join(&addr);
+    return wrong ? 1 : 0;
+}
@@ -0,0 +1,424 @@
+// Modbus TCP to Modbus ASCII serial gateway daemon (ModbusGateway.h) on a Linux epoll loop.
+//
+// Listens for Modbus TCP clients and passes their requests to the controllers on a serial port, or, with no port
+// given, to simulated slaves (AsciiModbusSlave contexts) on an in-memory bus so it can be tried out and
+// benchmarked on loopback (host/GatewayBench.cpp). Simulated slave n (IDs 1, 2, 3 ...) holds (n - 1) * 0x100 + r
+// in holding register r, for the registers with no hook.
+// The gateway's counters are printed to stderr every GATEWAY_STATS_SECONDS when they have changed.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/ModbusMaster.cpp host/HexCodec.cpp
+//       host/ModbusGateway.cpp host/GatewayDaemon.cpp -o modbus_gateway
+//   ./modbus_gateway [-p tcp_port] [-d /dev/ttyUSB0] [-b baud] [-n simulated_slaves] [-t cache_ttl_us] [-j 0|1]
+// -t 0 turns the cache off and -j 0 stops reads from different clients being joined.
+
+#include "AsciiModbusSlave.h"
+#include "host/ModbusGateway.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <termios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define GATEWAY_PORT 5020
+#define GATEWAY_BAUD 57600
+#define GATEWAY_SIM_SLAVES 8
+#define GATEWAY_MAX_CLIENTS 256
+#define GATEWAY_OUT_SIZE 8192               // replies a client hasn't taken yet, it is dropped if this fills
+#define GATEWAY_POLL_MS 1                   // the longest epoll_wait(), for timeouts and the simulated bus
+#define GATEWAY_STATS_SECONDS 5
+#define GATEWAY_SERIAL_LATENCY_US 20000     // allowed for a USB serial adapter, see ModbusMaster.latency_us
+#define SIM_WIRE_SIZE 4096
+
+typedef struct CLIENT {
+   int       fd;                             // -1 for a free slot
+   uint8_t   in[GATEWAY_ADU_SIZE];           // a request coming in
+   size_t    in_len;
+   uint8_t   out[GATEWAY_OUT_SIZE];
+   size_t    out_len;
+}Client;
+
+// the simulated RS485 bus, like host/MasterBench.cpp
+typedef struct SIMBUS {
+   ModbusSlave* slaves;
+   int       num_slaves;
+   uint8_t   wire[SIM_WIRE_SIZE];            // gateway to slaves, not gone down the wire yet
+   size_t    head;
+   size_t    tail;
+   uint64_t  chars;                          // character times simulated so far
+   uint32_t  tick_ns;
+}SimBus;
+
+static Client clients[GATEWAY_MAX_CLIENTS];
+static ModbusGateway gateway;
+static SimBus sim;
+static int epoll_fd;
+static int serial_fd = -1;
+static uint32_t baud = GATEWAY_BAUD;
+static volatile sig_atomic_t stop = 0;
+
+static uint64_t real_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// The gateway's clock. With the simulated bus it is the bus's own time, which is kept up with real time.
+static uint64_t now_us() {
+    if (serial_fd >= 0) return real_us();
+    return sim.chars * 10000000ULL / baud;
+}
+
+static void on_signal(int) {
+    stop = 1;
+}
+
+//----Simulated slaves-----------------
+
+static void sim_send(void*, const uint8_t* data, size_t len) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (sim.head - sim.tail >= SIM_WIRE_SIZE) return;
+        sim.wire[sim.head++ % SIM_WIRE_SIZE] = data[i];
+    }
+}
+
+static int sim_init(int num_slaves) {
+    int s;
+    int r;
+
+    sim.slaves = (ModbusSlave*)calloc(num_slaves, sizeof(ModbusSlave));
+    if (!sim.slaves) return -1;
+    sim.num_slaves = num_slaves;
+    for (s = 0; s < num_slaves; s++) {
+        modbus_slave_init(&sim.slaves[s], (uint8_t)(s + 1), MODBUS_ASCII, NULL);
+        for (r = hr_L_MOTOR_SPEED_SETTING; r <= hr_R_MOTOR_SPEED_SETTING; r++) {
+            modbus_slave_write_register(&sim.slaves[s], (uint8_t)r, (uint16_t)(s * 0x100 + r));
+        }
+        MODBUS_SLAVE_ISR_MEASURED(&sim.slaves[s], isr_hr_L_MOTOR_SPEED_MEASURED, s * 0x100 + hr_L_MOTOR_SPEED_MEASURED);
+        MODBUS_SLAVE_ISR_MEASURED(&sim.slaves[s], isr_hr_R_MOTOR_SPEED_MEASURED, s * 0x100 + hr_R_MOTOR_SPEED_MEASURED);
+    }
+    return 0;
+}
+
+// Move the bus on, a character time at a time, until it has caught up with real time.
+static void sim_run(uint64_t start_us) {
+    uint64_t target = (real_us() - start_us) * baud / 10000000ULL;
+    int s;
+
+    while (sim.chars < target) {
+        uint64_t at_us = sim.chars * 10000000ULL / baud;
+        int talking = 0;
+
+        if (sim.head != sim.tail) {
+            uint8_t byte = sim.wire[sim.tail++ % SIM_WIRE_SIZE];
+            for (s = 0; s < sim.num_slaves; s++) modbus_slave_rx_byte(&sim.slaves[s], byte);
+            talking++;
+        }
+        for (s = 0; s < sim.num_slaves; s++) {
+            int16_t byte;
+            if (modbus_slave_tx_idle(&sim.slaves[s])) continue;
+            byte = modbus_slave_tx_byte(&sim.slaves[s]);
+            if (++talking == 1) modbus_gateway_rx_byte(&gateway, (uint8_t)byte, at_us);
+        }
+        sim.tick_ns += (uint32_t)(10000000000ULL / baud);
+        while (sim.tick_ns >= MASTER_TICK_US * 1000) {
+            sim.tick_ns -= MASTER_TICK_US * 1000;
+            for (s = 0; s < sim.num_slaves; s++) MODBUS_SLAVE_UPDATE_TIMER(&sim.slaves[s]);
+        }
+        for (s = 0; s < sim.num_slaves; s++) modbus_slave_update(&sim.slaves[s]);
+        sim.chars++;
+        modbus_gateway_run(&gateway, sim.chars * 10000000ULL / baud);
+    }
+}
+
+//----Serial port----------------------
+
+static void serial_send(void*, const uint8_t* data, size_t len) {
+    // a request is at most a few hundred bytes, the driver's buffer takes it whole
+    if (write(serial_fd, data, len) != (ssize_t)len) perror("serial write");
+}
+
+static speed_t serial_speed(uint32_t rate) {
+    switch (rate) {
+      case 9600: return B9600;
+      case 19200: return B19200;
+      case 38400: return B38400;
+      case 57600: return B57600;
+      case 115200: return B115200;
+      case 230400: return B230400;
+      case 460800: return B460800;
+      case 500000: return B500000;
+      case 921600: return B921600;
+      case 1000000: return B1000000;
+      default: return B0;
+    }
+}
+
+static int serial_open(const char* device) {
+    struct termios tio;
+    int fd = open(device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+
+    if (fd < 0) return -1;
+    if (tcgetattr(fd, &tio) < 0) {
+        close(fd);
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tio.c_cflag |= CLOCAL | CREAD;
+    cfsetispeed(&tio, serial_speed(baud));
+    cfsetospeed(&tio, serial_speed(baud));
+    if ((serial_speed(baud) == B0) || (tcsetattr(fd, TCSANOW, &tio) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void serial_read() {
+    uint8_t buffer[256];
+    ssize_t n;
+    ssize_t i;
+
+    while ((n = read(serial_fd, buffer, sizeof(buffer))) > 0) {
+        uint64_t now = real_us();
+        for (i = 0; i < n; i++) modbus_gateway_rx_byte(&gateway, buffer[i], now);
+    }
+}
+
+//----TCP clients----------------------
+
+static void client_close(int c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, clients[c].fd, NULL);
+    close(clients[c].fd);
+    clients[c].fd = -1;
+    modbus_gateway_client_closed(&gateway, c);
+}
+
+static void client_flush(int c) {
+    Client* cl = &clients[c];
+    struct epoll_event ev;
+    ssize_t n = 0;
+
+    while (cl->out_len) {
+        n = send(cl->fd, cl->out, cl->out_len, MSG_NOSIGNAL);
+        if (n <= 0) break;
+        memmove(cl->out, cl->out + n, cl->out_len - n);
+        cl->out_len -= n;
+    }
+    if ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && cl->out_len) {
+        client_close(c);
+        return;
+    }
+    ev.events = cl->out_len ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.u32 = (uint32_t)c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cl->fd, &ev);
+}
+
+static void gateway_reply(void*, int c, const uint8_t* adu, size_t len) {
+    Client* cl = &clients[c];
+
+    if (cl->fd < 0) return;
+    if (cl->out_len + len > GATEWAY_OUT_SIZE) {
+        client_close(c);                            // not reading its replies
+        return;
+    }
+    memcpy(cl->out + cl->out_len, adu, len);
+    cl->out_len += len;
+    client_flush(c);
+}
+
+static void client_accept(int listen_fd) {
+    struct epoll_event ev;
+    int one = 1;
+    int fd;
+    int c;
+
+    while ((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+        for (c = 0; (c < GATEWAY_MAX_CLIENTS) && (clients[c].fd >= 0); c++);
+        if (c == GATEWAY_MAX_CLIENTS) {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        clients[c].fd = fd;
+        clients[c].in_len = 0;
+        clients[c].out_len = 0;
+        ev.events = EPOLLIN;
+        ev.data.u32 = (uint32_t)c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+// Read what the client has sent and pass each whole request to the gateway.
+static void client_read(int c) {
+    Client* cl = &clients[c];
+    uint8_t buffer[4096];
+    ssize_t n;
+    ssize_t i;
+
+    while ((n = recv(cl->fd, buffer, sizeof(buffer), 0)) > 0) {
+        for (i = 0; i < n; i++) {
+            size_t need;
+            cl->in[cl->in_len++] = buffer[i];
+            if (cl->in_len < GATEWAY_MBAP_SIZE) continue;
+            need = 6 + (((size_t)cl->in[4] << 8) | cl->in[5]);   // the length counts from the unit ID
+            if ((need <= GATEWAY_MBAP_SIZE) || (need > GATEWAY_ADU_SIZE)) {
+                client_close(c);
+                return;
+            }
+            if (cl->in_len < need) continue;
+            if (modbus_gateway_request(&gateway, c, cl->in, cl->in_len, now_us()) < 0) {
+                client_close(c);
+                return;
+            }
+            if (cl->fd < 0) return;                 // closed by gateway_reply()
+            cl->in_len = 0;
+        }
+    }
+    if ((n == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) client_close(c);
+}
+
+static int listen_on(uint16_t port) {
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(fd, 128) < 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void print_stats() {
+    static GatewayStats last;
+    GatewayStats* s = &gateway.stats;
+
+    if (memcmp(s, &last, sizeof(last)) == 0) return;
+    fprintf(stderr, "%u requests  %u cache hits  %u joined  %u split  %u serial transactions  %u timeouts  %u busy  "
+            "%u bad\n", s->requests, s->cache_hits, s->joined, s->split, s->transactions, s->timeouts, s->busy,
+            s->bad_requests);
+    last = *s;
+}
+
+// the event numbers above the client slots
+#define EVENT_LISTEN GATEWAY_MAX_CLIENTS
+#define EVENT_SERIAL (GATEWAY_MAX_CLIENTS + 1)
+
+int main(int argc, char** argv) {
+    struct epoll_event events[64];
+    struct epoll_event ev;
+    const char* device = NULL;
+    uint16_t port = GATEWAY_PORT;
+    int num_slaves = GATEWAY_SIM_SLAVES;
+    uint32_t ttl_us = GATEWAY_CACHE_TTL_US;
+    int join = 1;
+    uint64_t start_us;
+    uint64_t stats_us;
+    int listen_fd;
+    int opt;
+    int c;
+    int i;
+    int n;
+
+    while ((opt = getopt(argc, argv, "p:d:b:n:t:j:")) != -1) {
+        switch (opt) {
+          case 'p': port = (uint16_t)strtoul(optarg, NULL, 0); break;
+          case 'd': device = optarg; break;
+          case 'b': baud = (uint32_t)strtoul(optarg, NULL, 0); break;
+          case 'n': num_slaves = (int)strtol(optarg, NULL, 0); break;
+          case 't': ttl_us = (uint32_t)strtoul(optarg, NULL, 0); break;
+          case 'j': join = (int)strtol(optarg, NULL, 0); break;
+          default:
+            fprintf(stderr, "usage: %s [-p tcp_port] [-d serial_device] [-b baud] [-n simulated_slaves] "
+                            "[-t cache_ttl_us] [-j 0|1]\n", argv[0]);
+            return 1;
+        }
+    }
+    if ((baud == 0) || (num_slaves <= 0)) {
+        fprintf(stderr, "bad baud rate or number of slaves\n");
+        return 1;
+    }
+
+    for (c = 0; c < GATEWAY_MAX_CLIENTS; c++) clients[c].fd = -1;
+    epoll_fd = epoll_create1(0);
+    listen_fd = listen_on(port);
+    if ((epoll_fd < 0) || (listen_fd < 0)) {
+        perror("can't listen");
+        return 1;
+    }
+    ev.events = EPOLLIN;
+    ev.data.u32 = EVENT_LISTEN;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+    if (device) {
+        serial_fd = serial_open(device);
+        if (serial_fd < 0) {
+            fprintf(stderr, "can't open %s at %u baud\n", device, baud);
+            return 1;
+        }
+        ev.events = EPOLLIN;
+        ev.data.u32 = EVENT_SERIAL;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, serial_fd, &ev);
+        modbus_gateway_init(&gateway, baud, MODBUS_DELAY, serial_send, NULL, gateway_reply, NULL);
+        gateway.master.latency_us = GATEWAY_SERIAL_LATENCY_US;
+        fprintf(stderr, "port %u, %s at %u baud\n", port, device, baud);
+    }
+    else {
+        if (sim_init(num_slaves) < 0) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        modbus_gateway_init(&gateway, baud, MODBUS_DELAY, sim_send, NULL, gateway_reply, NULL);
+        fprintf(stderr, "port %u, %d simulated slaves at %u baud\n", port, num_slaves, baud);
+    }
+    gateway.ttl_us = ttl_us;
+    gateway.join_reads = (uint8_t)(join != 0);
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    start_us = real_us();
+    stats_us = start_us;
+    while (!stop) {
+        n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), GATEWAY_POLL_MS);
+        if (serial_fd < 0) sim_run(start_us);
+        for (i = 0; i < n; i++) {
+            uint32_t e = events[i].data.u32;
+            if (e == EVENT_LISTEN) client_accept(listen_fd);
+            else if (e == EVENT_SERIAL) serial_read();
+            else if (clients[e].fd >= 0) {
+                if (events[i].events & EPOLLOUT) client_flush((int)e);
+                if ((clients[e].fd >= 0) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) client_read((int)e);
+            }
+        }
+        modbus_gateway_run(&gateway, now_us());
+        if (real_us() - stats_us >= GATEWAY_STATS_SECONDS * 1000000ULL) {
+            print_stats();
+            stats_us = real_us();
+        }
+    }
+    print_stats();
+    for (c = 0; c < GATEWAY_MAX_CLIENTS; c++) {
+        if (clients[c].fd >= 0) close(clients[c].fd);
+    }
+    close(listen_fd);
+    if (serial_fd >= 0) close(serial_fd);
+    free(sim.slaves);
+    return 0;
+}
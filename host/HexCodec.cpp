@@ -0,0 +1,217 @@
+// Bulk ASCII hex codec, see HexCodec.h
+
+#include "HexCodec.h"
+#include "ModbusCodec.h"
+
+#if HEX_CODEC_SIMD && defined(__AVX2__)
+#define HEX_CODEC_PATH "avx2"
+#include <immintrin.h>
+#elif HEX_CODEC_SIMD && defined(__SSE2__)
+#define HEX_CODEC_PATH "sse2"
+#include <emmintrin.h>
+#else
+#define HEX_CODEC_PATH "scalar"
+#endif
+
+uint8_t hex_decode_scalar(const uint8_t* hex, size_t n, uint8_t* bytes, uint8_t* lrc) {
+    uint8_t sum = *lrc;
+    uint8_t hi;
+    uint8_t lo;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        hi = ascii_to_uint8(hex[i * 2]);
+        lo = ascii_to_uint8(hex[i * 2 + 1]);
+        if ((hi > 15) || (lo > 15)) {
+            *lrc = sum;
+            return 0;
+        }
+        bytes[i] = (uint8_t)((hi << 4) | lo);
+        sum += bytes[i];
+    }
+    *lrc = sum;
+    return 1;
+}
+
+void hex_encode_scalar(const uint8_t* bytes, size_t n, uint8_t* hex, uint8_t* lrc) {
+    uint8_t sum = *lrc;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        hex[i * 2] = UINT8_TO_ASCII(bytes[i] >> 4);
+        hex[i * 2 + 1] = UINT8_TO_ASCII(bytes[i] & 0x0F);
+        sum += bytes[i];
+    }
+    *lrc = sum;
+}
+
+const char* hex_codec_path() {
+    return HEX_CODEC_PATH;
+}
+
+#if HEX_CODEC_SIMD && defined(__SSE2__)
+//--SSE2, 32 characters (16 bytes) a step--------------------------------------------------------------------------
+
+// Characters to nibbles, each 0..15 in its own byte, and clears *valid if any of them isn't hex. The compares are
+// signed, so characters over 127 are below '0' and never hex.
+static inline __m128i sse2_nibbles(__m128i c, int* valid) {
+    __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(c, _mm_set1_epi8('F' + 1)));
+
+    if (_mm_movemask_epi8(_mm_or_si128(digit, letter)) != 0xFFFF) *valid = 0;
+    return _mm_or_si128(_mm_and_si128(digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                        _mm_and_si128(letter, _mm_sub_epi8(c, _mm_set1_epi8('A' - 10))));
+}
+
+// Each pair of nibbles (high first) to a byte, in the low half of its 16 bit word.
+static inline __m128i sse2_pairs(__m128i nibbles) {
+    return _mm_or_si128(_mm_and_si128(_mm_slli_epi16(nibbles, 4), _mm_set1_epi16(0x00F0)), _mm_srli_epi16(nibbles, 8));
+}
+
+// 0..15 to '0'..'9', 'A'..'F'.
+static inline __m128i sse2_hex(__m128i nibbles) {
+    __m128i letter = _mm_and_si128(_mm_cmpgt_epi8(nibbles, _mm_set1_epi8(9)), _mm_set1_epi8('A' - '9' - 1));
+
+    return _mm_add_epi8(_mm_add_epi8(nibbles, _mm_set1_epi8('0')), letter);
+}
+
+// As many whole steps as there are in n, returns the number of pairs done. The LRC is added up with sad, which
+// sums 8 bytes at a time into 64 bits.
+static size_t sse2_decode(const uint8_t* hex, size_t n, uint8_t* bytes, uint8_t* lrc, int* valid) {
+    __m128i sum = _mm_setzero_si128();
+    __m128i out;
+    uint64_t lanes[2];
+    size_t i = 0;
+
+    for (; (i + 16 <= n) && *valid; i += 16) {
+        out = _mm_packus_epi16(sse2_pairs(sse2_nibbles(_mm_loadu_si128((const __m128i*)(hex + i * 2)), valid)),
+                               sse2_pairs(sse2_nibbles(_mm_loadu_si128((const __m128i*)(hex + i * 2 + 16)), valid)));
+        _mm_storeu_si128((__m128i*)(bytes + i), out);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(out, _mm_setzero_si128()));
+    }
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    *lrc = (uint8_t)(*lrc + lanes[0] + lanes[1]);
+    return i;
+}
+
+static size_t sse2_encode(const uint8_t* bytes, size_t n, uint8_t* hex, uint8_t* lrc) {
+    __m128i sum = _mm_setzero_si128();
+    __m128i in;
+    __m128i hi;
+    __m128i lo;
+    uint64_t lanes[2];
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        in = _mm_loadu_si128((const __m128i*)(bytes + i));
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(in, _mm_setzero_si128()));
+        hi = sse2_hex(_mm_and_si128(_mm_srli_epi16(in, 4), _mm_set1_epi8(0x0F)));
+        lo = sse2_hex(_mm_and_si128(in, _mm_set1_epi8(0x0F)));
+        _mm_storeu_si128((__m128i*)(hex + i * 2), _mm_unpacklo_epi8(hi, lo));
+        _mm_storeu_si128((__m128i*)(hex + i * 2 + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+    _mm_storeu_si128((__m128i*)lanes, sum);
+    *lrc = (uint8_t)(*lrc + lanes[0] + lanes[1]);
+    return i;
+}
+#endif
+
+#if HEX_CODEC_SIMD && defined(__AVX2__)
+//--AVX2, 64 characters (32 bytes) a step--------------------------------------------------------------------------
+
+// As the SSE2 ones above, 256 bits at a time.
+static inline __m256i avx2_nibbles(__m256i c, int* valid) {
+    __m256i digit = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('0' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), c));
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8('A' - 1)),
+                                      _mm256_cmpgt_epi8(_mm256_set1_epi8('F' + 1), c));
+
+    if (_mm256_movemask_epi8(_mm256_or_si256(digit, letter)) != -1) *valid = 0;
+    return _mm256_or_si256(_mm256_and_si256(digit, _mm256_sub_epi8(c, _mm256_set1_epi8('0'))),
+                           _mm256_and_si256(letter, _mm256_sub_epi8(c, _mm256_set1_epi8('A' - 10))));
+}
+
+static inline __m256i avx2_pairs(__m256i nibbles) {
+    return _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(nibbles, 4), _mm256_set1_epi16(0x00F0)),
+                           _mm256_srli_epi16(nibbles, 8));
+}
+
+static inline __m256i avx2_hex(__m256i nibbles) {
+    __m256i letter = _mm256_and_si256(_mm256_cmpgt_epi8(nibbles, _mm256_set1_epi8(9)), _mm256_set1_epi8('A' - '9' - 1));
+
+    return _mm256_add_epi8(_mm256_add_epi8(nibbles, _mm256_set1_epi8('0')), letter);
+}
+
+static size_t avx2_decode(const uint8_t* hex, size_t n, uint8_t* bytes, uint8_t* lrc, int* valid) {
+    __m256i sum = _mm256_setzero_si256();
+    __m256i out;
+    uint64_t lanes[4];
+    size_t i = 0;
+
+    for (; (i + 32 <= n) && *valid; i += 32) {
+        // packus works on each 128 bit half, which leaves the 8 byte quarters as 0, 2, 1, 3
+        out = _mm256_packus_epi16(
+                avx2_pairs(avx2_nibbles(_mm256_loadu_si256((const __m256i*)(hex + i * 2)), valid)),
+                avx2_pairs(avx2_nibbles(_mm256_loadu_si256((const __m256i*)(hex + i * 2 + 32)), valid)));
+        out = _mm256_permute4x64_epi64(out, 0xD8);
+        _mm256_storeu_si256((__m256i*)(bytes + i), out);
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(out, _mm256_setzero_si256()));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    *lrc = (uint8_t)(*lrc + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    return i;
+}
+
+static size_t avx2_encode(const uint8_t* bytes, size_t n, uint8_t* hex, uint8_t* lrc) {
+    __m256i sum = _mm256_setzero_si256();
+    __m256i in;
+    __m256i hi;
+    __m256i lo;
+    __m256i first;
+    __m256i second;
+    uint64_t lanes[4];
+    size_t i = 0;
+
+    for (; i + 32 <= n; i += 32) {
+        in = _mm256_loadu_si256((const __m256i*)(bytes + i));
+        sum = _mm256_add_epi64(sum, _mm256_sad_epu8(in, _mm256_setzero_si256()));
+        hi = avx2_hex(_mm256_and_si256(_mm256_srli_epi16(in, 4), _mm256_set1_epi8(0x0F)));
+        lo = avx2_hex(_mm256_and_si256(in, _mm256_set1_epi8(0x0F)));
+        // unpack works on each 128 bit half too: bytes 0-7 and 16-23 in first, 8-15 and 24-31 in second
+        first = _mm256_unpacklo_epi8(hi, lo);
+        second = _mm256_unpackhi_epi8(hi, lo);
+        _mm256_storeu_si256((__m256i*)(hex + i * 2), _mm256_permute2x128_si256(first, second, 0x20));
+        _mm256_storeu_si256((__m256i*)(hex + i * 2 + 32), _mm256_permute2x128_si256(first, second, 0x31));
+    }
+    _mm256_storeu_si256((__m256i*)lanes, sum);
+    *lrc = (uint8_t)(*lrc + lanes[0] + lanes[1] + lanes[2] + lanes[3]);
+    return i;
+}
+#endif
+
+// The widest steps there are, then narrower ones, then a nibble at a time for what is left.
+uint8_t hex_decode(const uint8_t* hex, size_t n, uint8_t* bytes, uint8_t* lrc) {
+    size_t done = 0;
+    int valid = 1;
+
+#if HEX_CODEC_SIMD && defined(__AVX2__)
+    done += avx2_decode(hex, n, bytes, lrc, &valid);
+#endif
+#if HEX_CODEC_SIMD && defined(__SSE2__)
+    if (valid) done += sse2_decode(hex + done * 2, n - done, bytes + done, lrc, &valid);
+#endif
+    if (!valid) return 0;
+    return hex_decode_scalar(hex + done * 2, n - done, bytes + done, lrc);
+}
+
+void hex_encode(const uint8_t* bytes, size_t n, uint8_t* hex, uint8_t* lrc) {
+    size_t done = 0;
+
+#if HEX_CODEC_SIMD && defined(__AVX2__)
+    done += avx2_encode(bytes, n, hex, lrc);
+#endif
+#if HEX_CODEC_SIMD && defined(__SSE2__)
+    done += sse2_encode(bytes + done, n - done, hex + done * 2, lrc);
+#endif
+    hex_encode_scalar(bytes + done, n - done, hex + done * 2, lrc);
+}
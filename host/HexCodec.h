@@ -0,0 +1,36 @@
+#ifndef HEX_CODEC_H
+#define HEX_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Bulk ASCII hex codec for the host side (masters, gateways, replaying captures). Converts a whole frame's worth
+// of hex characters to bytes, or bytes to hex, and adds up the LRC in the same pass, giving exactly what
+// ascii_to_uint8() and UINT8_TO_ASCII (ModbusCodec.h) give a nibble at a time: only '0'..'9' and 'A'..'F' are hex,
+// and hex is sent in upper case. Nothing here is used by the AVR build.
+//
+// The vector path is picked when compiling: AVX2 if the compiler is allowed it (-mavx2 or -march=native), SSE2
+// otherwise on x86 (always there on x86-64), the nibble at a time code on anything else or with
+// -DHEX_CODEC_SIMD=0. A step does 64 (AVX2) or 32 (SSE2) characters, AVX2 finishes with an SSE2 step if it can and
+// the scalar code does the rest, so a frame of any length and alignment is fine.
+// host/CodecBench.cpp checks every path against the slave's helpers and measures them:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/HexCodec.cpp host/CodecBench.cpp -o codec_bench
+
+#ifndef HEX_CODEC_SIMD
+#define HEX_CODEC_SIMD 1
+#endif
+
+// n pairs of hex characters to n bytes, each added to *lrc. Returns 1 if every character was hex, 0 if not (bytes
+// and *lrc are then only part done).
+uint8_t hex_decode(const uint8_t* hex, size_t n, uint8_t* bytes, uint8_t* lrc);
+// n bytes to 2 * n upper case hex characters, each byte added to *lrc.
+void hex_encode(const uint8_t* bytes, size_t n, uint8_t* hex, uint8_t* lrc);
+
+// The same a nibble at a time, whatever the path, for checking and benchmarking the vector path against.
+uint8_t hex_decode_scalar(const uint8_t* hex, size_t n, uint8_t* bytes, uint8_t* lrc);
+void hex_encode_scalar(const uint8_t* bytes, size_t n, uint8_t* hex, uint8_t* lrc);
+
+// "avx2", "sse2" or "scalar", the path hex_decode() and hex_encode() were built with.
+const char* hex_codec_path();
+
+#endif
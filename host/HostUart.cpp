@@ -0,0 +1,148 @@
+#include "../AsciiModbusSlave.h"
+#include <chrono>
+#include <string.h>
+
+// Host loopback backend for AsciiModbusSlave, see HostUart.h
+
+#define QUEUE_MASK (HOST_UART_QUEUE_SIZE - 1)
+
+typedef struct HOSTQUEUE {
+   uint8_t  data[HOST_UART_QUEUE_SIZE];
+   uint32_t head;                           // next free slot, only ever incremented by the writer
+   uint32_t tail;                           // next byte to read, only ever incremented by the reader
+}HostQueue;
+
+static HostQueue rx;                        // master to slave
+static HostQueue tx;                        // slave to master
+
+uint8_t host_uart_tx_enable = 0;
+uint8_t host_uart_tx_interrupt = 0;
+static uint8_t shifting = 0;                // a byte is in the transmit shift register
+
+#define QUEUE_COUNT(q) ((q).head - (q).tail)
+
+static uint8_t host_uart_ready_to_send();
+
+void host_uart_reset() {
+    rx.head = rx.tail = 0;
+    tx.head = tx.tail = 0;
+    host_uart_tx_enable = 0;
+    host_uart_tx_interrupt = 0;
+    shifting = 0;
+}
+
+void host_uart_interrupts(uint16_t char_times) {
+    while (char_times--) {
+        if (QUEUE_COUNT(rx) != 0) modbus_uart_rx_isr();
+        if (host_uart_tx_interrupt && host_uart_ready_to_send()) {
+            modbus_uart_udre_isr();
+            shifting = 1;
+        }
+        else if (shifting) {
+            // the last byte has left the shift register and nothing followed it. 
+            shifting = 0;
+            modbus_uart_txc_isr();
+        }
+    }
+}
+
+uint8_t host_uart_byte_available() {
+    return (QUEUE_COUNT(rx) != 0);
+}
+
+static uint8_t host_uart_ready_to_send() {
+    return (QUEUE_COUNT(tx) < HOST_UART_QUEUE_SIZE);
+}
+
+uint8_t host_uart_get_byte() {
+    // like reading UDR0 with nothing received, returns whatever is lying around. 
+    if (QUEUE_COUNT(rx) == 0) return 0;
+    return rx.data[rx.tail++ & QUEUE_MASK];
+}
+
+void host_uart_send_byte(uint8_t data) {
+    // like writing UDR0 when it isn't ready, the byte is lost. 
+    if (QUEUE_COUNT(tx) >= HOST_UART_QUEUE_SIZE) return;
+    tx.data[tx.head++ & QUEUE_MASK] = data;
+}
+
+uint16_t host_profile_clock() {
+    // 8 cycles per uS like the ATMEGA328 at 8MHz, so the numbers read the same as on the board. 
+    return (uint16_t)(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now().time_since_epoch()).count() / 125);
+}
+
+// The EEPROM starts out erased, as a new chip would, the first time it is used. 
+uint8_t host_eeprom[HOST_EEPROM_SIZE];
+uint32_t host_eeprom_writes[HOST_EEPROM_SIZE];
+uint32_t host_eeprom_collisions = 0;
+static uint8_t eeprom_ready = 0;
+static uint32_t eeprom_write_left_us = 0;   // time until the write in progress is done, 0 when there isn't one
+static uint16_t eeprom_write_address;
+static uint8_t eeprom_write_data;
+
+void host_eeprom_erase() {
+    memset(host_eeprom, 0xFF, sizeof(host_eeprom));
+    memset(host_eeprom_writes, 0, sizeof(host_eeprom_writes));
+    host_eeprom_collisions = 0;
+    eeprom_write_left_us = 0;
+    eeprom_ready = 1;
+}
+
+uint8_t host_eeprom_busy() {
+    return (eeprom_write_left_us != 0);
+}
+
+uint8_t host_eeprom_read(uint16_t address) {
+    if (!eeprom_ready) host_eeprom_erase();
+    return host_eeprom[address % HOST_EEPROM_SIZE];
+}
+
+// The byte has its new value once the write is done, nothing reads it before then as the AVR can't. 
+void host_eeprom_write(uint16_t address, uint8_t data) {
+    if (!eeprom_ready) host_eeprom_erase();
+    if (eeprom_write_left_us) {
+        host_eeprom_collisions++;
+        return;
+    }
+    eeprom_write_address = address % HOST_EEPROM_SIZE;
+    eeprom_write_data = data;
+    eeprom_write_left_us = HOST_EEPROM_WRITE_US;
+    host_eeprom_writes[eeprom_write_address]++;
+}
+
+void host_eeprom_elapse(uint32_t us) {
+    if (!eeprom_write_left_us) return;
+    if (us < eeprom_write_left_us) {
+        eeprom_write_left_us -= us;
+        return;
+    }
+    eeprom_write_left_us = 0;
+    host_eeprom[eeprom_write_address] = eeprom_write_data;
+}
+
+void host_eeprom_power_cut() {
+    if (!eeprom_write_left_us) return;
+    eeprom_write_left_us = 0;
+    host_eeprom[eeprom_write_address] = 0x00;
+}
+
+size_t host_uart_inject(const uint8_t* data, size_t len) {
+    size_t i;
+    for (i = 0; (i < len) && (QUEUE_COUNT(rx) < HOST_UART_QUEUE_SIZE); i++) {
+        rx.data[rx.head++ & QUEUE_MASK] = data[i];
+    }
+    return i;
+}
+
+size_t host_uart_take(uint8_t* buffer, size_t max_len) {
+    size_t i;
+    for (i = 0; (i < max_len) && (QUEUE_COUNT(tx) != 0); i++) {
+        buffer[i] = tx.data[tx.tail++ & QUEUE_MASK];
+    }
+    return i;
+}
+
+size_t host_uart_tx_pending() {
+    return QUEUE_COUNT(tx);
+}
@@ -0,0 +1,69 @@
+#ifndef HOST_UART_H
+#define HOST_UART_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// In-memory stand in for the USART so AsciiModbusSlave can be built and run on a PC.
+// Nothing in here is used by the AVR build, AsciiModbusSlave.h only pulls it in when __AVR__ isn't defined.
+//
+// There are two queues: 
+//   rx - bytes travelling from the master to the slave. Filled with host_uart_inject(), emptied by the slave.
+//   tx - bytes travelling from the slave to the master. Filled by the slave, emptied with host_uart_take(). 
+// Both are fixed size so a benchmark can run millions of frames without allocating anything. 
+//
+// There are no interrupts on the host. host_uart_interrupts() plays the part of the USART hardware, 
+// moving bytes between the wire and the slaves ring buffers by calling the modbus_uart_*_isr() routines.
+
+#define HOST_UART_QUEUE_SIZE 4096   // must be a power of two
+
+// -------------------------------
+//   Used by the slave (via the macros in AsciiModbusSlave.h)
+// -------------------------------
+
+extern uint8_t host_uart_tx_enable;         // state of the RS485 transmit enable pin
+extern uint8_t host_uart_tx_interrupt;      // the data register empty interrupt is enabled
+
+void host_uart_reset();
+uint8_t host_uart_get_byte();
+void host_uart_send_byte(uint8_t data);
+// stands in for Timer1 when profiling (MODBUS_PROFILE), counts 8MHz clock cycles of real time and wraps at 65536. 
+uint16_t host_profile_clock();
+
+// The EEPROM, for the saved registers. A write takes HOST_EEPROM_WRITE_US, which only passes when the test says so
+// with host_eeprom_elapse(), and a write started while busy is counted in host_eeprom_collisions (the real one would
+// lose it). 
+#define HOST_EEPROM_SIZE 1024
+#define HOST_EEPROM_WRITE_US 3300
+
+uint8_t host_eeprom_busy();
+uint8_t host_eeprom_read(uint16_t address);
+void host_eeprom_write(uint16_t address, uint8_t data);
+
+// -------------------------------
+//   Used by the master side (tests, benchmarks)
+// -------------------------------
+
+// Simulate char_times character times passing on the wire. Each character time delivers at most one 
+// byte to the receive interrupt and takes at most one byte from the transmit interrupt, like the real USART. 
+void host_uart_interrupts(uint16_t char_times);
+// there are bytes on the wire which haven't been delivered to the slave yet. 
+uint8_t host_uart_byte_available();
+// returns the number of bytes actually queued, less than len if the rx queue is full. 
+size_t host_uart_inject(const uint8_t* data, size_t len);
+// copy up to max_len bytes sent by the slave into buffer, returns the number of bytes copied. 
+size_t host_uart_take(uint8_t* buffer, size_t max_len);
+// number of bytes sent by the slave which haven't been taken yet. 
+size_t host_uart_tx_pending();
+
+// The EEPROM as a new chip, all 0xFF, with nothing written. 
+void host_eeprom_erase();
+// us uS of simulated time pass, finishing a write in progress if it has had long enough. 
+void host_eeprom_elapse(uint32_t us);
+// Lose the power: a write in progress leaves its byte half done (0x00, as if erased and partly written) and stops. 
+void host_eeprom_power_cut();
+extern uint8_t host_eeprom[HOST_EEPROM_SIZE];
+extern uint32_t host_eeprom_writes[HOST_EEPROM_SIZE];   // how many times each byte has been written, for the wear
+extern uint32_t host_eeprom_collisions;
+
+#endif
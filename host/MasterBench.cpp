@@ -0,0 +1,284 @@
+// Poll rate benchmark for the host master (ModbusMaster.h) against simulated slaves.
+//
+// BENCH_SLAVES slaves (AsciiModbusSlave contexts, IDs 1, 2, 3 ...) and the master share an in-memory RS485 bus.
+// Time moves one character time at a time. In each one the bus carries one byte, from the master to every slave
+// or from a slave to the master, each slave's timer is ticked and modbus_slave_update() is called (a busy main
+// loop), and the master is run. One more slave ID is polled which nobody answers, to show a dead slave doesn't
+// hold up the rest.
+// Each slave is given different register values and every value the master reads is checked.
+// The same poll list is run with and without joining adjacent reads, and the usable poll rate (reads of the
+// application's register blocks per second) is reported for both.
+// Then a new speed setting is written to every slave, once as a fn6 to each in turn and once as a single
+// broadcast, and again to half of them as a group write. The time each takes is reported and every slave's
+// registers are checked afterwards.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/ModbusMaster.cpp host/HexCodec.cpp host/MasterBench.cpp
+//       -o master_bench
+//   ./master_bench [simulated_seconds]
+// The bus runs at the slaves' MODBUS_BAUD, which can be set when building, e.g. 1Mbps with -DMODBUS_BAUD=1000000UL.
+
+#include "AsciiModbusSlave.h"
+#include "host/ModbusMaster.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_BAUD MODBUS_BAUD             // the slaves' MODBUS_DELAY is worked out for it
+#define BENCH_SLAVES 8
+#define BENCH_DEAD_ID (BENCH_SLAVES + 1)    // polled but not on the bus
+#define BENCH_SECONDS 10
+#define BENCH_WIRE_SIZE 1024
+
+// the bytes the master has sent which haven't gone down the wire yet
+typedef struct BENCHWIRE {
+   uint8_t   data[BENCH_WIRE_SIZE];
+   size_t    head;
+   size_t    tail;
+}BenchWire;
+
+// what the application wants from each slave and where it keeps it
+typedef struct BENCHDATA {
+   uint16_t  settings[2];                    // 0x0000-0x0001, every 10mS
+   uint16_t  measured[2];                    // 0x0002-0x0003, every 10mS
+   uint16_t  errors[1];                      // 0x0004, every 100mS
+   uint16_t  latency[MODBUS_LATENCY_BUCKETS];// 0x0011-0x0018, every second
+}BenchData;
+
+static void wire_send(void* user, const uint8_t* data, size_t len) {
+    BenchWire* wire = (BenchWire*)user;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (wire->head - wire->tail >= BENCH_WIRE_SIZE) return;
+        wire->data[wire->head++ % BENCH_WIRE_SIZE] = data[i];
+    }
+}
+
+static uint16_t expected_value(int slave, uint8_t reg) {
+    return (uint16_t)(slave * 0x100 + reg);
+}
+
+static void add_polls(ModbusMaster* m, BenchData* data) {
+    int s;
+
+    for (s = 0; s < BENCH_DEAD_ID; s++) {
+        uint8_t id = (uint8_t)(s + 1);
+        modbus_master_add_poll(m, id, 0x0000, 2, 10000, data[s].settings);
+        modbus_master_add_poll(m, id, 0x0002, 2, 10000, data[s].measured);
+        modbus_master_add_poll(m, id, 0x0004, 1, 100000, data[s].errors);
+        modbus_master_add_poll(m, id, 0x0011, MODBUS_LATENCY_BUCKETS, 1000000, data[s].latency);
+    }
+}
+
+// the slaves, the master and the wire between them
+typedef struct BENCHBUS {
+   ModbusSlave* slaves;
+   ModbusMaster* m;
+   BenchWire* wire;
+   uint32_t  tick_ns;                        // towards the next slave timer tick
+   unsigned long collisions;
+   uint64_t  busy;                           // character times with something on the wire
+}BenchBus;
+
+// One character time on the wire at character c.
+static void bus_step(BenchBus* bus, uint64_t c) {
+    uint64_t now_us = c * 10000000ULL / BENCH_BAUD;
+    int talking = 0;
+    int s;
+
+    if (bus->wire->head != bus->wire->tail) {
+        uint8_t byte = bus->wire->data[bus->wire->tail++ % BENCH_WIRE_SIZE];
+        for (s = 0; s < BENCH_SLAVES; s++) modbus_slave_rx_byte(&bus->slaves[s], byte);
+        talking++;
+    }
+    for (s = 0; s < BENCH_SLAVES; s++) {
+        int16_t byte;
+        if (modbus_slave_tx_idle(&bus->slaves[s])) continue;
+        byte = modbus_slave_tx_byte(&bus->slaves[s]);
+        if (++talking == 1) modbus_master_rx_byte(bus->m, (uint8_t)byte, now_us);
+    }
+    if (talking > 1) bus->collisions++;
+    if (talking) bus->busy++;
+
+    // the slaves' timer interrupt and main loop
+    bus->tick_ns += (uint32_t)(10000000000ULL / BENCH_BAUD);
+    while (bus->tick_ns >= MASTER_TICK_US * 1000) {
+        bus->tick_ns -= MASTER_TICK_US * 1000;
+        for (s = 0; s < BENCH_SLAVES; s++) MODBUS_SLAVE_UPDATE_TIMER(&bus->slaves[s]);
+    }
+    for (s = 0; s < BENCH_SLAVES; s++) modbus_slave_update(&bus->slaves[s]);
+
+    modbus_master_run(bus->m, now_us);
+}
+
+static void init_slaves(ModbusSlave* slaves) {
+    int s;
+    int i;
+
+    for (s = 0; s < BENCH_SLAVES; s++) {
+        modbus_slave_init(&slaves[s], (uint8_t)(s + 1), MODBUS_ASCII, NULL);
+        for (i = hr_L_MOTOR_SPEED_SETTING; i <= hr_R_MOTOR_SPEED_SETTING; i++) {
+            modbus_slave_write_register(&slaves[s], (uint8_t)i, expected_value(s, (uint8_t)i));
+        }
+        MODBUS_SLAVE_ISR_MEASURED(&slaves[s], isr_hr_L_MOTOR_SPEED_MEASURED, expected_value(s, hr_L_MOTOR_SPEED_MEASURED));
+        MODBUS_SLAVE_ISR_MEASURED(&slaves[s], isr_hr_R_MOTOR_SPEED_MEASURED, expected_value(s, hr_R_MOTOR_SPEED_MEASURED));
+    }
+}
+
+// returns the number of values read which weren't what the slave holds
+static unsigned long check_values(BenchData* data) {
+    unsigned long wrong = 0;
+    int s;
+
+    for (s = 0; s < BENCH_SLAVES; s++) {
+        if (data[s].settings[0] != expected_value(s, hr_L_MOTOR_SPEED_SETTING)) wrong++;
+        if (data[s].settings[1] != expected_value(s, hr_R_MOTOR_SPEED_SETTING)) wrong++;
+        if (data[s].measured[0] != expected_value(s, hr_L_MOTOR_SPEED_MEASURED)) wrong++;
+        if (data[s].measured[1] != expected_value(s, hr_R_MOTOR_SPEED_MEASURED)) wrong++;
+    }
+    return wrong;
+}
+
+static void run(const char* name, uint8_t merge_reads, unsigned long seconds) {
+    ModbusSlave* slaves = (ModbusSlave*)calloc(BENCH_SLAVES, sizeof(ModbusSlave));
+    BenchData* data = (BenchData*)calloc(BENCH_DEAD_ID, sizeof(BenchData));
+    ModbusMaster* m = (ModbusMaster*)calloc(1, sizeof(ModbusMaster));
+    BenchWire* wire = (BenchWire*)calloc(1, sizeof(BenchWire));
+    BenchBus bus;
+    uint64_t chars = (uint64_t)seconds * BENCH_BAUD / 10;
+    uint64_t c;
+    unsigned long updates = 0;
+    unsigned long requests = 0;
+    int s;
+    int i;
+
+    if (!slaves || !data || !m || !wire) {
+        printf("%-10s out of memory\n", name);
+        return;
+    }
+    init_slaves(slaves);
+    modbus_master_init(m, BENCH_BAUD, MODBUS_DELAY, wire_send, wire);
+    m->merge_reads = merge_reads;
+    add_polls(m, data);
+
+    memset(&bus, 0, sizeof(bus));
+    bus.slaves = slaves;
+    bus.m = m;
+    bus.wire = wire;
+    for (c = 0; c < chars; c++) bus_step(&bus, c);
+
+    for (i = 0; i < m->num_polls; i++) updates += m->polls[i].updates;
+    for (s = 0; s < m->num_slaves; s++) requests += m->slaves[s].requests;
+    printf("%-10s %8.0f polls/s %8.0f requests/s  bus busy %3.0f%%  %lu collisions  %lu wrong values\n",
+           name, (double)updates / seconds, (double)requests / seconds, 100.0 * bus.busy / chars, bus.collisions,
+           check_values(data));
+    for (s = 0; s < m->num_slaves; s++) {
+        MasterSlave* slave = &m->slaves[s];
+        printf("           slave %3u %7u requests %7u responses %5u timeouts %3u bad  turnaround %5u uS%s\n",
+               slave->id, slave->requests, slave->responses, slave->timeouts, slave->bad_frames, slave->turnaround_us,
+               slave->dead ? "  dead" : "");
+    }
+    free(slaves);
+    free(data);
+    free(m);
+    free(wire);
+}
+
+// ---------------------------------------------------------------------------------------------------------------------
+// Writing one setting to many slaves
+
+#define BENCH_WRITE_VALUE 0x1234
+#define BENCH_WRITE_GROUP 1                 // the even slave IDs are put in this group
+#define BENCH_WRITE_TIMEOUT_CHARS 20000     // 3.5S, far longer than any of these should take
+
+// done for each write, counts them back in
+static void write_done(void* user, const uint8_t*, size_t) {
+    (*(int*)user)++;
+}
+
+// How a setting is written. The slaves with the bit set in to get BENCH_WRITE_VALUE, the rest are checked to still
+// have their own value.
+#define WRITE_EACH 0                        // a fn6 to each
+#define WRITE_BROADCAST 1                   // one fn6 to address 0
+#define WRITE_GROUP 2                       // one fn6 to BENCH_WRITE_GROUP's address
+
+static void run_write(const char* name, uint8_t how) {
+    ModbusSlave* slaves = (ModbusSlave*)calloc(BENCH_SLAVES, sizeof(ModbusSlave));
+    ModbusMaster* m = (ModbusMaster*)calloc(1, sizeof(ModbusMaster));
+    BenchWire* wire = (BenchWire*)calloc(1, sizeof(BenchWire));
+    BenchBus bus;
+    uint8_t pdu[5];
+    uint32_t to = 0;
+    int writes = 0;
+    int done = 0;
+    int sent = 0;
+    unsigned long wrong = 0;
+    uint64_t c;
+    int s;
+
+    if (!slaves || !m || !wire) {
+        printf("%-10s out of memory\n", name);
+        return;
+    }
+    init_slaves(slaves);
+    for (s = 0; s < BENCH_SLAVES; s++) {
+        if (((s + 1) & 1) == 0) modbus_slave_set_groups(&slaves[s], 1 << BENCH_WRITE_GROUP);
+        if ((how != WRITE_GROUP) || (((s + 1) & 1) == 0)) to |= 1UL << s;
+    }
+    modbus_master_init(m, BENCH_BAUD, MODBUS_DELAY, wire_send, wire);
+    memset(&bus, 0, sizeof(bus));
+    bus.slaves = slaves;
+    bus.m = m;
+    bus.wire = wire;
+
+    pdu[0] = 0x06;
+    pdu[1] = 0;
+    pdu[2] = hr_L_MOTOR_SPEED_SETTING;
+    pdu[3] = (uint8_t)(BENCH_WRITE_VALUE >> 8);
+    pdu[4] = (uint8_t)BENCH_WRITE_VALUE;
+    writes = (how == WRITE_EACH) ? BENCH_SLAVES : 1;
+
+    // the writes go out one after another as soon as the bus is free, until the last is done
+    for (c = 0; (c < BENCH_WRITE_TIMEOUT_CHARS) && (done < writes); c++) {
+        uint64_t now_us = c * 10000000ULL / BENCH_BAUD;
+
+        if ((sent == done) && (sent < writes)) {
+            int result;
+            if (how == WRITE_EACH) result = modbus_master_transact(m, (uint8_t)(sent + 1), pdu, sizeof(pdu), 5, write_done, &done, now_us);
+            else if (how == WRITE_BROADCAST) result = modbus_master_broadcast(m, MASTER_BROADCAST_ID, pdu, sizeof(pdu), write_done, &done, now_us);
+            else result = modbus_master_broadcast(m, MASTER_GROUP_BASE + BENCH_WRITE_GROUP, pdu, sizeof(pdu), write_done, &done, now_us);
+            if (result == 0) sent++;
+        }
+        bus_step(&bus, c);
+    }
+    // let anything still coming out of a slave finish, there shouldn't be anything
+    for (s = 0; s < 200; s++) bus_step(&bus, c + s);
+
+    for (s = 0; s < BENCH_SLAVES; s++) {
+        uint16_t expected = (to & (1UL << s)) ? BENCH_WRITE_VALUE : expected_value(s, hr_L_MOTOR_SPEED_SETTING);
+        if (modbus_slave_read_register(&slaves[s], hr_L_MOTOR_SPEED_SETTING) != expected) wrong++;
+    }
+    printf("%-10s %2d writes to %u slaves in %7.0f uS  bus busy %5lu chars  %lu collisions  %lu wrong values%s\n",
+           name, writes, (unsigned)__builtin_popcount(to), (double)c * 10000000.0 / BENCH_BAUD,
+           (unsigned long)bus.busy, bus.collisions, wrong, (done < writes) ? "  not finished" : "");
+    free(slaves);
+    free(m);
+    free(wire);
+}
+
+int main(int argc, char** argv) {
+    unsigned long seconds = BENCH_SECONDS;
+
+    if (argc > 1) seconds = strtoul(argv[1], NULL, 0);
+    if (seconds == 0) seconds = BENCH_SECONDS;
+
+    printf("%d slaves + 1 dead at %lu bps, %lu simulated seconds\n", BENCH_SLAVES, BENCH_BAUD, seconds);
+    run("joined", 1, seconds);
+    run("separate", 0, seconds);
+    printf("a speed setting for every slave, and for the even IDs (group %d)\n", BENCH_WRITE_GROUP);
+    run_write("each", WRITE_EACH);
+    run_write("broadcast", WRITE_BROADCAST);
+    run_write("group", WRITE_GROUP);
+    return 0;
+}
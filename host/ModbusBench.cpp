@@ -0,0 +1,241 @@
+// Host throughput benchmark for AsciiModbusSlave.
+//
+// Pushes frames through modbus_update() (and so through the receive and transmit statemachines) using the
+// in-memory loopback backend in HostUart.cpp and reports frames/sec, bytes/sec and time per frame.
+// The main loop is simulated as being busy for BENCH_CHARS_PER_STEP character times between calls to modbus_update(),
+// during which host_uart_interrupts() moves bytes between the wire and the ring buffers and the timer interrupt 
+// calls UPDATE_MODBUS_TIMER() the matching number of times.
+// The last test runs BENCH_MANY_SLAVES separate slave contexts side by side, fed directly rather than through the 
+// loopback, and it prints the size of a context. 
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/ModbusBench.cpp -o modbus_bench
+//   ./modbus_bench [number_of_frames]
+
+#include "AsciiModbusSlave.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+
+#define BENCH_SLAVE_ID 0xA5
+#define DEFAULT_FRAMES 1000000UL
+#define MAX_FRAME_LEN 64
+#define MAX_UPDATES_PER_FRAME 10000      // give up waiting for a response after this many modbus_update() calls
+#define BENCH_CHARS_PER_STEP 8            // 8 x 173uS at 57600bps, much longer than the old polling limit
+#define BENCH_TICKS_PER_CHAR 4            // timer ticks (38uS) in one character time (173uS)
+#define BENCH_MANY_SLAVES 1000            // slaves run side by side in bench_many_slaves()
+
+typedef std::chrono::steady_clock Clock;
+
+static double seconds_since(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Build an ASCII frame ":<hex bytes><lrc>\r\n" from the binary bytes, returns the length.
+static size_t build_frame(const uint8_t* bytes, size_t n, uint8_t* frame) {
+    static const char hex[] = "0123456789ABCDEF";
+    uint8_t lrc = 0;
+    size_t len = 0;
+    size_t i;
+
+    frame[len++] = ':';
+    for (i = 0; i <= n; i++) {
+        uint8_t b;
+        if (i < n) {
+            b = bytes[i];
+            lrc += b;
+        }
+        else b = (uint8_t)(-lrc);
+        frame[len++] = hex[b >> 4];
+        frame[len++] = hex[b & 0x0F];
+    }
+    frame[len++] = '\r';
+    frame[len++] = '\n';
+    return len;
+}
+
+// Build an RTU frame: the binary bytes followed by the CRC low byte first, returns the length.
+static size_t build_rtu_frame(const uint8_t* bytes, size_t n, uint8_t* frame) {
+    uint16_t crc = 0xFFFF;
+    size_t i;
+    uint8_t bit;
+
+    for (i = 0; i < n; i++) {
+        frame[i] = bytes[i];
+        crc ^= bytes[i];
+        for (bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+    frame[n] = (uint8_t)crc;
+    frame[n + 1] = (uint8_t)(crc >> 8);
+    return n + 2;
+}
+
+// One pass of the simulated main loop.
+static void bench_step() {
+    uint8_t c;
+    uint8_t i;
+
+    for (c = 0; c < BENCH_CHARS_PER_STEP; c++) {
+        host_uart_interrupts(1);
+        for (i = 0; i < BENCH_TICKS_PER_CHAR; i++) UPDATE_MODBUS_TIMER();
+    }
+    modbus_update();
+}
+
+// Run modbus_update() until the slave has sent a complete response or gives up. An ASCII response is complete 
+// when it ends in LF, an RTU response (which has no end character) when it is expected_len bytes long.
+// returns the number of modbus_update() calls made, 0 if no response.
+static unsigned long run_until_response(uint8_t* response, size_t* response_len, size_t expected_len) {
+    unsigned long updates = 0;
+    size_t len = 0;
+
+    while (updates < MAX_UPDATES_PER_FRAME) {
+        bench_step();
+        updates++;
+        while (host_uart_tx_pending()) {
+            len += host_uart_take(&response[len], 1);
+            if ((expected_len == 0) ? (response[len - 1] == '\n') : (len == expected_len)) {
+                *response_len = len;
+                return updates;
+            }
+            if (len >= MAX_FRAME_LEN) len = 0;
+        }
+    }
+    *response_len = len;
+    return 0;
+}
+
+static void report(const char* name, unsigned long frames, unsigned long bytes, double secs) {
+    printf("%-12s %10lu frames %8.3f s %12.0f frames/s %12.0f bytes/s %10.1f ns/frame\n",
+           name, frames, secs, frames / secs, bytes / secs, secs * 1e9 / frames);
+}
+
+// Receive side: a stream of requests is fed in and modbus_update() is called until all of it is consumed.
+static void bench_receive(unsigned long frames, const uint8_t* request, size_t request_len) {
+    uint8_t discard[HOST_UART_QUEUE_SIZE];
+    unsigned long sent = 0;
+    Clock::time_point start;
+
+    modbus_init(BENCH_SLAVE_ID);
+    start = Clock::now();
+    while (sent < frames) {
+        while (host_uart_inject(request, request_len) == request_len) {
+            if (++sent >= frames) break;
+        }
+        while (host_uart_byte_available()) {
+            bench_step();
+            host_uart_take(discard, sizeof(discard));
+        }
+    }
+    report("receive", frames, frames * request_len, seconds_since(start));
+}
+
+// Request/response: one request in, wait for the complete response, repeat. Gives the turnaround per frame.
+static void bench_round_trip(const char* name, uint8_t mode, unsigned long frames, const uint8_t* request, size_t request_len,
+                             size_t expected_len) {
+    uint8_t response[MAX_FRAME_LEN];
+    size_t response_len = 0;
+    unsigned long bytes = 0;
+    unsigned long updates = 0;
+    unsigned long done = 0;
+    unsigned long i;
+    double worst = 0;
+    Clock::time_point start;
+    Clock::time_point frame_start;
+
+    modbus_init(BENCH_SLAVE_ID, mode);
+    start = Clock::now();
+    for (i = 0; i < frames; i++) {
+        unsigned long n;
+        double t;
+
+        frame_start = Clock::now();
+        host_uart_inject(request, request_len);
+        n = run_until_response(response, &response_len, expected_len);
+        t = seconds_since(frame_start);
+        if (t > worst) worst = t;
+        if (n == 0) break;
+        updates += n;
+        bytes += request_len + response_len;
+        done++;
+    }
+    if (done == 0) {
+        printf("%-12s no response from the slave\n", name);
+        return;
+    }
+    report(name, done, bytes, seconds_since(start));
+    if (mode == MODBUS_ASCII) printf("             last response %.*s", (int)response_len, response);
+    printf("             %.1f modbus_update() calls/frame, worst frame %.1f us\n",
+           (double)updates / done, worst * 1e6);
+}
+
+// Many slaves in one process, each with its own context as if each was on its own line. They are stepped round 
+// robin, each step giving a slave BENCH_CHARS_PER_STEP characters of its request, the matching timer ticks and a 
+// call to modbus_slave_update(), then taking whatever it has sent. 
+static void bench_many_slaves(unsigned long slaves, unsigned long frames_per_slave, const uint8_t* request, size_t request_len) {
+    ModbusSlave* ctx = (ModbusSlave*)calloc(slaves, sizeof(ModbusSlave));
+    size_t* sent = (size_t*)calloc(slaves, sizeof(size_t));
+    unsigned long* done = (unsigned long*)calloc(slaves, sizeof(unsigned long));
+    unsigned long finished = 0;
+    unsigned long steps = 0;
+    unsigned long s;
+    uint8_t c;
+    int16_t data;
+    Clock::time_point start;
+
+    if (!ctx || !sent || !done) {
+        printf("%-12s out of memory\n", "slaves");
+        return;
+    }
+    for (s = 0; s < slaves; s++) modbus_slave_init(&ctx[s], BENCH_SLAVE_ID, MODBUS_ASCII, NULL);
+    start = Clock::now();
+    while ((finished < slaves) && (steps < MAX_UPDATES_PER_FRAME * frames_per_slave)) {
+        steps++;
+        for (s = 0; s < slaves; s++) {
+            if (done[s] >= frames_per_slave) continue;
+            for (c = 0; c < BENCH_CHARS_PER_STEP; c++) {
+                if (sent[s] < request_len) modbus_slave_rx_byte(&ctx[s], request[sent[s]++]);
+            }
+            for (c = 0; c < BENCH_CHARS_PER_STEP * BENCH_TICKS_PER_CHAR; c++) MODBUS_SLAVE_UPDATE_TIMER(&ctx[s]);
+            modbus_slave_update(&ctx[s]);
+            while ((data = modbus_slave_tx_byte(&ctx[s])) >= 0) {
+                if (data != '\n') continue;
+                sent[s] = 0;   // response complete, send the next request
+                if (++done[s] >= frames_per_slave) finished++;
+            }
+        }
+    }
+    report("slaves", slaves * frames_per_slave, slaves * frames_per_slave * request_len, seconds_since(start));
+    printf("             %lu slaves, %lu frames each, %s\n", slaves, frames_per_slave,
+           (finished == slaves) ? "all answered" : "SOME DID NOT ANSWER");
+    free(ctx);
+    free(sent);
+    free(done);
+}
+
+int main(int argc, char** argv) {
+    // read 2 holding registers starting at 0
+    const uint8_t fn3[] = {BENCH_SLAVE_ID, 0x03, 0x00, 0x00, 0x00, 0x02};
+    uint8_t request[MAX_FRAME_LEN];
+    size_t request_len;
+    unsigned long frames = DEFAULT_FRAMES;
+
+    if (argc > 1) frames = strtoul(argv[1], NULL, 0);
+    if (frames == 0) frames = DEFAULT_FRAMES;
+
+    request_len = build_frame(fn3, sizeof(fn3), request);
+    printf("request      %.*s", (int)request_len, request);
+
+    bench_receive(frames, request, request_len);
+    bench_round_trip("round trip", MODBUS_ASCII, frames, request, request_len, 0);
+
+    // the same request in RTU, the response is address, function, byte count, 2 registers and the CRC.
+    request_len = build_rtu_frame(fn3, sizeof(fn3), request);
+    bench_round_trip("rtu trip", MODBUS_RTU, frames, request, request_len, 3 + 4 + 2);
+
+    request_len = build_frame(fn3, sizeof(fn3), request);
+    bench_many_slaves(BENCH_MANY_SLAVES, frames / BENCH_MANY_SLAVES + 1, request, request_len);
+    printf("context      %u bytes per slave on this machine\n", (unsigned)sizeof(ModbusSlave));
+    return 0;
+}
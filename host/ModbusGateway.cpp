@@ -0,0 +1,389 @@
+#include "ModbusGateway.h"
+#include <string.h>
+
+// Modbus TCP to Modbus ASCII gateway, see ModbusGateway.h
+
+#define EXCEPTION_ILLEGAL_FUNCTION 0x01
+#define EXCEPTION_ILLEGAL_VALUE 0x03
+#define EXCEPTION_BUSY 0x06
+#define EXCEPTION_NO_RESPONSE 0x0B
+
+static void reply_pdu(ModbusGateway* g, GatewayWaiter* w, uint8_t slave_id, const uint8_t* pdu, size_t len);
+static void reply_exception(ModbusGateway* g, GatewayWaiter* w, uint8_t slave_id, uint8_t fn, uint8_t exception);
+static void reply_registers(ModbusGateway* g, GatewayWaiter* w, uint8_t slave_id, const uint16_t* values);
+static uint8_t write_waiting(ModbusGateway* g, uint8_t slave_id);
+static GatewayCache* cache_find(ModbusGateway* g, uint8_t slave_id, uint16_t address, uint8_t count, uint64_t now_us);
+static void cache_store(ModbusGateway* g, uint8_t slave_id, uint16_t address, uint8_t count, const uint8_t* data,
+                        uint64_t now_us);
+static void cache_drop(ModbusGateway* g, uint8_t slave_id);
+static uint8_t join_read(ModbusGateway* g, uint8_t slave_id, GatewayWaiter* w);
+static GatewayJob* queue_add(ModbusGateway* g);
+static GatewayJob* queue_add_front(ModbusGateway* g);
+static size_t response_len(const uint8_t* pdu, size_t len);
+static void transaction_done(void* user, const uint8_t* pdu, size_t len);
+
+#define JOB(g, i) (&(g)->queue[((g)->head + (i)) % GATEWAY_QUEUE_SIZE])
+#define GET_U16(p) ((uint16_t)(((p)[0] << 8) | (p)[1]))
+#define IS_BROADCAST(id) (((id) == MASTER_BROADCAST_ID) || ((id) >= MASTER_GROUP_BASE))
+
+void modbus_gateway_init(ModbusGateway* g, uint32_t baud, uint8_t turnaround_ticks, MasterSend send, void* send_user,
+                         GatewayReply reply, void* reply_user) {
+    memset(g, 0, sizeof(ModbusGateway));
+    modbus_master_init(&g->master, baud, turnaround_ticks, send, send_user);
+    g->reply = reply;
+    g->reply_user = reply_user;
+    g->ttl_us = GATEWAY_CACHE_TTL_US;
+    g->join_reads = 1;
+}
+
+int modbus_gateway_request(ModbusGateway* g, int client, const uint8_t* adu, size_t len, uint64_t now_us) {
+    const uint8_t* pdu = adu + GATEWAY_MBAP_SIZE;
+    size_t pdu_len;
+    uint8_t slave_id;
+    GatewayWaiter w;
+    GatewayCache* hit;
+    GatewayJob* job;
+
+    if ((len <= GATEWAY_MBAP_SIZE) || (len > GATEWAY_ADU_SIZE)) return -1;
+    if ((GET_U16(&adu[2]) != 0) || (GET_U16(&adu[4]) != len - 6)) return -1;    // protocol 0, length from unit ID
+    pdu_len = len - GATEWAY_MBAP_SIZE;
+    slave_id = adu[6];
+    w.client = client;
+    w.transaction = GET_U16(&adu[0]);
+    w.address = 0;
+    w.count = 0;
+    g->stats.requests++;
+
+    if (pdu[0] & 0x80) {
+        g->stats.bad_requests++;
+        reply_exception(g, &w, slave_id, pdu[0], EXCEPTION_ILLEGAL_FUNCTION);
+        return 0;
+    }
+    if (IS_BROADCAST(slave_id) && (pdu[0] != 0x06) && (pdu[0] != 0x10)) {
+        g->stats.bad_requests++;
+        reply_exception(g, &w, slave_id, pdu[0], EXCEPTION_ILLEGAL_FUNCTION);
+        return 0;
+    }
+    if (IS_BROADCAST(slave_id) && (pdu_len < 5)) {
+        g->stats.bad_requests++;
+        reply_exception(g, &w, slave_id, pdu[0], EXCEPTION_ILLEGAL_VALUE);
+        return 0;
+    }
+    if (modbus_master_slave_dead(&g->master, slave_id, now_us)) {
+        g->stats.timeouts++;
+        reply_exception(g, &w, slave_id, pdu[0], EXCEPTION_NO_RESPONSE);
+        return 0;
+    }
+
+    if (pdu[0] == 0x03) {
+        if (pdu_len != 5) {
+            g->stats.bad_requests++;
+            reply_exception(g, &w, slave_id, pdu[0], EXCEPTION_ILLEGAL_VALUE);
+            return 0;
+        }
+        w.address = GET_U16(&pdu[1]);
+        if ((GET_U16(&pdu[3]) == 0) || (GET_U16(&pdu[3]) > MASTER_MAX_READ)) {
+            g->stats.bad_requests++;
+            reply_exception(g, &w, slave_id, pdu[0], EXCEPTION_ILLEGAL_VALUE);
+            return 0;
+        }
+        w.count = (uint8_t)GET_U16(&pdu[3]);
+        if (!write_waiting(g, slave_id)) {
+            hit = cache_find(g, slave_id, w.address, w.count, now_us);
+            if (hit) {
+                g->stats.cache_hits++;
+                reply_registers(g, &w, slave_id, &hit->values[w.address - hit->address]);
+                return 0;
+            }
+        }
+        if (g->join_reads && join_read(g, slave_id, &w)) {
+            g->stats.joined++;
+            return 0;
+        }
+    }
+
+    job = queue_add(g);
+    if (!job) {
+        g->stats.busy++;
+        reply_exception(g, &w, slave_id, pdu[0], EXCEPTION_BUSY);
+        return 0;
+    }
+    job->slave_id = slave_id;
+    job->is_read = (pdu[0] == 0x03);
+    job->broadcast = IS_BROADCAST(slave_id);
+    job->address = w.address;
+    job->count = w.count;
+    memcpy(job->pdu, pdu, pdu_len);
+    job->pdu_len = pdu_len;
+    job->alone = 0;
+    job->waiters[0] = w;
+    job->num_waiters = 1;
+    if (!job->is_read) cache_drop(g, slave_id);
+    modbus_gateway_run(g, now_us);
+    return 0;
+}
+
+void modbus_gateway_client_closed(ModbusGateway* g, int client) {
+    int i;
+    int j;
+
+    for (i = 0; i < g->count; i++) {
+        GatewayJob* job = JOB(g, i);
+        for (j = 0; j < job->num_waiters; j++) {
+            if (job->waiters[j].client == client) job->waiters[j].client = -1;
+        }
+    }
+}
+
+void modbus_gateway_rx_byte(ModbusGateway* g, uint8_t data, uint64_t now_us) {
+    modbus_master_rx_byte(&g->master, data, now_us);
+}
+
+void modbus_gateway_run(ModbusGateway* g, uint64_t now_us) {
+    GatewayJob* job;
+    uint8_t pdu[5];
+
+    modbus_master_run(&g->master, now_us);
+    if (g->on_bus || (g->count == 0)) return;
+    job = JOB(g, 0);
+    if (job->is_read) {
+        // the range may have grown since it was queued
+        pdu[0] = 0x03;
+        pdu[1] = (uint8_t)(job->address >> 8);
+        pdu[2] = (uint8_t)job->address;
+        pdu[3] = 0;
+        pdu[4] = job->count;
+        memcpy(job->pdu, pdu, sizeof(pdu));
+        job->pdu_len = sizeof(pdu);
+    }
+    if (job->broadcast) {
+        if (modbus_master_broadcast(&g->master, job->slave_id, job->pdu, job->pdu_len, transaction_done, g, now_us) < 0) {
+            return;
+        }
+    }
+    else if (modbus_master_transact(&g->master, job->slave_id, job->pdu, job->pdu_len,
+                                    response_len(job->pdu, job->pdu_len), transaction_done, g, now_us) < 0) return;
+    g->on_bus = 1;
+    g->stats.transactions++;
+}
+
+// Called by the master when the transaction at the head of the queue is over, pdu is NULL if it timed out or was
+// a broadcast.
+static void transaction_done(void* user, const uint8_t* pdu, size_t len) {
+    ModbusGateway* g = (ModbusGateway*)user;
+    GatewayJob* job = JOB(g, 0);
+    uint16_t values[MASTER_MAX_READ];
+    GatewayWaiter again[GATEWAY_MAX_WAITERS];
+    uint8_t slave_id = job->slave_id;
+    uint8_t num_again = 0;
+    uint8_t good_read;
+    uint8_t refused_joined;
+    int i;
+
+    good_read = job->is_read && pdu && (len == 2 + 2 * (size_t)job->count) && (pdu[0] == 0x03)
+              && (pdu[1] == 2 * job->count);
+    // a joined read the slave answered with an exception may only have been refused because of registers another
+    // client asked for (past the end of the map, say), so each client's own registers are read again on their
+    // own. A client which asked for the whole range gets the exception, it was its own request.
+    refused_joined = job->is_read && pdu && (len >= 1) && (pdu[0] & 0x80) && (job->num_waiters > 1);
+    if (good_read) {
+        for (i = 0; i < job->count; i++) values[i] = GET_U16(&pdu[2 + 2 * i]);
+        cache_store(g, job->slave_id, job->address, job->count, &pdu[2], g->master.request_end_us);
+    }
+    if (!pdu && !job->broadcast) g->stats.timeouts++;
+    for (i = 0; i < job->num_waiters; i++) {
+        GatewayWaiter* w = &job->waiters[i];
+        if (w->client < 0) continue;
+        if (job->broadcast) reply_pdu(g, w, job->slave_id, job->pdu, 5);     // fn6 and fn16 both echo 5 bytes
+        else if (!pdu) reply_exception(g, w, job->slave_id, job->pdu[0], EXCEPTION_NO_RESPONSE);
+        else if (good_read) reply_registers(g, w, job->slave_id, &values[w->address - job->address]);
+        else if (refused_joined && ((w->address != job->address) || (w->count != job->count))) again[num_again++] = *w;
+        else reply_pdu(g, w, job->slave_id, pdu, len);
+    }
+    // whatever the slave did with it, what it holds may have changed
+    if (!job->is_read) cache_drop(g, job->slave_id);
+    g->head = (uint8_t)((g->head + 1) % GATEWAY_QUEUE_SIZE);
+    g->count--;
+    g->on_bus = 0;
+    // at the front, in the order they asked, so they still go before anything queued after them
+    if (num_again) g->stats.split++;
+    for (i = num_again - 1; i >= 0; i--) {
+        job = queue_add_front(g);
+        if (!job) {
+            g->stats.busy++;
+            reply_exception(g, &again[i], slave_id, 0x03, EXCEPTION_BUSY);
+            continue;
+        }
+        job->slave_id = slave_id;
+        job->is_read = 1;
+        job->broadcast = 0;
+        job->alone = 1;
+        job->address = again[i].address;
+        job->count = again[i].count;
+        job->waiters[0] = again[i];
+        job->num_waiters = 1;
+    }
+}
+
+// fn3: join w onto a read of the same slave already queued. Returns 1 if it was.
+static uint8_t join_read(ModbusGateway* g, uint8_t slave_id, GatewayWaiter* w) {
+    uint32_t w_hi = (uint32_t)w->address + w->count;
+    int i;
+
+    // newest first, stopping at anything other than a read to this slave so nothing is read before a write
+    // that was asked for first.
+    for (i = g->count - 1; i >= 0; i--) {
+        GatewayJob* job = JOB(g, i);
+        uint32_t hi = (uint32_t)job->address + job->count;
+        uint32_t new_lo;
+        uint32_t new_hi;
+
+        if ((job->slave_id != slave_id) && !job->broadcast) continue;
+        if (!job->is_read) return 0;
+        if (job->alone || (job->num_waiters >= GATEWAY_MAX_WAITERS)) continue;
+        if ((w->address > hi) || (w_hi < job->address)) continue;
+        new_lo = (w->address < job->address) ? w->address : job->address;
+        new_hi = (w_hi > hi) ? w_hi : hi;
+        // the one on the bus can't change, it has to have the registers already
+        if ((i == 0) && g->on_bus && ((new_lo != job->address) || (new_hi != hi))) continue;
+        if ((new_hi - new_lo) > MASTER_MAX_READ) continue;
+        job->address = (uint16_t)new_lo;
+        job->count = (uint8_t)(new_hi - new_lo);
+        job->waiters[job->num_waiters++] = *w;
+        return 1;
+    }
+    return 0;
+}
+
+static GatewayJob* queue_add(ModbusGateway* g) {
+    GatewayJob* job;
+
+    if (g->count >= GATEWAY_QUEUE_SIZE) return NULL;
+    job = JOB(g, g->count);
+    g->count++;
+    return job;
+}
+
+// Only when nothing is on the bus, the new job goes next.
+static GatewayJob* queue_add_front(ModbusGateway* g) {
+    if (g->count >= GATEWAY_QUEUE_SIZE) return NULL;
+    g->head = (uint8_t)((g->head + GATEWAY_QUEUE_SIZE - 1) % GATEWAY_QUEUE_SIZE);
+    g->count++;
+    return JOB(g, 0);
+}
+
+// A write (anything other than fn3) to the slave, or a broadcast, is queued or on the bus.
+static uint8_t write_waiting(ModbusGateway* g, uint8_t slave_id) {
+    int i;
+
+    for (i = 0; i < g->count; i++) {
+        GatewayJob* job = JOB(g, i);
+        if (((job->slave_id == slave_id) || job->broadcast) && !job->is_read) return 1;
+    }
+    return 0;
+}
+
+static GatewayCache* cache_find(ModbusGateway* g, uint8_t slave_id, uint16_t address, uint8_t count, uint64_t now_us) {
+    int i;
+
+    for (i = 0; i < GATEWAY_CACHE_SIZE; i++) {
+        GatewayCache* c = &g->cache[i];
+        if (!c->valid || (c->slave_id != slave_id)) continue;
+        if ((address < c->address) || ((uint32_t)address + count > (uint32_t)c->address + c->count)) continue;
+        if (now_us - c->time_us > g->ttl_us) continue;
+        return c;
+    }
+    return NULL;
+}
+
+// data is the register values as they came from the slave, high byte first.
+static void cache_store(ModbusGateway* g, uint8_t slave_id, uint16_t address, uint8_t count, const uint8_t* data,
+                        uint64_t now_us) {
+    GatewayCache* c = NULL;
+    int i;
+
+    if (g->ttl_us == 0) return;
+    // the same block again, or a free one, or take turns
+    for (i = 0; (i < GATEWAY_CACHE_SIZE) && !c; i++) {
+        GatewayCache* o = &g->cache[i];
+        if (o->valid && (o->slave_id == slave_id) && (o->address == address) && (o->count == count)) c = o;
+    }
+    for (i = 0; (i < GATEWAY_CACHE_SIZE) && !c; i++) {
+        if (!g->cache[i].valid) c = &g->cache[i];
+    }
+    if (!c) {
+        c = &g->cache[g->next_cache];
+        g->next_cache = (uint8_t)((g->next_cache + 1) % GATEWAY_CACHE_SIZE);
+    }
+    c->valid = 1;
+    c->slave_id = slave_id;
+    c->address = address;
+    c->count = count;
+    c->time_us = now_us;
+    for (i = 0; i < count; i++) c->values[i] = GET_U16(&data[2 * i]);
+}
+
+// A broadcast drops the lot, the gateway doesn't know who is in which group.
+static void cache_drop(ModbusGateway* g, uint8_t slave_id) {
+    int i;
+
+    for (i = 0; i < GATEWAY_CACHE_SIZE; i++) {
+        if ((g->cache[i].slave_id == slave_id) || IS_BROADCAST(slave_id)) g->cache[i].valid = 0;
+    }
+}
+
+// The longest PDU the slave can answer a request with, for the master's timeout.
+static size_t response_len(const uint8_t* pdu, size_t len) {
+    switch (pdu[0]) {
+      case 0x03:
+      case 0x04:
+      case 0x17:                                    // the read count comes first in fn23 too
+        return (len >= 5) ? 2 + 2 * (size_t)GET_U16(&pdu[3]) : MASTER_MAX_PDU;
+      case 0x05:
+      case 0x06:
+      case 0x0F:
+      case 0x10:
+        return 5;
+      case 0x08:
+        return len;                                 // an echo
+      default:
+        return MASTER_MAX_PDU;
+    }
+}
+
+static void reply_pdu(ModbusGateway* g, GatewayWaiter* w, uint8_t slave_id, const uint8_t* pdu, size_t len) {
+    uint8_t adu[GATEWAY_ADU_SIZE];
+
+    if (len > MASTER_MAX_PDU) return;
+    adu[0] = (uint8_t)(w->transaction >> 8);
+    adu[1] = (uint8_t)w->transaction;
+    adu[2] = 0;
+    adu[3] = 0;
+    adu[4] = (uint8_t)((len + 1) >> 8);
+    adu[5] = (uint8_t)(len + 1);
+    adu[6] = slave_id;
+    memcpy(&adu[GATEWAY_MBAP_SIZE], pdu, len);
+    g->reply(g->reply_user, w->client, adu, GATEWAY_MBAP_SIZE + len);
+}
+
+static void reply_exception(ModbusGateway* g, GatewayWaiter* w, uint8_t slave_id, uint8_t fn, uint8_t exception) {
+    uint8_t pdu[2];
+
+    pdu[0] = (uint8_t)(fn | 0x80);
+    pdu[1] = exception;
+    reply_pdu(g, w, slave_id, pdu, sizeof(pdu));
+}
+
+// a fn3 response with w->count values
+static void reply_registers(ModbusGateway* g, GatewayWaiter* w, uint8_t slave_id, const uint16_t* values) {
+    uint8_t pdu[2 + 2 * MASTER_MAX_READ];
+    int i;
+
+    pdu[0] = 0x03;
+    pdu[1] = (uint8_t)(2 * w->count);
+    for (i = 0; i < w->count; i++) {
+        pdu[2 + 2 * i] = (uint8_t)(values[i] >> 8);
+        pdu[3 + 2 * i] = (uint8_t)values[i];
+    }
+    reply_pdu(g, w, slave_id, pdu, 2 + 2 * (size_t)w->count);
+}
@@ -0,0 +1,113 @@
+#ifndef MODBUS_GATEWAY_H
+#define MODBUS_GATEWAY_H
+
+#include "ModbusMaster.h"
+
+// Modbus TCP to Modbus ASCII serial gateway, the part that doesn't know about sockets or serial ports.
+// host/GatewayDaemon.cpp runs it on an epoll loop, it is built with the master and the slave's codec:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/ModbusMaster.cpp host/HexCodec.cpp
+//       host/ModbusGateway.cpp <program>.cpp
+//
+// Each whole MBAP request from a TCP client is handed to modbus_gateway_request() with a client number chosen by
+// the caller, answers come back through the reply function, and the serial side goes through a ModbusMaster
+// (modbus_master_transact()), so bytes from the bus go to modbus_gateway_rx_byte() and modbus_gateway_run() has to
+// be called often. The unit ID of the request is the slave ID on the bus.
+//
+// The serial link is far slower than TCP, so the gateway does as few serial transactions as it can:
+//   - fn3 reads are answered from a cache of recent responses if they are no older than ttl_us.
+//   - A fn3 read which isn't in the cache joins onto a read of the same slave which is waiting to go out
+//     (overlapping or consecutive addresses, up to 125 registers), or onto the one on the bus if that covers it.
+//     One serial transaction then answers every client which asked. If the slave answers a joined read with an
+//     exception, each client's own registers are read again on their own, so one client's bad request doesn't
+//     become an error for the others.
+//   - Everything else (writes, fn8, fn23 ...) is sent as it is, one at a time in the order it arrived. A read is
+//     never joined onto one which is ahead of a write to the same slave, and the cache isn't used for a slave with
+//     a write waiting, so a client always reads back what it wrote. The slave's cache is thrown away when a write
+//     is queued and again when it finishes.
+// Unit ID 0 and the group IDs (MASTER_GROUP_BASE up) are broadcasts on the bus, only fn6 and fn16 are allowed. No
+// slave answers one, so the client gets the usual write response once the slaves have had time to carry it out.
+// A broadcast is a write to every slave as far as the queue and the cache are concerned.
+// Requests to a slave the master has marked dead get exception 0x0B (no response from the target) straight away,
+// and exception 0x06 (busy) when the queue is full.
+
+#define GATEWAY_QUEUE_SIZE 64               // serial transactions waiting, including the one on the bus
+#define GATEWAY_MAX_WAITERS 32              // client requests answered by one serial transaction
+#define GATEWAY_CACHE_SIZE 64               // register blocks held
+#define GATEWAY_CACHE_TTL_US 20000          // default age limit for a cached read
+#define GATEWAY_MBAP_SIZE 7                 // transaction ID, protocol ID, length, unit ID
+#define GATEWAY_ADU_SIZE (GATEWAY_MBAP_SIZE + MASTER_MAX_PDU)
+
+// send len bytes of a whole MBAP response to a client
+typedef void (*GatewayReply)(void* user, int client, const uint8_t* adu, size_t len);
+
+// a client request waiting on a serial transaction
+typedef struct GATEWAYWAITER {
+   int       client;                         // -1 once the client has gone
+   uint16_t  transaction;                    // MBAP transaction ID, returned as it came
+   uint16_t  address;                        // fn3: the registers this client wants
+   uint8_t   count;
+}GatewayWaiter;
+
+typedef struct GATEWAYJOB {
+   uint8_t   slave_id;
+   uint8_t   is_read;                        // a fn3 which other reads can join
+   uint8_t   broadcast;                      // a write to every slave or a group, nothing answers
+   uint8_t   alone;                          // a client's part of a joined read which was refused, nothing joins it
+   uint16_t  address;                        // fn3: the registers read
+   uint8_t   count;
+   uint8_t   pdu[MASTER_MAX_PDU];            // anything else: sent as it is
+   size_t    pdu_len;
+   GatewayWaiter waiters[GATEWAY_MAX_WAITERS];
+   uint8_t   num_waiters;
+}GatewayJob;
+
+typedef struct GATEWAYCACHE {
+   uint8_t   valid;
+   uint8_t   slave_id;
+   uint16_t  address;
+   uint8_t   count;
+   uint64_t  time_us;                        // when the response arrived
+   uint16_t  values[MASTER_MAX_READ];
+}GatewayCache;
+
+typedef struct GATEWAYSTATS {
+   uint32_t  requests;                       // from the clients
+   uint32_t  cache_hits;
+   uint32_t  joined;                         // answered by a serial transaction another client's request started
+   uint32_t  transactions;                   // serial
+   uint32_t  timeouts;
+   uint32_t  busy;                           // queue full
+   uint32_t  split;                          // joined reads refused with an exception and read again per client
+   uint32_t  bad_requests;                   // answered with exception 1 or 3 without going to the bus
+}GatewayStats;
+
+typedef struct MODBUSGATEWAY {
+   ModbusMaster master;
+   GatewayReply reply;
+   void*     reply_user;
+   uint32_t  ttl_us;                         // 0 turns the cache off
+   uint8_t   join_reads;                     // 1 to join reads from different clients (the default)
+
+   GatewayJob queue[GATEWAY_QUEUE_SIZE];     // a ring, queue[head] is on the bus when on_bus is set
+   uint8_t   head;
+   uint8_t   count;
+   uint8_t   on_bus;
+
+   GatewayCache cache[GATEWAY_CACHE_SIZE];
+   uint8_t   next_cache;                     // the block replaced next when there is no free one
+
+   GatewayStats stats;
+}ModbusGateway;
+
+// baud, turnaround_ticks and send are passed to modbus_master_init().
+void modbus_gateway_init(ModbusGateway* g, uint32_t baud, uint8_t turnaround_ticks, MasterSend send, void* send_user,
+                         GatewayReply reply, void* reply_user);
+// one whole request, MBAP header and PDU. Returns -1 if it isn't Modbus TCP and the connection should be closed.
+int modbus_gateway_request(ModbusGateway* g, int client, const uint8_t* adu, size_t len, uint64_t now_us);
+// the client has disconnected, anything still waiting for it is dropped when it completes.
+void modbus_gateway_client_closed(ModbusGateway* g, int client);
+void modbus_gateway_rx_byte(ModbusGateway* g, uint8_t data, uint64_t now_us);
+// times out the transaction on the bus and starts the next one.
+void modbus_gateway_run(ModbusGateway* g, uint64_t now_us);
+
+#endif
@@ -0,0 +1,364 @@
+#include "ModbusMaster.h"
+#include "../ModbusCodec.h"
+#include "HexCodec.h"
+#include <string.h>
+
+// Host side Modbus ASCII master, see ModbusMaster.h
+
+#define NS_PER_US 1000
+
+static int find_slave(ModbusMaster* m, uint8_t slave_id);
+static int next_poll(ModbusMaster* m, uint64_t now_us);
+static void send_request(ModbusMaster* m, int first, uint64_t now_us);
+static void send_frame(ModbusMaster* m, const uint8_t* bytes, size_t n, size_t response_len, uint64_t now_us);
+static void end_request(ModbusMaster* m, uint64_t now_us, uint8_t answered);
+static void parse_response(ModbusMaster* m, uint64_t now_us);
+static size_t decode_frame(ModbusMaster* m, uint8_t* bytes);
+static void stream_frame(ModbusMaster* m, const uint8_t* bytes, size_t n, uint64_t now_us);
+
+void modbus_master_init(ModbusMaster* m, uint32_t baud, uint8_t turnaround_ticks, MasterSend send, void* user) {
+    memset(m, 0, sizeof(ModbusMaster));
+    m->send = send;
+    m->user = user;
+    m->char_ns = (uint32_t)(10ULL * 1000000000ULL / baud);       // start, 8 data, stop
+    m->default_turnaround_us = (uint32_t)turnaround_ticks * MASTER_TICK_US;
+    m->merge_reads = 1;
+}
+
+int modbus_master_add_poll(ModbusMaster* m, uint8_t slave_id, uint16_t address, uint8_t count, uint32_t period_us,
+                           uint16_t* dest) {
+    MasterPoll* poll;
+    int slave = find_slave(m, slave_id);
+
+    if ((slave < 0) || (m->num_polls >= MASTER_MAX_POLLS) || (count == 0) || (count > MASTER_MAX_READ)) return -1;
+    poll = &m->polls[m->num_polls];
+    memset(poll, 0, sizeof(MasterPoll));
+    poll->slave = (uint8_t)slave;
+    poll->address = address;
+    poll->count = count;
+    poll->period_us = period_us;
+    poll->dest = dest;
+    return m->num_polls++;
+}
+
+// The slave's index, added if it isn't there yet. -1 if there is no room.
+static int find_slave(ModbusMaster* m, uint8_t slave_id) {
+    MasterSlave* slave;
+    int i;
+
+    for (i = 0; i < m->num_slaves; i++) {
+        if (m->slaves[i].id == slave_id) return i;
+    }
+    if (m->num_slaves >= MASTER_MAX_SLAVES) return -1;
+    slave = &m->slaves[m->num_slaves];
+    memset(slave, 0, sizeof(MasterSlave));
+    slave->id = slave_id;
+    slave->turnaround_us = m->default_turnaround_us;
+    return m->num_slaves++;
+}
+
+void modbus_master_run(ModbusMaster* m, uint64_t now_us) {
+    int first;
+
+    if (m->waiting) {
+        // the deadline allows for the whole response, so one which has started but not finished by then is no good.
+        // Unless it could be a push, which holds the response up for as long as it takes (see stream_frame()).
+        if (now_us < m->deadline_us) return;
+        if (m->receiving && m->stream
+            && ((now_us - m->frame_start_us) < (MASTER_FRAME_SIZE * (uint64_t)m->char_ns) / NS_PER_US)) return;
+        end_request(m, now_us, 0);
+    }
+    first = next_poll(m, now_us);
+    if (first >= 0) send_request(m, first, now_us);
+}
+
+// The poll to send next: due, to a slave which isn't dead (unless it is time to try it again), and the shortest
+// period. -1 if nothing is due.
+static int next_poll(ModbusMaster* m, uint64_t now_us) {
+    int best = -1;
+    int i;
+
+    for (i = 0; i < m->num_polls; i++) {
+        MasterPoll* poll = &m->polls[i];
+        MasterSlave* slave = &m->slaves[poll->slave];
+
+        if (poll->next_due_us > now_us) continue;
+        if (slave->dead && (slave->retry_us > now_us)) continue;
+        if ((best < 0) || (poll->period_us < m->polls[best].period_us)
+            || ((poll->period_us == m->polls[best].period_us) && (poll->next_due_us < m->polls[best].next_due_us))) best = i;
+    }
+    return best;
+}
+
+// Send a fn3 for the poll first, with any other polls of the same slave joined onto it.
+static void send_request(ModbusMaster* m, int first, uint64_t now_us) {
+    MasterPoll* poll = &m->polls[first];
+    uint32_t lo = poll->address;
+    uint32_t hi = (uint32_t)poll->address + poll->count;     // one past the last register
+    uint8_t bytes[6];
+    uint8_t joined = 1;
+    int i;
+
+    for (i = 0; i < m->num_polls; i++) m->polls[i].in_request = 0;
+    poll->in_request = 1;
+    // keep going round until nothing else joins on, each one added can make room for another.
+    while (m->merge_reads && joined) {
+        joined = 0;
+        for (i = 0; i < m->num_polls; i++) {
+            MasterPoll* other = &m->polls[i];
+            uint32_t other_hi = (uint32_t)other->address + other->count;
+            uint32_t new_lo;
+            uint32_t new_hi;
+
+            if (other->in_request || (other->slave != poll->slave)) continue;
+            if (other->next_due_us > now_us + other->period_us / 2) continue;
+            if ((other->address > hi) || (other_hi < lo)) continue;
+            new_lo = (other->address < lo) ? other->address : lo;
+            new_hi = (other_hi > hi) ? other_hi : hi;
+            if ((new_hi - new_lo) > MASTER_MAX_READ) continue;
+            lo = new_lo;
+            hi = new_hi;
+            other->in_request = 1;
+            joined = 1;
+        }
+    }
+
+    m->slave = poll->slave;
+    m->address = (uint16_t)lo;
+    m->count = (uint8_t)(hi - lo);
+    m->broadcast = 0;
+    m->done = NULL;
+    bytes[0] = m->slaves[m->slave].id;
+    bytes[1] = 0x03;
+    bytes[2] = (uint8_t)(lo >> 8);
+    bytes[3] = (uint8_t)lo;
+    bytes[4] = 0;
+    bytes[5] = m->count;
+    send_frame(m, bytes, sizeof(bytes), 2 + 2 * (size_t)m->count, now_us);
+}
+
+int modbus_master_transact(ModbusMaster* m, uint8_t slave_id, const uint8_t* pdu, size_t len, size_t response_len,
+                           MasterDone done, void* done_user, uint64_t now_us) {
+    uint8_t bytes[1 + MASTER_MAX_PDU];
+    int slave;
+    int i;
+
+    if (m->waiting || (len == 0) || (len > MASTER_MAX_PDU)) return -1;
+    slave = find_slave(m, slave_id);
+    if (slave < 0) return -1;
+    for (i = 0; i < m->num_polls; i++) m->polls[i].in_request = 0;
+    m->slave = (uint8_t)slave;
+    m->broadcast = 0;
+    m->done = done;
+    m->done_user = done_user;
+    bytes[0] = slave_id;
+    memcpy(&bytes[1], pdu, len);
+    send_frame(m, bytes, 1 + len, (response_len > MASTER_MAX_PDU) ? MASTER_MAX_PDU : response_len, now_us);
+    return 0;
+}
+
+int modbus_master_broadcast(ModbusMaster* m, uint8_t address, const uint8_t* pdu, size_t len, MasterDone done,
+                            void* done_user, uint64_t now_us) {
+    uint8_t bytes[1 + MASTER_MAX_PDU];
+    int i;
+
+    if (m->waiting || (len == 0) || (len > MASTER_MAX_PDU)) return -1;
+    if ((address != MASTER_BROADCAST_ID) && (address < MASTER_GROUP_BASE)) return -1;
+    for (i = 0; i < m->num_polls; i++) m->polls[i].in_request = 0;
+    m->broadcast = 1;
+    m->done = done;
+    m->done_user = done_user;
+    bytes[0] = address;
+    memcpy(&bytes[1], pdu, len);
+    send_frame(m, bytes, 1 + len, 0, now_us);
+    return 0;
+}
+
+void modbus_master_on_stream(ModbusMaster* m, MasterStream stream, void* user) {
+    m->stream = stream;
+    m->stream_user = user;
+}
+
+uint8_t modbus_master_slave_dead(ModbusMaster* m, uint8_t slave_id, uint64_t now_us) {
+    int i;
+
+    for (i = 0; i < m->num_slaves; i++) {
+        if (m->slaves[i].id == slave_id) return m->slaves[i].dead && (m->slaves[i].retry_us > now_us);
+    }
+    return 0;
+}
+
+// Send address and PDU as an ASCII frame and work out when to give up on the response.
+static void send_frame(ModbusMaster* m, const uint8_t* bytes, size_t n, size_t response_len, uint64_t now_us) {
+    uint8_t frame[1 + 2 * (1 + MASTER_MAX_PDU + 1) + 2];
+    uint8_t lrc = 0;
+    size_t len = 0;
+
+    frame[len++] = ':';
+    hex_encode(bytes, n, frame + len, &lrc);
+    len += n * 2;
+    lrc = (uint8_t)(0 - lrc);
+    frame[len++] = UINT8_TO_ASCII(lrc >> 4);
+    frame[len++] = UINT8_TO_ASCII(lrc & 0x0F);
+    frame[len++] = '\r';
+    frame[len++] = '\n';
+
+    m->request_end_us = now_us + (len * m->char_ns) / NS_PER_US;
+    m->waiting = 1;
+    // a push can be coming in while the request goes out, it is kept. Otherwise anything half received is stale.
+    if (!m->stream) {
+        m->receiving = 0;
+        m->frame_len = 0;
+    }
+    if (m->broadcast) {
+        // no response, but the slaves get the time they would have taken to answer before anything else is sent.
+        m->deadline_us = m->request_end_us + m->latency_us + m->default_turnaround_us;
+    }
+    else {
+        // the response is ':', address, the PDU and the LRC as hex, then CR LF.
+        m->deadline_us = m->request_end_us + m->latency_us + m->slaves[m->slave].turnaround_us
+                       + ((1 + 2 * (1 + (uint64_t)response_len + 1) + 2 + MASTER_TIMEOUT_MARGIN_CHARS) * m->char_ns) / NS_PER_US;
+        m->slaves[m->slave].requests++;
+    }
+    m->send(m->user, frame, len);
+}
+
+// The request on the bus is over, answered or not.
+static void end_request(ModbusMaster* m, uint64_t now_us, uint8_t answered) {
+    MasterSlave* slave = &m->slaves[m->slave];
+    MasterDone done = m->done;
+    int i;
+
+    m->waiting = 0;
+    m->receiving = 0;
+    m->done = NULL;
+    if (m->broadcast) {
+        // nobody was meant to answer, so nobody missed it.
+        m->broadcast = 0;
+        if (done) done(m->done_user, NULL, 0);
+        return;
+    }
+    if (answered) {
+        slave->timeouts_in_row = 0;
+        slave->dead = 0;
+    }
+    else {
+        slave->timeouts++;
+        if (slave->timeouts_in_row < 255) slave->timeouts_in_row++;
+        if (slave->timeouts_in_row >= MASTER_DEAD_AFTER) {
+            slave->dead = 1;
+            slave->retry_us = now_us + MASTER_DEAD_RETRY_US;
+        }
+    }
+    // the polls in the request are due again a period from now whether they were answered or not, so a slave
+    // which doesn't answer doesn't get asked again straight away.
+    for (i = 0; i < m->num_polls; i++) {
+        if (!m->polls[i].in_request) continue;
+        m->polls[i].next_due_us = now_us + m->polls[i].period_us;
+        m->polls[i].in_request = 0;
+    }
+    // the bus is free again before done is called, so it can send the next request straight away.
+    if (!answered && done) done(m->done_user, NULL, 0);
+}
+
+void modbus_master_rx_byte(ModbusMaster* m, uint8_t data, uint64_t now_us) {
+    // nothing expected (noise or a late response) unless a slave could be pushing.
+    if (m->broadcast || (!m->waiting && !m->stream)) return;
+    if (data == ':') {
+        m->receiving = 1;
+        m->frame_start_us = now_us;
+        m->frame_len = 0;
+        return;
+    }
+    if (!m->receiving) return;
+    if (data == '\n') {
+        parse_response(m, now_us);
+        return;
+    }
+    if (m->frame_len < MASTER_FRAME_SIZE) m->frame[m->frame_len++] = data;
+}
+
+// The frame between ':' and LF in m->frame as bytes, with the LRC checked. Returns the number of bytes, 0 if the
+// frame is no good.
+static size_t decode_frame(ModbusMaster* m, uint8_t* bytes) {
+    size_t n = m->frame_len >> 1;
+    uint8_t lrc = 0;
+
+    if ((m->frame_len < 2) || (m->frame[m->frame_len - 1] != '\r') || !(m->frame_len & 1)) return 0;
+    if (!hex_decode(m->frame, n, bytes, &lrc)) return 0;
+    if ((lrc != 0) || (n < 3)) return 0;
+    return n;
+}
+
+// A push: address, MASTER_FN_STREAM, byte count, values, LRC. A response which was due is held up behind it for as
+// long as it took.
+static void stream_frame(ModbusMaster* m, const uint8_t* bytes, size_t n, uint64_t now_us) {
+    uint16_t values[MASTER_MAX_READ];
+    uint8_t count = (uint8_t)(bytes[2] >> 1);
+    int i;
+
+    if (m->waiting) m->deadline_us += now_us - m->frame_start_us + m->char_ns / NS_PER_US;
+    if ((bytes[2] & 1) || (count > MASTER_MAX_READ) || (n != (size_t)(3 + bytes[2] + 1))) return;
+    for (i = 0; i < count; i++) values[i] = (uint16_t)((bytes[3 + 2 * i] << 8) | bytes[4 + 2 * i]);
+    m->pushes++;
+    m->stream(m->stream_user, bytes[0], values, count, m->frame_start_us);
+}
+
+// A whole frame (between ':' and LF) is in m->frame, a push or the response.
+static void parse_response(ModbusMaster* m, uint64_t now_us) {
+    MasterSlave* slave = &m->slaves[m->slave];
+    uint8_t bytes[MASTER_FRAME_SIZE / 2];
+    size_t n;
+    size_t i;
+    uint32_t turnaround;
+    int p;
+
+    m->receiving = 0;
+    n = decode_frame(m, bytes);
+    if (n && (bytes[1] == MASTER_FN_STREAM) && m->stream) {
+        stream_frame(m, bytes, n, now_us);
+        return;
+    }
+    if (!m->waiting) return;
+    if ((n == 0) || (bytes[0] != slave->id)) {
+        slave->bad_frames++;
+        return;                                   // carry on waiting, a good response could still come
+    }
+    // learn how long the slave takes to answer. It goes up straight away and comes down slowly, so one quick
+    // answer doesn't make the next timeout too short.
+    turnaround = (m->frame_start_us > m->request_end_us) ? (uint32_t)(m->frame_start_us - m->request_end_us) : 0;
+    turnaround = (turnaround > (m->char_ns / NS_PER_US)) ? turnaround - (m->char_ns / NS_PER_US) : 0;   // ':' itself
+    if (turnaround < m->default_turnaround_us) turnaround = m->default_turnaround_us;
+    if (turnaround > slave->turnaround_us) slave->turnaround_us = turnaround;
+    else slave->turnaround_us = (slave->turnaround_us * 7 + turnaround) / 8;
+
+    if (m->done) {
+        MasterDone done = m->done;
+        if (bytes[1] & 0x80) slave->exceptions++;
+        else slave->responses++;
+        end_request(m, now_us, 1);
+        done(m->done_user, &bytes[1], n - 2);
+        return;
+    }
+    if (bytes[1] == 0x83) {
+        slave->exceptions++;
+        end_request(m, now_us, 1);
+        return;
+    }
+    if ((bytes[1] != 0x03) || (bytes[2] != (uint8_t)(m->count << 1)) || (n != (size_t)(3 + bytes[2] + 1))) {
+        slave->bad_frames++;
+        return;
+    }
+    slave->responses++;
+    for (p = 0; p < m->num_polls; p++) {
+        MasterPoll* poll = &m->polls[p];
+        if (!poll->in_request) continue;
+        for (i = 0; i < poll->count; i++) {
+            size_t at = 3 + 2 * (poll->address - m->address + i);
+            if (poll->dest) poll->dest[i] = (uint16_t)((bytes[at] << 8) | bytes[at + 1]);
+        }
+        poll->updates++;
+        poll->updated_us = now_us;
+    }
+    end_request(m, now_us, 1);
+}
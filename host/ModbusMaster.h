@@ -0,0 +1,146 @@
+#ifndef MODBUS_MASTER_H
+#define MODBUS_MASTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Host side Modbus ASCII master for supervisory software polling several slaves (e.g. the hoverboard controllers,
+// each with its own slaveID) on one RS485 segment. Frames are turned to and from hex a whole frame at a time
+// (host/HexCodec.h), which gives exactly what the slave's helpers (ModbusCodec.h) do, so it is built with
+// AsciiModbusSlave.cpp:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/ModbusMaster.cpp host/HexCodec.cpp <your program>.cpp
+//
+// The application lists what it wants read and how often with modbus_master_add_poll(), then keeps calling
+// modbus_master_run() and hands every byte received to modbus_master_rx_byte(). Neither blocks, time is passed in
+// by the caller, and bytes go out through the send function given to modbus_master_init(), so it can run on a
+// serial port, a PTY or the in-memory bus in host/MasterBench.cpp.
+//
+// Only one request can be on an RS485 bus at a time, so the poll rate comes from wasting as little time as
+// possible between them:
+//   - The next request goes out as soon as a response ends.
+//   - The timeout for each request is worked out from its length, the response length and the slave's turnaround
+//     (MODBUS_DELAY, learnt from the slave's actual responses), rather than a fixed long wait. A missing response
+//     costs little more than a good one.
+//   - A slave that misses MASTER_DEAD_AFTER responses in a row is treated as dead and only tried every
+//     MASTER_DEAD_RETRY_US, so it doesn't take bus time from the others.
+//   - When a read is due, any other reads from the same slave which join onto it (consecutive or overlapping
+//     addresses) and are due within half their period are done in the same fn3.
+//   - The due read with the shortest period goes first, so if the bus is overloaded the fast registers keep
+//     their rate and the slow ones wait.
+//
+// modbus_master_transact() sends any other request once, in place of a poll, and hands the response PDU to a done
+// function. The Modbus TCP gateway (host/ModbusGateway.h) is built on it. modbus_master_broadcast() sends a write
+// to every slave at once (address 0) or to a group of them (MASTER_GROUP_BASE up, see modbus_set_groups() in
+// AsciiModbusSlave.h). Nothing answers, so the bus is only held for the request and the slaves' turnaround.
+// A slave which is streaming (MODBUS_FN_STREAM in AsciiModbusSlave.h) pushes its block without being asked. Give
+// modbus_master_on_stream() a function for the pushes and they are handed to it as they arrive, between or in the
+// middle of the master's own transactions. A response held up behind a push doesn't time out.
+
+#define MASTER_MAX_SLAVES 32
+#define MASTER_MAX_POLLS 128
+#define MASTER_MAX_READ 125                 // registers in one fn3
+#define MASTER_FRAME_SIZE 520               // ':' + 2 x (3 + 250 + 1) + CR LF, the longest fn3 response
+#define MASTER_DEAD_AFTER 3                 // timeouts in a row before a slave is treated as dead
+#define MASTER_DEAD_RETRY_US 1000000        // how often a dead slave is tried
+#define MASTER_TICK_US 38                   // the slaves' UPDATE_MODBUS_TIMER() period (MODBUS_TICK_CYCLES), MODBUS_DELAY
+                                            // is in these
+#define MASTER_TIMEOUT_MARGIN_CHARS 4       // character times allowed on top of the expected response time
+#define MASTER_MAX_PDU 253                  // function code and data, the most a serial frame can carry
+#define MASTER_BROADCAST_ID 0               // every slave
+#define MASTER_GROUP_BASE 248               // 248 to 255 are groups 0 to 7, the slaves' MODBUS_GROUP_BASE
+#define MASTER_FN_STREAM 0x41               // a push from a streaming slave, the slaves' MODBUS_FN_STREAM
+
+typedef void (*MasterSend)(void* user, const uint8_t* data, size_t len);
+// the response to a modbus_master_transact() request, function code first and without the address and LRC.
+// pdu is NULL and len 0 if the slave didn't answer.
+typedef void (*MasterDone)(void* user, const uint8_t* pdu, size_t len);
+// the registers pushed by a streaming slave, at is when the push started arriving (its ':').
+typedef void (*MasterStream)(void* user, uint8_t slave_id, const uint16_t* values, uint8_t count, uint64_t at_us);
+
+// Something to read: count registers from address on a slave, every period_us. The values are copied to dest.
+typedef struct MASTERPOLL {
+   uint8_t   slave;                          // index into ModbusMaster.slaves
+   uint16_t  address;
+   uint8_t   count;
+   uint32_t  period_us;
+   uint64_t  next_due_us;
+   uint16_t* dest;
+   uint8_t   in_request;                     // part of the request on the bus now
+   uint32_t  updates;                        // times dest has been filled in
+   uint64_t  updated_us;                     // when it was last filled in
+}MasterPoll;
+
+typedef struct MASTERSLAVE {
+   uint8_t   id;
+   uint32_t  turnaround_us;                  // end of request to start of response, learnt
+   uint8_t   timeouts_in_row;
+   uint8_t   dead;
+   uint64_t  retry_us;                       // when a dead slave is next tried
+   uint32_t  requests;
+   uint32_t  responses;
+   uint32_t  timeouts;
+   uint32_t  exceptions;
+   uint32_t  bad_frames;                     // bad LRC, wrong slave / function code / length
+}MasterSlave;
+
+typedef struct MODBUSMASTER {
+   MasterSend send;
+   void*     user;
+   uint32_t  char_ns;                        // one character time on the wire
+   uint32_t  default_turnaround_us;
+   uint8_t   merge_reads;                    // 1 to join adjacent reads into one fn3 (the default)
+   uint32_t  latency_us;                     // added to every timeout for the host's own serial delays, e.g. a
+                                             // USB adapter holding received bytes for a few mS. 0 by default.
+   MasterStream stream;                      // set by modbus_master_on_stream()
+   void*     stream_user;
+   uint32_t  pushes;                         // handed to stream
+
+   MasterSlave slaves[MASTER_MAX_SLAVES];
+   uint8_t   num_slaves;
+   MasterPoll polls[MASTER_MAX_POLLS];
+   uint8_t   num_polls;
+
+   // the request on the bus
+   uint8_t   waiting;                        // a response is expected, or a broadcast is being given time
+   uint8_t   broadcast;                      // the request is a broadcast, nothing will answer it
+   uint8_t   slave;                          // who to
+   uint16_t  address;
+   uint8_t   count;
+   uint64_t  request_end_us;                 // when the last character of the request will have been sent
+   uint64_t  deadline_us;                    // give up on the response at this time
+   MasterDone done;                          // set for a modbus_master_transact() request, NULL for polls
+   void*     done_user;
+
+   // the response coming in
+   uint8_t   receiving;                      // ':' has arrived
+   uint64_t  frame_start_us;                 // when it did
+   uint8_t   frame[MASTER_FRAME_SIZE];
+   size_t    frame_len;
+}ModbusMaster;
+
+// turnaround_ticks is the slaves' MODBUS_DELAY, the starting point for each slave's turnaround.
+void modbus_master_init(ModbusMaster* m, uint32_t baud, uint8_t turnaround_ticks, MasterSend send, void* user);
+// returns the index of the poll, or -1 if there is no room or the count is 0 or more than MASTER_MAX_READ.
+int modbus_master_add_poll(ModbusMaster* m, uint8_t slave_id, uint16_t address, uint8_t count, uint32_t period_us,
+                           uint16_t* dest);
+void modbus_master_rx_byte(ModbusMaster* m, uint8_t data, uint64_t now_us);
+// sends the next request if the bus is free, or gives up on the current one if it has timed out.
+void modbus_master_run(ModbusMaster* m, uint64_t now_us);
+// Send pdu (function code and data) to slave_id now. response_len is the longest PDU expected back, it sets the
+// timeout. done is called from modbus_master_rx_byte() or modbus_master_run() when the request is over.
+// Returns -1 if a request is already on the bus, there is no room for the slave or the PDU is too long.
+int modbus_master_transact(ModbusMaster* m, uint8_t slave_id, const uint8_t* pdu, size_t len, size_t response_len,
+                           MasterDone done, void* done_user, uint64_t now_us);
+// Send pdu (a fn6 or fn16) to every slave, address MASTER_BROADCAST_ID, or a group, MASTER_GROUP_BASE + group.
+// The bus is held until the slaves should all have carried it out, then done (if it isn't NULL) is called with
+// NULL and 0. Returns -1 if a request is already on the bus, the address isn't a broadcast one or the PDU is too
+// long.
+int modbus_master_broadcast(ModbusMaster* m, uint8_t address, const uint8_t* pdu, size_t len, MasterDone done,
+                            void* done_user, uint64_t now_us);
+// Receive pushes from streaming slaves, which are otherwise ignored. The slaves are set up with their hr_STREAM_...
+// registers like anything else.
+void modbus_master_on_stream(ModbusMaster* m, MasterStream stream, void* user);
+// 1 if the slave has stopped answering and isn't due to be tried again yet.
+uint8_t modbus_master_slave_dead(ModbusMaster* m, uint8_t slave_id, uint64_t now_us);
+
+#endif
@@ -0,0 +1,504 @@
+// Simulation of the motor data output (MotorOutput.h) on Timer1, checked against the old per-bit interrupt.
+//
+// The new output: Timer1 counts CPU cycles, each channel's compare unit toggles its pin when the count reaches its
+// OCR1x and then asks for the compare interrupt, which runs motor_channel_next_edge() and adds the result to OCR1x,
+// as the sketch's interrupts do. The interrupts are given the time they would take on the ATmega328 (estimates
+// from the instructions in them, SIM_..._CYCLES below) and start late by a random amount as well as when the other
+// channel's interrupt or the modbus tick's is running, so the check covers the interrupt loading an edge after it
+// has gone. The modbus tick is Timer2's compare interrupt every MODBUS_TICK_CYCLES. It has the higher priority but
+// lets the motor interrupts in (ISR_NOBLOCK), so it only holds them off for a moment. While a motor interrupt runs
+// only one of its compares is remembered, so it counts the ticks due off Timer1 as the sketch's does, making up the
+// ones it missed.
+// The old output: the interrupt which ran every bit time with a statemachine for the bits and one for the words,
+// ported as it was (only the speed reads are moved to a function). Whatever it set for the pin came out at the next
+// compare match, one bit time later.
+//
+// Both are run with the same speeds, a new one every frame, for each channel. The bit streams are compared bit
+// for bit from the first start bit, then the new one is decoded as a 9 bit serial line and each frame checked:
+// the marker, the speed twice, 0x55 and a sync pause of at least 500uS. Prints the interrupts per second against
+// the old interrupt's 26316, the CPU time the interrupts take (the motor's and the modbus tick's, against the old
+// interrupt which did both), the least time any interrupt had to spare before its next edge, and the longest a 
+// setpoint can wait for the frame which carries it.
+// The new output is run again with a slew rate limit (hr_SPEED_RAMP) and each frame's speed checked against the 
+// limit worked out here. Then the speed measurement (MotorFeedback.h) is given feedback lines of several 
+// frequencies, with jitter, and the speeds it publishes checked against them.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. MotorOutput.cpp MotorFeedback.cpp host/MotorSim.cpp -o motor_sim
+//   ./motor_sim [simulated_seconds]
+
+#include "MotorOutput.h"
+#include "MotorFeedback.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SIM_CPU_HZ 8000000UL
+#define SIM_SECONDS 2
+#define SIM_CHANNELS 2                      // 0 is the right channel on OC1A, 1 the left on OC1B
+#define SIM_MAX_BITS (SIM_CPU_HZ / MOTOR_BIT_CYCLES * 60 + 1)
+#define SIM_MAX_FRAMES (SIM_MAX_BITS / MOTOR_FRAME_BITS + 2)
+#define SIM_RAMP 300                        // the slew rate limit for the second run, speed per frame
+#define SIM_FEEDBACK_SECONDS 2
+#define SIM_FEEDBACK_JITTER 2               // percent of the period each feedback edge can be early or late
+#define SIM_SYNC_PAUSE_US 500               // the least idle the receivers need before a frame
+#define SIM_TICK_PERIOD 304UL               // MODBUS_TICK_CYCLES, the modbus tick interrupt's period
+
+// What the interrupts cost on the AVR, in CPU cycles. The Arduino build links with -flto, so 
+// motor_channel_next_edge() and motor_channel_load() are inlined into them. 
+#define SIM_ISR_ENTRY_CYCLES 35             // from the compare match to the first instruction after the pushes
+#define SIM_STEP_CYCLES 14                  // each bit time motor_channel_next_edge() steps through
+#define SIM_OCR_WRITE_CYCLES 30             // the rest of motor_channel_next_edge() and the add to OCR1x
+#define SIM_LOAD_CYCLES 800                 // motor_channel_load(), the setpoints and the measured speed's 32 bit 
+                                            // divide
+#define SIM_EXIT_CYCLES 30                  // the pops and the return
+#define SIM_TICK_CYCLES 100                 // the modbus tick interrupt counting one tick, all in
+#define SIM_TICK_MADE_UP_CYCLES 30          // each tick more it makes up
+#define SIM_TICK_HELD_CYCLES 20             // the most it holds the motor interrupts off, for its vector, the TCNT1
+                                            // read or counting a tick
+#define SIM_BLOCKED_CYCLES 60               // the most another interrupt (the USART's) holds them off
+#define SIM_OLD_CYCLES 110                  // the old interrupt with its modbus tick, over a frame's bit times
+
+static uint8_t new_bits[SIM_CHANNELS][SIM_MAX_BITS];
+static uint8_t old_bits[SIM_MAX_BITS];
+static unsigned long frames_loaded[SIM_CHANNELS];
+static int16_t expected_speed[SIM_CHANNELS][SIM_MAX_FRAMES];
+
+// The speed for a channel's nth frame. The edge cases first, then anything.
+static int16_t sim_speed(int channel, unsigned long frame) {
+    static const int16_t edge_cases[] = { 0, -1, 1, 0x00FF, 0x0100, 0x7FFF, -0x8000, 0x5555, -0x5556, 0x0155 };
+    uint32_t x;
+
+    if (frame < sizeof(edge_cases) / sizeof(edge_cases[0])) return edge_cases[frame];
+    x = (uint32_t)(frame * 2654435761UL + channel * 40503UL);
+    x ^= x >> 13;
+    x *= 0x5bd1e995UL;
+    x ^= x >> 15;
+    return (int16_t)x;
+}
+
+// What each frame should carry, frame n's speed moved from frame n-1's towards sim_speed(channel, n) by no more 
+// than ramp (0 for no limit). Frame 0 is motor_channel_init()'s, speed 0.
+static void expect_speeds(uint16_t ramp) {
+    int c;
+    unsigned long n;
+
+    for (c = 0; c < SIM_CHANNELS; c++) {
+        long sent = 0;
+        expected_speed[c][0] = 0;
+        for (n = 1; n < SIM_MAX_FRAMES; n++) {
+            long change = (long)sim_speed(c, n) - sent;
+            if (ramp && (change > ramp)) change = ramp;
+            if (ramp && (change < -(long)ramp)) change = -(long)ramp;
+            sent += change;
+            expected_speed[c][n] = (int16_t)sent;
+        }
+    }
+}
+
+// ------------------------------------------------------------------------------------------------------------------
+// THE OLD INTERRUPT
+// ------------------------------------------------------------------------------------------------------------------
+
+enum MSGST {sSTART_FRAME, sSPEED1, sSPEED2, sSPEED3, sSPEED4, sPAUSE};
+enum BITST {sD0, sD1, sD2, sD3, sD4, sD5, sD6, sD7, sD8, sSTOP, sFINISH, sIDLE, sSTART};
+
+typedef struct OLDMOTOR {
+   uint8_t   message_state;
+   uint8_t   bit_state;
+   uint8_t   delay_count;
+   uint8_t   rdata;
+   int16_t   rspeed;
+   uint8_t   next_level;                     // what the pin does at the next compare match
+   int       channel;
+   unsigned long frame;                      // the frame the speed is read for
+}OldMotor;
+
+// The old ISR(TIMER1_COMPA_vect), less the modbus timer and profiling.
+static void old_isr(OldMotor* m) {
+    switch(m->bit_state) {
+        case sIDLE :
+            m->next_level = 1;
+            break;
+        case sSTART:
+            m->next_level = 0;
+            m->bit_state = sD0;
+            break;
+        case sD0: case sD1: case sD2: case sD3: case sD4: case sD5: case sD6: case sD7:
+            m->next_level = (m->rdata & (1 << m->bit_state)) ? 1 : 0;
+            m->bit_state++;
+            break;
+        case sD8:
+            m->next_level = (m->message_state == sSTART_FRAME) ? 1 : 0;
+            m->bit_state = sSTOP;
+            break;
+        case sSTOP:
+            m->next_level = 1;
+            m->bit_state = sFINISH;
+            break;
+        case sFINISH:
+            m->next_level = 1;
+            m->bit_state = sIDLE;
+            break;
+        default :
+            m->bit_state = sIDLE;
+            m->next_level = 1;
+            break;
+    }
+    if (m->bit_state == sIDLE) {
+        switch(m->message_state) {
+            case sSTART_FRAME : m->rdata = (m->rspeed & 0xFF); break;
+            case sSPEED1 : m->rdata = ((m->rspeed >> 8) & 0xFF); break;
+            case sSPEED2 : m->rdata = (m->rspeed & 0xFF); break;
+            case sSPEED3 : m->rdata = ((m->rspeed >> 8) & 0xFF); break;
+            case sSPEED4 : m->rdata = 0x55; break;
+            default : break;
+        }
+        if (m->message_state >= sPAUSE) {
+            m->delay_count++;
+            m->rspeed = sim_speed(m->channel, m->frame);
+            if (m->delay_count > 13) {
+                m->delay_count = 0;
+                m->rdata = 0x00;
+                m->message_state = sSTART_FRAME;
+                m->bit_state = sSTART;
+                m->frame++;
+            }
+        }
+        else {
+            m->message_state++;
+            m->bit_state = sSTART;
+        }
+    }
+}
+
+// The old output for a channel, one level per bit time from the first compare match.
+static void run_old(int channel, unsigned long num_bits) {
+    OldMotor m;
+    unsigned long i;
+
+    memset(&m, 0, sizeof(m));
+    m.message_state = sPAUSE;
+    m.bit_state = sIDLE;
+    m.next_level = 1;
+    m.channel = channel;
+    for (i = 0; i < num_bits; i++) {
+        old_bits[i] = m.next_level;
+        old_isr(&m);
+    }
+}
+
+// ------------------------------------------------------------------------------------------------------------------
+// THE NEW OUTPUT ON A SIMULATED TIMER1
+// ------------------------------------------------------------------------------------------------------------------
+
+typedef struct SIMRESULT {
+   unsigned long interrupts[SIM_CHANNELS];
+   unsigned long ticks;                      // modbus tick interrupts
+   unsigned long made_up;                    // ticks they made up for compares missed
+   uint64_t  motor_cycles;                   // CPU cycles in the motor interrupts
+   uint64_t  tick_cycles;                    // and in the modbus tick's
+   unsigned long late;                       // edges loaded after they should have happened
+   long      least_spare;                    // cycles between loading an edge and it happening
+   uint64_t  setpoint_wait;                  // most cycles from just missing a frame's setpoint read to the start
+                                             // of the frame which has it
+}SimResult;
+
+// Fills new_bits[][] with each channel's level at every bit time of its own, from its first compare match.
+static void run_new(unsigned long num_bits, uint16_t ramp, SimResult* result) {
+    MotorChannel channels[SIM_CHANNELS];
+    uint64_t ocr[SIM_CHANNELS];
+    uint64_t phase[SIM_CHANNELS];
+    uint8_t level[SIM_CHANNELS];
+    unsigned long filled[SIM_CHANNELS];
+    uint64_t end = (uint64_t)num_bits * MOTOR_BIT_CYCLES;
+    uint64_t cpu_free = 0;
+    uint64_t tick_at = SIM_TICK_PERIOD;
+    uint64_t last_load[SIM_CHANNELS];
+    int c;
+
+    memset(result, 0, sizeof(*result));
+    result->least_spare = 0x7FFFFFFF;
+    srand(1);
+    for (c = 0; c < SIM_CHANNELS; c++) {
+        motor_channel_init(&channels[c]);
+        phase[c] = (uint64_t)c * (MOTOR_BIT_CYCLES / 2);      // as the sketch starts them
+        ocr[c] = phase[c] + MOTOR_BIT_CYCLES;
+        level[c] = 1;
+        new_bits[c][0] = 1;
+        filled[c] = 1;
+        frames_loaded[c] = 1;                                  // frame 0 is motor_channel_init()'s, speed 0
+        last_load[c] = 0;
+    }
+    for (;;) {
+        uint64_t t;
+        uint64_t start;
+        uint64_t loaded;
+        uint16_t cycles;
+        unsigned long steps;
+        unsigned long k;
+
+        // the next compare match, OC1A first if both are due (it has the higher priority)
+        c = (ocr[0] <= ocr[1]) ? 0 : 1;
+        t = ocr[c];
+        if (t >= end) break;
+
+        // the hardware toggles the pin, which holds until the next edge
+        k = (unsigned long)((t - phase[c]) / MOTOR_BIT_CYCLES);
+        if ((t - phase[c]) % MOTOR_BIT_CYCLES) {
+            printf("channel %d: an edge off the bit time grid at cycle %llu\n", c, (unsigned long long)t);
+            exit(1);
+        }
+        while (filled[c] < k) new_bits[c][filled[c]++] = level[c];
+        level[c] ^= 1;
+
+        // and the interrupt runs when it can, after any modbus ticks due by then
+        start = ((t > cpu_free) ? t : cpu_free) + (rand() % (SIM_BLOCKED_CYCLES + 1));
+        while (tick_at <= start) {
+            uint64_t tick_start = (tick_at > cpu_free) ? tick_at : cpu_free;
+            uint64_t busy = SIM_TICK_CYCLES;
+
+            // the compares while it waited are the one interrupt
+            while (tick_at + SIM_TICK_PERIOD <= tick_start) {
+                tick_at += SIM_TICK_PERIOD;
+                busy += SIM_TICK_MADE_UP_CYCLES;
+                result->made_up++;
+            }
+            tick_at += SIM_TICK_PERIOD;
+            result->ticks++;
+            result->tick_cycles += busy;
+            if (start < tick_start + SIM_TICK_HELD_CYCLES) start = tick_start + SIM_TICK_HELD_CYCLES;
+        }
+        start += SIM_ISR_ENTRY_CYCLES;
+        cycles = motor_channel_next_edge(&channels[c]);
+        steps = cycles / MOTOR_BIT_CYCLES;
+        if (MOTOR_FRAME_DUE(&channels[c])) steps -= MOTOR_PAUSE_BITS;
+        loaded = start + steps * SIM_STEP_CYCLES + SIM_OCR_WRITE_CYCLES;
+        ocr[c] = t + cycles;
+        if ((int64_t)(ocr[c] - loaded) < result->least_spare) result->least_spare = (long)(int64_t)(ocr[c] - loaded);
+        if (loaded >= ocr[c]) result->late++;
+        cpu_free = loaded + SIM_EXIT_CYCLES;
+        result->motor_cycles += cpu_free - start + SIM_ISR_ENTRY_CYCLES;
+        if (MOTOR_FRAME_DUE(&channels[c])) {
+            motor_channel_load(&channels[c], sim_speed(c, frames_loaded[c]++), ramp);
+            cpu_free += SIM_LOAD_CYCLES;
+            result->motor_cycles += SIM_LOAD_CYCLES;
+            // a setpoint which came just after the last read waits for this one, then for the frame to start
+            if (last_load[c] && (ocr[c] - last_load[c] > result->setpoint_wait)) {
+                result->setpoint_wait = ocr[c] - last_load[c];
+            }
+            last_load[c] = start;
+        }
+        result->interrupts[c]++;
+    }
+    for (c = 0; c < SIM_CHANNELS; c++) {
+        while (filled[c] < num_bits) new_bits[c][filled[c]++] = level[c];
+    }
+    for (; tick_at < end; tick_at += SIM_TICK_PERIOD) {
+        result->ticks++;
+        result->tick_cycles += SIM_TICK_CYCLES;
+    }
+}
+
+// ------------------------------------------------------------------------------------------------------------------
+// CHECKS
+// ------------------------------------------------------------------------------------------------------------------
+
+static unsigned long first_start_bit(const uint8_t* bits, unsigned long num_bits) {
+    unsigned long i;
+    for (i = 0; (i < num_bits) && bits[i]; i++);
+    return i;
+}
+
+// Compares from each stream's first start bit, returns the number of bits which differ.
+static unsigned long compare_streams(const uint8_t* a, const uint8_t* b, unsigned long num_bits) {
+    unsigned long ia = first_start_bit(a, num_bits);
+    unsigned long ib = first_start_bit(b, num_bits);
+    unsigned long differ = 0;
+    unsigned long first = 0;
+
+    while ((ia < num_bits) && (ib < num_bits)) {
+        if (a[ia] != b[ib]) {
+            if (differ == 0) first = ia;
+            differ++;
+        }
+        ia++;
+        ib++;
+    }
+    if (differ) printf("  first difference at bit %lu\n", first);
+    return differ;
+}
+
+// Decodes the stream as a 9 bit serial line and checks every whole frame. Returns the frames which were right,
+// or -1 after printing what was wrong.
+static long decode_frames(int channel, const uint8_t* bits, unsigned long num_bits) {
+    unsigned long i = first_start_bit(bits, num_bits);
+    unsigned long idle = 0;
+    unsigned long frame = 0;
+    int word = 0;
+    uint16_t expected[MOTOR_FRAME_WORDS];
+
+    while (i + MOTOR_WORD_BITS <= num_bits) {
+        uint16_t data = 0;
+        int b;
+
+        if (bits[i]) {
+            idle++;
+            i++;
+            continue;
+        }
+        // a start bit
+        if ((word == 0) && (frame > 0) && (idle * MOTOR_BIT_CYCLES * 1000000UL < SIM_SYNC_PAUSE_US * SIM_CPU_HZ)) {
+            printf("channel %d frame %lu: the sync pause was only %lu bit times\n", channel, frame, idle);
+            return -1;
+        }
+        if ((word != 0) && (idle != 1)) {
+            printf("channel %d frame %lu word %d: %lu bit times idle between words\n", channel, frame, word, idle);
+            return -1;
+        }
+        for (b = 0; b < 9; b++) data |= (uint16_t)bits[i + 1 + b] << b;
+        if (!bits[i + 10]) {
+            printf("channel %d frame %lu word %d: no stop bit\n", channel, frame, word);
+            return -1;
+        }
+        if (word == 0) {
+            int16_t speed = expected_speed[channel][frame];
+            expected[0] = MOTOR_FRAME_MARKER;
+            expected[1] = (uint8_t)speed;
+            expected[2] = (uint8_t)((uint16_t)speed >> 8);
+            expected[3] = expected[1];
+            expected[4] = expected[2];
+            expected[5] = MOTOR_END_OF_FRAME;
+        }
+        if (data != expected[word]) {
+            printf("channel %d frame %lu word %d: 0x%03X, should be 0x%03X\n", channel, frame, word, data,
+                   expected[word]);
+            return -1;
+        }
+        i += 11;
+        idle = 0;
+        if (++word == MOTOR_FRAME_WORDS) {
+            word = 0;
+            frame++;
+        }
+    }
+    return (long)frame;
+}
+
+// Runs a feedback line of hz edges per second through the measurement while the motor is sent the speed sent, and 
+// checks every speed published after the first (which may have started part way through a period): within 
+// SIM_FEEDBACK_JITTER percent plus 1 edge/s, with the sign of sent. With hz 0 there must be none, the measured 
+// register starts at 0.
+// Returns the last speed published, or prints what was wrong and exits.
+static int16_t check_feedback(double hz, int16_t sent) {
+    MotorFeedback fb;
+    uint64_t end = (uint64_t)SIM_FEEDBACK_SECONDS * SIM_CPU_HZ;
+    uint64_t frame_at = 20000;                       // the right channel's frame due edge is about here
+    uint64_t edge_at = 1000;
+    double period = hz ? SIM_CPU_HZ / hz : 0;
+    unsigned long edges = 0;
+    unsigned long published = 0;
+    int16_t speed = 0;
+    int16_t measured;
+    double want = (sent < 0) ? -hz : hz;
+
+    srand(2);
+    motor_feedback_init(&fb, 0);
+    for (;;) {
+        if (hz && (edge_at < frame_at)) {
+            motor_feedback_edge(&fb, (uint16_t)edge_at);
+            edges++;
+            edge_at = (uint64_t)(1000 + edges * period +
+                                 period * SIM_FEEDBACK_JITTER / 100.0 * ((rand() % 2001) - 1000) / 1000.0);
+            continue;
+        }
+        if (frame_at >= end) break;
+        if (motor_feedback_frame(&fb, (uint16_t)frame_at, sent, &measured)) {
+            published++;
+            speed = measured;
+            if ((hz == 0) || 
+                ((published > 1) && (fabs(measured - want) > fabs(want) * SIM_FEEDBACK_JITTER / 100.0 + 1))) {
+                printf("feedback at %.0f edges/s: measured %d\n", want, measured);
+                exit(1);
+            }
+        }
+        frame_at += MOTOR_FRAME_CYCLES;
+    }
+    if ((hz != 0) && (published == 0)) {
+        printf("feedback at %.0f edges/s: %lu speeds\n", want, published);
+        exit(1);
+    }
+    return speed;
+}
+
+int main(int argc, char** argv) {
+    unsigned long seconds = SIM_SECONDS;
+    unsigned long num_bits;
+    unsigned long total = 0;
+    SimResult result;
+    int failed = 0;
+    int c;
+
+    if (argc > 1) seconds = strtoul(argv[1], NULL, 0);
+    if ((seconds == 0) || (seconds > 60)) seconds = SIM_SECONDS;
+    num_bits = seconds * SIM_CPU_HZ / MOTOR_BIT_CYCLES;
+
+    expect_speeds(0);
+    run_new(num_bits, 0, &result);
+    printf("%lu simulated seconds, %lu bit times of 38uS, frames of %d bit times\n", seconds, num_bits,
+           MOTOR_FRAME_BITS);
+    for (c = 0; c < SIM_CHANNELS; c++) {
+        unsigned long differ;
+        long frames;
+
+        run_old(c, num_bits);
+        differ = compare_streams(new_bits[c], old_bits, num_bits);
+        frames = decode_frames(c, new_bits[c], num_bits);
+        printf("%s channel: %lu bits differ from the old interrupt, %ld frames decoded, %8.0f interrupts/s\n",
+               c ? "left " : "right", differ, frames, result.interrupts[c] / (double)seconds);
+        if (differ || (frames <= 0)) failed = 1;
+        total += result.interrupts[c];
+    }
+    printf("both channels: %8.0f interrupts/s, the old interrupt took %8.0f/s for one\n", total / (double)seconds,
+           (double)SIM_CPU_HZ / MOTOR_BIT_CYCLES);
+    {
+        double old_cycles = (double)SIM_CPU_HZ / MOTOR_BIT_CYCLES * SIM_OLD_CYCLES;
+        double motor_cycles = result.motor_cycles / (double)seconds;
+        double tick_cycles = result.tick_cycles / (double)seconds;
+
+        printf("interrupt CPU time: old %8.0f cycles/s (%.1f%%), one channel and the modbus tick\n", old_cycles,
+               old_cycles * 100 / SIM_CPU_HZ);
+        printf("                    new %8.0f cycles/s (%.1f%%), both channels %.0f (%.1f%%) and the modbus tick %.0f "
+               "(%.1f%%)\n", motor_cycles + tick_cycles, (motor_cycles + tick_cycles) * 100 / SIM_CPU_HZ, motor_cycles,
+               motor_cycles * 100 / SIM_CPU_HZ, tick_cycles, tick_cycles * 100 / SIM_CPU_HZ);
+        printf("modbus tick: %8.0f interrupts/s, %lu ticks made up for compares missed\n",
+               result.ticks / (double)seconds, result.made_up);
+        printf("one interrupt per word for both channels would be %8.0f interrupts/s\n",
+               (double)SIM_CPU_HZ / MOTOR_FRAME_CYCLES * MOTOR_FRAME_WORDS * SIM_CHANNELS);
+    }
+    printf("edges loaded late: %lu, least time to spare %ld cycles (%.1f uS)\n", result.late, result.least_spare,
+           result.least_spare * 1e6 / SIM_CPU_HZ);
+    printf("setpoint to the start of the frame with it: at most %.0f uS\n", result.setpoint_wait * 1e6 / SIM_CPU_HZ);
+    if (result.late) failed = 1;
+
+    expect_speeds(SIM_RAMP);
+    run_new(num_bits, SIM_RAMP, &result);
+    for (c = 0; c < SIM_CHANNELS; c++) {
+        long frames = decode_frames(c, new_bits[c], num_bits);
+        printf("%s channel ramped by %d a frame: %ld frames decoded\n", c ? "left " : "right", SIM_RAMP, frames);
+        if (frames <= 0) failed = 1;
+    }
+    if (result.late) failed = 1;
+
+    {
+        static const double rates[] = { 0, 6, 50, 300, 1000, 4000, 25000 };
+        unsigned i;
+        for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+            printf("feedback %6.0f edges/s: measured %6d, %6d going backwards\n", rates[i], 
+                   check_feedback(rates[i], 500), check_feedback(rates[i], -500));
+        }
+    }
+    if (failed) printf("FAILED\n");
+    return failed;
+}
@@ -0,0 +1,192 @@
+// Reads the profiling results (MODBUS_PROFILE in AsciiModbusSlave.h) back over the bus, as a master would from a
+// board, and checks them.
+//
+// One slave (built with MODBUS_PROFILE) is sent ASCII requests a character time at a time, with its timer ticked
+// and modbus_slave_update() called once a character (host/SimSlave.h). A stand in for the motor interrupt
+// (MODBUS_PROFILE_ISR_BEGIN() / _END()) runs every SIM_ISR_EVERY characters, and reports itself late once. The
+// master:
+//   - sends fn3 reads, fn6 and fn16 writes, a fn23, a request for another slave and one with a bad LRC
+//   - reads every MODBUS_PROFILE_... number with a fn23 which writes it into hr_PROFILE_SELECT and reads
+//     hr_PROFILE_MIN ... hr_PROFILE_ISR_OVERRUNS back in the same request, and prints them as a table
+//   - clears them with MODBUS_PROFILE_CLEAR and reads the update's numbers again
+// and checks that every state the requests go through was timed, that min <= average <= max for everything
+// timed, that the interrupt was timed with the one late edge counted, that a number which isn't anything reads as
+// 0, and that the clear started the counts again. Exits with 1 if any check fails.
+// The times are host time counted in 8MHz cycles (host_profile_clock()), so only the counts and the shape mean
+// anything here, not the numbers of cycles.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -DMODBUS_PROFILE=1 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/HexCodec.cpp host/SimSlave.cpp
+//       host/ProfileRead.cpp -o profile_read
+//   ./profile_read
+
+#include "AsciiModbusSlave.h"
+#include "host/SimSlave.h"
+#include "ModbusStateMachine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !MODBUS_PROFILE
+#error "build with -DMODBUS_PROFILE=1"
+#endif
+
+#define SIM_SLAVE_ID 1
+#define SIM_OTHER_ID 9
+#define SIM_REQUESTS 50                           // of each kind
+#define SIM_ISR_EVERY 4                           // characters between motor interrupts
+#define SIM_PROFILE_SELECT 0x0080                 // the addresses of the PROFILE registers in MODBUS_PROFILE_REGISTERS
+#define SIM_PROFILE_MIN 0x0081
+#define SIM_PROFILE_COUNT 5                       // MIN, MAX, AVERAGE, CALLS, ISR_OVERRUNS
+#define SIM_SPEED_RAMP 0x0005
+#define SIM_NOTHING 0x50                          // between the receive states and MODBUS_PROFILE_UPDATE
+
+typedef struct PROFILED {
+    uint16_t  min;
+    uint16_t  max;
+    uint16_t  average;
+    uint16_t  calls;
+    uint16_t  isr_overruns;
+} Profiled;
+
+#define SM_NAME(state, ...) #state,
+static const char* const tx_names[] = {MODBUS_TX_STATES(SM_NAME)};
+static const char* const rx_names[] = {MODBUS_RX_STATES(SM_NAME)};
+
+// the states the requests sent must go through
+static const uint8_t tx_used[] = {mTXSTART, mCOLON, mSLAVEID, mFNCODE, mCHOICE, mNUMDATA, mTXREG, mDATAADD, mVALUE,
+                                  mLRC, mCRLF, mFINISH};
+static const uint8_t rx_used[] = {sSLAVE_ADDRESS, sCOMMAND, sREG_ADDRESS1, sREG_NUM_OR_ADDRESS2, sVALUE1, sVALUE2,
+                                  sWRITE_ADDRESS1, sWRITE_ADDRESS2, sWRITE_NUM1, sWRITE_NUM2, sBYTE_COUNT, sDATA,
+                                  sLRC};
+
+static SimSlave sim;
+static uint8_t late_sent = 0;
+static unsigned long failures = 0;
+
+static void check(int ok, const char* what) {
+    if (!ok) {
+        failures++;
+        printf("FAILED: %s\n", what);
+    }
+}
+
+// Every SIM_ISR_EVERY characters, the motor interrupt.
+static void motor_isr(SimSlave* sim, int16_t, int16_t) {
+    if ((sim->chars % SIM_ISR_EVERY) == 0) {
+        MODBUS_PROFILE_ISR_BEGIN();
+        if (!late_sent) {
+            MODBUS_PROFILE_ISR_LATE();
+            late_sent = 1;
+        }
+        MODBUS_PROFILE_ISR_END();
+    }
+}
+
+// A fn23 which writes select into hr_PROFILE_SELECT and reads what it selects.
+static void read_profile(uint16_t select, Profiled* p) {
+    uint8_t pdu[] = {SIM_SLAVE_ID, 0x17, (uint8_t)(SIM_PROFILE_MIN >> 8), (uint8_t)SIM_PROFILE_MIN, 0x00,
+                     SIM_PROFILE_COUNT, (uint8_t)(SIM_PROFILE_SELECT >> 8), (uint8_t)SIM_PROFILE_SELECT, 0x00, 0x01,
+                     0x02, (uint8_t)(select >> 8), (uint8_t)select};
+    uint16_t values[SIM_PROFILE_COUNT];
+    int i;
+
+    sim_slave_request(&sim, pdu, sizeof(pdu), 0);
+    for (i = 0; i < SIM_PROFILE_COUNT; i++) {
+        values[i] = (uint16_t)(sim_slave_answer_byte(&sim, 3 + i * 2) << 8 | sim_slave_answer_byte(&sim, 4 + i * 2));
+    }
+    p->min = values[0];
+    p->max = values[1];
+    p->average = values[2];
+    p->calls = values[3];
+    p->isr_overruns = values[4];
+}
+
+// The requests whose handling is profiled.
+static void send_traffic() {
+    static const uint8_t fn3[] = {SIM_SLAVE_ID, 0x03, 0x00, 0x00, 0x00, 0x04};
+    static const uint8_t fn16[] = {SIM_SLAVE_ID, 0x10, 0x00, 0x00, 0x00, 0x02, 0x04, 0x01, 0x00, 0x02, 0x00};
+    static const uint8_t fn23[] = {SIM_SLAVE_ID, 0x17, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x01, 0x02, 0x00,
+                                   0x10};
+    static const uint8_t other[] = {SIM_OTHER_ID, 0x03, 0x00, 0x00, 0x00, 0x04};
+    int i;
+
+    for (i = 0; i < SIM_REQUESTS; i++) {
+        sim_slave_request(&sim, fn3, sizeof(fn3), 0);
+        sim_slave_write_register(&sim, SIM_SPEED_RAMP, (uint16_t)(i * 10));
+        sim_slave_request(&sim, fn16, sizeof(fn16), 0);
+        sim_slave_request(&sim, fn23, sizeof(fn23), 0);
+        sim_slave_request(&sim, other, sizeof(other), 0);
+        sim_slave_request(&sim, fn3, sizeof(fn3), 1);
+    }
+}
+
+static void print_row(const char* name, const Profiled* p) {
+    printf("  %-22s %6u %6u %6u %6u\n", name, p->min, p->max, p->average, p->calls);
+}
+
+// Timed something, and its numbers are in order.
+static void check_row(const char* name, const Profiled* p, int used) {
+    char what[96];
+
+    snprintf(what, sizeof(what), "%s wasn't timed", name);
+    if (used) check(p->calls > 0, what);
+    if (p->calls > 0) {
+        snprintf(what, sizeof(what), "%s has min, average, max out of order", name);
+        check((p->min <= p->average) && (p->average <= p->max), what);
+    }
+}
+
+static int listed(const uint8_t* list, size_t n, uint8_t state) {
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (list[i] == state) return 1;
+    }
+    return 0;
+}
+
+int main() {
+    Profiled p;
+    Profiled update;
+    uint8_t s;
+
+    sim_slave_init(&sim, SIM_SLAVE_ID, motor_isr);
+    send_traffic();
+
+    printf("profile read back over the bus, host time in 8MHz cycles: %lu characters, %d of each request\n", sim.chars,
+           SIM_REQUESTS);
+    printf("  %-22s %6s %6s %6s %6s\n", "", "min", "max", "avg", "calls");
+    for (s = 0; s < mMAX_STATES; s++) {
+        read_profile(MODBUS_PROFILE_TX + s, &p);
+        if (p.calls) print_row(tx_names[s], &p);
+        check_row(tx_names[s], &p, listed(tx_used, sizeof(tx_used), s));
+    }
+    for (s = 0; s < sMAX_STATES; s++) {
+        read_profile(MODBUS_PROFILE_RX + s, &p);
+        if (p.calls) print_row(rx_names[s], &p);
+        check_row(rx_names[s], &p, listed(rx_used, sizeof(rx_used), s));
+    }
+    read_profile(MODBUS_PROFILE_UPDATE, &update);
+    print_row("modbus_slave_update()", &update);
+    check_row("modbus_slave_update()", &update, 1);
+    read_profile(MODBUS_PROFILE_ISR, &p);
+    print_row("motor interrupt", &p);
+    check_row("motor interrupt", &p, 1);
+    printf("  interrupt overruns %u\n", p.isr_overruns);
+    check(p.isr_overruns == 1, "the late interrupt wasn't counted once");
+    read_profile(SIM_NOTHING, &p);
+    check((p.min | p.max | p.average | p.calls) == 0, "a number which isn't anything didn't read as 0");
+
+    // clear, then only the updates since are counted
+    sim_slave_write_register(&sim, SIM_PROFILE_SELECT, MODBUS_PROFILE_CLEAR);
+    read_profile(MODBUS_PROFILE_UPDATE, &p);
+    printf("  after clearing, modbus_slave_update() calls %u (%u before)\n", p.calls, update.calls);
+    check((p.calls > 0) && (p.calls < 200) && (p.calls < update.calls), "clearing didn't start the counts again");
+    read_profile(MODBUS_PROFILE_ISR, &p);
+    check(p.isr_overruns == 0, "clearing didn't clear the interrupt overruns");
+    check(sim.unanswered == 0, "a request wasn't answered");
+
+    printf("%s\n", failures ? "FAILED" : "ok");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,413 @@
+// Regression benchmark for the slave's frame handling: replays a corpus of bus traffic through a slave context.
+//
+// Each scenario is a stream of bytes as they would arrive on the wire: well formed fn3 and fn6 requests, frames
+// for other slave IDs, frames with spaces and tabs between the hex pairs (which the receiver skips), frames with a
+// bad LRC, frames cut off by a ':' and started again, and a mix like a busy shared bus. A capture of real traffic
+// (raw bytes, e.g. from a serial sniffer) can be added with -r.
+// The stream is fed to modbus_slave_rx_byte() BENCH_CHARS_PER_STEP bytes at a time with the matching timer ticks,
+// then modbus_slave_update() is called and the response taken, over and over until at least the given number of
+// bytes has gone in. So the whole receive statemachine, the request processing and the transmit statemachine
+// (the hex encoding and LRC of the responses) are timed together.
+//
+// For each scenario it prints cycles per received byte (the x86 time stamp counter, nanoseconds elsewhere),
+// frames per second and the number of allocations made while it ran, which must be 0. The number of responses
+// is checked against what the corpus should get, so a change which breaks the parsing can't look like a speed up.
+// It also prints what the board's CPU would be spared, which the host's speed doesn't show: "rx %" is the share of
+// the bytes which the rx interrupt put into rx (the rest were skipped as part of a frame for another slave, see
+// AsciiModbusSlave.h), and "idle %" the share of the modbus_slave_update() calls after which the slave had nothing
+// to do, when modbus_idle() would let the CPU sleep.
+//
+// Every burst of a scenario is run right after a burst of a reference receiver over the same bytes, a bare hex
+// decode and LRC with a call per byte, which no change to the slave touches. "vs ref" is the median over the bursts
+// of the scenario's cycles/byte over the reference's just before it. The host's clock speed and load move both, so
+// it holds from run to run where cycles/byte doesn't, and moves much less from one machine to another.
+// With -b the "vs ref" of each scenario is compared with a baseline file, and the exit code is 1 if any is more
+// than BENCH_TOLERANCE_PERCENT higher, or anything else is wrong. -w writes them as a new baseline. The bursts are
+// shorter with a smaller -n, which moves "vs ref" too, so host/replay_baseline.txt is for the default.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/ReplayBench.cpp -o replay_bench
+//   ./replay_bench [-n bytes] [-b host/replay_baseline.txt] [-w new_baseline.txt] [-r capture.bin]
+
+#include "AsciiModbusSlave.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define BENCH_SLAVE_ID 0xA5
+#define BENCH_FOREIGN_ID 0x11
+#define BENCH_DEFAULT_BYTES 20000000UL
+#define BENCH_CHARS_PER_STEP 8            // bytes given to the slave between calls to modbus_slave_update()
+#define BENCH_TICKS_PER_CHAR 4            // timer ticks (38uS) in one character time (173uS) at 57600
+#define BENCH_RUNS 40                     // each scenario is run in this many short bursts, the fastest is shown
+                                          // as it leaves out the bursts slowed by other programs
+#define BENCH_TOLERANCE_PERCENT 25        // "vs ref" moves by up to about 12% between runs on a loaded host
+#define BENCH_MAX_SCENARIOS 16
+#define BENCH_STREAM_SIZE 4096
+#define BENCH_CAPTURE_SIZE (1024 * 1024)
+
+typedef std::chrono::steady_clock Clock;
+
+typedef struct SCENARIO {
+   const char* name;
+   uint8_t*  stream;
+   size_t    len;
+   unsigned long frames;                     // in one pass of the stream
+   long      responses;                      // expected in one pass, -1 for a capture where it isn't known
+}Scenario;
+
+typedef struct RESULT {
+   double    cycles_per_byte;
+   double    vs_reference;                   // the median of cycles_per_byte over the reference's
+   double    frames_per_second;
+   unsigned long allocations;
+   double    queued_percent;                 // of the bytes received, those the rx interrupt put into rx
+   double    idle_percent;                   // of the modbus_slave_update() calls, those after which it was idle
+   uint8_t   responses_ok;
+}Result;
+
+//----Allocation counting--------------
+
+// The slave never allocates. Every malloc() made while a scenario runs is counted to make sure it stays that way.
+#ifdef __GLIBC__
+extern "C" void* __libc_malloc(size_t size);
+static volatile unsigned long allocations = 0;
+extern "C" void* malloc(size_t size) {
+    allocations++;
+    return __libc_malloc(size);
+}
+#else
+static volatile unsigned long allocations = 0;
+#endif
+
+static uint64_t cycles_now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+#endif
+}
+
+//----The corpus-----------------------
+
+// Append an ASCII frame ":<hex bytes><lrc>\r\n" for the binary bytes. pad puts a space or tab after every hex
+// pair, bad_lrc gets the LRC wrong and cut stops after that many hex pairs (0 for the whole frame).
+static void add_frame(Scenario* s, const uint8_t* bytes, size_t n, uint8_t pad, uint8_t bad_lrc, size_t cut) {
+    static const char hex[] = "0123456789ABCDEF";
+    uint8_t lrc = 0;
+    size_t i;
+
+    s->stream[s->len++] = ':';
+    for (i = 0; i <= n; i++) {
+        uint8_t b;
+        if (cut && (i == cut)) return;
+        if (i < n) {
+            b = bytes[i];
+            lrc += b;
+        }
+        else b = (uint8_t)(bad_lrc ? (1 - lrc) : -lrc);
+        s->stream[s->len++] = hex[b >> 4];
+        s->stream[s->len++] = hex[b & 0x0F];
+        if (pad) s->stream[s->len++] = (i & 1) ? '\t' : ' ';
+    }
+    s->stream[s->len++] = '\r';
+    s->stream[s->len++] = '\n';
+    s->frames++;
+}
+
+static const uint8_t fn3[] = {BENCH_SLAVE_ID, 0x03, 0x00, 0x00, 0x00, 0x04};
+static const uint8_t fn6[] = {BENCH_SLAVE_ID, 0x06, 0x00, 0x00, 0x12, 0x34};
+static const uint8_t fn3_foreign[] = {BENCH_FOREIGN_ID, 0x03, 0x00, 0x00, 0x00, 0x04};
+static const uint8_t fn6_foreign[] = {BENCH_FOREIGN_ID + 1, 0x06, 0x00, 0x01, 0x56, 0x78};
+// what another slave sends back to fn3_foreign, the other slaves see it on the bus too
+static const uint8_t response_foreign[] = {BENCH_FOREIGN_ID, 0x03, 0x08, 0x00, 0x01, 0x00, 0x02, 0x00, 0x03, 0x00, 0x04};
+
+static Scenario* new_scenario(Scenario* list, int* count, const char* name) {
+    Scenario* s = &list[(*count)++];
+
+    memset(s, 0, sizeof(Scenario));
+    s->name = name;
+    s->stream = (uint8_t*)calloc(1, BENCH_STREAM_SIZE);
+    return s;
+}
+
+static int build_corpus(Scenario* list) {
+    Scenario* s;
+    int count = 0;
+    int i;
+
+    s = new_scenario(list, &count, "fn3");
+    add_frame(s, fn3, sizeof(fn3), 0, 0, 0);
+    s->responses = 1;
+
+    s = new_scenario(list, &count, "fn6");
+    add_frame(s, fn6, sizeof(fn6), 0, 0, 0);
+    s->responses = 1;
+
+    s = new_scenario(list, &count, "foreign");
+    add_frame(s, fn3_foreign, sizeof(fn3_foreign), 0, 0, 0);
+    add_frame(s, response_foreign, sizeof(response_foreign), 0, 0, 0);
+    add_frame(s, fn6_foreign, sizeof(fn6_foreign), 0, 0, 0);
+    add_frame(s, fn6_foreign, sizeof(fn6_foreign), 0, 0, 0);
+    s->responses = 0;
+
+    s = new_scenario(list, &count, "padded");
+    add_frame(s, fn3, sizeof(fn3), 1, 0, 0);
+    s->responses = 1;
+
+    s = new_scenario(list, &count, "bad_lrc");
+    add_frame(s, fn3, sizeof(fn3), 0, 1, 0);
+    add_frame(s, fn6, sizeof(fn6), 0, 1, 0);
+    s->responses = 0;
+
+    // a frame broken off part way by the next ':', which must still be answered
+    s = new_scenario(list, &count, "resync");
+    add_frame(s, fn6, sizeof(fn6), 0, 0, 3);
+    add_frame(s, fn3, sizeof(fn3), 0, 0, 0);
+    s->responses = 1;
+
+    // a shared bus: for every request to us, seven requests and responses between the master and other slaves,
+    // a corrupt frame and a request broken off by the next one.
+    s = new_scenario(list, &count, "bus_mix");
+    for (i = 0; i < 7; i++) {
+        add_frame(s, fn3_foreign, sizeof(fn3_foreign), 0, 0, 0);
+        add_frame(s, response_foreign, sizeof(response_foreign), 0, 0, 0);
+    }
+    add_frame(s, fn6_foreign, sizeof(fn6_foreign), 0, 1, 0);
+    add_frame(s, fn3, sizeof(fn3), 0, 0, 2);
+    add_frame(s, fn3, sizeof(fn3), 0, 0, 0);
+    s->responses = 1;
+    return count;
+}
+
+// Raw bytes from a file, -1 if it can't be read.
+static int add_capture(Scenario* list, int* count, const char* path) {
+    FILE* f = fopen(path, "rb");
+    Scenario* s;
+    size_t i;
+
+    if (!f || (*count >= BENCH_MAX_SCENARIOS)) return -1;
+    s = &list[(*count)++];
+    memset(s, 0, sizeof(Scenario));
+    s->name = "capture";
+    s->stream = (uint8_t*)malloc(BENCH_CAPTURE_SIZE);
+    s->len = s->stream ? fread(s->stream, 1, BENCH_CAPTURE_SIZE, f) : 0;
+    fclose(f);
+    for (i = 0; i < s->len; i++) {
+        if (s->stream[i] == '\n') s->frames++;
+    }
+    s->responses = -1;
+    return (s->len && s->frames) ? 0 : -1;
+}
+
+//----The reference--------------------
+
+typedef struct REFERENCE {
+   uint8_t   frame[256];
+   uint8_t   len;
+   uint8_t   lrc;
+   uint8_t   high;                           // the first digit of a hex pair, 0xFF before it
+   unsigned long frames;                     // with a good LRC
+}Reference;
+
+static void __attribute__((noinline)) reference_rx_byte(Reference* ref, uint8_t c) {
+    uint8_t nibble;
+
+    if (c == ':') {
+        ref->len = 0;
+        ref->lrc = 0;
+        ref->high = 0xFF;
+        return;
+    }
+    if (c == '\n') {
+        if ((ref->len > 0) && (ref->lrc == 0)) ref->frames++;
+        ref->len = 0;
+        return;
+    }
+    if ((c >= '0') && (c <= '9')) nibble = (uint8_t)(c - '0');
+    else if ((c >= 'A') && (c <= 'F')) nibble = (uint8_t)(c - 'A' + 10);
+    else return;
+    if (ref->high == 0xFF) {
+        ref->high = nibble;
+        return;
+    }
+    ref->frame[ref->len] = (uint8_t)((ref->high << 4) | nibble);
+    ref->lrc += ref->frame[ref->len++];
+    ref->high = 0xFF;
+}
+
+static double run_reference(const Scenario* s, unsigned long min_bytes) {
+    static Reference ref;
+    unsigned long passes = (min_bytes + s->len - 1) / s->len;
+    unsigned long p;
+    uint64_t start_cycles;
+    size_t i;
+
+    memset(&ref, 0, sizeof(ref));
+    start_cycles = cycles_now();
+    for (p = 0; p < passes; p++) {
+        for (i = 0; i < s->len; i++) reference_rx_byte(&ref, s->stream[i]);
+    }
+    return (double)(cycles_now() - start_cycles) / ((double)passes * s->len);
+}
+
+//----Running--------------------------
+
+static void run_scenario(const Scenario* s, unsigned long min_bytes, Result* r) {
+    static ModbusSlave slave;
+    unsigned long passes = (min_bytes + s->len - 1) / s->len;
+    unsigned long responses = 0;
+    unsigned long queued = 0;
+    unsigned long updates = 0;
+    unsigned long idle = 0;
+    unsigned long before;
+    uint8_t head;
+    unsigned long p;
+    size_t at;
+    size_t end;
+    size_t i;
+    int16_t data;
+    uint64_t start_cycles;
+    uint64_t cycles;
+    Clock::time_point start;
+    double secs;
+
+    modbus_slave_init(&slave, BENCH_SLAVE_ID, MODBUS_ASCII, NULL);
+    before = allocations;
+    start = Clock::now();
+    start_cycles = cycles_now();
+    for (p = 0; p < passes; p++) {
+        for (at = 0; at < s->len; at = end) {
+            end = (at + BENCH_CHARS_PER_STEP < s->len) ? at + BENCH_CHARS_PER_STEP : s->len;
+            head = slave.rx.head;
+            for (i = at; i < end; i++) modbus_slave_rx_byte(&slave, s->stream[i]);
+            queued += (uint8_t)(slave.rx.head - head);
+            for (i = 0; i < BENCH_CHARS_PER_STEP * BENCH_TICKS_PER_CHAR; i++) MODBUS_SLAVE_UPDATE_TIMER(&slave);
+            modbus_slave_update(&slave);
+            while ((data = modbus_slave_tx_byte(&slave)) >= 0) {
+                if (data == '\n') responses++;
+            }
+            updates++;
+            idle += modbus_slave_idle(&slave);
+        }
+        // let the last response of the pass go out before the next pass starts, like the gap before a master
+        // sends its next request.
+        for (i = 0; i < 4 * MODBUS_DELAY; i++) {
+            MODBUS_SLAVE_UPDATE_TIMER(&slave);
+            modbus_slave_update(&slave);
+            while ((data = modbus_slave_tx_byte(&slave)) >= 0) {
+                if (data == '\n') responses++;
+            }
+        }
+    }
+    cycles = cycles_now() - start_cycles;
+    secs = std::chrono::duration<double>(Clock::now() - start).count();
+    r->allocations = allocations - before;
+    r->cycles_per_byte = (double)cycles / ((double)passes * s->len);
+    r->frames_per_second = (double)passes * s->frames / secs;
+    r->queued_percent = 100.0 * queued / ((double)passes * s->len);
+    r->idle_percent = 100.0 * idle / updates;
+    r->responses_ok = (s->responses < 0) || (responses == passes * (unsigned long)s->responses);
+}
+
+// The baseline "vs ref" for the scenario, 0 if there isn't one.
+static double baseline_for(const char* path, const char* name) {
+    FILE* f = fopen(path, "r");
+    char line[256];
+    char scenario[64];
+    double value;
+    double found = 0;
+
+    if (!f) return 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        if ((sscanf(line, "%63s %lf", scenario, &value) == 2) && (strcmp(scenario, name) == 0)) found = value;
+    }
+    fclose(f);
+    return found;
+}
+
+int main(int argc, char** argv) {
+    Scenario scenarios[BENCH_MAX_SCENARIOS];
+    Result results[BENCH_MAX_SCENARIOS];
+    unsigned long min_bytes = BENCH_DEFAULT_BYTES;
+    const char* baseline = NULL;
+    const char* write_to = NULL;
+    FILE* out;
+    int failed = 0;
+    int count;
+    int opt;
+    int i;
+    int run;
+
+    count = build_corpus(scenarios);
+    while ((opt = getopt(argc, argv, "n:b:w:r:")) != -1) {
+        switch (opt) {
+          case 'n': min_bytes = strtoul(optarg, NULL, 0); break;
+          case 'b': baseline = optarg; break;
+          case 'w': write_to = optarg; break;
+          case 'r':
+            if (add_capture(scenarios, &count, optarg) < 0) {
+                fprintf(stderr, "can't read frames from %s\n", optarg);
+                return 1;
+            }
+            break;
+          default:
+            fprintf(stderr, "usage: %s [-n bytes] [-b baseline] [-w new_baseline] [-r capture]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (min_bytes == 0) min_bytes = BENCH_DEFAULT_BYTES;
+
+    printf("%-10s %12s %7s %14s %12s %10s %7s %7s %s\n", "scenario", "cycles/byte", "vs ref", "frames/s",
+           "allocations", "responses", "rx %", "idle %", baseline ? "baseline" : "");
+    for (i = 0; i < count; i++) {
+        Result* r = &results[i];
+        double base = baseline ? baseline_for(baseline, scenarios[i].name) : 0;
+        double ratios[BENCH_RUNS];
+        int j;
+        uint8_t slower;
+
+        // the first burst of each warms the caches and is thrown away
+        run_reference(&scenarios[i], min_bytes / BENCH_RUNS);
+        run_scenario(&scenarios[i], min_bytes / BENCH_RUNS, r);
+        for (run = 0; run < BENCH_RUNS; run++) {
+            Result one;
+            double ref = run_reference(&scenarios[i], min_bytes / BENCH_RUNS);
+            run_scenario(&scenarios[i], min_bytes / BENCH_RUNS, &one);
+            // sorted as it goes
+            for (j = run; (j > 0) && (ratios[j - 1] > one.cycles_per_byte / ref); j--) ratios[j] = ratios[j - 1];
+            ratios[j] = one.cycles_per_byte / ref;
+            if ((run == 0) || (one.cycles_per_byte < r->cycles_per_byte)) *r = one;
+            if (one.allocations) r->allocations = one.allocations;
+            if (!one.responses_ok) r->responses_ok = 0;
+        }
+        r->vs_reference = ratios[BENCH_RUNS / 2];
+        slower = (base > 0) && (r->vs_reference > base * (100 + BENCH_TOLERANCE_PERCENT) / 100);
+        printf("%-10s %12.1f %7.2f %14.0f %12lu %10s %7.1f %7.1f", scenarios[i].name, r->cycles_per_byte, r->vs_reference,
+               r->frames_per_second, r->allocations, r->responses_ok ? "ok" : "WRONG", r->queued_percent,
+               r->idle_percent);
+        if (base > 0) printf(" %8.2f %+6.1f%%%s", base, 100.0 * (r->vs_reference - base) / base, slower ? "  SLOWER" : "");
+        printf("\n");
+        if (slower || r->allocations || !r->responses_ok) failed = 1;
+    }
+
+    if (write_to) {
+        out = fopen(write_to, "w");
+        if (!out) {
+            fprintf(stderr, "can't write %s\n", write_to);
+            return 1;
+        }
+        fprintf(out, "# ReplayBench cycles/byte over the reference's (\"vs ref\"), from ./replay_bench -w\n");
+        for (i = 0; i < count; i++) fprintf(out, "%-10s %.2f\n", scenarios[i].name, results[i].vs_reference);
+        fclose(out);
+    }
+    for (i = 0; i < count; i++) free(scenarios[i].stream);
+    if (failed) printf("FAILED\n");
+    return failed;
+}
@@ -0,0 +1,204 @@
+// Simulation of the saved registers (Saved registers in AsciiModbusSlave.h) against the host EEPROM in HostUart.h.
+//
+// One slave (an AsciiModbusSlave context, restored from EEPROM address 0) is sent ASCII requests a character time
+// at a time, with its timer ticked, modbus_slave_update() called once a character (a busy main loop) and the EEPROM
+// given the same time to get on with its writes, 3.3mS a byte.
+//   writes    the master writes hr_SPEED_RAMP every SIM_WRITE_PERIOD_US. Counts the saves and the EEPROM bytes
+//             written against the one write (of 2 bytes, to the same place) per request it would take to save each
+//             one straight away. There must be no more than a save per MODBUS_SAVE_SETTLE_MS.
+//   restart   a fn16 of hr_GROUPS to hr_SLAVE_ID (the stream registers between are left at 0), answered from the
+//             old ID, then the slave started again with the first ID: it must come back with the new ID, the 
+//             groups and the last ramp.
+//   power cut one set of values is saved, then another is cut short at each byte of its copy in turn (the byte
+//             being written is left half done). Each start up after must have all of the old values or all of the
+//             new ones, never a mixture.
+//   wear      SIM_WEAR_SAVES saves of different values, the most any EEPROM byte was written must be about
+//             SIM_WEAR_SAVES / MODBUS_SAVE_COPIES.
+// No update may start an EEPROM write while one is going (host_eeprom_collisions), as on the AVR that would wait.
+// Exits with 1 if any check fails.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/HexCodec.cpp host/SimSlave.cpp host/SaveSim.cpp -o save_sim
+//   ./save_sim [simulated_seconds]
+
+#include "AsciiModbusSlave.h"
+#include "host/SimSlave.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SIM_SLAVE_ID 1
+#define SIM_NEW_ID 7
+#define SIM_SECONDS 10
+#define SIM_WRITE_PERIOD_US 10000
+#define SIM_WEAR_SAVES 2000
+
+static SimSlave sim;
+
+// The EEPROM gets on with its writes for as long as a character takes.
+static void eeprom_char(SimSlave*, int16_t, int16_t) {
+    host_eeprom_elapse((uint32_t)(SIM_SLAVE_CHAR_NS / 1000));
+}
+
+// Until everything is in the EEPROM.
+static void sim_settle() {
+    while (modbus_slave_saving(&sim.slave)) sim_slave_char(&sim, NULL, NULL, 0);
+    sim_slave_idle(&sim, HOST_EEPROM_WRITE_US);
+}
+
+// A new start up, the context cleared and restored from the EEPROM.
+static uint8_t restart() {
+    modbus_slave_init(&sim.slave, SIM_SLAVE_ID, MODBUS_ASCII, NULL);
+    return modbus_slave_restore(&sim.slave, 0);
+}
+
+static uint32_t eeprom_bytes_written() {
+    uint32_t total = 0;
+    int i;
+
+    for (i = 0; i < HOST_EEPROM_SIZE; i++) total += host_eeprom_writes[i];
+    return total;
+}
+
+static uint32_t eeprom_most_written() {
+    uint32_t most = 0;
+    int i;
+
+    for (i = 0; i < HOST_EEPROM_SIZE; i++) if (host_eeprom_writes[i] > most) most = host_eeprom_writes[i];
+    return most;
+}
+
+// Returns 1 if the checks passed.
+static int run_writes(unsigned long seconds) {
+    unsigned long writes = seconds * 1000000UL / SIM_WRITE_PERIOD_US;
+    unsigned long saves = 0;
+    unsigned long max_saves = seconds * 1000UL / MODBUS_SAVE_SETTLE_MS + 1;
+    uint64_t start_ns = sim.now_ns;
+    uint8_t seq;
+    unsigned long i;
+    int ok;
+
+    host_eeprom_erase();
+    ok = (restart() == 0) && (sim.slave.slaveID == SIM_SLAVE_ID);
+    for (i = 1; i <= writes; i++) {
+        seq = sim.slave.save_seq;
+        sim_slave_write_register(&sim, hr_SPEED_RAMP, (uint16_t)i);
+        sim_slave_idle(&sim, (start_ns + i * SIM_WRITE_PERIOD_US * 1000 - sim.now_ns) / 1000);
+        if (sim.slave.save_seq != seq) saves++;
+    }
+    seq = sim.slave.save_seq;
+    sim_settle();
+    if (sim.slave.save_seq != seq) saves++;
+    ok = ok && (saves <= max_saves) && (host_eeprom_collisions == 0);
+    printf("writes     %lu writes of hr_SPEED_RAMP in %lu simulated seconds: %lu saves (at most %lu), "
+           "%lu EEPROM bytes written, the most to one byte %lu. Saving each write: %lu bytes, %lu to one byte  %s\n",
+           writes, seconds, saves, max_saves, (unsigned long)eeprom_bytes_written(),
+           (unsigned long)eeprom_most_written(), writes * 2, writes, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+static int run_restart() {
+    uint16_t ramp = modbus_slave_read_register(&sim.slave, hr_SPEED_RAMP);
+    uint8_t pdu[17] = {sim.slave.slaveID, 0x10, 0x00, 0x06, 0x00, 0x05, 0x0A, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00,
+                       0x00, 0x00, 0x00, SIM_NEW_ID};
+    uint8_t answered_by;
+    int restored;
+    int ok;
+
+    sim_slave_request(&sim, pdu, sizeof(pdu), 0);
+    answered_by = sim_slave_answer_byte(&sim, 0);
+    sim_settle();
+    restored = restart();
+    ok = restored && (answered_by == SIM_SLAVE_ID) && (sim.slave.slaveID == SIM_NEW_ID) && (sim.slave.groups == 0x03)
+         && (modbus_slave_read_register(&sim.slave, hr_SPEED_RAMP) == ramp) && (host_eeprom_collisions == 0);
+    printf("restart    ID %d to %d answered by %d, after the restart ID %d, groups %d, ramp %u  %s\n", SIM_SLAVE_ID,
+           SIM_NEW_ID, answered_by, sim.slave.slaveID, sim.slave.groups,
+           modbus_slave_read_register(&sim.slave, hr_SPEED_RAMP), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+// The saved registers are all old or all new.
+static int all_of(uint16_t ramp, uint8_t groups, uint8_t id) {
+    return (modbus_slave_read_register(&sim.slave, hr_SPEED_RAMP) == ramp) && (sim.slave.groups == groups)
+           && (sim.slave.slaveID == id);
+}
+
+static int run_power_cut() {
+    unsigned long old_values = 0;
+    unsigned long new_values = 0;
+    unsigned long mixed = 0;
+    uint32_t cut;
+    uint32_t start;
+    int done = 0;
+
+    for (cut = 1; !done; cut++) {
+        host_eeprom_erase();
+        restart();
+        // the groups are saved as hr_GROUPS reads them, which is what was set
+        modbus_slave_set_groups(&sim.slave, 0x01);
+        modbus_slave_write_register(&sim.slave, hr_SPEED_RAMP, 100);
+        modbus_slave_write_register(&sim.slave, hr_SLAVE_ID, 20);
+        sim_settle();
+        start = eeprom_bytes_written();
+        modbus_slave_set_groups(&sim.slave, 0x02);
+        modbus_slave_write_register(&sim.slave, hr_SPEED_RAMP, 200);
+        modbus_slave_write_register(&sim.slave, hr_SLAVE_ID, 30);
+        // until the cut byte has started
+        while (modbus_slave_saving(&sim.slave) && (eeprom_bytes_written() - start < cut)) {
+            sim_slave_char(&sim, NULL, NULL, 0);
+        }
+        if (!modbus_slave_saving(&sim.slave)) {
+            // the whole copy went in before there were cut writes to cut short, one more start up for that
+            sim_slave_idle(&sim, HOST_EEPROM_WRITE_US);
+            done = 1;
+        }
+        host_eeprom_power_cut();
+        restart();
+        if (all_of(100, 0x01, 20)) old_values++;
+        else if (all_of(200, 0x02, 30)) new_values++;
+        else mixed++;
+    }
+    printf("power cut  at each of the %u bytes written of a %d byte copy and once after it: %lu came back with "
+           "the old values, %lu with the new, %lu mixed  %s\n", cut - 2, MODBUS_SAVE_COPY_SIZE, old_values, new_values, mixed,
+           (mixed == 0) && (new_values == 1) ? "ok" : "FAILED");
+    return (mixed == 0) && (new_values == 1);
+}
+
+static int run_wear() {
+    uint32_t most;
+    uint32_t limit = SIM_WEAR_SAVES / MODBUS_SAVE_COPIES + 1;
+    int i;
+    int ok;
+
+    host_eeprom_erase();
+    restart();
+    for (i = 0; i < SIM_WEAR_SAVES; i++) {
+        modbus_slave_write_register(&sim.slave, hr_SPEED_RAMP, (uint16_t)(i * 0x0101));
+        sim_settle();
+    }
+    most = eeprom_most_written();
+    ok = (restart() == 1) && (modbus_slave_read_register(&sim.slave, hr_SPEED_RAMP) == (uint16_t)((i - 1) * 0x0101))
+         && (most <= limit) && (host_eeprom_collisions == 0);
+    printf("wear       %d saves round %d copies: the most any EEPROM byte was written is %lu (limit %lu), "
+           "%lu bytes written in all  %s\n", SIM_WEAR_SAVES, MODBUS_SAVE_COPIES, (unsigned long)most,
+           (unsigned long)limit, (unsigned long)eeprom_bytes_written(), ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    unsigned long seconds = SIM_SECONDS;
+    int ok = 1;
+
+    if (argc > 1) seconds = strtoul(argv[1], NULL, 0);
+    if (seconds == 0) seconds = SIM_SECONDS;
+    sim_slave_init(&sim, SIM_SLAVE_ID, eeprom_char);
+
+    printf("%d saved registers, copies of %d bytes, %d copies, saves at most every %d mS\n", MODBUS_SAVED_REGISTERS,
+           MODBUS_SAVE_COPY_SIZE, MODBUS_SAVE_COPIES, MODBUS_SAVE_SETTLE_MS);
+    ok &= run_writes(seconds);
+    ok &= run_restart();
+    ok &= run_power_cut();
+    ok &= run_wear();
+    if (sim.unanswered) printf("%lu requests weren't answered\n", sim.unanswered);
+    return (ok && !sim.unanswered) ? 0 : 1;
+}
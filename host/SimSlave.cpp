@@ -0,0 +1,88 @@
+#include "host/SimSlave.h"
+#include "host/HexCodec.h"
+#include "ModbusCodec.h"
+#include <string.h>
+
+void sim_slave_init(SimSlave* sim, uint8_t slave_id, SimSlaveHook on_char) {
+    memset(sim, 0, sizeof(SimSlave));
+    sim->on_char = on_char;
+    modbus_slave_init(&sim->slave, slave_id, MODBUS_ASCII, NULL);
+}
+
+void sim_slave_char(SimSlave* sim, const uint8_t* request, size_t* sent, size_t len) {
+    int16_t rx = -1;
+    int16_t tx;
+
+    if (request && (*sent < len)) {
+        rx = request[(*sent)++];
+        modbus_slave_rx_byte(&sim->slave, (uint8_t)rx);
+    }
+    tx = modbus_slave_tx_byte(&sim->slave);
+    if (tx >= 0) {
+        if (tx == ':') sim->answer_at = 0;
+        if (sim->answer_at < SIM_SLAVE_FRAME_SIZE) sim->answer[sim->answer_at++] = (uint8_t)tx;
+        if (tx == '\n') sim->answer_len = sim->answer_at;
+    }
+    sim->chars++;
+    if (sim->on_char) sim->on_char(sim, rx, tx);
+    sim->now_ns += SIM_SLAVE_CHAR_NS;
+    sim->tick_ns += SIM_SLAVE_CHAR_NS;
+    while (sim->tick_ns >= SIM_SLAVE_TICK_NS) {
+        sim->tick_ns -= SIM_SLAVE_TICK_NS;
+        MODBUS_SLAVE_UPDATE_TIMER(&sim->slave);
+    }
+    modbus_slave_update(&sim->slave);
+}
+
+void sim_slave_idle(SimSlave* sim, uint64_t us) {
+    uint64_t until = sim->now_ns + us * 1000;
+
+    while (sim->now_ns < until) sim_slave_char(sim, NULL, NULL, 0);
+}
+
+uint8_t sim_slave_request(SimSlave* sim, const uint8_t* bytes, size_t n, uint8_t bad_lrc) {
+    uint8_t frame[SIM_SLAVE_FRAME_SIZE];
+    uint8_t lrc = 0;
+    uint8_t answered = !bad_lrc && (bytes[0] == sim->slave.slaveID);
+    size_t len = 0;
+    size_t sent = 0;
+    unsigned long waited = 0;
+
+    if (2 * n + 5 > SIM_SLAVE_FRAME_SIZE) return 0;
+    frame[len++] = ':';
+    hex_encode(bytes, n, &frame[len], &lrc);
+    len += 2 * n;
+    lrc = (uint8_t)(0 - lrc + (bad_lrc ? 1 : 0));
+    frame[len++] = UINT8_TO_ASCII(lrc >> 4);
+    frame[len++] = UINT8_TO_ASCII(lrc & 0x0F);
+    frame[len++] = '\r';
+    frame[len++] = '\n';
+    sim->answer_len = 0;
+    while (sent < len) sim_slave_char(sim, frame, &sent, len);
+    if (!answered) return 0;
+    while ((sim->answer_len == 0) && (waited++ < SIM_SLAVE_ANSWER_CHARS)) sim_slave_char(sim, NULL, NULL, 0);
+    if (sim->answer_len == 0) {
+        sim->unanswered++;
+        return 0;
+    }
+    return 1;
+}
+
+uint8_t sim_slave_answer_byte(const SimSlave* sim, size_t i) {
+    if (2 + i * 2 >= sim->answer_len) return 0;
+    return (uint8_t)((ascii_to_uint8(sim->answer[1 + i * 2]) << 4) | ascii_to_uint8(sim->answer[2 + i * 2]));
+}
+
+uint8_t sim_slave_write_register(SimSlave* sim, uint16_t address, uint16_t value) {
+    uint8_t pdu[6] = {sim->slave.slaveID, 0x06, (uint8_t)(address >> 8), (uint8_t)address, (uint8_t)(value >> 8),
+                      (uint8_t)value};
+
+    return sim_slave_request(sim, pdu, sizeof(pdu), 0);
+}
+
+uint16_t sim_slave_read_register(SimSlave* sim, uint16_t address) {
+    uint8_t pdu[6] = {sim->slave.slaveID, 0x03, (uint8_t)(address >> 8), (uint8_t)address, 0x00, 0x01};
+
+    if (!sim_slave_request(sim, pdu, sizeof(pdu), 0)) return 0;
+    return (uint16_t)(sim_slave_answer_byte(sim, 3) << 8 | sim_slave_answer_byte(sim, 4));
+}
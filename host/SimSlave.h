@@ -0,0 +1,56 @@
+#ifndef SIM_SLAVE_H
+#define SIM_SLAVE_H
+
+#include "AsciiModbusSlave.h"
+#include <stdint.h>
+#include <stddef.h>
+
+// One simulated slave for the host tools that talk to a single slave a character time at a time (SaveSim.cpp,
+// CaptureDecode.cpp, ProfileRead.cpp). Each character time one byte of the request (if any) goes to the slave and
+// one byte of its answer is taken, the tool's own hook runs (the EEPROM, a log, a stand in interrupt ...), the timer
+// is ticked for the time that has passed and modbus_slave_update() is called, a busy main loop. Requests are
+// turned into ASCII frames with hex_encode() (host/HexCodec.h), so it is built with:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/HexCodec.cpp host/SimSlave.cpp <your tool>.cpp
+//
+// sim_slave_request() waits for the answer only as long as SIM_SLAVE_ANSWER_CHARS character times after the
+// request. One that doesn't come is counted in unanswered, which a tool should check, rather than hanging it.
+
+#define SIM_SLAVE_FRAME_SIZE 64             // the longest frame either way, as ASCII
+#define SIM_SLAVE_ANSWER_CHARS 400          // MODBUS_DELAY and a whole SIM_SLAVE_FRAME_SIZE answer, many times over
+#define SIM_SLAVE_CHAR_NS (10000000000ULL / MODBUS_BAUD)
+#define SIM_SLAVE_TICK_NS (MODBUS_TICK_CYCLES * 1000000000ULL / MODBUS_F_CPU)
+
+struct SIMSLAVE;
+// called every character time as the bytes have gone, before the timer and modbus_slave_update(), with the byte
+// sent to the slave and the one it sent (-1 for none).
+typedef void (*SimSlaveHook)(struct SIMSLAVE* sim, int16_t rx, int16_t tx);
+
+typedef struct SIMSLAVE {
+   ModbusSlave slave;
+   SimSlaveHook on_char;                     // NULL for none
+   uint64_t  now_ns;                         // a character time a step
+   uint64_t  tick_ns;                        // since the last timer tick
+   unsigned long chars;                      // character times so far
+   unsigned long unanswered;                 // requests the slave should have answered but didn't
+   uint8_t   answer[SIM_SLAVE_FRAME_SIZE];   // the last frame the slave sent, as ASCII
+   size_t    answer_len;                     // 0 until the whole of it has come
+   size_t    answer_at;
+}SimSlave;
+
+// Clears everything, and starts the slave as modbus_slave_init() in ASCII mode.
+void sim_slave_init(SimSlave* sim, uint8_t slave_id, SimSlaveHook on_char);
+// One character time, sending request[*sent] if *sent < len (request may be NULL).
+void sim_slave_char(SimSlave* sim, const uint8_t* request, size_t* sent, size_t len);
+// At least us of character times with nothing sent.
+void sim_slave_idle(SimSlave* sim, uint64_t us);
+// Sends an ASCII request of the binary bytes, with the LRC off by one if bad_lrc, and waits for the answer if the
+// slave should give one (it is to its ID, with a good LRC). Returns 1 if it was answered.
+uint8_t sim_slave_request(SimSlave* sim, const uint8_t* bytes, size_t n, uint8_t bad_lrc);
+// Byte i of the last answer after the ':', 0 if there is no answer or it is too short.
+uint8_t sim_slave_answer_byte(const SimSlave* sim, size_t i);
+// Writes one register with a fn6.
+uint8_t sim_slave_write_register(SimSlave* sim, uint16_t address, uint16_t value);
+// Reads one register with a fn3, 0 if it wasn't answered.
+uint16_t sim_slave_read_register(SimSlave* sim, uint16_t address);
+
+#endif
@@ -0,0 +1,145 @@
+// Draws the transmit and receive statemachines of AsciiModbusSlave as a graphviz digraph.
+//
+// The states and their exits come from the MODBUS_TX_STATES and MODBUS_RX_STATES tables in ModbusStateMachine.h,
+// so the diagram is always the machine that is compiled. If the path to AsciiModbusSlave.cpp is given the text in
+// FORWARD_WHEN("..."), BRANCH_IF("..."), REPEAT_UNTIL("...") and DROP_IF("...") is read out of each state function
+// and used to label the edges.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. host/StateDiagram.cpp -o state_diagram
+//   ./state_diagram AsciiModbusSlave.cpp | dot -Tpng -o statemachines.png
+
+#include "ModbusStateMachine.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LABEL 256
+
+struct DiagramRow {
+    const char* state;
+    const char* function;
+    const char* exits[rMAX_RETURN_VALUES];
+};
+
+static const char* const exit_macros[rMAX_RETURN_VALUES] = {"FORWARD_WHEN", "BRANCH_IF", "REPEAT_UNTIL", "DROP_IF"};
+static const char* const exit_styles[rMAX_RETURN_VALUES] = {"solid", "dashed", "dotted", "bold"};
+
+// the tables as strings, an sNULL / mNULL exit is left out of the diagram
+#define TX_ROW(state, function, forward, branch, repeat) {#state, #function, {#forward, #branch, #repeat, "mNULL"}},
+#define RX_ROW(state, function, forward, branch, repeat, drop) {#state, #function, {#forward, #branch, #repeat, #drop}},
+
+static const DiagramRow tx_rows[] = { MODBUS_TX_STATES(TX_ROW) };
+static const DiagramRow rx_rows[] = { MODBUS_RX_STATES(RX_ROW) };
+
+static_assert(sizeof(tx_rows) / sizeof(tx_rows[0]) == mMAX_STATES, "tx_rows doesn't match MODBUS_TX_STATES");
+static_assert(sizeof(rx_rows) / sizeof(rx_rows[0]) == sMAX_STATES, "rx_rows doesn't match MODBUS_RX_STATES");
+
+// Read a whole file into a nul terminated buffer, NULL if it can't be read.
+static char* read_file(const char* path) {
+    FILE* f = fopen(path, "rb");
+    char* text;
+    long len;
+
+    if (!f) return NULL;
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    text = (char*)malloc(len + 1);
+    if (text && (fread(text, 1, len, f) != (size_t)len)) {
+        free(text);
+        text = NULL;
+    }
+    if (text) text[len] = 0;
+    fclose(f);
+    return text;
+}
+
+// The body of a state function's definition (not its prototype), from the '{' to the end of the file.
+static const char* find_body(const char* source, const char* function) {
+    size_t n = strlen(function);
+    const char* p = source;
+
+    while ((p = strstr(p, function)) != NULL) {
+        const char* q = p + n;
+        p = q;
+        if ((*q != ' ') && (*q != '(')) continue;       // only the start of a longer name
+        q = strchr(q, ')');
+        if (!q) return NULL;
+        q++;
+        while ((*q == ' ') || (*q == '\t')) q++;
+        if (*q == '{') return q;
+    }
+    return NULL;
+}
+
+// Join the strings given to one of the exit macros in a function body with "\n" for the edge label.
+static void collect_label(const char* body, const char* macro, char* label) {
+    size_t n = strlen(macro);
+    const char* end = body ? strstr(body, "\n}") : NULL;
+    const char* p = body;
+    size_t n_label;
+
+    label[0] = 0;
+    if (!body) return;
+    while (((p = strstr(p, macro)) != NULL) && (!end || (p < end))) {
+        const char* text;
+        const char* close;
+        char piece[MAX_LABEL];
+
+        p += n;
+        if (strncmp(p, "(\"", 2) != 0) continue;
+        text = p + 2;
+        close = strchr(text, '"');
+        if (!close) return;
+        snprintf(piece, sizeof(piece), "%.*s", (int)(close - text), text);
+        if (strstr(label, piece)) continue;             // the same reason is often given on more than one line
+        n_label = strlen(label);
+        // a reason which doesn't fit is left off whole rather than cut short
+        if (snprintf(label + n_label, MAX_LABEL - n_label, "%s%s", n_label ? "\\n" : "", piece)
+            >= (int)(MAX_LABEL - n_label)) {
+            label[n_label] = '\0';
+            return;
+        }
+    }
+}
+
+static void print_machine(const char* name, const DiagramRow* rows, unsigned count, const char* null_state,
+                          const char* source) {
+    unsigned i;
+    uint8_t rc;
+
+    printf("  subgraph cluster_%s {\n    label=\"%s\";\n", name, name);
+    for (i = 0; i < count; i++) {
+        printf("    %s [label=\"%s\\n%s\"];\n", rows[i].state, rows[i].state, rows[i].function);
+    }
+    for (i = 0; i < count; i++) {
+        const char* body = source ? find_body(source, rows[i].function) : NULL;
+        for (rc = 0; rc < rMAX_RETURN_VALUES; rc++) {
+            char label[MAX_LABEL];
+            if (strcmp(rows[i].exits[rc], null_state) == 0) continue;
+            collect_label(body, exit_macros[rc], label);
+            printf("    %s -> %s [style=%s, label=\"%s\"];\n", rows[i].state, rows[i].exits[rc], exit_styles[rc],
+                   label[0] ? label : exit_macros[rc]);
+        }
+    }
+    printf("  }\n");
+}
+
+int main(int argc, char** argv) {
+    char* source = NULL;
+
+    if (argc > 1) {
+        source = read_file(argv[1]);
+        if (!source) {
+            fprintf(stderr, "can't read %s\n", argv[1]);
+            return 1;
+        }
+    }
+    printf("digraph modbus {\n  node [shape=box];\n");
+    print_machine("transmit", tx_rows, mMAX_STATES, "mNULL", source);
+    print_machine("receive", rx_rows, sMAX_STATES, "sNULL", source);
+    printf("}\n");
+    free(source);
+    return 0;
+}
@@ -0,0 +1,241 @@
+// Telemetry rate and push jitter for a streaming slave (MODBUS_FN_STREAM in AsciiModbusSlave.h) against polling.
+//
+// One slave (an AsciiModbusSlave context, ID 1) and the host master (ModbusMaster.h) on a full duplex point to point
+// link: the master's bytes go down one wire and the slave's come back on the other, one character time at a time.
+// In each, the slave's timer is ticked, modbus_slave_update() is called (a busy main loop) and the master is run.
+// The measured speeds (hr_L_MOTOR_SPEED_MEASURED and hr_R_MOTOR_SPEED_MEASURED) are wanted as often as possible:
+//   polled    a fn3 of the two registers, sent again as soon as each is answered
+//   streamed  the slave set up to push them, with a period a tenth longer than a push takes
+//   +writes   streamed with a period of one and a half pushes, leaving room for the master to write a speed 
+//             setting every BENCH_WRITE_PERIOD_US and have it answered between the pushes
+// Each sample is checked against what the slave holds. For the streamed runs each push is timed against a grid of
+// whole periods from the first, and the jitter (the earliest to the latest) must be within the limit: a tick and a 
+// character (the slave can only start a push on a tick, and this simulation only runs its main loop once a 
+// character) plus, with writes, the longest an answer can hold a push up (its MODBUS_DELAY, which is looked at as
+// coarsely, and its characters). 
+// Grid points without a push are counted as skipped, there must be none. The writes must all be answered.
+// Exits with 1 if any check fails.
+//
+// Build and run from the top of the repository:
+//   g++ -O2 -I. AsciiModbusSlave.cpp host/HostUart.cpp host/ModbusMaster.cpp host/HexCodec.cpp host/StreamBench.cpp
+//       -o stream_bench
+//   ./stream_bench [simulated_seconds]
+
+#include "AsciiModbusSlave.h"
+#include "host/ModbusMaster.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_BAUD MODBUS_BAUD
+#define BENCH_SLAVE_ID 1
+#define BENCH_SECONDS 10
+#define BENCH_WIRE_SIZE 1024
+#define BENCH_WRITE_PERIOD_US 20000
+#define BENCH_PUSH_CHARS (1 + 2 * (3 + 4 + 1) + 2)     // ':', address, function, count, 2 registers, LRC, CR LF
+#define BENCH_WRITE_CHARS (1 + 2 * (6 + 1) + 2)        // a fn6 request or its answer
+#define BENCH_SPEED_L 1234
+#define BENCH_SPEED_R (-567)
+
+// the bytes the master has sent which haven't gone down the wire yet
+typedef struct BENCHWIRE {
+   uint8_t   data[BENCH_WIRE_SIZE];
+   size_t    head;
+   size_t    tail;
+}BenchWire;
+
+// what came in
+typedef struct BENCHSTATS {
+   unsigned long samples;
+   unsigned long wrong;                      // values which weren't what the slave holds
+   unsigned long pushes;
+   uint32_t  period_us;                      // what the pushes should be
+   uint64_t  grid_us;                        // when the first push came, the others should be whole periods on
+   uint32_t  early_us;                       // the most a push can be ahead of the first, see on_push()
+   double    sum_off;                        // and sum of squares, for the standard deviation
+   double    sum_off2;
+   int64_t   min_off;                        // how far from the grid, the earliest and the latest
+   int64_t   max_off;
+   unsigned long skipped;                    // grid points with no push
+   unsigned long writes;
+   unsigned long writes_answered;
+}BenchStats;
+
+static void wire_send(void* user, const uint8_t* data, size_t len) {
+    BenchWire* wire = (BenchWire*)user;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        if (wire->head - wire->tail >= BENCH_WIRE_SIZE) return;
+        wire->data[wire->head++ % BENCH_WIRE_SIZE] = data[i];
+    }
+}
+
+static uint64_t char_time_us(uint64_t c) {
+    return c * 10000000ULL / BENCH_BAUD;
+}
+
+static void check_sample(BenchStats* stats, const uint16_t* values) {
+    stats->samples++;
+    if ((values[0] != (uint16_t)BENCH_SPEED_L) || (values[1] != (uint16_t)BENCH_SPEED_R)) stats->wrong++;
+}
+
+static void on_push(void* user, uint8_t slave_id, const uint16_t* values, uint8_t count, uint64_t at_us) {
+    BenchStats* stats = (BenchStats*)user;
+    int64_t periods;
+    int64_t off;
+
+    if ((slave_id != BENCH_SLAVE_ID) || (count != 2)) {
+        stats->wrong++;
+        return;
+    }
+    check_sample(stats, values);
+    // the pushes are due on a fixed grid, so each is measured from where it should be rather than from the last
+    // one, and the jitter is how far apart the earliest and the latest are. The first might have been late itself, 
+    // so a push can be up to early_us ahead of its grid point, anything later than that is behind it (an answer
+    // can hold a push up by more than half a period).
+    stats->pushes++;
+    if (stats->pushes == 1) stats->grid_us = at_us;
+    periods = ((int64_t)(at_us - stats->grid_us) + stats->early_us) / stats->period_us;
+    stats->skipped = (unsigned long)(periods + 1 - (int64_t)stats->pushes);
+    off = (int64_t)(at_us - stats->grid_us) - periods * stats->period_us;
+    if (off < stats->min_off) stats->min_off = off;
+    if (off > stats->max_off) stats->max_off = off;
+    stats->sum_off += (double)off;
+    stats->sum_off2 += (double)off * off;
+}
+
+static void on_write(void* user, const uint8_t* pdu, size_t len) {
+    BenchStats* stats = (BenchStats*)user;
+
+    if (pdu && (len == 5) && (pdu[0] == 0x06)) stats->writes_answered++;
+}
+
+static void on_setup(void* user, const uint8_t* pdu, size_t len) {
+    *(int*)user = (pdu && (len == 5) && (pdu[0] == 0x10)) ? 1 : -1;
+}
+
+#define RUN_POLLED 0
+#define RUN_STREAMED 1
+#define RUN_STREAMED_WRITES 2
+
+// Returns 1 if the checks passed.
+static int run(const char* name, uint8_t how, uint16_t period_ticks, unsigned long seconds) {
+    ModbusSlave* slave = (ModbusSlave*)calloc(1, sizeof(ModbusSlave));
+    ModbusMaster* m = (ModbusMaster*)calloc(1, sizeof(ModbusMaster));
+    BenchWire* wire = (BenchWire*)calloc(1, sizeof(BenchWire));
+    BenchStats stats;
+    uint16_t polled[2];
+    uint64_t chars = (uint64_t)seconds * BENCH_BAUD / 10;
+    uint64_t next_write_us = BENCH_WRITE_PERIOD_US;
+    uint64_t start_us = 0;
+    uint64_t c;
+    uint32_t tick_ns = 0;
+    uint32_t limit_us;
+    unsigned long poll_updates = 0;
+    int set_up = (how == RUN_POLLED) ? 1 : 0;
+    int ok = 1;
+    double mean = 0;
+    double sd = 0;
+
+    if (!slave || !m || !wire) {
+        printf("%-10s out of memory\n", name);
+        return 0;
+    }
+    memset(&stats, 0, sizeof(stats));
+    stats.period_us = (uint32_t)period_ticks * MASTER_TICK_US;
+    stats.early_us = MASTER_TICK_US + (uint32_t)char_time_us(1);
+    modbus_slave_init(slave, BENCH_SLAVE_ID, MODBUS_ASCII, NULL);
+    MODBUS_SLAVE_ISR_MEASURED(slave, isr_hr_L_MOTOR_SPEED_MEASURED, (uint16_t)BENCH_SPEED_L);
+    MODBUS_SLAVE_ISR_MEASURED(slave, isr_hr_R_MOTOR_SPEED_MEASURED, (uint16_t)BENCH_SPEED_R);
+    modbus_master_init(m, BENCH_BAUD, MODBUS_DELAY, wire_send, wire);
+    if (how == RUN_POLLED) modbus_master_add_poll(m, BENCH_SLAVE_ID, 0x0002, 2, 0, polled);
+    else {
+        // the period which starts it and the block, in one fn16
+        uint8_t pdu[12] = {0x10, 0x00, 0x07, 0x00, 0x03, 0x06,
+                           (uint8_t)(period_ticks >> 8), (uint8_t)period_ticks, 0x00, 0x02, 0x00, 0x02};
+        modbus_master_on_stream(m, on_push, &stats);
+        modbus_master_transact(m, BENCH_SLAVE_ID, pdu, sizeof(pdu), 5, on_setup, &set_up, 0);
+    }
+
+    for (c = 0; c < chars; c++) {
+        uint64_t now_us = char_time_us(c);
+        int16_t byte;
+
+        // one character time each way
+        if (wire->head != wire->tail) modbus_slave_rx_byte(slave, wire->data[wire->tail++ % BENCH_WIRE_SIZE]);
+        if (!modbus_slave_tx_idle(slave)) {
+            byte = modbus_slave_tx_byte(slave);
+            modbus_master_rx_byte(m, (uint8_t)byte, now_us);
+        }
+
+        // the slave's timer interrupt and main loop
+        tick_ns += (uint32_t)(10000000000ULL / BENCH_BAUD);
+        while (tick_ns >= MASTER_TICK_US * 1000) {
+            tick_ns -= MASTER_TICK_US * 1000;
+            MODBUS_SLAVE_UPDATE_TIMER(slave);
+        }
+        modbus_slave_update(slave);
+
+        modbus_master_run(m, now_us);
+        if ((set_up == 1) && !start_us) start_us = now_us;
+        if ((how == RUN_STREAMED_WRITES) && (set_up == 1) && (now_us >= next_write_us) && !m->waiting) {
+            uint8_t pdu[5] = {0x06, 0x00, hr_L_MOTOR_SPEED_SETTING, (uint8_t)(stats.writes >> 8), (uint8_t)stats.writes};
+            if (modbus_master_transact(m, BENCH_SLAVE_ID, pdu, sizeof(pdu), 5, on_write, &stats, now_us) == 0) {
+                stats.writes++;
+                next_write_us += BENCH_WRITE_PERIOD_US;
+            }
+        }
+    }
+    // the last write might not have been answered yet
+    if (m->waiting && (stats.writes_answered + 1 == stats.writes)) stats.writes--;
+
+    if (how == RUN_POLLED) {
+        poll_updates = m->polls[0].updates;
+        stats.samples = poll_updates;
+        if ((polled[0] != (uint16_t)BENCH_SPEED_L) || (polled[1] != (uint16_t)BENCH_SPEED_R)) stats.wrong++;
+        printf("%-10s %6.0f samples/s  %lu wrong\n", name, (double)stats.samples / seconds, stats.wrong);
+        ok = (stats.wrong == 0) && (stats.samples > 0);
+    }
+    else {
+        limit_us = stats.early_us;
+        if (how == RUN_STREAMED_WRITES) {
+            limit_us += stats.early_us + MODBUS_DELAY * MASTER_TICK_US + (uint32_t)char_time_us(BENCH_WRITE_CHARS);
+        }
+        if (stats.pushes) {
+            mean = stats.sum_off / stats.pushes;
+            sd = sqrt(stats.sum_off2 / stats.pushes - mean * mean);
+        }
+        ok = (set_up == 1) && (stats.wrong == 0) && (stats.pushes > 0) && (stats.max_off - stats.min_off <= limit_us)
+             && (stats.skipped == 0) && (stats.writes_answered == stats.writes);
+        printf("%-10s %6.0f samples/s  period %5u uS  jitter %5lld uS (%+lld to %+lld, sd %3.0f, limit %4u)  "
+               "%lu skipped  %lu/%lu writes answered  %lu wrong  %s\n",
+               name, (double)stats.samples / seconds, stats.period_us, (long long)(stats.max_off - stats.min_off),
+               (long long)stats.min_off, (long long)stats.max_off, sd, limit_us, stats.skipped, stats.writes_answered,
+               stats.writes, stats.wrong, ok ? "ok" : "FAILED");
+    }
+    free(slave);
+    free(m);
+    free(wire);
+    return ok;
+}
+
+// The period for pushes of the two registers, tenths is how many tenths of a push long it is.
+static uint16_t period_ticks(unsigned tenths) {
+    return (uint16_t)((char_time_us(BENCH_PUSH_CHARS) * tenths / 10 + MASTER_TICK_US - 1) / MASTER_TICK_US);
+}
+
+int main(int argc, char** argv) {
+    unsigned long seconds = BENCH_SECONDS;
+    int ok = 1;
+
+    if (argc > 1) seconds = strtoul(argv[1], NULL, 0);
+    if (seconds == 0) seconds = BENCH_SECONDS;
+
+    printf("1 slave at %lu bps full duplex, %lu simulated seconds\n", (unsigned long)BENCH_BAUD, seconds);
+    ok &= run("polled", RUN_POLLED, 0, seconds);
+    ok &= run("streamed", RUN_STREAMED, period_ticks(11), seconds);
+    ok &= run("+writes", RUN_STREAMED_WRITES, period_ticks(15), seconds);
+    return ok ? 0 : 1;
+}
@@ -6,41 +6,99 @@
   disable all arduino serial stuff and directly set it up, don't use serial interrups as it messes up timing
 */
 #include "AsciiModbusSlave.h"
+#include "MotorOutput.h"
+#include "MotorFeedback.h"
 
+// The motor data comes out of Timer1's two output compare pins, OC1A for the right channel and OC1B for the left. 
+// OC1B is pin 10, the left channel used to be planned for pin 3 which has no Timer1 output. 
 #define R_DATA 9
 #define DATA 1
-#define L_DATA 3
+#define L_DATA 10
 #define SYNCH 6
 #define DATA_FRAME 5
 #define DATA_SAMPLE 4
+// The RS485 driver's transmit enable, high while the slave answers. The modbus library sets it up and drives it
+// (TX_PIN_SETUP() in AsciiModbusSlave.h), it must not be SYNCH's pin. 
+#define TX_ENABLE 7
 
-#define SET_R_DATA_HIGH_NEXT_TICK() (TCCR1A |= _BV(6)) 
-#define SET_R_DATA_LOW_NEXT_TICK() (TCCR1A &= ~(_BV(6))) 
+// The motors' feedback lines, timed for the measured speeds. The right one is on ICP1 (pin 8), Timer1's input 
+// capture. There is only the one, so the left one is on INT0 (pin 2) and the interrupt reads Timer1. 
+#define R_FEEDBACK 8
+#define L_FEEDBACK 2
 
 #define SET_SYNCH_HIGH() (PORTD |= _BV(6)) 
 #define SET_SYNCH_LOW() (PORTD &= ~(_BV(6))) 
 
+#if defined(TX_ENABLE_BIT)
+static_assert(TX_ENABLE_BIT == TX_ENABLE, "the modbus transmit enable isn't on TX_ENABLE's pin");
+#endif
 
+// Where the interrupt has to have loaded the next edge by, it is late if the compare time is closer than this 
+// (or already gone) when it has finished. Only checked when profiling, it is counted in hr_PROFILE_ISR_OVERRUNS. 
+#define MOTOR_LATE_CYCLES 16
+#if MODBUS_PROFILE
+#define MOTOR_CHECK_LATE(ocr) do { if ((int16_t)((ocr) - TCNT1) < MOTOR_LATE_CYCLES) MODBUS_PROFILE_ISR_LATE(); } while (0)
+#else
+#define MOTOR_CHECK_LATE(ocr) ((void)0)
+#endif
 
-int16_t speed = 0;
+
+// The two motor channels, each a schedule of edges for its compare unit (MotorOutput.h), and their measured speeds 
+// (MotorFeedback.h). Only used by the interrupts. 
+static MotorChannel rmotor;
+static MotorChannel lmotor;
+static MotorFeedback rfeedback;
+static MotorFeedback lfeedback;
 
 void InitTimer1(void) {
-  // Clear the timer
+  TCCR1B = 0;          // stopped while it is set up
   TCNT1 = 0;
-  TIFR1  = 0b00100111; // clear any pending interups
-  TIMSK1 = 0b00000010; // Enable output compare match A
-  TCCR1A = 0b11110000; // CTC mode, use OCR1A set both OC1A and OC1B
-  TCCR1B = 0b00001001; // CTC mode, no prescaler  
+  TCCR1A = 0b11110000; // set OC1A and OC1B on a compare match...
+  TCCR1C = 0b11000000; // ...and force one, so both lines start high (idle)
+  TCCR1A = 0b01010000; // from now on toggle OC1A and OC1B on a compare match, normal mode (counts 0 to 0xFFFF)
   
-  // 38uS / (1/8MHz) = 304   38uS is one bit time, 8MHz is the processer clock speed. 
-  // This means we will get an interupt every bit time. 
-  OCR1A = 304; 
-
+  // The left channel runs half a bit behind the right, so the two interrupts never want the same bit time. 
+  motor_channel_init(&rmotor);
+  motor_channel_init(&lmotor);
+  OCR1A = MOTOR_BIT_CYCLES;
+  OCR1B = MOTOR_BIT_CYCLES + MOTOR_BIT_CYCLES / 2;
+  motor_feedback_init(&rfeedback, 0);
+  motor_feedback_init(&lfeedback, 0);
+  TIFR1  = 0b00100111; // clear any pending interupts
+  TIMSK1 = 0b00100110; // Enable output compare match A and B, and input capture
+  EICRA  = 0b00000011; // INT0 on a rising edge
+  EIFR   = 0b00000001;
+  EIMSK  = 0b00000001; // Enable INT0
+  TCCR1B = 0b11000001; // capture rising edges with the noise canceller, normal mode, no prescaler, Timer1 counts 
+                       // CPU cycles
 }
 
+// The modbus timer (UPDATE_MODBUS_TIMER(), which MODBUS_DELAY is worked out for) ticks every MODBUS_TICK_CYCLES, 
+// 38uS, from Timer2's compare interrupt. The motor interrupts hold it off for longer than that when they load a frame
+// (see host/MotorSim.cpp), and only one compare is remembered, so rather than one tick each time the interrupt counts
+// the ticks which are due off the free running Timer1, and so makes up any it missed. 
+// It has a higher priority than the motor compare interrupts, which have only tens of cycles to spare before an
+// edge, so it lets them in straight away (ISR_NOBLOCK) and only holds them off to read TCNT1, a 16 bit read through
+// the TEMP register which the motor and feedback interrupts use too, and to count a tick, as the rx interrupt reads 
+// the 16 bit clock (MODBUS_CAPTURE). If a motor interrupt holds it up for longer than a tick its own compare can 
+// come in on it. That returns straight away, and the loop counts the tick (or the next interrupt does, if the loop 
+// had just finished). 
+static uint16_t modbus_tick_at;
+static volatile uint8_t modbus_ticking = 0;
+
+void InitTimer2(void) {
+  TCCR2B = 0;          // stopped while it is set up
+  TCNT2 = 0;
+  TCCR2A = 0b00000010; // CTC mode, counts 0 to OCR2A
+  OCR2A = MODBUS_TICK_CYCLES / 8 - 1;
+  TIFR2  = 0b00000111; // clear any pending interupts
+  TIMSK2 = 0b00000010; // Enable output compare match A
+  modbus_tick_at = TCNT1;
+  TCCR2B = 0b00000010; // CPU clock / 8
+}
 
-
-
+static_assert((MODBUS_TICK_CYCLES % 8 == 0) && (MODBUS_TICK_CYCLES / 8 <= 256), 
+              "Timer2 can't count MODBUS_TICK_CYCLES with its /8 prescaler");
 
 
 // the setup routine runs on reset:
@@ -48,9 +106,12 @@ void setup() {
 
   pinMode(LED_BUILTIN, OUTPUT);
   pinMode(R_DATA, OUTPUT);  
+  pinMode(L_DATA, OUTPUT);  
   pinMode(SYNCH, OUTPUT);  
   pinMode(DATA_FRAME, OUTPUT);  
   pinMode(DATA_SAMPLE, OUTPUT);
+  pinMode(R_FEEDBACK, INPUT_PULLUP);
+  pinMode(L_FEEDBACK, INPUT_PULLUP);
 
 
   digitalWrite(SYNCH, LOW);  
@@ -62,116 +123,86 @@ void setup() {
   noInterrupts();           // disable all interrupts
   TIMSK0 &= ~_BV(TOIE0);    // disable timer0 overflow interrupt, this means delay() millis() and micros() no longer work.
   InitTimer1();
+  InitTimer2();             // after Timer1, which it counts the ticks off
   interrupts();             // enable all interrupts
 
   modbus_init(0xA5);
 }
 
 
-// There are two statemachines running together. One that marks where we are up to in the message frame and one that marks where
-// we are up to in sending out each individual bit for a byte that makes up the message. (where byte is actually 9bits plus start and stop). 
-// The 9th bit is only used to indicate the start of a message frame so it doesn't make up any part of the actual data - the actual data is byte based. 
-
-// A data frame consists of a start and end frame with a repeated speed (twos compliment 16 bit integer). 
-enum MSGST {sSTART_FRAME, sSPEED1, sSPEED2, sSPEED3, sSPEED4, sPAUSE};
-//typedef enum MSGST message_states;  
-//message_states message_state = sPAUSE;
-uint8_t message_state = sPAUSE;
-
-// States for where we are up to when sending an individuale byte (well its 9bits of data plus start and stop bits) 
-enum BITST {sD0, sD1, sD2, sD3, sD4, sD5, sD6, sD7, sD8, sSTOP, sFINISH, sIDLE, sSTART};
-//typedef enum BITST bit_states;  
-//bit_states bit_state = sIDLE;
-uint8_t bit_state = sIDLE;
-
-uint8_t speed_update_guard = 0; 
-int16_t rspeed = 0;
-int16_t lspeed = 0;
-
-int16_t buffered_rspeed = 0;
-int16_t buffered_lspeed = 0;
-
-uint8_t rdata = 0;
-uint8_t ldata = 0;
-
-static uint8_t delay_count = 0;
+// Each compare interrupt is at an edge of its channel, which the hardware has already made. All it does is load the 
+// time of the channel's next edge, counted from this one so it doesn't matter how late the interrupt ran. With both
+// channels sending 0x55 there is an edge every half bit time, so anything more is kept for the sync pause. 
+// A data frame consists of a start and end frame with a repeated speed (twos compliment 16 bit integer), see 
+// MotorOutput.h. The speeds are the settings written over modbus, which come through the setpoint exchange so both 
+// 16bit values are always complete and from the same update. Each is read when the channel finishes a frame, during 
+// the sync pause, and goes out in the next frame (slew rate limited by hr_SPEED_RAMP), so a write gets to the motor
+// within a frame (3.2mS) of modbus_update() taking it. The measured speed is worked out then too. 
+// SYNCH is high for the right channel's pause, to trigger a scope or logic analyser. 
 ISR(TIMER1_COMPA_vect) {
-
-  UPDATE_MODBUS_TIMER();
-  
-  // send out the byte of data along with start and stop bits. The 9th bit is treated specially since its only used if 
-  // we are sending the start of frame byte. All the other times its zero. 
-  switch(bit_state) {
-      case sIDLE :
-        // It is up to the message state machine to move this statemachine out of sIDLE. 
-        SET_R_DATA_HIGH_NEXT_TICK();
-        break; 
-      case sSTART:    
-        SET_R_DATA_LOW_NEXT_TICK();
-        bit_state = sD0;
-        break;           
-      case sD0: case sD1: case sD2: case sD3: case sD4: case sD5: case sD6: case sD7: 
-        if (rdata & _BV(bit_state)) SET_R_DATA_HIGH_NEXT_TICK();
-        else SET_R_DATA_LOW_NEXT_TICK();
-        bit_state++;
-        break;  
-      case sD8:
-        // the only time the 9th bit is used is to send the frame start message. 
-        if (message_state == sSTART_FRAME) SET_R_DATA_HIGH_NEXT_TICK();
-        else SET_R_DATA_LOW_NEXT_TICK();
-        bit_state = sSTOP;
-        break;
-      case sSTOP:       
-        SET_R_DATA_HIGH_NEXT_TICK();  
-        bit_state = sFINISH;     
-        break;
-      case sFINISH:
-        SET_R_DATA_HIGH_NEXT_TICK();  
-        bit_state = sIDLE;     
-        break;      
-      default :
-        bit_state = sIDLE;
-        SET_R_DATA_HIGH_NEXT_TICK();
-        break;        
+  uint16_t cycles;
+  int16_t measured;
+
+  MODBUS_PROFILE_ISR_BEGIN();   // times this interrupt when MODBUS_PROFILE is set (AsciiModbusSlave.h)
+  if (MOTOR_FRAME_DUE(&rmotor)) SET_SYNCH_LOW();      // this edge is the start of a frame
+  cycles = motor_channel_next_edge(&rmotor);
+  OCR1A += cycles;
+  if (MOTOR_FRAME_DUE(&rmotor)) {
+    motor_channel_load(&rmotor, (int16_t)MODBUS_ISR_SETPOINT(isr_hr_R_MOTOR_SPEED_SETTING), 
+                       MODBUS_ISR_SETPOINT(isr_hr_SPEED_RAMP));
+    SET_SYNCH_HIGH();
+    if (motor_feedback_frame(&rfeedback, OCR1A - cycles, rmotor.sent, &measured)) {
+      MODBUS_ISR_MEASURED(isr_hr_R_MOTOR_SPEED_MEASURED, (uint16_t)measured);
+    }
   }
+  MOTOR_CHECK_LATE(OCR1A);
+  MODBUS_PROFILE_ISR_END();
+}
 
-  // cycle through the a frame of data and prepare each byte of data for the state machine above to send out. 
-  // this statemachine only progresses when the bit statemachine above is in the idle state - i.e. after each byte has been sent
-  // we work out what to send next. 
-  if (bit_state == sIDLE) {
-    switch(message_state) { 
-        case sSTART_FRAME : rdata = (rspeed & 0xFF); break;   
-        case sSPEED1 : rdata = ((rspeed >> 8) & 0xFF); break;     
-        case sSPEED2 : rdata = (rspeed & 0xFF); break;    
-        case sSPEED3 : rdata = ((rspeed >> 8) & 0xFF); break;    
-        case sSPEED4 : rdata = 0x55; break;   
-        case sPAUSE : break;                                  
-        default : break;          
+ISR(TIMER1_COMPB_vect) {
+  uint16_t cycles;
+  int16_t measured;
+
+  MODBUS_PROFILE_ISR_BEGIN();
+  cycles = motor_channel_next_edge(&lmotor);
+  OCR1B += cycles;
+  if (MOTOR_FRAME_DUE(&lmotor)) {
+    motor_channel_load(&lmotor, (int16_t)MODBUS_ISR_SETPOINT(isr_hr_L_MOTOR_SPEED_SETTING), 
+                       MODBUS_ISR_SETPOINT(isr_hr_SPEED_RAMP));
+    if (motor_feedback_frame(&lfeedback, OCR1B - cycles, lmotor.sent, &measured)) {
+      MODBUS_ISR_MEASURED(isr_hr_L_MOTOR_SPEED_MEASURED, (uint16_t)measured);
     }
-    if (message_state >= sPAUSE) {
-      // delay for 500uS between each frame of data 500uS is longer than sending out 11bits which is one word. This big regular pause 
-      // makes it easy for a software bit banging serial port to synchronise to the data, and easy to see frames on a scope or logic analyser. 
-      // Also, update the speed values ready for the next frame of data. Since the speed values are 16bit, check the guard first to make sure
-      // they aren't part way through being updated when the interrupt happned. 
-      SET_SYNCH_HIGH();
-       delay_count++;
-       if (!(speed_update_guard)) {
-         buffered_rspeed = rspeed;
-         buffered_lspeed = lspeed;
-       }
-       if (delay_count > 13) {
-         delay_count = 0;    
-         rdata = 0x00;
-         message_state = sSTART_FRAME;  
-         bit_state = sSTART; // kick the other statemachine off to send out the byte of data.  
-         SET_SYNCH_LOW();
-       }   
-    }
-    else {
-      message_state++;
-      bit_state = sSTART; // kick the other statemachine off to send out the byte of data.
-    }    
-  }  
+  }
+  MOTOR_CHECK_LATE(OCR1B);
+  MODBUS_PROFILE_ISR_END();
+}
+
+ISR(TIMER2_COMPA_vect, ISR_NOBLOCK) {
+  uint16_t now;
+
+  noInterrupts();
+  if (modbus_ticking) return;
+  modbus_ticking = 1;
+  for (;;) {
+    noInterrupts();
+    now = TCNT1;
+    interrupts();
+    if ((uint16_t)(now - modbus_tick_at) < MODBUS_TICK_CYCLES) break;
+    modbus_tick_at += MODBUS_TICK_CYCLES;
+    noInterrupts();
+    UPDATE_MODBUS_TIMER();
+    interrupts();
+  }
+  modbus_ticking = 0;
+}
+
+// The feedback edges. These have a higher priority than the compare interrupts, which MotorFeedback.cpp relies on. 
+ISR(TIMER1_CAPT_vect) {
+  motor_feedback_edge(&rfeedback, ICR1);
+}
+
+ISR(INT0_vect) {
+  motor_feedback_edge(&lfeedback, TCNT1);
 }
 
 
@@ -199,8 +230,8 @@ ISR(TIMER1_COMPA_vect) {
 
 // the loop routine runs over and over again forever:
 void loop() {
-
   modbus_update();
+  modbus_idle();   // sleeps until the next interrupt when MODBUS_IDLE_SLEEP is set
   
 //  uint8_t uart_data = 0;
   
@@ -241,4 +272,4 @@ void loop() {
 }
 
 
-
+